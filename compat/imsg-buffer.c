@@ -67,6 +67,7 @@ ibuf_open(size_t len)
 	}
 	buf->size = buf->max = len;
 	buf->fd = -1;
+	buf->flags = IBUF_F_SECRET;
 
 	return (buf);
 }
@@ -92,6 +93,7 @@ ibuf_dynamic(size_t len, size_t max)
 	buf->size = len;
 	buf->max = max;
 	buf->fd = -1;
+	buf->flags = IBUF_F_SECRET;
 
 	return (buf);
 }
@@ -113,18 +115,23 @@ ibuf_reserve(struct ibuf *buf, size_t len)
 
 	if (buf->wpos + len > buf->size) {
 		unsigned char	*nb;
+		size_t		 size = buf->wpos + len;
 
 		/* check if buffer is allowed to grow */
-		if (buf->wpos + len > buf->max) {
+		if (size > buf->max) {
 			errno = ERANGE;
 			return (NULL);
 		}
-		nb = realloc(buf->buf, buf->wpos + len);
+		/* grow geometrically to avoid a realloc for every add */
+		if ((buf->flags & IBUF_F_GROW) && size < buf->size * 2)
+			size = buf->size * 2 < buf->max ? buf->size * 2 :
+			    buf->max;
+		nb = realloc(buf->buf, size);
 		if (nb == NULL)
 			return (NULL);
-		memset(nb + buf->size, 0, buf->wpos + len - buf->size);
+		memset(nb + buf->size, 0, size - buf->size);
 		buf->buf = nb;
-		buf->size = buf->wpos + len;
+		buf->size = size;
 	}
 
 	b = buf->buf + buf->wpos;
@@ -524,7 +531,10 @@ ibuf_free(struct ibuf *buf)
 		abort();
 	if (buf->fd >= 0)
 		close(buf->fd);
-	freezero(buf->buf, buf->size);
+	if (buf->flags & IBUF_F_SECRET)
+		freezero(buf->buf, buf->size);
+	else
+		free(buf->buf);
 	free(buf);
 }
 
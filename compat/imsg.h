@@ -36,8 +36,12 @@ struct ibuf {
 	size_t			 wpos;
 	size_t			 rpos;
 	int			 fd;
+	int			 flags;
 };
 
+#define IBUF_F_SECRET		0x01	/* freezero() on ibuf_free() */
+#define IBUF_F_GROW		0x02	/* grow geometrically up to max */
+
 struct msgbuf;
 
 struct imsgbuf {
@@ -17,7 +17,7 @@
 
 /* OPENBSD ORIGINAL: lib/libc/string/timingsafe_bcmp.c */
 
-#include "includes.h"
+#include <string.h>
 #ifndef HAVE_TIMINGSAFE_BCMP
 
 int
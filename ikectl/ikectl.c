@@ -25,15 +25,22 @@
 #include <sys/un.h>
 #include <sys/tree.h>
 
+#include <netinet/in.h>
+#include <netinet/ip_ipsp.h>
+
 #include <err.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <event.h>
+#include <limits.h>
+#include <netdb.h>
 
 #include "iked.h"
+#include "ikev2.h"
 #include "parser.h"
 
 __dead void	 usage(void);
@@ -48,7 +55,12 @@ struct imsgname *monitor_lookup(uint8_t);
 int		 monitor(struct imsg *);
 
 int		 show_string(struct imsg *);
-int		 show_stats(struct imsg *, int);
+int		 show_sa(struct imsg *);
+void		 show_sa_filter(struct parse_result *, struct iked_sa_filter *);
+int		 show_stats(struct imsg *, int, enum actions);
+void		 show_peers_req(struct parse_result *,
+		    struct iked_peerstat_req *);
+int		 show_peers(struct imsg *, enum actions);
 
 int		 ca_opt(struct parse_result *);
 
@@ -160,6 +172,9 @@ main(int argc, char *argv[])
 	struct sockaddr_un	 s_un;
 	struct parse_result	*res;
 	struct imsg		 imsg;
+	struct iked_sa_filter	 filter;
+	struct iked_peerstat_req peerreq;
+	struct iked_verbose	 verbose;
 	int			 ctl_sock;
 	int			 done = 1;
 	int			 n;
@@ -214,6 +229,12 @@ main(int argc, char *argv[])
 			err(1, "pledge");
 		ca_opt(res);
 		break;
+	case USERDB_CREATE:
+		if (pledge("stdio wpath cpath fattr", NULL) == -1)
+			err(1, "pledge");
+		if (userdb_create(res->path) == -1)
+			exit(1);
+		break;
 	case NONE:
 		usage();
 		break;
@@ -299,14 +320,34 @@ main(int argc, char *argv[])
 		imsg_compose(ibuf, IMSG_CTL_RESET_ID, 0, 0, -1,
 		    res->id, strlen(res->id));
 		break;
+	case REDIRECT_ALL:
+		imsg_compose(ibuf, IMSG_CTL_REDIRECT, 0, 0, -1, NULL, 0);
+		printf("redirect request sent.\n");
+		break;
+	case REDIRECT_ID:
+		imsg_compose(ibuf, IMSG_CTL_REDIRECT, 0, 0, -1,
+		    res->id, strlen(res->id));
+		printf("redirect request sent.\n");
+		break;
 	case SHOW_SA:
-		imsg_compose(ibuf, IMSG_CTL_SHOW_SA, 0, 0, -1, NULL, 0);
+		show_sa_filter(res, &filter);
+		imsg_compose(ibuf, IMSG_CTL_SHOW_SA, 0, 0, -1,
+		    &filter, sizeof(filter));
 		done = 0;
 		break;
 	case SHOW_STATS:
+	case SHOW_STATS_JSON:
+	case SHOW_STATS_OPENMETRICS:
 		imsg_compose(ibuf, IMSG_CTL_SHOW_STATS, 0, 0, -1, NULL, 0);
 		done = 0;
 		break;
+	case SHOW_PEERS:
+	case SHOW_PEERS_ID:
+		show_peers_req(res, &peerreq);
+		imsg_compose(ibuf, IMSG_CTL_SHOW_PEERS, 0, 0, -1,
+		    &peerreq, sizeof(peerreq));
+		done = 0;
+		break;
 	case SHOW_CERTSTORE:
 		imsg_compose(ibuf, IMSG_CTL_SHOW_CERTSTORE, 0, 0, -1, NULL, 0);
 		done = 0;
@@ -332,7 +373,13 @@ main(int argc, char *argv[])
 		break;
 	case LOG_VERBOSE:
 	case LOG_BRIEF:
-		imsg_compose(ibuf, IMSG_CTL_VERBOSE, 0, 0, -1, &v, sizeof(v));
+		verbose.v_level = v;
+		verbose.v_subsys = -1;
+		if (res->subsys != NULL &&
+		    (verbose.v_subsys = log_subsys_lookup(res->subsys)) == -1)
+			errx(1, "unknown subsystem: %s", res->subsys);
+		imsg_compose(ibuf, IMSG_CTL_VERBOSE, 0, 0, -1,
+		    &verbose, sizeof(verbose));
 		printf("logging request sent.\n");
 		break;
 	default:
@@ -358,9 +405,17 @@ main(int argc, char *argv[])
 				done = monitor(&imsg);
 				break;
 			case SHOW_STATS:
-				done = show_stats(&imsg, quiet);
+			case SHOW_STATS_JSON:
+			case SHOW_STATS_OPENMETRICS:
+				done = show_stats(&imsg, quiet, res->action);
 				break;
 			case SHOW_SA:
+				done = show_sa(&imsg);
+				break;
+			case SHOW_PEERS:
+			case SHOW_PEERS_ID:
+				done = show_peers(&imsg, res->action);
+				break;
 			case SHOW_CERTSTORE:
 				done = show_string(&imsg);
 				break;
@@ -414,7 +469,6 @@ show_string(struct imsg *imsg)
 	int	done = 0;
 
 	switch (imsg->hdr.type) {
-	case IMSG_CTL_SHOW_SA:
 	case IMSG_CTL_SHOW_CERTSTORE:
 		break;
 	default:
@@ -428,24 +482,371 @@ show_string(struct imsg *imsg)
 	return (done);
 }
 
-static char *
-plural(uint64_t n)
+static struct iked_constmap ctl_state_map[] = {
+	{ IKEV2_STATE_INIT,		"INIT" },
+	{ IKEV2_STATE_COOKIE,		"COOKIE" },
+	{ IKEV2_STATE_SA_INIT,		"SA_INIT" },
+	{ IKEV2_STATE_EAP,		"EAP" },
+	{ IKEV2_STATE_EAP_SUCCESS,	"EAP_SUCCESS" },
+	{ IKEV2_STATE_AUTH_REQUEST,	"AUTH_REQUEST" },
+	{ IKEV2_STATE_AUTH_SUCCESS,	"AUTH_SUCCESS" },
+	{ IKEV2_STATE_VALID,		"VALID" },
+	{ IKEV2_STATE_EAP_VALID,	"EAP_VALID" },
+	{ IKEV2_STATE_ESTABLISHED,	"ESTABLISHED" },
+	{ IKEV2_STATE_CLOSING,		"CLOSING" },
+	{ IKEV2_STATE_CLOSED,		"CLOSED" },
+	{ 0 }
+};
+
+static struct iked_constmap ctl_saproto_map[] = {
+	{ IKEV2_SAPROTO_NONE,		"NONE" },
+	{ IKEV2_SAPROTO_IKE,		"IKE" },
+	{ IKEV2_SAPROTO_AH,		"AH" },
+	{ IKEV2_SAPROTO_ESP,		"ESP" },
+	{ IKEV2_SAPROTO_IPCOMP,		"IPCOMP" },
+	{ 0 }
+};
+
+void
+show_sa_filter(struct parse_result *res, struct iked_sa_filter *sf)
 {
-        return (n != 1 ? "s" : "");
+	struct addrinfo		 hints, *ai;
+	struct iked_constmap	*map;
+	const char		*errstr;
+	char			*p, *s;
+
+	bzero(sf, sizeof(*sf));
+	sf->sf_peermask = -1;
+	sf->sf_state = -1;
+	sf->sf_after_initiator = -1;
+
+	if (res->sa_policy && strlcpy(sf->sf_policy, res->sa_policy,
+	    sizeof(sf->sf_policy)) >= sizeof(sf->sf_policy))
+		errx(1, "policy name too long");
+	if (res->id && strlcpy(sf->sf_id, res->id,
+	    sizeof(sf->sf_id)) >= sizeof(sf->sf_id))
+		errx(1, "id too long");
+	if (res->sa_peer) {
+		if ((p = strchr(res->sa_peer, '/')) != NULL) {
+			*p++ = '\0';
+			sf->sf_peermask = strtonum(p, 0, 128, &errstr);
+			if (errstr)
+				errx(1, "prefix length is %s: %s", errstr, p);
+		}
+		bzero(&hints, sizeof(hints));
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM; /* dummy */
+		hints.ai_flags = AI_NUMERICHOST;
+		if (getaddrinfo(res->sa_peer, NULL, &hints, &ai) != 0)
+			errx(1, "invalid peer address: %s", res->sa_peer);
+		memcpy(&sf->sf_peer, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+		if (sf->sf_peer.ss_family == AF_INET &&
+		    sf->sf_peermask > 32)
+			errx(1, "invalid prefix length: %d", sf->sf_peermask);
+	}
+	if (res->sa_state) {
+		for (map = ctl_state_map; map->cm_name != NULL; map++)
+			if (strcasecmp(map->cm_name, res->sa_state) == 0)
+				break;
+		if (map->cm_name == NULL)
+			errx(1, "unknown state: %s", res->sa_state);
+		sf->sf_state = map->cm_type;
+	}
+	if (res->sa_after) {
+		/* cursor printed by a previous page: <ispi>:<i|r> */
+		if ((p = strrchr(res->sa_after, ':')) == NULL ||
+		    (strcmp(p, ":i") != 0 && strcmp(p, ":r") != 0))
+			errx(1, "invalid cursor: %s", res->sa_after);
+		sf->sf_after_initiator = p[1] == 'i';
+		*p = '\0';
+		errno = 0;
+		sf->sf_after_ispi = strtoull(res->sa_after, &s, 16);
+		if (errno || *res->sa_after == '\0' || *s != '\0')
+			errx(1, "invalid cursor: %s", res->sa_after);
+	}
+	if (res->sa_limit) {
+		sf->sf_limit = strtonum(res->sa_limit, 1, UINT_MAX, &errstr);
+		if (errstr)
+			errx(1, "limit is %s: %s", errstr, res->sa_limit);
+	}
+}
+
+static const char *
+ctl_addr(struct iked_ctl_addr *ca)
+{
+	struct sockaddr_storage	 ss;
+
+	if (ctl_addr_unpack(&ss, ca) == -1)
+		return ("any");
+	return (print_addr(&ss));
 }
 
 /*
- * Dump IKE statistics structure.
+ * Format the packed IKE SA, Child SA and flow records.
  */
 int
-show_stats(struct imsg *imsg, int quiet)
+show_sa(struct imsg *imsg)
 {
-	struct iked_stats *stat;
-	int		 done = 1;
+	struct iked_ctl_rec	 rec;
+	struct iked_ctl_sa	 cs;
+	struct iked_ctl_childsa	 cc;
+	struct iked_ctl_flow	 cf;
+	struct iked_ctl_cursor	 cursor;
+	uint8_t			*ptr = imsg->data;
+	size_t			 len = IMSG_DATA_SIZE(imsg), rlen;
+	char			*id, *pol;
+
+	if (imsg->hdr.type != IMSG_CTL_SHOW_SA)
+		return (0);
+	if (len == 0)
+		return (1);
+
+	while (len >= sizeof(rec)) {
+		memcpy(&rec, ptr, sizeof(rec));
+		if (rec.cr_len < sizeof(rec) || rec.cr_len > len)
+			break;
+		rlen = rec.cr_len - sizeof(rec);
+		switch (rec.cr_type) {
+		case IKED_CTL_REC_SA:
+			if (rlen < sizeof(cs))
+				break;
+			memcpy(&cs, ptr + sizeof(rec), sizeof(cs));
+			if (cs.cs_idlen == 0 || cs.cs_policylen == 0 ||
+			    sizeof(cs) + cs.cs_idlen + cs.cs_policylen > rlen)
+				break;
+			id = (char *)ptr + sizeof(rec) + sizeof(cs);
+			pol = id + cs.cs_idlen;
+			id[cs.cs_idlen - 1] = '\0';
+			pol[cs.cs_policylen - 1] = '\0';
+			printf("iked_sas: rspi %s", print_spi(cs.cs_rspi, 8));
+			printf(" ispi %s %s", print_spi(cs.cs_ispi, 8),
+			    ctl_addr(&cs.cs_local));
+			printf("->%s<%s>[%s] %s %c%s%s policy '%s'\n",
+			    ctl_addr(&cs.cs_peer), id,
+			    cs.cs_addrpool.ca_af ? ctl_addr(&cs.cs_addrpool) : "",
+			    print_map(cs.cs_state, ctl_state_map),
+			    cs.cs_flags & IKED_CTL_SA_INITIATOR ? 'i' : 'r',
+			    cs.cs_flags & IKED_CTL_SA_NATT ? " natt" : "",
+			    cs.cs_flags & IKED_CTL_SA_UDPENCAP ?
+			    " udpecap" : "", pol);
+			break;
+		case IKED_CTL_REC_CHILDSA:
+			if (rlen < sizeof(cc))
+				break;
+			memcpy(&cc, ptr + sizeof(rec), sizeof(cc));
+			printf("%s %s", cc.cc_flags & IKED_CTL_CSA_BUNDLED ?
+			    "             " : "  sa_childsas:",
+			    print_map(cc.cc_saproto, ctl_saproto_map));
+			printf(" %s %s %s", print_spi(cc.cc_spi, cc.cc_spisize),
+			    cc.cc_dir == IPSP_DIRECTION_IN ? "in" : "out",
+			    ctl_addr(&cc.cc_local));
+			printf(" -> %s (%s%s%s%s)\n", ctl_addr(&cc.cc_peer),
+			    cc.cc_flags & IKED_CTL_CSA_LOADED ? "L" : "",
+			    cc.cc_flags & IKED_CTL_CSA_REKEY ? "R" : "",
+			    cc.cc_flags & IKED_CTL_CSA_ALLOCATED ? "A" : "",
+			    cc.cc_flags & IKED_CTL_CSA_PERSISTENT ? "P" : "");
+			break;
+		case IKED_CTL_REC_FLOW:
+			if (rlen < sizeof(cf))
+				break;
+			memcpy(&cf, ptr + sizeof(rec), sizeof(cf));
+			printf("  sa_flows: %s %s %s/%d",
+			    print_map(cf.cf_saproto, ctl_saproto_map),
+			    cf.cf_dir == IPSP_DIRECTION_IN ? "in" : "out",
+			    ctl_addr(&cf.cf_src), cf.cf_src.ca_mask);
+			printf(" -> %s/%d ", ctl_addr(&cf.cf_dst),
+			    cf.cf_dst.ca_mask);
+			if (cf.cf_prenat.ca_af != 0)
+				printf("[%s/%d] ", ctl_addr(&cf.cf_prenat),
+				    cf.cf_prenat.ca_mask);
+			printf("[%u]@%d (%s)\n", cf.cf_ipproto,
+			    cf.cf_rdomain, cf.cf_loaded ? "L" : "");
+			break;
+		case IKED_CTL_REC_CURSOR:
+			if (rlen < sizeof(cursor))
+				break;
+			memcpy(&cursor, ptr + sizeof(rec), sizeof(cursor));
+			printf("more SAs follow, continue with: after "
+			    "%llx:%c\n", (unsigned long long)cursor.cc_ispi,
+			    cursor.cc_initiator ? 'i' : 'r');
+			break;
+		default:
+			break;
+		}
+		ptr += rec.cr_len;
+		len -= rec.cr_len;
+	}
+
+	return (0);
+}
+
+static char *
+plural(uint64_t n)
+{
+        return (n != 1 ? "s" : "");
+}
+
+static void
+show_hist(const char *name, struct iked_hist *h, int quiet)
+{
+	uint64_t	 v[4];
+	unsigned int	 i;
+
+	if (h->h_count == 0 && quiet)
+		return;
+	v[0] = hist_percentile(h, 50);
+	v[1] = hist_percentile(h, 90);
+	v[2] = hist_percentile(h, 99);
+	v[3] = h->h_max;
+	printf("\t%s: %llu sample%s", name,
+	    (unsigned long long)h->h_count, plural(h->h_count));
+	for (i = 0; i < 4; i++)
+		printf(", %s %llu.%03llums", i == 3 ? "max" :
+		    i == 2 ? "p99" : i == 1 ? "p90" : "p50",
+		    (unsigned long long)v[i] / 1000,
+		    (unsigned long long)v[i] % 1000);
+	printf("\n");
+}
+
+/* machine readable names, in struct iked_stats order */
+struct statdesc {
+	const char	*sd_name;
+	size_t		 sd_off;
+	int		 sd_gauge;
+	const char	*sd_help;
+};
+#define S(f, g, h)	{ #f, offsetof(struct iked_stats, ikes_##f), g, h }
+static const struct statdesc statdescs[] = {
+	S(sa_created, 0, "IKE SAs created"),
+	S(sa_established_total, 0, "IKE SAs established"),
+	S(sa_established_current, 1, "IKE SAs currently established"),
+	S(sa_established_failures, 0, "IKE SAs failed to establish"),
+	S(sa_proposals_negotiate_failures, 0, "Failed proposal negotiations"),
+	S(sa_rekeyed, 0, "IKE SAs rekeyed"),
+	S(sa_removed, 0, "IKE SAs removed"),
+	S(csa_created, 0, "Child SAs created"),
+	S(csa_removed, 0, "Child SAs removed"),
+	S(msg_sent, 0, "Messages sent"),
+	S(msg_send_failures, 0, "Messages that could not be sent"),
+	S(msg_rcvd, 0, "Messages received"),
+	S(msg_rcvd_busy, 0, "Requests dropped, response being worked on"),
+	S(msg_rcvd_dropped, 0, "Messages dropped"),
+	S(msg_rcvd_filtered, 0, "Messages dropped by the kernel"),
+	S(retransmit_request, 0, "Requests retransmitted"),
+	S(retransmit_response, 0, "Responses retransmitted"),
+	S(retransmit_limit, 0, "Requests timed out"),
+	S(frag_sent, 0, "Fragments sent"),
+	S(frag_send_failures, 0, "Fragments that could not be sent"),
+	S(frag_rcvd, 0, "Fragments received"),
+	S(frag_rcvd_drop, 0, "Fragments dropped"),
+	S(frag_reass_ok, 0, "Fragments reassembled"),
+	S(frag_reass_drop, 0, "Fragments that could not be reassembled"),
+	S(update_addresses_sent, 0, "Update addresses requests sent"),
+	S(dpd_sent, 0, "DPD requests sent"),
+	S(keepalive_sent, 0, "Keepalive messages sent"),
+	S(keepalive_ticks, 0, "Keepalive ticks"),
+	S(keepalive_tick_max, 1, "Keepalive messages in the busiest tick"),
+	S(keepalive_syscalls, 0, "System calls for keepalives"),
+	S(response_cache_evicted, 0, "Cached responses evicted"),
+	S(init_deferred, 0, "Initiations deferred by rate limit"),
+	S(init_backoff, 0, "Initiations delayed by backoff"),
+	S(rekey_started, 0, "Rekeys started"),
+	S(rekey_deferred, 0, "Rekeys deferred by rate limit"),
+	S(rekey_rate_max, 1, "Rekeys in the busiest second"),
+	S(sa_current, 1, "IKE SAs"),
+	S(csa_active, 1, "Child SAs loaded"),
+	S(flow_active, 1, "Flows loaded"),
+	S(radius_sent, 0, "RADIUS requests sent"),
+	S(radius_retransmit, 0, "RADIUS requests retransmitted"),
+	S(radius_failover, 0, "RADIUS requests failed over"),
+	S(radius_timeout, 0, "RADIUS requests timed out"),
+	S(radius_invalid, 0, "Invalid RADIUS responses"),
+	S(radius_wait, 0, "RADIUS requests waiting for an identifier"),
+	S(radius_accept, 0, "RADIUS Access-Accepts received"),
+	S(radius_reject, 0, "RADIUS Access-Rejects received"),
+	S(radius_pending, 1, "RADIUS requests pending"),
+	S(resume_ticket_issued, 0, "Resumption tickets issued"),
+	S(resume_ticket_refused, 0, "Resumption tickets refused"),
+	S(resume_sent, 0, "IKE_SESSION_RESUME requests sent"),
+	S(resume_accepted, 0, "IKE_SESSION_RESUME requests accepted"),
+	S(resume_rejected, 0, "IKE_SESSION_RESUME requests rejected"),
+	S(resume_fallback, 0, "Resumptions falling back to IKE_SA_INIT"),
+	S(redirect_sa_init, 0, "Peers redirected in IKE_SA_INIT"),
+	S(redirect_informational, 0, "Established IKE SAs redirected"),
+	S(redirect_followed, 0, "Redirects followed"),
+	S(redirect_loop, 0, "Redirects ignored as loops"),
+	S(childless_sa, 0, "IKE SAs established without child SA"),
+	S(childless_acquire, 0, "Child SAs requested on demand"),
+	S(spipool_hit, 0, "SPIs taken from the reserved pool"),
+	S(spipool_miss, 0, "SPIs requested from the kernel directly"),
+	S(spipool_expired, 0, "Reserved SPIs expired unused"),
+	S(spipool_reserved, 1, "Reserved SPIs"),
+	S(ipsec_batch, 0, "Child SA installs batched"),
+	S(ipsec_batch_msgs, 0, "PF_KEY messages written in batches"),
+	S(ipsec_batch_rollback, 0, "Batched installs rolled back"),
+	S(pfkey_acquire_coalesced, 0, "ACQUIREs coalesced with a pending one"),
+	S(pfkey_acquire_dropped, 0, "ACQUIREs dropped, too many pending"),
+	S(pfkey_acquire_pending, 1, "ACQUIREs waiting for a busy IKE SA"),
+};
+#undef S
+
+#define H(f, h)		{ #f, offsetof(struct iked_stats, ikes_lat_##f), 0, h }
+static const struct statdesc histdescs[] = {
+	H(sa_init, "IKE_SA_INIT request processing"),
+	H(auth, "IKE_SA_INIT to IKE SA established"),
+	H(ca_cert, "Certificate validation round trip"),
+	H(ca_ocsp, "Certificate validation answered by OCSP"),
+	H(ca_auth, "AUTH payload round trip"),
+	H(ca_certreq, "Certificate lookup round trip"),
+	H(pfkey, "PF_KEY request"),
+	H(rekey, "Rekey"),
+	H(radius, "RADIUS round trip"),
+	H(resume, "IKE_SESSION_RESUME request processing"),
+};
+#undef H
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+static struct iked_stats	 stats;
+static struct iked_policy_stats	*polstats;
+static size_t			 npolstats;
+
+static uint64_t
+stat_get(const struct statdesc *sd)
+{
+	return (*(uint64_t *)((uint8_t *)&stats + sd->sd_off));
+}
+
+static struct iked_hist *
+stat_hist(const struct statdesc *sd)
+{
+	return ((struct iked_hist *)((uint8_t *)&stats + sd->sd_off));
+}
+
+static void
+print_escaped(const char *str, int json)
+{
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if (*str == '\n')
+			printf("\\n");
+		else if (json && (unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+}
+
+static void
+show_stats_text(int quiet)
+{
+	struct iked_stats	*stat = &stats;
+	size_t			 i;
 
-	if (IMSG_DATA_SIZE(imsg) != sizeof(*stat))
-		return (done);
-	stat = imsg->data;
 	printf("ike:\n");
 #define p(f, m) if (stat->f || !quiet) \
 	printf(m, (unsigned long long)stat->f, plural(stat->f))
@@ -463,6 +864,7 @@ show_stats(struct imsg *imsg, int quiet)
 	p(ikes_msg_send_failures, "\t%llu message%s could not be sent\n");
 	p(ikes_msg_rcvd, "\t%llu message%s received\n");
 	p(ikes_msg_rcvd_dropped, "\t%llu message%s dropped\n");
+	p(ikes_msg_rcvd_filtered, "\t%llu message%s dropped by the kernel\n");
 	p(ikes_msg_rcvd_busy, "\t%llu request%s dropped, response being worked on\n");
 	p(ikes_retransmit_response, "\t%llu response%s retransmitted\n");
 	p(ikes_retransmit_request, "\t%llu request%s retransmitted\n");
@@ -476,6 +878,310 @@ show_stats(struct imsg *imsg, int quiet)
 	p(ikes_update_addresses_sent, "\t%llu update addresses request%s sent\n");
 	p(ikes_dpd_sent, "\t%llu dpd request%s sent\n");
 	p(ikes_keepalive_sent, "\t%llu keepalive message%s sent\n");
+	p(ikes_keepalive_ticks, "\t%llu keepalive tick%s\n");
+	p(ikes_keepalive_tick_max, "\t%llu keepalive message%s in the busiest tick\n");
+	p(ikes_keepalive_syscalls, "\t%llu system call%s for keepalives\n");
+	p(ikes_response_cache_evicted, "\t%llu cached response%s evicted\n");
+	p(ikes_init_deferred, "\t%llu initiation%s deferred by rate limit\n");
+	p(ikes_init_backoff, "\t%llu initiation%s delayed by backoff\n");
+	p(ikes_rekey_started, "\t%llu rekey%s started\n");
+	p(ikes_rekey_deferred, "\t%llu rekey%s deferred by rate limit\n");
+	p(ikes_rekey_rate_max, "\t%llu rekey%s in the busiest second\n");
+	p(ikes_sa_current, "\t%llu IKE SA%s in memory\n");
+	p(ikes_csa_active, "\t%llu Child SA%s loaded\n");
+	p(ikes_flow_active, "\t%llu flow%s loaded\n");
+	p(ikes_radius_sent, "\t%llu RADIUS request%s sent\n");
+	p(ikes_radius_retransmit, "\t%llu RADIUS request%s retransmitted\n");
+	p(ikes_radius_failover, "\t%llu RADIUS request%s failed over\n");
+	p(ikes_radius_timeout, "\t%llu RADIUS request%s timed out\n");
+	p(ikes_radius_invalid, "\t%llu invalid RADIUS response%s\n");
+	p(ikes_radius_wait, "\t%llu RADIUS request%s waited for an identifier\n");
+	p(ikes_radius_accept, "\t%llu RADIUS Access-Accept%s received\n");
+	p(ikes_radius_reject, "\t%llu RADIUS Access-Reject%s received\n");
+	p(ikes_radius_pending, "\t%llu RADIUS request%s pending\n");
+	p(ikes_resume_ticket_issued, "\t%llu resumption ticket%s issued\n");
+	p(ikes_resume_ticket_refused, "\t%llu resumption ticket%s refused\n");
+	p(ikes_resume_sent, "\t%llu IKE_SESSION_RESUME request%s sent\n");
+	p(ikes_resume_accepted,
+	    "\t%llu IKE_SESSION_RESUME request%s accepted\n");
+	p(ikes_resume_rejected,
+	    "\t%llu IKE_SESSION_RESUME request%s rejected\n");
+	p(ikes_resume_fallback,
+	    "\t%llu resumption%s fell back to IKE_SA_INIT\n");
+	p(ikes_redirect_sa_init, "\t%llu peer%s redirected in IKE_SA_INIT\n");
+	p(ikes_redirect_informational,
+	    "\t%llu established IKE SA%s redirected\n");
+	p(ikes_redirect_followed, "\t%llu redirect%s followed\n");
+	p(ikes_redirect_loop, "\t%llu redirect%s ignored as loop\n");
+	p(ikes_childless_sa,
+	    "\t%llu IKE SA%s established without child SA\n");
+	p(ikes_childless_acquire, "\t%llu child SA%s requested on demand\n");
+	p(ikes_spipool_hit, "\t%llu SPI%s taken from the reserved pool\n");
+	p(ikes_spipool_miss,
+	    "\t%llu SPI%s requested from the kernel directly\n");
+	p(ikes_spipool_expired, "\t%llu reserved SPI%s expired unused\n");
+	p(ikes_spipool_reserved, "\t%llu reserved SPI%s\n");
+	p(ikes_ipsec_batch, "\t%llu child SA install%s batched\n");
+	p(ikes_ipsec_batch_msgs,
+	    "\t%llu PF_KEY message%s written in batches\n");
+	p(ikes_ipsec_batch_rollback,
+	    "\t%llu batched install%s rolled back\n");
+	p(ikes_pfkey_acquire_coalesced,
+	    "\t%llu ACQUIRE%s coalesced with a pending one\n");
+	p(ikes_pfkey_acquire_dropped,
+	    "\t%llu ACQUIRE%s dropped, too many pending\n");
+	p(ikes_pfkey_acquire_pending,
+	    "\t%llu ACQUIRE%s waiting for a busy IKE SA\n");
 #undef p
-	return (done);
+
+	printf("latency:\n");
+	for (i = 0; i < nitems(histdescs); i++)
+		show_hist(histdescs[i].sd_help, stat_hist(&histdescs[i]),
+		    quiet);
+
+	printf("policies:\n");
+	for (i = 0; i < npolstats; i++) {
+		if (polstats[i].ps_established == 0 && quiet)
+			continue;
+		printf("\t%llu IKE SA%s established for policy '%s'\n",
+		    (unsigned long long)polstats[i].ps_established,
+		    plural(polstats[i].ps_established), polstats[i].ps_name);
+	}
+}
+
+static void
+show_stats_json(void)
+{
+	const struct statdesc	*sd;
+	struct iked_hist	*h;
+	size_t			 i, j;
+	int			 first;
+
+	printf("{\n");
+	for (i = 0; i < nitems(statdescs); i++) {
+		sd = &statdescs[i];
+		printf("  \"%s\": %llu,\n", sd->sd_name,
+		    (unsigned long long)stat_get(sd));
+	}
+
+	printf("  \"latency_us\": {\n");
+	for (i = 0; i < nitems(histdescs); i++) {
+		sd = &histdescs[i];
+		h = stat_hist(sd);
+		printf("    \"%s\": { \"count\": %llu, \"sum\": %llu, "
+		    "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+		    "\"max\": %llu,\n      \"buckets\": [", sd->sd_name,
+		    (unsigned long long)h->h_count,
+		    (unsigned long long)h->h_sum,
+		    (unsigned long long)hist_percentile(h, 50),
+		    (unsigned long long)hist_percentile(h, 90),
+		    (unsigned long long)hist_percentile(h, 99),
+		    (unsigned long long)h->h_max);
+		/* [upper bound, count] of the non-empty buckets */
+		for (j = 0, first = 1; j < IKED_HIST_BUCKETS; j++) {
+			if (h->h_bucket[j] == 0)
+				continue;
+			printf("%s[%llu, %u]", first ? "" : ", ",
+			    (unsigned long long)hist_bucket_max(j),
+			    h->h_bucket[j]);
+			first = 0;
+		}
+		printf("] }%s\n", i + 1 < nitems(histdescs) ? "," : "");
+	}
+	printf("  },\n");
+
+	printf("  \"policies\": {");
+	for (i = 0; i < npolstats; i++) {
+		printf("%s\n    \"", i ? "," : "");
+		print_escaped(polstats[i].ps_name, 1);
+		printf("\": { \"sa_established\": %llu }",
+		    (unsigned long long)polstats[i].ps_established);
+	}
+	printf("%s}\n}\n", npolstats ? "\n  " : "");
+}
+
+static void
+show_stats_openmetrics(void)
+{
+	const struct statdesc	*sd;
+	struct iked_hist	*h;
+	uint64_t		 n, v;
+	size_t			 i, j;
+	int			 len;
+
+	for (i = 0; i < nitems(statdescs); i++) {
+		sd = &statdescs[i];
+		/* counter families must not carry the _total suffix */
+		len = strlen(sd->sd_name);
+		if (!sd->sd_gauge && len > 6 &&
+		    strcmp(sd->sd_name + len - 6, "_total") == 0)
+			len -= 6;
+		printf("# TYPE iked_%.*s %s\n", len, sd->sd_name,
+		    sd->sd_gauge ? "gauge" : "counter");
+		printf("# HELP iked_%.*s %s.\n", len, sd->sd_name,
+		    sd->sd_help);
+		printf("iked_%.*s%s %llu\n", len, sd->sd_name,
+		    sd->sd_gauge ? "" : "_total",
+		    (unsigned long long)stat_get(sd));
+	}
+
+	for (i = 0; i < nitems(histdescs); i++) {
+		sd = &histdescs[i];
+		h = stat_hist(sd);
+		printf("# TYPE iked_%s_seconds histogram\n", sd->sd_name);
+		printf("# HELP iked_%s_seconds %s.\n", sd->sd_name,
+		    sd->sd_help);
+		/* cumulative, only the buckets that changed the count */
+		for (j = 0, n = 0; j < IKED_HIST_BUCKETS - 1; j++) {
+			if (h->h_bucket[j] == 0)
+				continue;
+			n += h->h_bucket[j];
+			v = hist_bucket_max(j);
+			printf("iked_%s_seconds_bucket{le=\"%llu.%06llu\"} "
+			    "%llu\n", sd->sd_name,
+			    (unsigned long long)v / 1000000,
+			    (unsigned long long)v % 1000000,
+			    (unsigned long long)n);
+		}
+		printf("iked_%s_seconds_bucket{le=\"+Inf\"} %llu\n",
+		    sd->sd_name, (unsigned long long)h->h_count);
+		printf("iked_%s_seconds_count %llu\n", sd->sd_name,
+		    (unsigned long long)h->h_count);
+		printf("iked_%s_seconds_sum %llu.%06llu\n", sd->sd_name,
+		    (unsigned long long)h->h_sum / 1000000,
+		    (unsigned long long)h->h_sum % 1000000);
+	}
+
+	printf("# TYPE iked_policy_sa_established gauge\n");
+	printf("# HELP iked_policy_sa_established "
+	    "IKE SAs currently established per policy.\n");
+	for (i = 0; i < npolstats; i++) {
+		printf("iked_policy_sa_established{policy=\"");
+		print_escaped(polstats[i].ps_name, 0);
+		printf("\"} %llu\n",
+		    (unsigned long long)polstats[i].ps_established);
+	}
+	printf("# EOF\n");
+}
+
+/*
+ * Collect the IKE statistics structure and the per-policy counters
+ * following it, and dump them when the empty reply arrives.
+ */
+int
+show_stats(struct imsg *imsg, int quiet, enum actions format)
+{
+	struct iked_policy_stats	*ps;
+	size_t				 len = IMSG_DATA_SIZE(imsg);
+
+	if (imsg->hdr.type != IMSG_CTL_SHOW_STATS)
+		return (0);
+	if (len == sizeof(stats)) {
+		memcpy(&stats, imsg->data, sizeof(stats));
+		return (0);
+	} else if (len == sizeof(*ps)) {
+		if ((ps = reallocarray(polstats, npolstats + 1,
+		    sizeof(*ps))) == NULL)
+			err(1, "reallocarray");
+		polstats = ps;
+		memcpy(&polstats[npolstats], imsg->data, sizeof(*ps));
+		polstats[npolstats].ps_name[sizeof(ps->ps_name) - 1] = '\0';
+		npolstats++;
+		return (0);
+	} else if (len != 0)
+		return (1);
+
+	switch (format) {
+	case SHOW_STATS_JSON:
+		show_stats_json();
+		break;
+	case SHOW_STATS_OPENMETRICS:
+		show_stats_openmetrics();
+		break;
+	default:
+		show_stats_text(quiet);
+		break;
+	}
+	free(polstats);
+	polstats = NULL;
+	npolstats = 0;
+
+	return (1);
+}
+
+static struct iked_constmap ctl_peerstat_map[] = {
+	{ IKED_PEERSTAT_MSG_RCVD,	"received" },
+	{ IKED_PEERSTAT_MSG_SENT,	"sent" },
+	{ IKED_PEERSTAT_DROPPED,	"dropped" },
+	{ IKED_PEERSTAT_RETRANSMIT,	"retransmits" },
+	{ IKED_PEERSTAT_AUTH_FAILED,	"authfail" },
+	{ IKED_PEERSTAT_REKEY,		"rekeys" },
+	{ IKED_PEERSTAT_BYTES_RCVD,	"bytes-in" },
+	{ IKED_PEERSTAT_BYTES_SENT,	"bytes-out" },
+	{ 0 }
+};
+
+void
+show_peers_req(struct parse_result *res, struct iked_peerstat_req *pr)
+{
+	struct iked_constmap	*map;
+	const char		*errstr;
+
+	bzero(pr, sizeof(*pr));
+	pr->pr_table = res->action == SHOW_PEERS_ID ?
+	    IKED_PEERSTAT_ID : IKED_PEERSTAT_ADDR;
+	pr->pr_metric = IKED_PEERSTAT_MSG_RCVD;
+	pr->pr_limit = 10;
+
+	if (res->peers_by) {
+		for (map = ctl_peerstat_map; map->cm_name != NULL; map++)
+			if (strcmp(map->cm_name, res->peers_by) == 0)
+				break;
+		if (map->cm_name == NULL)
+			errx(1, "unknown metric: %s", res->peers_by);
+		pr->pr_metric = map->cm_type;
+	}
+	if (res->peers_top) {
+		pr->pr_limit = strtonum(res->peers_top, 0, UINT32_MAX,
+		    &errstr);
+		if (errstr != NULL)
+			errx(1, "number is %s: %s", errstr, res->peers_top);
+	}
+}
+
+/*
+ * One reply per peer, busiest first, and an empty reply at the end.
+ */
+int
+show_peers(struct imsg *imsg, enum actions action)
+{
+	static int		 header;
+	struct iked_peer_stats	 pe;
+	const char		*name;
+	unsigned int		 i;
+
+	if (imsg->hdr.type != IMSG_CTL_SHOW_PEERS)
+		return (0);
+	if (IMSG_DATA_SIZE(imsg) != sizeof(pe))
+		return (1);
+	memcpy(&pe, imsg->data, sizeof(pe));
+	pe.pe_id[sizeof(pe.pe_id) - 1] = '\0';
+
+	if (!header) {
+		printf("%8s %8s %8s %8s %8s %8s %10s %10s %8s %s\n",
+		    "RCVD", "SENT", "DROPPED", "RETRANS", "AUTHFAIL",
+		    "REKEYS", "BYTES-IN", "BYTES-OUT", "ERROR",
+		    action == SHOW_PEERS_ID ? "ID" : "PEER");
+		header = 1;
+	}
+	for (i = 0; i < IKED_PEERSTAT_MAX; i++)
+		printf(i < IKED_PEERSTAT_BYTES_RCVD ? "%8llu " : "%10llu ",
+		    (unsigned long long)pe.pe_count[i]);
+	if (action == SHOW_PEERS_ID)
+		name = pe.pe_id;
+	else
+		name = print_addr(&pe.pe_addr);
+	printf("%8llu %s\n", (unsigned long long)pe.pe_error, name);
+
+	return (0);
 }
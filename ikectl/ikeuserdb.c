@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event.h>
+
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+#include <openssl/provider.h>
+#endif
+
+#include "iked.h"
+#include "chap_ms.h"
+#include "parser.h"
+
+struct userdb_entry {
+	char			*ue_name;
+	size_t			 ue_namelen;
+	uint32_t		 ue_hash;
+	uint32_t		 ue_bucket;
+	uint8_t			 ue_nthash[MSCHAP_HASH_SZ];
+};
+
+static int	 userdb_entry_cmp(const void *, const void *);
+static int	 userdb_write(FILE *, struct userdb_entry *, uint32_t);
+
+static int
+userdb_entry_cmp(const void *a, const void *b)
+{
+	const struct userdb_entry	*ea = a, *eb = b;
+
+	if (ea->ue_bucket != eb->ue_bucket)
+		return (ea->ue_bucket < eb->ue_bucket ? -1 : 1);
+	if (ea->ue_namelen != eb->ue_namelen)
+		return (ea->ue_namelen < eb->ue_namelen ? -1 : 1);
+	return (memcmp(ea->ue_name, eb->ue_name, ea->ue_namelen));
+}
+
+static int
+userdb_write(FILE *fp, struct userdb_entry *ent, uint32_t n)
+{
+	struct iked_userdb_hdr	 hdr;
+	struct iked_userdb_rec	 rec;
+	uint32_t		 nbuckets = n > 0 ? n : 1;
+	uint32_t		 i, b, idx, off;
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.uh_magic, IKED_USERDB_MAGIC, sizeof(hdr.uh_magic));
+	hdr.uh_nbuckets = htobe32(nbuckets);
+	hdr.uh_nrecords = htobe32(n);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		return (-1);
+
+	/* The entries are sorted by bucket */
+	for (b = 0, i = 0; b <= nbuckets; b++) {
+		while (i < n && ent[i].ue_bucket < b)
+			i++;
+		idx = htobe32(i);
+		if (fwrite(&idx, sizeof(idx), 1, fp) != 1)
+			return (-1);
+	}
+
+	off = sizeof(hdr) + (nbuckets + 1) * sizeof(idx) + n * sizeof(rec);
+	for (i = 0; i < n; i++) {
+		bzero(&rec, sizeof(rec));
+		rec.ur_hash = htobe32(ent[i].ue_hash);
+		rec.ur_name = htobe32(off);
+		memcpy(rec.ur_nthash, ent[i].ue_nthash, sizeof(rec.ur_nthash));
+		rec.ur_namelen = htobe16(ent[i].ue_namelen);
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+			return (-1);
+		off += ent[i].ue_namelen;
+	}
+
+	for (i = 0; i < n; i++)
+		if (fwrite(ent[i].ue_name, ent[i].ue_namelen, 1, fp) != 1)
+			return (-1);
+
+	return (0);
+}
+
+/*
+ * Read "name password" lines from stdin and replace the database file
+ * with a new one, so that a running iked keeps its mapping of the old
+ * file until it is reloaded.
+ */
+int
+userdb_create(const char *path)
+{
+	struct userdb_entry	*ent = NULL, *e;
+	char			*line = NULL, *name, *pass, *p;
+	char			 tmp[PATH_MAX];
+	size_t			 linesize = 0, passlen;
+	ssize_t			 linelen;
+	uint32_t		 n = 0, max = 0, i;
+	uint8_t			*upass;
+	FILE			*fp = NULL;
+	int			 fd = -1, ret = -1;
+	unsigned long		 lineno = 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+	/* MD4 for the NT password hash is in the legacy provider */
+	if (OSSL_PROVIDER_load(NULL, "default") == NULL ||
+	    OSSL_PROVIDER_load(NULL, "legacy") == NULL)
+		errx(1, "failed to load the legacy provider");
+#endif
+
+	tmp[0] = '\0';
+	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+		lineno++;
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		if (*name == '\0' || *name == '#')
+			continue;
+		for (p = name; *p != '\0' && !isspace((unsigned char)*p); p++)
+			;
+		if (*p != '\0')
+			*p++ = '\0';
+		for (pass = p; isspace((unsigned char)*pass); pass++)
+			;
+		for (p = pass + strlen(pass); p > pass &&
+		    isspace((unsigned char)p[-1]); p--)
+			p[-1] = '\0';
+		if (*pass == '\0' || strlen(name) >= LOGIN_NAME_MAX ||
+		    (passlen = strlen(pass)) >= IKED_PASSWORD_SIZE ||
+		    passlen > MSCHAP_MAXNTPASSWORD_SZ) {
+			warnx("line %lu: invalid user", lineno);
+			goto done;
+		}
+
+		if (n == max) {
+			max = max ? max * 2 : 1024;
+			if ((e = reallocarray(ent, max, sizeof(*ent))) == NULL)
+				err(1, NULL);
+			ent = e;
+		}
+		e = &ent[n];
+		if ((e->ue_name = strdup(name)) == NULL)
+			err(1, NULL);
+		e->ue_namelen = strlen(name);
+		e->ue_hash = userdb_hash(name, e->ue_namelen);
+		if ((upass = string2unicode(pass, &passlen)) == NULL)
+			err(1, NULL);
+		mschap_ntpassword_hash(upass, passlen, e->ue_nthash);
+		freezero(upass, passlen);
+		explicit_bzero(pass, strlen(pass));
+		n++;
+	}
+	if (ferror(stdin)) {
+		warn("stdin");
+		goto done;
+	}
+
+	for (i = 0; i < n; i++)
+		ent[i].ue_bucket = ent[i].ue_hash % n;
+	if (n > 0)
+		qsort(ent, n, sizeof(*ent), userdb_entry_cmp);
+	for (i = 1; i < n; i++) {
+		if (userdb_entry_cmp(&ent[i - 1], &ent[i]) == 0) {
+			warnx("duplicate user %s", ent[i].ue_name);
+			goto done;
+		}
+	}
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    sizeof(tmp)) {
+		warnx("%s: path too long", path);
+		tmp[0] = '\0';
+		goto done;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		tmp[0] = '\0';
+		goto done;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp);
+		goto done;
+	}
+	fd = -1;
+	if (fchmod(fileno(fp), 0600) == -1 ||
+	    userdb_write(fp, ent, n) == -1 || fflush(fp) != 0 ||
+	    fsync(fileno(fp)) == -1) {
+		warn("%s", tmp);
+		goto done;
+	}
+	if (rename(tmp, path) == -1) {
+		warn("%s", path);
+		goto done;
+	}
+	tmp[0] = '\0';
+
+	printf("wrote %u users to %s\n", n, path);
+	ret = 0;
+ done:
+	if (fp != NULL)
+		fclose(fp);
+	if (fd != -1)
+		close(fd);
+	if (tmp[0] != '\0')
+		unlink(tmp);
+	for (i = 0; i < n; i++)
+		free(ent[i].ue_name);
+	free(ent);
+	freezero(line, linesize);
+	return (ret);
+}
@@ -45,7 +45,15 @@ enum token_type {
 	ADDRESS,
 	FQDN,
 	PASSWORD,
-	IKEID
+	IKEID,
+	SAPOLICY,
+	SAPEER,
+	SASTATE,
+	SAAFTER,
+	SALIMIT,
+	PEERSBY,
+	PEERSTOP,
+	LOGSUBSYS
 };
 
 struct token {
@@ -59,6 +67,7 @@ static const struct token t_main[];
 static const struct token t_reset[];
 static const struct token t_reset_id[];
 static const struct token t_log[];
+static const struct token t_log_subsys[];
 static const struct token t_load[];
 static const struct token t_ca[];
 static const struct token t_ca_pass[];
@@ -75,9 +84,22 @@ static const struct token t_ca_key_modifiers[];
 static const struct token t_ca_key_path[];
 static const struct token t_show[];
 static const struct token t_show_ca[];
+static const struct token t_show_stats[];
+static const struct token t_show_peers[];
+static const struct token t_show_peers_by[];
+static const struct token t_show_peers_top[];
+static const struct token t_show_sa[];
+static const struct token t_show_sa_policy[];
+static const struct token t_show_sa_peer[];
+static const struct token t_show_sa_id[];
+static const struct token t_show_sa_state[];
+static const struct token t_show_sa_after[];
+static const struct token t_show_sa_limit[];
 static const struct token t_show_ca_modifiers[];
 static const struct token t_show_ca_cert[];
 static const struct token t_opt_path[];
+static const struct token t_userdb[];
+static const struct token t_redirect[];
 
 static const struct token t_main[] = {
 	{ KEYWORD,	"active",	ACTIVE,		NULL },
@@ -87,16 +109,24 @@ static const struct token t_main[] = {
 	{ KEYWORD,	"load",		LOAD,		t_load },
 	{ KEYWORD,	"log",		NONE,		t_log },
 	{ KEYWORD,	"monitor",	MONITOR,	NULL },
+	{ KEYWORD,	"redirect",	NONE,		t_redirect },
 	{ KEYWORD,	"reload",	RELOAD,		NULL },
 	{ KEYWORD,	"reset",	NONE,		t_reset },
 	{ KEYWORD,	"show",		NONE,		t_show },
 	{ KEYWORD,	"ca",		CA,		t_ca },
+	{ KEYWORD,	"userdb",	NONE,		t_userdb },
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
 static const struct token t_log[] = {
-	{ KEYWORD,	"verbose",	LOG_VERBOSE,	NULL },
-	{ KEYWORD,	"brief",	LOG_BRIEF,	NULL },
+	{ KEYWORD,	"verbose",	LOG_VERBOSE,	t_log_subsys },
+	{ KEYWORD,	"brief",	LOG_BRIEF,	t_log_subsys },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_log_subsys[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ LOGSUBSYS,	"",		NONE,		NULL },
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
@@ -110,6 +140,12 @@ static const struct token t_reset[] = {
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
+static const struct token t_redirect[] = {
+	{ KEYWORD,	"all",		REDIRECT_ALL,	NULL },
+	{ KEYWORD,	"id",		REDIRECT_ID,	t_reset_id },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
 static const struct token t_reset_id[] = {
 	{ IKEID,	"",		NONE,		NULL },
 	{ ENDTOKEN,	"",		NONE,		NULL }
@@ -120,6 +156,11 @@ static const struct token t_load[] = {
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
+static const struct token t_userdb[] = {
+	{ KEYWORD,	"create",	USERDB_CREATE,	t_load },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
 static const struct token t_ca[] = {
 	{ CANAME,	"",		NONE,		t_ca_modifiers },
 	{ ENDTOKEN,	"",		NONE,		NULL },
@@ -213,9 +254,76 @@ static const struct token t_ca_key_path[] = {
 
 static const struct token t_show[] = {
 	{ KEYWORD,	"ca",		SHOW_CA,	t_show_ca },
-	{ KEYWORD,	"sa",		SHOW_SA,	NULL },
+	{ KEYWORD,	"sa",		SHOW_SA,	t_show_sa },
 	{ KEYWORD,	"certstore",	SHOW_CERTSTORE,NULL },
-	{ KEYWORD,	"stats",	SHOW_STATS,	NULL },
+	{ KEYWORD,	"stats",	SHOW_STATS,	t_show_stats },
+	{ KEYWORD,	"peers",	SHOW_PEERS,	t_show_peers },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ KEYWORD,	"policy",	NONE,		t_show_sa_policy },
+	{ KEYWORD,	"peer",		NONE,		t_show_sa_peer },
+	{ KEYWORD,	"id",		NONE,		t_show_sa_id },
+	{ KEYWORD,	"state",	NONE,		t_show_sa_state },
+	{ KEYWORD,	"after",	NONE,		t_show_sa_after },
+	{ KEYWORD,	"limit",	NONE,		t_show_sa_limit },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_policy[] = {
+	{ SAPOLICY,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_peer[] = {
+	{ SAPEER,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_id[] = {
+	{ IKEID,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_state[] = {
+	{ SASTATE,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_after[] = {
+	{ SAAFTER,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_sa_limit[] = {
+	{ SALIMIT,	"",		NONE,		t_show_sa },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_stats[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ KEYWORD,	"json",		SHOW_STATS_JSON, NULL },
+	{ KEYWORD,	"openmetrics",	SHOW_STATS_OPENMETRICS, NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_peers[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ KEYWORD,	"id",		SHOW_PEERS_ID,	t_show_peers },
+	{ KEYWORD,	"by",		NONE,		t_show_peers_by },
+	{ KEYWORD,	"top",		NONE,		t_show_peers_top },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_peers_by[] = {
+	{ PEERSBY,	"",		NONE,		t_show_peers },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_peers_top[] = {
+	{ PEERSTOP,	"",		NONE,		t_show_peers },
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
@@ -362,6 +470,62 @@ match_token(char *word, const struct token table[])
 				t = &table[i];
 			}
 			break;
+		case SAPOLICY:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.sa_policy = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case SAPEER:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.sa_peer = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case SASTATE:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.sa_state = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case SAAFTER:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.sa_after = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case SALIMIT:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.sa_limit = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case PEERSBY:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.peers_by = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case PEERSTOP:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.peers_top = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
+		case LOGSUBSYS:
+			if (!match && word != NULL && strlen(word) > 0) {
+				res.subsys = strdup(word);
+				match++;
+				t = &table[i];
+			}
+			break;
 		case ENDTOKEN:
 			break;
 		}
@@ -414,6 +578,28 @@ show_valid_args(const struct token table[])
 		case IKEID:
 			fprintf(stderr, "  <ikeid>\n");
 			break;
+		case SAPOLICY:
+			fprintf(stderr, "  <policy>\n");
+			break;
+		case SAPEER:
+			fprintf(stderr, "  <address>[/<prefixlen>]\n");
+			break;
+		case SASTATE:
+			fprintf(stderr, "  <state>\n");
+			break;
+		case SAAFTER:
+			fprintf(stderr, "  <cursor>\n");
+			break;
+		case SALIMIT:
+		case PEERSTOP:
+			fprintf(stderr, "  <number>\n");
+			break;
+		case PEERSBY:
+			fprintf(stderr, "  <metric>\n");
+			break;
+		case LOGSUBSYS:
+			fprintf(stderr, "  <subsystem>\n");
+			break;
 		case ENDTOKEN:
 			break;
 		}
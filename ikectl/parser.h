@@ -58,7 +58,14 @@ enum actions {
 	SHOW_SA,
 	RESET_ID,
 	SHOW_CERTSTORE,
-	SHOW_STATS
+	SHOW_STATS,
+	SHOW_STATS_JSON,
+	SHOW_STATS_OPENMETRICS,
+	SHOW_PEERS,
+	SHOW_PEERS_ID,
+	REDIRECT_ALL,
+	REDIRECT_ID,
+	USERDB_CREATE
 };
 
 struct parse_result {
@@ -70,6 +77,14 @@ struct parse_result {
 	char		*host;
 	char		*peer;
 	char		*id;
+	char		*sa_policy;
+	char		*sa_peer;
+	char		*sa_state;
+	char		*sa_after;
+	char		*sa_limit;
+	char		*peers_by;
+	char		*peers_top;
+	char		*subsys;
 	int		 htype;
 	int		 quiet;
 };
@@ -94,4 +109,6 @@ int		 ca_key_delete(struct ca *, char *);
 int		 ca_key_install(struct ca *, char *, char *);
 int		 ca_key_import(struct ca *, char *, char *);
 
+int		 userdb_create(const char *);
+
 #endif /* IKECTL_PARSER_H */
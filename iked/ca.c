@@ -47,6 +47,7 @@
 #include <openssl/provider.h>
 #endif
 
+#define LOG_SUBSYS	LOG_SUBSYS_CA
 #include "iked.h"
 #include "ikev2.h"
 
@@ -370,6 +371,9 @@ ca_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 	case IMSG_OCSP_CFG:
 		config_getocsp(env, imsg);
 		break;
+	case IMSG_OCSP_CACHE:
+		ocsp_cache_open(env, imsg);
+		break;
 	case IMSG_PRIVKEY:
 	case IMSG_PUBKEY:
 		config_getkey(env, imsg);
@@ -177,28 +177,29 @@ mschap_challenge_hash(uint8_t *peer_challenge, uint8_t *auth_challenge,
 	memcpy(challenge, md, MSCHAP_CHALLENGE_SZ);
 }
 
+/*
+ * The following functions take the NT password hash, the MD4 of the
+ * unicode password, instead of the password itself.
+ */
 void
 mschap_nt_response(uint8_t *auth_challenge, uint8_t *peer_challenge,
-    uint8_t *username, int usernamelen, uint8_t *password, int passwordlen,
+    uint8_t *username, int usernamelen, uint8_t *password_hash,
     uint8_t *response)
 {
 	uint8_t		 challenge[MSCHAP_CHALLENGE_SZ];
-	uint8_t		 password_hash[MSCHAP_HASH_SZ];
 
 	mschap_challenge_hash(peer_challenge, auth_challenge,
 	    username, usernamelen, challenge);
 
-	mschap_ntpassword_hash(password, passwordlen, password_hash);
 	mschap_challenge_response(challenge, password_hash, response);
 }
 
 void
-mschap_auth_response(uint8_t *password, int passwordlen,
+mschap_auth_response(uint8_t *password_hash,
     uint8_t *ntresponse, uint8_t *auth_challenge, uint8_t *peer_challenge,
     uint8_t *username, int usernamelen, uint8_t *auth_response)
 {
 	EVP_MD_CTX	*ctx;
-	uint8_t		 password_hash[MSCHAP_HASH_SZ];
 	uint8_t		 password_hash2[MSCHAP_HASH_SZ];
 	uint8_t		 challenge[MSCHAP_CHALLENGE_SZ];
 	uint8_t		 md[SHA_DIGEST_LENGTH], *ptr;
@@ -222,7 +223,6 @@ mschap_auth_response(uint8_t *password, int passwordlen,
 	ctx = EVP_MD_CTX_new();
 	if (ctx == NULL)
 		fatalx("%s: EVP_MD_CTX_NEW()", __func__);
-	mschap_ntpassword_hash(password, passwordlen, password_hash);
 	mschap_ntpassword_hash(password_hash, MSCHAP_HASH_SZ, password_hash2);
 
 	EVP_DigestInit(ctx, EVP_sha1());
@@ -334,16 +334,13 @@ mschap_asymetric_startkey(uint8_t *masterkey, uint8_t *sessionkey,
 }
 
 void
-mschap_msk(uint8_t *password, int passwordlen,
-    uint8_t *ntresponse, uint8_t *msk)
+mschap_msk(uint8_t *password_hash, uint8_t *ntresponse, uint8_t *msk)
 {
-	uint8_t		 password_hash[MSCHAP_HASH_SZ];
 	uint8_t		 password_hash2[MSCHAP_HASH_SZ];
 	uint8_t		 masterkey[MSCHAP_MASTERKEY_SZ];
 	uint8_t		 sendkey[MSCHAP_MASTERKEY_SZ];
 	uint8_t		 recvkey[MSCHAP_MASTERKEY_SZ];
 
-	mschap_ntpassword_hash(password, passwordlen, password_hash);
 	mschap_ntpassword_hash(password_hash, MSCHAP_HASH_SZ, password_hash2);
 
 	mschap_masterkey(password_hash2, ntresponse, masterkey);
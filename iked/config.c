@@ -19,6 +19,7 @@
 
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
@@ -33,10 +34,12 @@
 #include <errno.h>
 #include <err.h>
 #include <event.h>
+#include <fcntl.h>
 
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_POLICY
 #include "iked.h"
 #include "ikev2.h"
 
@@ -51,8 +54,6 @@ config_new_sa(struct iked *env, int initiator)
 	TAILQ_INIT(&sa->sa_proposals);
 	TAILQ_INIT(&sa->sa_childsas);
 	TAILQ_INIT(&sa->sa_flows);
-	TAILQ_INIT(&sa->sa_requests);
-	TAILQ_INIT(&sa->sa_responses);
 	sa->sa_hdr.sh_initiator = initiator;
 	sa->sa_type = IKED_SATYPE_LOCAL;
 
@@ -65,6 +66,7 @@ config_new_sa(struct iked *env, int initiator)
 	memcpy(&sa->sa_timeused, &sa->sa_timecreated, sizeof(sa->sa_timeused));
 
 	ikestat_inc(env, ikes_sa_created);
+	ikestat_inc(env, ikes_sa_current);
 	return (sa);
 }
 
@@ -99,15 +101,9 @@ config_free_kex(struct iked_kex *kex)
 void
 config_free_fragments(struct iked_frag *frag)
 {
-	size_t i;
-
-	if (frag && frag->frag_arr) {
-		for (i = 0; i < frag->frag_total; i++) {
-			if (frag->frag_arr[i] != NULL)
-				free(frag->frag_arr[i]->frag_data);
-			free(frag->frag_arr[i]);
-		}
-		free(frag->frag_arr);
+	if (frag && frag->frag_buf) {
+		ibuf_free(frag->frag_buf);
+		free(frag->frag_len);
 		bzero(frag, sizeof(struct iked_frag));
 	}
 }
@@ -118,7 +114,7 @@ config_free_sa(struct iked *env, struct iked_sa *sa)
 	int i;
 
 	timer_del(env, &sa->sa_timer);
-	timer_del(env, &sa->sa_keepalive);
+	ikev2_keepalive_del(env, sa);
 	timer_del(env, &sa->sa_rekey);
 
 	config_free_fragments(&sa->sa_fragments);
@@ -136,8 +132,13 @@ config_free_sa(struct iked *env, struct iked_sa *sa)
 		free(sa->sa_addrpool6);
 	}
 
+	ikev2_init_halfopen_done(env, sa);
+	ikev2_rekey_done(env, sa);
 	if (sa->sa_policy) {
+		if (sa->sa_state == IKEV2_STATE_ESTABLISHED)
+			sa->sa_policy->pol_established--;
 		TAILQ_REMOVE(&sa->sa_policy->pol_sapeers, sa, sa_peer_entry);
+		ikev2_init_enqueue(env, sa->sa_policy);
 		policy_unref(env, sa->sa_policy);
 	}
 
@@ -180,6 +181,9 @@ config_free_sa(struct iked *env, struct iked_sa *sa)
 	ibuf_free(sa->sa_eap.id_buf);
 	free(sa->sa_eapid);
 	ibuf_free(sa->sa_eapmsk);
+	radius_request_free(env, sa->sa_radreq);
+	ibuf_free(sa->sa_radstate);
+	resume_ticket_free(sa->sa_ticket);
 
 	free(sa->sa_cp_addr);
 	free(sa->sa_cp_addr6);
@@ -190,6 +194,7 @@ config_free_sa(struct iked *env, struct iked_sa *sa)
 	if (sa->sa_state == IKEV2_STATE_ESTABLISHED)
 		ikestat_dec(env, ikes_sa_established_current);
 	ikestat_inc(env, ikes_sa_removed);
+	ikestat_dec(env, ikes_sa_current);
 
 	free(sa);
 }
@@ -241,6 +246,9 @@ config_free_policy(struct iked *env, struct iked_policy *pol)
 		return;
 
  remove:
+	if (pol->pol_initqueued)
+		TAILQ_REMOVE(&env->sc_initq, pol, pol_initentry);
+
 	while ((tsi = TAILQ_FIRST(&pol->pol_tssrc))) {
 		TAILQ_REMOVE(&pol->pol_tssrc, tsi, ts_entry);
 		free(tsi);
@@ -251,6 +259,7 @@ config_free_policy(struct iked *env, struct iked_policy *pol)
 	}
 	config_free_proposals(&pol->pol_proposals, 0);
 	config_free_flows(env, &pol->pol_flows);
+	resume_ticket_free(pol->pol_ticket);
 	free(pol);
 }
 
@@ -339,6 +348,7 @@ config_free_childsas(struct iked *env, struct iked_childsas *head,
 		TAILQ_REMOVE(head, csa, csa_entry);
 		if (csa->csa_loaded) {
 			RB_REMOVE(iked_activesas, &env->sc_activesas, csa);
+			ikestat_dec(env, ikes_csa_active);
 			(void)ipsec_sa_delete(env, csa);
 		}
 		if ((ipcomp = csa->csa_bundled) != NULL) {
@@ -571,6 +581,8 @@ config_doreset(struct iked *env, unsigned int mode)
 		TAILQ_FOREACH_SAFE(pol, &env->sc_policies, pol_entry, poltmp) {
 			config_free_policy(env, pol);
 		}
+		radius_config_reset(env);
+		redirect_config_reset(env);
 	}
 
 	if (mode == RESET_ALL || mode == RESET_SA) {
@@ -593,6 +605,8 @@ config_doreset(struct iked *env, unsigned int mode)
 			RB_REMOVE(iked_users, &env->sc_users, usr);
 			free(usr);
 		}
+		userdb_close(env->sc_userdb);
+		env->sc_userdb = NULL;
 	}
 
 	return (0);
@@ -608,7 +622,7 @@ config_setsocket(struct iked *env, struct sockaddr_storage *ss,
 {
 	int	 s;
 
-	if ((s = udp_bind((struct sockaddr *)ss, port)) == -1)
+	if ((s = udp_bind((struct sockaddr *)ss, port, natt)) == -1)
 		return (-1);
 
 #if defined(UDP_ENCAP_ESPINUDP)
@@ -743,6 +757,108 @@ config_getuser(struct iked *env, struct imsg *imsg)
 	return (ret);
 }
 
+/*
+ * The parent opens the user database, which is mapped by the ikev2
+ * process.  A reload sends the current file again; if no database is
+ * configured, -1 unloads the previous one.  The database holds
+ * password equivalents and gets the same checks as iked.conf.
+ */
+int
+config_setuserdb(struct iked *env)
+{
+	struct stat	 st;
+	int		 fd = -1;
+
+	if (env->sc_opts & IKED_OPT_NOACTION)
+		return (0);
+
+	if (env->sc_userdbfile != NULL &&
+	    (fd = open(env->sc_userdbfile, O_RDONLY | O_CLOEXEC)) == -1) {
+		log_warn("%s: %s", __func__, env->sc_userdbfile);
+		return (-1);
+	}
+	/* not even readable by the group, unlike iked.conf */
+	if (fd != -1 && (check_file_secrecy(fd, env->sc_userdbfile) == -1 ||
+	    fstat(fd, &st) == -1 || (st.st_mode & S_IRGRP))) {
+		log_warnx("%s: %s: refusing insecure user database",
+		    __func__, env->sc_userdbfile);
+		close(fd);
+		return (-1);
+	}
+
+	return (proc_compose_imsg(&env->sc_ps, PROC_IKEV2, -1,
+	    IMSG_CFG_USERDB, -1, fd, NULL, 0));
+}
+
+int
+config_getuserdb(struct iked *env, struct imsg *imsg)
+{
+	struct iked_userdb	*db = NULL;
+	int			 fd;
+
+	/* Keep the old database if the new one is invalid */
+	if ((fd = imsg_get_fd(imsg)) != -1 &&
+	    (db = userdb_open(fd)) == NULL)
+		return (-1);
+
+	userdb_close(env->sc_userdb);
+	env->sc_userdb = db;
+	return (0);
+}
+
+int
+config_setradius(struct iked *env, struct iked_radserver *srv,
+    enum privsep_procid id)
+{
+	if (env->sc_opts & IKED_OPT_NOACTION) {
+		print_radius(srv);
+		return (0);
+	}
+
+	proc_compose(&env->sc_ps, id, IMSG_CFG_RADIUS, srv, sizeof(*srv));
+	return (0);
+}
+
+int
+config_getradius(struct iked *env, struct imsg *imsg)
+{
+	struct iked_radserver	 srv;
+
+	IMSG_SIZE_CHECK(imsg, &srv);
+	memcpy(&srv, imsg->data, sizeof(srv));
+	srv.rs_secret[sizeof(srv.rs_secret) - 1] = '\0';
+
+	radius_config_add(env, &srv);
+
+	explicit_bzero(&srv, sizeof(srv));
+	return (0);
+}
+
+int
+config_setredirect(struct iked *env, struct iked_redirgw *gw,
+    enum privsep_procid id)
+{
+	if (env->sc_opts & IKED_OPT_NOACTION) {
+		print_redirect(gw);
+		return (0);
+	}
+
+	proc_compose(&env->sc_ps, id, IMSG_CFG_REDIRECT, gw, sizeof(*gw));
+	return (0);
+}
+
+int
+config_getredirect(struct iked *env, struct imsg *imsg)
+{
+	struct iked_redirgw	 gw;
+
+	IMSG_SIZE_CHECK(imsg, &gw);
+	memcpy(&gw, imsg->data, sizeof(gw));
+
+	redirect_config_add(env, &gw);
+	return (0);
+}
+
 int
 config_setpolicy(struct iked *env, struct iked_policy *pol,
     enum privsep_procid id)
@@ -963,6 +1079,9 @@ config_getstatic(struct iked *env, struct imsg *imsg)
 	log_debug("%s: nattport %u", __func__, env->sc_nattport);
 	log_debug("%s: %sstickyaddress", __func__,
 	    env->sc_stickyaddress ? "" : "no ");
+	log_debug("%s: redirect mode %d max-sas %llu", __func__,
+	    env->sc_redirect_mode,
+	    (long long unsigned)env->sc_redirect_maxsas);
 
 	ikev2_reset_alive_timer(env);
 
@@ -993,6 +1112,39 @@ config_setocsp(struct iked *env)
 	    iov, iovcnt));
 }
 
+/*
+ * The OCSP cache file is opened once at startup, the parent can't
+ * create files after pledge and the ca process can't write them.
+ */
+int
+config_setocspcache(struct iked *env)
+{
+	struct stat	 st;
+	int		 fd;
+
+	if (env->sc_opts & IKED_OPT_NOACTION ||
+	    env->sc_ocsp_cachefile == NULL)
+		return (0);
+
+	if ((fd = open(env->sc_ocsp_cachefile,
+	    O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) == -1) {
+		log_warn("%s: %s", __func__, env->sc_ocsp_cachefile);
+		return (-1);
+	}
+	/* cached statuses are trusted without asking the responder */
+	if (check_file_secrecy(fd, env->sc_ocsp_cachefile) == -1 ||
+	    fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (st.st_mode & S_IRGRP)) {
+		log_warnx("%s: %s: refusing insecure OCSP cache",
+		    __func__, env->sc_ocsp_cachefile);
+		close(fd);
+		return (-1);
+	}
+
+	return (proc_compose_imsg(&env->sc_ps, PROC_CERT, -1,
+	    IMSG_OCSP_CACHE, -1, fd, NULL, 0));
+}
+
 int
 config_getocsp(struct iked *env, struct imsg *imsg)
 {
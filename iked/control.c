@@ -268,7 +268,8 @@ control_dispatch_imsg(int fd, short event, void *arg)
 	struct iked		*env = cs->cs_env;
 	struct ctl_conn		*c;
 	struct imsg		 imsg;
-	int			 n, v;
+	struct iked_verbose	 v;
+	int			 n;
 
 	if ((c = control_connbyfd(fd)) == NULL) {
 		log_warn("%s: fd %d: not found", __func__, fd);
@@ -318,7 +319,7 @@ control_dispatch_imsg(int fd, short event, void *arg)
 			IMSG_SIZE_CHECK(&imsg, &v);
 
 			memcpy(&v, imsg.data, sizeof(v));
-			log_setverbose(v);
+			log_setverbose_subsys(v.v_subsys, v.v_level);
 
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
 			break;
@@ -331,10 +332,12 @@ control_dispatch_imsg(int fd, short event, void *arg)
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
 			break;
 		case IMSG_CTL_RESET_ID:
+		case IMSG_CTL_REDIRECT:
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_IKEV2, -1);
 			break;
 		case IMSG_CTL_SHOW_SA:
 		case IMSG_CTL_SHOW_STATS:
+		case IMSG_CTL_SHOW_PEERS:
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_IKEV2, -1);
 			break;
 		case IMSG_CTL_SHOW_CERTSTORE:
@@ -381,6 +384,7 @@ control_dispatch_ikev2(int fd, struct privsep_proc *p, struct imsg *imsg)
 	switch (imsg->hdr.type) {
 	case IMSG_CTL_SHOW_SA:
 	case IMSG_CTL_SHOW_STATS:
+	case IMSG_CTL_SHOW_PEERS:
 		control_imsg_forward_peerid(imsg);
 		return (0);
 	default:
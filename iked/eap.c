@@ -36,6 +36,7 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_EAP
 #include "iked.h"
 #include "ikev2.h"
 #include "eap.h"
@@ -107,7 +108,7 @@ eap_identity_request(struct iked *env, struct iked_sa *sa)
 		return (0);
 
 	/* New encrypted message buffer */
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		goto done;
 
 	id = &sa->sa_rid;
@@ -195,7 +196,7 @@ eap_challenge_request(struct iked *env, struct iked_sa *sa,
 	int				 ret = -1;
 	struct ibuf			*e;
 
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		return (-1);
 
 	if ((eap = ibuf_reserve(e, sizeof(*eap))) == NULL)
@@ -246,7 +247,7 @@ eap_message_send(struct iked *env, struct iked_sa *sa, int eap_code, int eap_id)
 	int				 ret = -1;
 	struct ibuf			*e;
 
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		return (-1);
 
 	if ((resp = ibuf_reserve(e, sizeof(*resp))) == NULL)
@@ -278,7 +279,7 @@ eap_mschap_challenge(struct iked *env, struct iked_sa *sa, int eap_id,
 	char				*msg;
 	int				 ret = -1;
 
-	if ((eapmsg = ibuf_static()) == NULL)
+	if ((eapmsg = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		return (-1);
 
 	msg = " M=Welcome";
@@ -317,7 +318,7 @@ eap_mschap_success(struct iked *env, struct iked_sa *sa, int eap_id)
 	struct eap_mschap		*ms;
 	int				 ret = -1;
 
-	if ((eapmsg = ibuf_static()) == NULL)
+	if ((eapmsg = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		return (-1);
 	if ((resp = ibuf_reserve(eapmsg, sizeof(*resp))) == NULL)
 		goto done;
@@ -451,6 +452,24 @@ eap_parse(struct iked *env, const struct iked_sa *sa, struct iked_message *msg,
 	msg->msg_parent->msg_eap.eam_id = hdr->eap_id;
 	msg->msg_parent->msg_eap.eam_type = eap->eap_type;
 
+	/*
+	 * With RADIUS the method runs between the peer and the server,
+	 * only the first identity is needed for the User-Name.
+	 */
+	if (!response && sa->sa_policy != NULL &&
+	    sa->sa_policy->pol_auth.auth_eap == EAP_TYPE_RADIUS &&
+	    hdr->eap_code == EAP_CODE_RESPONSE) {
+		ibuf_free(msg->msg_parent->msg_eap.eam_msg);
+		if ((msg->msg_parent->msg_eap.eam_msg = ibuf_new(data,
+		    betoh16(hdr->eap_length))) == NULL)
+			return (-1);
+		if (eap->eap_type != EAP_TYPE_IDENTITY ||
+		    sa->sa_eapid != NULL) {
+			msg->msg_parent->msg_eap.eam_state = EAP_STATE_RADIUS;
+			return (0);
+		}
+	}
+
 	switch (eap->eap_type) {
 	case EAP_TYPE_IDENTITY:
 		if (eap->eap_code == EAP_CODE_REQUEST)
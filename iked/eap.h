@@ -95,6 +95,7 @@ extern struct iked_constmap eap_code_map[];
 #define EAP_TYPE_PWD		52	/* RFC-harkins-emu-eap-pwd-12.txt */
 #define EAP_TYPE_EXPANDED_TYPE	254	/* RFC3748 */
 #define EAP_TYPE_EXPERIMENTAL	255	/* RFC3748 */
+#define EAP_TYPE_RADIUS		10001	/* internal, RADIUS pass-through */
 
 extern struct iked_constmap eap_type_map[];
 
@@ -325,6 +325,8 @@ parent_configure(struct iked *env)
 	if (env->sc_nattmode != NATT_DISABLE)
 		config_setsocket(env, &ss, htons(env->sc_nattport), PROC_IKEV2, 1);
 
+	config_setocspcache(env);
+
 	/*
 	 * pledge in the parent process:
 	 * It has to run fairly late to allow forking the processes and
@@ -347,6 +349,7 @@ parent_configure(struct iked *env)
 	config_setstatic(env);
 	config_setcoupled(env, env->sc_decoupled ? 0 : 1);
 	config_setocsp(env);
+	config_setuserdb(env);
 	/* Must be last */
 	config_setmode(env, env->sc_passive ? 1 : 0);
 
@@ -379,6 +382,7 @@ parent_reload(struct iked *env, int reset, const char *filename)
 		config_setstatic(env);
 		config_setcoupled(env, env->sc_decoupled ? 0 : 1);
 		config_setocsp(env);
+		config_setuserdb(env);
 		/* Must be last */
 		config_setmode(env, env->sc_passive ? 1 : 0);
 	} else {
@@ -29,6 +29,7 @@
 #include "openbsd-compat.h"
 
 #include "types.h"
+#include "log.h"
 #include "dh.h"
 
 #define MAXIMUM(a,b) (((a)>(b))?(a):(b))
@@ -211,6 +212,18 @@ struct iked_childsa {
 RB_HEAD(iked_activesas, iked_childsa);
 TAILQ_HEAD(iked_childsas, iked_childsa);
 
+/* SAs and flows of one negotiation, installed or rolled back together */
+struct ipsec_batch_op {
+	struct iked_childsa		*bo_sa;
+	struct iked_childsa		*bo_last;	/* bundled with */
+	struct iked_flow		*bo_flow;
+	uint32_t			 bo_seq;	/* of the request */
+	int				 bo_errno;	/* -1 until reply */
+
+	TAILQ_ENTRY(ipsec_batch_op)	 bo_entry;
+};
+TAILQ_HEAD(ipsec_batch, ipsec_batch_op);
+
 
 struct iked_static_id {
 	uint8_t		id_type;
@@ -221,7 +234,7 @@ struct iked_static_id {
 
 struct iked_auth {
 	uint8_t		auth_method;
-	uint8_t		auth_eap;			/* optional EAP */
+	uint16_t	auth_eap;			/* optional EAP */
 	uint8_t		auth_length;			/* zero if EAP */
 	uint8_t		auth_data[IKED_PSK_SIZE];
 };
@@ -235,6 +248,7 @@ struct iked_cfg {
 };
 
 TAILQ_HEAD(iked_sapeers, iked_sa);
+TAILQ_HEAD(iked_sas_rekeying, iked_sa);
 
 struct iked_lifetime {
 	uint64_t			 lt_bytes;
@@ -264,6 +278,8 @@ struct iked_policy {
 #define IKED_POLICY_TRANSPORT		 0x040
 #define IKED_POLICY_ROUTING		 0x080
 #define IKED_POLICY_NATT_FORCE		 0x100
+#define IKED_POLICY_RESUME		 0x200
+#define IKED_POLICY_CHILDLESS		 0x400
 
 	int				 pol_refcnt;
 
@@ -304,10 +320,23 @@ struct iked_policy {
 	struct iked_lifetime		 pol_lifetime;	/* child SA lifetime */
 
 	struct iked_sapeers		 pol_sapeers;
+	uint64_t			 pol_established; /* IKE SAs */
+
+	struct iked_ticket		*pol_ticket;	/* session resumption */
+
+	struct iked_addr		 pol_redirect;	/* gateway, RFC 5685 */
+	struct iked_addr		 pol_redirfrom;	/* redirected from */
+	unsigned int			 pol_redirects;	/* loop protection */
+
+	TAILQ_ENTRY(iked_policy)	 pol_initentry;	/* initiation queue */
+	int				 pol_initqueued;
+	unsigned int			 pol_initfails;	/* for the backoff */
+	time_t				 pol_initnext;	/* monotonic */
 
 	TAILQ_ENTRY(iked_policy)	 pol_entry;
 };
 TAILQ_HEAD(iked_policies, iked_policy);
+TAILQ_HEAD(iked_initq, iked_policy);
 
 struct iked_hash {
 	uint8_t		 hash_type;	/* PRF or INTEGR */
@@ -368,8 +397,27 @@ struct iked_id {
     "\20\01CERT\02CERTVALID\03CERTREQ\04AUTH\05AUTHVALID\06SA\07EAPVALID" \
     "\10CHILDSA\11INF"
 
-TAILQ_HEAD(iked_msgqueue, iked_msg_retransmit);
+/*
+ * Pending requests and cached responses are kept in a small ring
+ * indexed by the message ID modulo the window size.
+ */
+#define IKED_MSGQUEUE_WINDOW	8		/* must be a power of 2 */
+#define IKED_MSGQUEUE_SLOT(id)	((id) & (IKED_MSGQUEUE_WINDOW - 1))
+struct iked_msgqueue {
+	struct iked_msg_retransmit	*mq_slot[IKED_MSGQUEUE_WINDOW];
+	unsigned int			 mq_count;
+};
 TAILQ_HEAD(iked_msg_fragqueue, iked_message);
+TAILQ_HEAD(iked_msg_responses, iked_msg_retransmit);
+
+/*
+ * NAT-T keepalives are scheduled on a wheel with one slot per second,
+ * all keepalives of a slot are sent together.
+ */
+struct iked_keepalive_slot {
+	TAILQ_HEAD(, iked_sa)		 ks_sas;
+	unsigned int			 ks_count;
+};
 
 struct iked_sahdr {
 	uint64_t			 sh_ispi;	/* Initiator SPI */
@@ -387,19 +435,26 @@ struct iked_kex {
 	struct ibuf			*kex_dhpeer;	/* pointer to i or r */
 };
 
-struct iked_frag_entry {
-	uint8_t	*frag_data;
-	size_t	 frag_size;
-};
-
+/*
+ * Fragments are decrypted directly into one reassembly buffer.  A
+ * fragment is written at its final offset if all previous fragments
+ * have been received, otherwise into its slot at (frag_num - 1) *
+ * frag_slot from where it is moved down once the gap is filled.
+ */
 struct iked_frag {
-	struct iked_frag_entry	**frag_arr;	/* list of fragment buffers */
+	struct ibuf		 *frag_buf;	/* reassembly buffer */
+	size_t			  frag_slot;	/* max. size of a fragment */
+	uint16_t		 *frag_len;	/* decrypted fragment sizes */
 	size_t			  frag_count;	/* number of fragments received */
 #define IKED_FRAG_TOTAL_MAX	  111		/* upper limit (64kB / 576B) */
 	size_t			  frag_total;	/* total numbe of fragments */
 	size_t			  frag_total_size;
+	size_t			  frag_placed;	/* fragments at final offset */
+	size_t			  frag_placed_size;
 	uint8_t			  frag_nextpayload;
-
+	uint8_t			  frag_map[(IKED_FRAG_TOTAL_MAX + 7) / 8];
+#define IKED_FRAG_ISSET(f, i)	((f)->frag_map[(i) / 8] & (1 << ((i) % 8)))
+#define IKED_FRAG_SET(f, i)	((f)->frag_map[(i) / 8] |= (1 << ((i) % 8)))
 };
 
 struct iked_ipcomp {
@@ -431,6 +486,16 @@ struct iked_sa {
 	int				 sa_usekeepalive;/* NAT-T keepalive */
 
 	int				 sa_state;
+	int				 sa_halfopen;	/* initiating */
+	int				 sa_rekeying;	/* on sc_rekeys */
+	TAILQ_ENTRY(iked_sa)		 sa_rekey_entry;
+	uint64_t			 sa_lat_start;	/* hist_now() */
+	uint64_t			 sa_lat_cert;
+	uint64_t			 sa_lat_certreq;
+	uint64_t			 sa_lat_auth;
+	uint64_t			 sa_lat_rekey;
+	unsigned int			 sa_peerstat;	/* ID entry + 1 */
+	uint32_t			 sa_peerstat_gen;
 	unsigned int			 sa_stateflags;
 	unsigned int			 sa_stateinit;	/* SA_INIT */
 	unsigned int			 sa_statevalid;	/* IKE_AUTH */
@@ -486,6 +551,18 @@ struct iked_sa {
 	char				*sa_eapid;	/* EAP identity */
 	struct iked_id			 sa_eap;	/* EAP challenge */
 	struct ibuf			*sa_eapmsk;	/* EAK session key */
+	struct iked_radreq		*sa_radreq;	/* pending RADIUS request */
+	struct ibuf			*sa_radstate;	/* RADIUS State attribute */
+
+	int				 sa_resumed;	/* IKE_SESSION_RESUME */
+	int				 sa_ticketreq;	/* peer wants a ticket */
+	struct iked_ticket		*sa_ticket;	/* session resumption */
+
+	int				 sa_redirect;	/* peer can be redirected */
+	int				 sa_redirected;	/* by the responder */
+
+	int				 sa_childless;	/* peer supports RFC 6023 */
+	int				 sa_nochild;	/* IKE_AUTH without child */
 
 	struct iked_proposals		 sa_proposals;	/* SA proposals */
 	struct iked_childsas		 sa_childsas;	/* IPsec Child SAs */
@@ -513,7 +590,8 @@ struct iked_sa {
 #define IKED_IKE_SA_DELETE_TIMEOUT	 120		/* 2 minutes */
 #define IKED_IKE_SA_ALIVE_TIMEOUT	 60		/* 1 minute */
 
-	struct iked_timer		 sa_keepalive;	/* keepalive timer */
+	TAILQ_ENTRY(iked_sa)		 sa_keepalive_entry;
+	struct iked_keepalive_slot	*sa_keepalive;	/* keepalive slot */
 #define IKED_IKE_SA_KEEPALIVE_TIMEOUT	 20
 
 	struct iked_timer		 sa_rekey;	/* rekey timeout */
@@ -546,6 +624,21 @@ RB_HEAD(iked_addrpool6, iked_sa);
 
 /* stats */
 
+/*
+ * Log-linear latency histogram in microseconds: values below
+ * IKED_HIST_SUB get a bucket each, every power of two above is split
+ * into IKED_HIST_SUB linear sub-buckets (12.5% relative error).
+ */
+#define IKED_HIST_SUBBITS	3
+#define IKED_HIST_SUB		(1 << IKED_HIST_SUBBITS)
+#define IKED_HIST_BUCKETS	256
+struct iked_hist {
+	uint64_t	h_count;
+	uint64_t	h_sum;
+	uint64_t	h_max;
+	uint32_t	h_bucket[IKED_HIST_BUCKETS];
+};
+
 struct iked_stats {
 	uint64_t	ikes_sa_created;
 	uint64_t	ikes_sa_established_total;
@@ -561,6 +654,7 @@ struct iked_stats {
 	uint64_t	ikes_msg_rcvd;
 	uint64_t	ikes_msg_rcvd_busy;
 	uint64_t	ikes_msg_rcvd_dropped;
+	uint64_t	ikes_msg_rcvd_filtered;		/* by the kernel */
 	uint64_t	ikes_retransmit_request;
 	uint64_t	ikes_retransmit_response;
 	uint64_t	ikes_retransmit_limit;
@@ -573,11 +667,195 @@ struct iked_stats {
 	uint64_t	ikes_update_addresses_sent;
 	uint64_t	ikes_dpd_sent;
 	uint64_t	ikes_keepalive_sent;
+	uint64_t	ikes_keepalive_ticks;
+	uint64_t	ikes_keepalive_tick_max;	/* max per tick */
+	uint64_t	ikes_keepalive_syscalls;
+	uint64_t	ikes_response_cache_evicted;
+	uint64_t	ikes_init_deferred;
+	uint64_t	ikes_init_backoff;
+	uint64_t	ikes_rekey_started;
+	uint64_t	ikes_rekey_deferred;
+	uint64_t	ikes_rekey_rate_max;		/* per second */
+	uint64_t	ikes_sa_current;		/* gauge */
+	uint64_t	ikes_csa_active;		/* gauge */
+	uint64_t	ikes_flow_active;		/* gauge */
+	uint64_t	ikes_radius_sent;
+	uint64_t	ikes_radius_retransmit;
+	uint64_t	ikes_radius_failover;
+	uint64_t	ikes_radius_timeout;
+	uint64_t	ikes_radius_invalid;
+	uint64_t	ikes_radius_wait;
+	uint64_t	ikes_radius_accept;
+	uint64_t	ikes_radius_reject;
+	uint64_t	ikes_radius_pending;		/* gauge */
+	uint64_t	ikes_resume_ticket_issued;
+	uint64_t	ikes_resume_ticket_refused;
+	uint64_t	ikes_resume_sent;
+	uint64_t	ikes_resume_accepted;
+	uint64_t	ikes_resume_rejected;
+	uint64_t	ikes_resume_fallback;
+	uint64_t	ikes_redirect_sa_init;
+	uint64_t	ikes_redirect_informational;
+	uint64_t	ikes_redirect_followed;
+	uint64_t	ikes_redirect_loop;
+	uint64_t	ikes_childless_sa;
+	uint64_t	ikes_childless_acquire;
+	uint64_t	ikes_spipool_hit;
+	uint64_t	ikes_spipool_miss;
+	uint64_t	ikes_spipool_expired;
+	uint64_t	ikes_spipool_reserved;		/* gauge */
+	uint64_t	ikes_ipsec_batch;
+	uint64_t	ikes_ipsec_batch_msgs;
+	uint64_t	ikes_ipsec_batch_rollback;
+	uint64_t	ikes_pfkey_acquire_coalesced;
+	uint64_t	ikes_pfkey_acquire_dropped;
+	uint64_t	ikes_pfkey_acquire_pending;	/* gauge */
+
+	/* latencies */
+	struct iked_hist ikes_lat_sa_init;	/* SA_INIT request processing */
+	struct iked_hist ikes_lat_auth;		/* SA_INIT to ESTABLISHED */
+	struct iked_hist ikes_lat_ca_cert;	/* IMSG_CERT to IMSG_CERTVALID */
+	struct iked_hist ikes_lat_ca_ocsp;	/* as above, answered by OCSP */
+	struct iked_hist ikes_lat_ca_auth;	/* IMSG_AUTH round trip */
+	struct iked_hist ikes_lat_ca_certreq;	/* IMSG_CERTREQ to IMSG_CERT */
+	struct iked_hist ikes_lat_pfkey;	/* pfkey_write() */
+	struct iked_hist ikes_lat_rekey;	/* CREATE_CHILD_SA rekey */
+	struct iked_hist ikes_lat_radius;	/* RADIUS round trip */
+	struct iked_hist ikes_lat_resume;	/* IKE_SESSION_RESUME request */
+};
+
+/* IMSG_CTL_VERBOSE */
+struct iked_verbose {
+	int		 v_subsys;	/* LOG_SUBSYS_*, -1 for all */
+	int		 v_level;
+};
+
+/* per-policy counters, sent after struct iked_stats */
+struct iked_policy_stats {
+	char		ps_name[IKED_ID_SIZE];
+	uint64_t	ps_established;
+};
+
+/*
+ * Per-peer counters, kept in two fixed-size tables keyed by peer
+ * address and by peer ID.  A new peer replaces the entry with the
+ * fewest events and inherits its count as pe_error (space-saving),
+ * so the busiest peers stay in the table.
+ */
+#define IKED_PEERSTAT_MSG_RCVD		 0
+#define IKED_PEERSTAT_MSG_SENT		 1
+#define IKED_PEERSTAT_DROPPED		 2
+#define IKED_PEERSTAT_RETRANSMIT	 3
+#define IKED_PEERSTAT_AUTH_FAILED	 4
+#define IKED_PEERSTAT_REKEY		 5
+#define IKED_PEERSTAT_BYTES_RCVD	 6	/* not counted as events */
+#define IKED_PEERSTAT_BYTES_SENT	 7
+#define IKED_PEERSTAT_MAX		 8
+#define IKED_PEERSTAT_ENTRIES		 256
+#define IKED_PEERSTAT_IDLEN		 256
+
+struct iked_peer_stats {
+	struct sockaddr_storage	 pe_addr;	/* unused in the ID table */
+	char			 pe_id[IKED_PEERSTAT_IDLEN];
+	uint64_t		 pe_events;	/* including pe_error */
+	uint64_t		 pe_error;	/* upper bound of missed events */
+	uint64_t		 pe_count[IKED_PEERSTAT_MAX];
+};
+
+/* IMSG_CTL_SHOW_PEERS request */
+struct iked_peerstat_req {
+	uint8_t			 pr_table;
+#define IKED_PEERSTAT_ADDR	 0
+#define IKED_PEERSTAT_ID	 1
+	uint8_t			 pr_metric;
+	uint16_t		 pr_reserved;
+	uint32_t		 pr_limit;	/* 0 for all */
+};
+
+/* IMSG_CTL_SHOW_SA request, unset fields match all SAs */
+struct iked_sa_filter {
+	char			 sf_policy[IKED_ID_SIZE];
+	char			 sf_id[IKED_ID_SIZE];
+	struct sockaddr_storage	 sf_peer;
+	int			 sf_peermask;	/* -1 for the host */
+	int			 sf_state;	/* -1 for any */
+	uint64_t		 sf_after_ispi;	/* cursor */
+	int			 sf_after_initiator; /* -1 to start */
+	unsigned int		 sf_limit;	/* IKE SAs, 0 for all */
+};
+
+/*
+ * IMSG_CTL_SHOW_SA replies are packed records, each padded to 8 bytes.
+ * A Child SA or flow record belongs to the preceding IKE SA record.
+ */
+struct iked_ctl_rec {
+	uint16_t		 cr_type;
+#define IKED_CTL_REC_SA		 1
+#define IKED_CTL_REC_CHILDSA	 2
+#define IKED_CTL_REC_FLOW	 3
+#define IKED_CTL_REC_CURSOR	 4	/* more SAs after the limit */
+	uint16_t		 cr_len;	/* including the header */
+	uint32_t		 cr_reserved;
+};
+
+struct iked_ctl_addr {
+	uint8_t			 ca_af;
+	uint8_t			 ca_mask;
+	uint16_t		 ca_port;
+	uint8_t			 ca_addr[16];
+};
+
+struct iked_ctl_sa {
+	uint64_t		 cs_ispi;
+	uint64_t		 cs_rspi;
+	struct iked_ctl_addr	 cs_local;
+	struct iked_ctl_addr	 cs_peer;
+	struct iked_ctl_addr	 cs_addrpool;
+	uint8_t			 cs_state;
+	uint8_t			 cs_flags;
+#define IKED_CTL_SA_INITIATOR	 0x01
+#define IKED_CTL_SA_NATT	 0x02
+#define IKED_CTL_SA_UDPENCAP	 0x04
+	uint16_t		 cs_idlen;	/* id and policy name follow */
+	uint16_t		 cs_policylen;
+};
+
+struct iked_ctl_childsa {
+	uint64_t		 cc_spi;
+	struct iked_ctl_addr	 cc_local;
+	struct iked_ctl_addr	 cc_peer;
+	uint8_t			 cc_saproto;
+	uint8_t			 cc_spisize;
+	uint8_t			 cc_dir;
+	uint8_t			 cc_flags;
+#define IKED_CTL_CSA_LOADED	 0x01
+#define IKED_CTL_CSA_REKEY	 0x02
+#define IKED_CTL_CSA_ALLOCATED	 0x04
+#define IKED_CTL_CSA_PERSISTENT	 0x08
+#define IKED_CTL_CSA_BUNDLED	 0x10	/* IPcomp of the previous one */
+};
+
+struct iked_ctl_flow {
+	struct iked_ctl_addr	 cf_src;
+	struct iked_ctl_addr	 cf_dst;
+	struct iked_ctl_addr	 cf_prenat;
+	int32_t			 cf_rdomain;
+	uint8_t			 cf_saproto;
+	uint8_t			 cf_dir;
+	uint8_t			 cf_ipproto;
+	uint8_t			 cf_loaded;
+};
+
+struct iked_ctl_cursor {
+	uint64_t		 cc_ispi;
+	uint8_t			 cc_initiator;
 };
 
 #define ikestat_add(env, c, n)	do { env->sc_stats.c += (n); } while(0)
 #define ikestat_inc(env, c)	ikestat_add(env, c, 1)
 #define ikestat_dec(env, c)	ikestat_add(env, c, -1)
+#define ikestat_lat(env, h, start)	\
+	hist_add(&(env)->sc_stats.h, hist_now() - (start))
 
 struct iked_certreq {
 	struct ibuf			*cr_data;
@@ -590,6 +868,7 @@ SIMPLEQ_HEAD(iked_certreqs, iked_certreq);
 #define EAP_STATE_MSCHAPV2_CHALLENGE	(2)
 #define EAP_STATE_MSCHAPV2_SUCCESS	(3)
 #define EAP_STATE_SUCCESS		(4)
+#define EAP_STATE_RADIUS		(5)
 
 struct eap_msg {
 	char		*eam_identity;
@@ -603,11 +882,22 @@ struct eap_msg {
 	uint8_t		 eam_challenge[16];
 	uint8_t		 eam_ntresponse[24];
 	uint32_t	 eam_state;
+	struct ibuf	*eam_msg;	/* to be sent to the RADIUS server */
+};
+
+/*
+ * Encoded datagram shared between the send path and the retransmit
+ * queue.  It must not be modified once it has been sent.
+ */
+struct iked_wirebuf {
+	struct ibuf		*wb_buf;
+	int			 wb_refcnt;
 };
 
 struct iked_message {
 	struct ibuf		*msg_data;
 	size_t			 msg_offset;
+	struct iked_wirebuf	*msg_wire;	/* shared msg_data, if set */
 
 	struct sockaddr_storage	 msg_local;
 	socklen_t		 msg_locallen;
@@ -648,6 +938,9 @@ struct iked_message {
 	struct iked_id		 msg_cert;
 	struct iked_id		 msg_scert[IKED_SCERT_MAX]; /* supplemental certs */
 	struct ibuf		*msg_cookie;
+	struct ibuf		*msg_ticket;	/* resumption ticket */
+	uint32_t		 msg_ticket_lifetime;
+	struct sockaddr_storage	*msg_redirect;	/* new gateway */
 	uint16_t		 msg_group;
 	uint16_t		 msg_cpi;
 	uint8_t			 msg_transform;
@@ -678,10 +971,15 @@ struct iked_message {
 
 struct iked_msg_retransmit {
 	struct iked_msg_fragqueue	      mrt_frags;
-	TAILQ_ENTRY(iked_msg_retransmit)      mrt_entry;
-	struct iked_timer		      mrt_timer;
+	TAILQ_ENTRY(iked_msg_retransmit)      mrt_entry;	/* response aging */
+	struct iked_timer		      mrt_timer;	/* requests only */
 	int				      mrt_tries;
 #define IKED_RETRANSMIT_TRIES	 5		/* try 5 times */
+	uint32_t			      mrt_msgid;
+	uint8_t				      mrt_exchange;
+	int				      mrt_response;
+	size_t				      mrt_size;		/* cached bytes */
+	time_t				      mrt_expire;	/* responses only */
 };
 
 #define IKED_MSG_NAT_SRC_IP				0x01
@@ -698,6 +996,11 @@ struct iked_msg_retransmit {
 #define IKED_MSG_FLAGS_USE_TRANSPORT			0x0100
 #define IKED_MSG_FLAGS_TEMPORARY_FAILURE		0x0200
 #define IKED_MSG_FLAGS_NO_PROPOSAL_CHOSEN		0x0400
+#define IKED_MSG_FLAGS_TICKET_REQUEST			0x0800
+#define IKED_MSG_FLAGS_TICKET_NACK			0x1000
+#define IKED_MSG_FLAGS_REDIRECT_SUPPORTED		0x2000
+#define IKED_MSG_FLAGS_REDIRECTED_FROM			0x4000
+#define IKED_MSG_FLAGS_CHILDLESS			0x8000
 
 
 struct iked_user {
@@ -707,6 +1010,136 @@ struct iked_user {
 };
 RB_HEAD(iked_users, iked_user);
 
+/*
+ * User database file, see ikectl userdb.  All values are in network
+ * byte order.  The header is followed by the bucket index, the records
+ * sorted by bucket and the user names.  The records of bucket b are
+ * the ones from index[b] up to index[b + 1].
+ */
+#define IKED_USERDB_MAGIC	"IKEDUDB1"
+
+struct iked_userdb_hdr {
+	uint8_t			 uh_magic[8];
+	uint32_t		 uh_nbuckets;
+	uint32_t		 uh_nrecords;
+};
+
+struct iked_userdb_rec {
+	uint32_t		 ur_hash;
+	uint32_t		 ur_name;	/* file offset of the name */
+	uint8_t			 ur_nthash[16];	/* MD4 of the password */
+	uint16_t		 ur_namelen;
+	uint16_t		 ur_reserved;
+};
+
+struct iked_userdb {
+	uint8_t			*ud_map;
+	size_t			 ud_size;
+	uint32_t		 ud_nbuckets;
+	uint32_t		 ud_nrecords;
+	uint32_t		*ud_index;
+	struct iked_userdb_rec	*ud_records;
+};
+
+/*
+ * RADIUS servers for the EAP pass-through, see radius.c.  The parent
+ * sends the address and secret, the other fields belong to the ikev2
+ * process.
+ */
+#define IKED_RADIUS_PORT	1812
+#define IKED_RADIUS_SOCKETS	4	/* per address family */
+#define IKED_RADIUS_TIMEOUT	3	/* seconds per try */
+#define IKED_RADIUS_MAXTRIES	3	/* tries per server */
+#define IKED_RADIUS_DEADTIME	30	/* seconds a server is skipped */
+
+struct iked_radserver {
+	struct sockaddr_storage	 rs_sockaddr;
+	char			 rs_secret[IKED_PASSWORD_SIZE];
+	uint64_t		 rs_deaduntil;	/* hist_now() */
+	TAILQ_ENTRY(iked_radserver) rs_entry;
+};
+TAILQ_HEAD(iked_radservers, iked_radserver);
+
+/* The requests of all servers share the identifiers of a socket */
+struct iked_radsock {
+	int			 rsk_fd;
+	struct event		 rsk_ev;
+	struct iked		*rsk_env;
+	struct iked_radreq	*rsk_reqs[256];
+	unsigned int		 rsk_nreqs;
+	uint8_t			 rsk_nextid;
+};
+
+struct iked_radreq {
+	struct iked_sa		*rr_sa;
+	struct iked_radserver	*rr_server;
+	struct iked_radsock	*rr_sock;	/* holding rr_id */
+	int			 rr_waiting;	/* on sc_radwait */
+	uint8_t			 rr_id;
+	uint8_t			 rr_auth[16];	/* Request Authenticator */
+	struct ibuf		*rr_eap;	/* from the peer */
+	struct ibuf		*rr_pkt;	/* as sent to rr_server */
+	struct iked_timer	 rr_timer;
+	unsigned int		 rr_tries;	/* on rr_server */
+	unsigned int		 rr_servers;	/* servers tried */
+	uint64_t		 rr_start;	/* hist_now() */
+	TAILQ_ENTRY(iked_radreq) rr_entry;	/* sc_radwait */
+};
+TAILQ_HEAD(iked_radreqs, iked_radreq);
+
+/*
+ * Session resumption tickets (RFC 5723), see resume.c.  The responder
+ * seals the ticket with a random key of the ikev2 process that is
+ * replaced every IKED_TICKET_LIFETIME seconds, the previous key opens
+ * the tickets that are still valid.  The initiator keeps the ticket
+ * with the SK_d and the transforms of the IKE SA it was issued for.
+ */
+#define IKED_TICKET_LIFETIME	(8 * 60 * 60)	/* 8 hours */
+#define IKED_TICKET_MAX		1024		/* bytes, accepted */
+#define IKED_TICKET_KEYSZ	32		/* AES-256-GCM */
+
+struct iked_ticketkey {
+	uint32_t		 tkk_id;
+	uint8_t			 tkk_key[IKED_TICKET_KEYSZ];
+	time_t			 tkk_created;	/* monotonic */
+};
+
+struct iked_ticket {
+	struct ibuf		*tk_opaque;	/* sealed, initiator */
+	struct ibuf		*tk_key_d;	/* SK_d of the old IKE SA */
+	struct iked_proposals	 tk_proposals;	/* transforms of the SA */
+	time_t			 tk_expire;	/* monotonic */
+	char			 tk_policy[IKED_ID_SIZE]; /* responder */
+	struct iked_id		 tk_id;		/* IDi, responder */
+	char			*tk_eapid;	/* responder */
+};
+
+/*
+ * Gateways that new IKE SAs are redirected to (RFC 5685), see
+ * redirect.c.  The mode selects when a peer is redirected and which
+ * gateway it gets, the parent sends the address and weight of each
+ * gateway.
+ */
+#define IKED_REDIRECT_MAX	5	/* redirects followed without an SA */
+#define IKED_REDIRECT_WEIGHT	1
+#define IKED_REDIRECT_WEIGHT_MAX 100
+
+enum iked_redirect_mode {
+	REDIRECT_NONE = 0,
+	REDIRECT_STATIC,	/* all peers, round robin */
+	REDIRECT_WEIGHTED,	/* all peers, by weight */
+	REDIRECT_MAXSAS		/* above sc_redirect_maxsas, by weight */
+};
+
+struct iked_redirgw {
+	struct sockaddr_storage	 rg_addr;
+	unsigned int		 rg_weight;
+	int			 rg_current;	/* smooth weighted round robin */
+	uint64_t		 rg_redirected;
+	TAILQ_ENTRY(iked_redirgw) rg_entry;
+};
+TAILQ_HEAD(iked_redirgws, iked_redirgw);
+
 struct privsep_pipes {
 	int				*pp_pipes[PROC_MAX];
 };
@@ -766,6 +1199,10 @@ struct iked_ocsp_entry {
 	void			*ioe_ocsp;	/* private ocsp request data */
 };
 TAILQ_HEAD(iked_ocsp_requests, iked_ocsp_entry);
+TAILQ_HEAD(iked_ocsp_conns, iked_ocsp_conn);
+
+/* verified OCSP statuses, private to ocsp.c */
+RB_HEAD(iked_ocsp_cache, iked_ocsp_cache_entry);
 
 /*
  * Daemon configuration
@@ -786,6 +1223,11 @@ struct iked_static {
 	in_port_t		 st_nattport;
 	int			 st_stickyaddress; /* addr per DSTID  */
 	int			 st_vendorid;
+	int			 st_rekeywindow; /* percent of lifetime */
+	int			 st_radius_timeout;
+	int			 st_radius_maxtries;
+	int			 st_redirect_mode;
+	uint64_t		 st_redirect_maxsas;
 };
 
 struct iked {
@@ -806,6 +1248,11 @@ struct iked {
 #define sc_nattport		sc_static.st_nattport
 #define sc_stickyaddress	sc_static.st_stickyaddress
 #define sc_vendorid		sc_static.st_vendorid
+#define sc_rekeywindow		sc_static.st_rekeywindow
+#define sc_radius_timeout	sc_static.st_radius_timeout
+#define sc_radius_maxtries	sc_static.st_radius_maxtries
+#define sc_redirect_mode	sc_static.st_redirect_mode
+#define sc_redirect_maxsas	sc_static.st_redirect_maxsas
 
 	struct iked_policies		 sc_policies;
 	struct iked_policy		*sc_defaultcon;
@@ -815,8 +1262,23 @@ struct iked {
 	struct iked_activesas		 sc_activesas;
 	struct iked_flows		 sc_activeflows;
 	struct iked_users		 sc_users;
+	char				*sc_userdbfile;
+	struct iked_userdb		*sc_userdb;	/* ikev2 process */
+
+	struct iked_radservers		 sc_radservers;
+	struct iked_radserver		*sc_radnext;	/* round robin */
+	struct iked_radsock		*sc_radsock4[IKED_RADIUS_SOCKETS];
+	struct iked_radsock		*sc_radsock6[IKED_RADIUS_SOCKETS];
+	unsigned int			 sc_radsocknext;
+	struct iked_radreqs		 sc_radwait;	/* no free identifier */
+
+	struct iked_ticketkey		 sc_ticketkeys[2]; /* current, previous */
+
+	struct iked_redirgws		 sc_redirgws;
+	struct iked_redirgw		*sc_redirnext;	/* round robin */
 
 	struct iked_stats		 sc_stats;
+	struct iked_peerstat_table	*sc_peerstats[2]; /* ikev2 process */
 
 	void				*sc_priv;	/* per-process */
 
@@ -831,15 +1293,48 @@ struct iked {
 	struct iked_socket		*sc_sock6[2];
 
 	struct iked_timer		 sc_inittmr;
+	time_t				 sc_initnext;	/* timer, monotonic */
+	struct iked_initq		 sc_initq;	/* by pol_initnext */
+	unsigned int			 sc_inithalfopen;
 #define IKED_INITIATOR_INITIAL		 2
-#define IKED_INITIATOR_INTERVAL		 60
+#define IKED_INITIATOR_INTERVAL		 60	/* max backoff */
+#define IKED_INITIATOR_RATE		 20	/* per second */
+#define IKED_INITIATOR_HALFOPEN		 100
+
+	struct iked_sas_rekeying	 sc_rekeys;	/* in flight */
+	time_t				 sc_rekeysec;
+	unsigned int			 sc_rekeysec_count;
+#define IKED_REKEY_MAX			 32
+#define IKED_REKEY_PEER_MAX		 4
+#define IKED_REKEY_WINDOW		 10	/* default, percent */
+
+	struct iked_msg_responses	 sc_responses;	/* cached, by age */
+	size_t				 sc_responses_size;
+#define IKED_RESPONSE_CACHE_MAX		 (16 * 1024 * 1024)
+	struct iked_timer		 sc_responsetmr;
+#define IKED_RESPONSE_SWEEP_INTERVAL	 10
+
+#define IKED_KEEPALIVE_SLOTS		 IKED_IKE_SA_KEEPALIVE_TIMEOUT
+#define IKED_KEEPALIVE_JITTER		 5		/* seconds */
+	struct iked_keepalive_slot	 sc_keepalive[IKED_KEEPALIVE_SLOTS];
+	unsigned int			 sc_keepalive_cur;
+	unsigned int			 sc_keepalive_count;
+	struct iked_timer		 sc_keepalivetmr;
 
 	struct privsep			 sc_ps;
 
 	struct iked_ocsp_requests	 sc_ocsp;
+	struct iked_ocsp_conns		 sc_ocsp_conns;	/* idle keep-alive */
+	struct iked_ocsp_resolver	*sc_ocsp_resolver;
 	char				*sc_ocsp_url;
 	long				 sc_ocsp_tolerate;
 	long				 sc_ocsp_maxage;
+	char				*sc_ocsp_cachefile;
+	struct iked_ocsp_cache		 sc_ocsp_cache;
+	unsigned int			 sc_ocsp_cachesize;
+	int				 sc_ocsp_cachefd;
+	int				 sc_ocsp_cachedirty;
+	struct iked_timer		 sc_ocsp_cachetmr;
 
 	struct iked_addrpool		 sc_addrpool;
 	struct iked_addrpool6		 sc_addrpool6;
@@ -942,10 +1437,19 @@ int	 config_setpfkey(struct iked *);
 int	 config_getpfkey(struct iked *, struct imsg *);
 int	 config_setuser(struct iked *, struct iked_user *, enum privsep_procid);
 int	 config_getuser(struct iked *, struct imsg *);
+int	 config_setuserdb(struct iked *);
+int	 config_getuserdb(struct iked *, struct imsg *);
+int	 config_setradius(struct iked *, struct iked_radserver *,
+	    enum privsep_procid);
+int	 config_getradius(struct iked *, struct imsg *);
+int	 config_setredirect(struct iked *, struct iked_redirgw *,
+	    enum privsep_procid);
+int	 config_getredirect(struct iked *, struct imsg *);
 int	 config_setcompile(struct iked *, enum privsep_procid);
 int	 config_getcompile(struct iked *);
 int	 config_setocsp(struct iked *);
 int	 config_getocsp(struct iked *, struct imsg *);
+int	 config_setocspcache(struct iked *);
 int	 config_setkeys(struct iked *);
 int	 config_getkey(struct iked *, struct imsg *);
 int	 config_setstatic(struct iked *);
@@ -1064,6 +1568,10 @@ int vroute_getcloneroute(struct iked *, struct imsg *);
 void	 ikev2(struct privsep *, struct privsep_proc *);
 void	 ikev2_recv(struct iked *, struct iked_message *);
 void	 ikev2_init_ike_sa(struct iked *, void *);
+void	 ikev2_init_enqueue(struct iked *, struct iked_policy *);
+void	 ikev2_init_halfopen_done(struct iked *, struct iked_sa *);
+time_t	 ikev2_init_time(void);
+void	 ikev2_rekey_done(struct iked *, struct iked_sa *);
 int	 ikev2_policy2id(struct iked_static_id *, struct iked_id *, int);
 int	 ikev2_childsa_enable(struct iked *, struct iked_sa *);
 int	 ikev2_childsa_delete(struct iked *, struct iked_sa *,
@@ -1072,7 +1580,9 @@ void	 ikev2_ikesa_recv_delete(struct iked *, struct iked_sa *);
 void	 ikev2_ike_sa_timeout(struct iked *env, void *);
 void	 ikev2_ike_sa_setreason(struct iked_sa *, char *);
 void	 ikev2_reset_alive_timer(struct iked *);
+void	 ikev2_keepalive_del(struct iked *, struct iked_sa *);
 int	 ikev2_ike_sa_delete(struct iked *, struct iked_sa *);
+int	 ikev2_send_auth_failed(struct iked *, struct iked_sa *);
 
 struct ibuf *
 	 ikev2_prfplus(struct iked_hash *, struct ibuf *, struct ibuf *,
@@ -1110,9 +1620,16 @@ void	 ikev2_msg_cb(int, short, void *);
 struct ibuf *
 	 ikev2_msg_init(struct iked *, struct iked_message *,
 	    struct sockaddr_storage *, socklen_t,
-	    struct sockaddr_storage *, socklen_t, int);
+	    struct sockaddr_storage *, socklen_t, int, uint8_t);
+struct ibuf *
+	 ikev2_msg_buf(uint8_t);
 struct iked_message *
 	 ikev2_msg_copy(struct iked *, struct iked_message *);
+struct iked_wirebuf *
+	 ikev2_msg_wire(struct iked_message *);
+void	 ikev2_msg_wire_unref(struct iked_wirebuf *);
+ssize_t	 ikev2_msg_sendtofrom(struct iked_message *);
+int	 ikev2_msg_sendqueue(struct iked *, struct iked_msg_fragqueue *);
 void	 ikev2_msg_cleanup(struct iked *, struct iked_message *);
 uint32_t
 	 ikev2_msg_id(struct iked *, struct iked_sa *);
@@ -1133,6 +1650,8 @@ struct ibuf
 struct ibuf *
 	 ikev2_msg_decrypt(struct iked *, struct iked_sa *,
 	    struct ibuf *, struct ibuf *);
+ssize_t	 ikev2_msg_decrypt_buf(struct iked *, struct iked_sa *,
+	    struct ibuf *, uint8_t *, size_t, uint8_t *, size_t);
 int	 ikev2_msg_integr(struct iked *, struct iked_sa *, struct ibuf *);
 int	 ikev2_msg_frompeer(struct iked_message *);
 struct iked_socket *
@@ -1175,6 +1694,7 @@ int	 pfkey_sa_add(struct iked *, struct iked_childsa *, struct iked_childsa *);
 int	 pfkey_sa_update_addresses(struct iked *, struct iked_childsa *);
 int	 pfkey_sa_delete(struct iked *, struct iked_childsa *);
 int	 pfkey_sa_last_used(struct iked *, struct iked_childsa *, uint64_t *);
+int	 pfkey_batch(struct iked *, struct ipsec_batch *);
 int	 pfkey_flush(struct iked *);
 int	 pfkey_socket(struct iked *);
 void	 pfkey_init(struct iked *, int fd);
@@ -1192,6 +1712,12 @@ int	 ipsec_sa_rpl(struct iked *, struct iked_childsa *, uint32_t *);
 int	 ipsec_sa_lifetimes(struct iked *, struct iked_childsa *, struct iked_lifetime *,
 	     struct iked_lifetime *, struct iked_lifetime *);
 int	 ipsec_flush(struct iked *);
+void	 ipsec_batch_init(struct ipsec_batch *);
+int	 ipsec_batch_sa_add(struct ipsec_batch *, struct iked_childsa *,
+	    struct iked_childsa *);
+int	 ipsec_batch_flow_add(struct ipsec_batch *, struct iked_flow *);
+int	 ipsec_batch_commit(struct iked *, struct ipsec_batch *);
+void	 ipsec_batch_clear(struct ipsec_batch *);
 int	 ipsec_socket(struct iked *);
 void	 ipsec_init(struct iked *, int fd);
 
@@ -1219,6 +1745,46 @@ void	 timer_set(struct iked *, struct iked_timer *,
 void	 timer_add(struct iked *, struct iked_timer *, int);
 void	 timer_del(struct iked *, struct iked_timer *);
 
+/* peerstat.c */
+void	 peerstat_add(struct iked *, struct sockaddr *, struct iked_sa *,
+	    unsigned int, uint64_t);
+void	 peerstat_msg(struct iked *, struct iked_message *, unsigned int,
+	    uint64_t);
+void	 peerstat_ctl_show(struct iked *, struct imsg *);
+
+/* userdb.c */
+uint32_t userdb_hash(const char *, size_t);
+struct iked_userdb *
+	 userdb_open(int);
+void	 userdb_close(struct iked_userdb *);
+int	 userdb_lookup(struct iked_userdb *, const char *, uint8_t *);
+
+/* radius.c */
+void	 radius_config_add(struct iked *, struct iked_radserver *);
+void	 radius_config_reset(struct iked *);
+int	 radius_request(struct iked *, struct iked_sa *, struct ibuf **);
+void	 radius_request_free(struct iked *, struct iked_radreq *);
+
+/* resume.c */
+struct ibuf *
+	 resume_ticket_seal(struct iked *, struct iked_sa *);
+struct iked_ticket *
+	 resume_ticket_open(struct iked *, struct ibuf *);
+int	 resume_ticket_save(struct iked_sa *, struct ibuf *, uint32_t);
+struct iked_ticket *
+	 resume_ticket_get(struct iked_policy *);
+void	 resume_ticket_free(struct iked_ticket *);
+int	 resume_authsign(struct iked *, struct iked_sa *);
+int	 resume_authverify(struct iked *, struct iked_sa *);
+
+/* redirect.c */
+void	 redirect_config_add(struct iked *, struct iked_redirgw *);
+void	 redirect_config_reset(struct iked *);
+struct sockaddr_storage *
+	 redirect_select(struct iked *, int);
+int	 redirect_addgw(struct ibuf *, struct sockaddr_storage *);
+ssize_t	 redirect_getgw(uint8_t *, size_t, struct sockaddr_storage *);
+
 /* proc.c */
 void	 proc_init(struct privsep *, struct privsep_proc *, unsigned int, int,
 	    int, char **, enum privsep_procid);
@@ -1258,9 +1824,18 @@ in_port_t
 int	 socket_setport(struct sockaddr *, in_port_t);
 int	 socket_getaddr(int, struct sockaddr_storage *);
 int	 socket_bypass(int, struct sockaddr *);
-int	 udp_bind(struct sockaddr *, in_port_t);
+int	 socket_filter(int, int);
+int	 socket_drops(int, uint32_t *);
+int	 udp_bind(struct sockaddr *, in_port_t, int);
 ssize_t	 sendtofrom(int, void *, size_t, int, struct sockaddr *,
 	    socklen_t, struct sockaddr *, socklen_t);
+ssize_t	 sendtofromv(int, struct iovec *, int, int, struct sockaddr *,
+	    socklen_t, struct sockaddr *, socklen_t);
+int	 sendmtofrom(int, struct iovec *, int, unsigned int,
+	    struct sockaddr *, socklen_t, struct sockaddr *, socklen_t);
+unsigned int
+	 sendtofrom_peers(int, void *, size_t, struct sockaddr_storage **,
+	    struct sockaddr_storage **, unsigned int, unsigned int *);
 ssize_t	 recvfromto(int, void *, size_t, int, struct sockaddr *,
 	    socklen_t *, struct sockaddr *, socklen_t *);
 const char *
@@ -1268,9 +1843,9 @@ const char *
 const char *
 	 print_map(unsigned int, struct iked_constmap *);
 void	 lc_idtype(char *);
-void	 print_hex(const uint8_t *, off_t, size_t);
-void	 print_hexval(const uint8_t *, off_t, size_t);
-void	 print_hexbuf(struct ibuf *);
+void	 (print_hex)(const uint8_t *, off_t, size_t);
+void	 (print_hexval)(const uint8_t *, off_t, size_t);
+void	 (print_hexbuf)(struct ibuf *);
 const char *
 	 print_bits(unsigned short, unsigned char *);
 int	 sockaddr_cmp(struct sockaddr *, struct sockaddr *, int);
@@ -1287,16 +1862,40 @@ const char *
 	 print_proto(uint8_t);
 int	 expand_string(char *, size_t, const char *, const char *);
 uint8_t *string2unicode(const char *, size_t *);
-void	 print_debug(const char *, ...)
+void	 (print_debug)(const char *, ...)
 	    __attribute__((format(printf, 1, 2)));
 void	 print_verbose(const char *, ...)
 	    __attribute__((format(printf, 1, 2)));
+uint64_t hist_now(void);
+void	 hist_add(struct iked_hist *, uint64_t);
+uint64_t hist_percentile(struct iked_hist *, unsigned int);
+uint64_t hist_bucket_max(unsigned int);
+void	 ctl_addr_pack(struct iked_ctl_addr *, struct sockaddr *, int);
+int	 ctl_addr_unpack(struct sockaddr_storage *, struct iked_ctl_addr *);
+
+/* dumps to stderr, checked against the verbosity of the caller */
+#define print_hex(...) do {						\
+	if (log_level_ok(3))						\
+		(print_hex)(__VA_ARGS__);				\
+} while (0)
+#define print_hexval(...) do {						\
+	if (log_level_ok(2))						\
+		(print_hexval)(__VA_ARGS__);				\
+} while (0)
+#define print_hexbuf(...) do {						\
+	if (log_level_ok(3))						\
+		(print_hexbuf)(__VA_ARGS__);				\
+} while (0)
+#define print_debug(...) do {						\
+	if (log_level_ok(3))						\
+		(print_debug)(__VA_ARGS__);				\
+} while (0)
 
 /* imsg_util.c */
 struct ibuf *
 	 ibuf_new(const void *, size_t);
 struct ibuf *
-	 ibuf_static(void);
+	 ibuf_message(size_t);
 size_t	 ibuf_length(struct ibuf *);
 int	 ibuf_setsize(struct ibuf *, size_t);
 struct ibuf *
@@ -1306,37 +1905,17 @@ struct ibuf *
 struct ibuf *
 	 ibuf_random(size_t);
 
-/* log.c */
-void	log_init(int, int);
-void	log_procinit(const char *);
-void	log_setverbose(int);
-int	log_getverbose(void);
-void	log_warn(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_warnx(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_info(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_debug(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	logit(int, const char *, ...)
-	    __attribute__((__format__ (printf, 2, 3)));
-void	vlog(int, const char *, va_list)
-	    __attribute__((__format__ (printf, 2, 0)));
-__dead void fatal(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-__dead void fatalx(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-
 /* ocsp.c */
 int	 ocsp_connect(struct iked *, struct imsg *);
 int	 ocsp_receive_fd(struct iked *, struct imsg *);
 int	 ocsp_validate_cert(struct iked *, void *, size_t, struct iked_sahdr,
     uint8_t, X509 *);
+int	 ocsp_cache_open(struct iked *, struct imsg *);
 
 /* parse.y */
 int	 parse_config(const char *, struct iked *);
 int	 cmdline_symset(char *);
+int	 check_file_secrecy(int, const char *);
 extern const struct ipsec_xf authxfs[];
 extern const struct ipsec_xf prfxfs[];
 extern const struct ipsec_xf *encxfs;
@@ -1353,6 +1932,8 @@ int	 encxf_noauth(unsigned int);
 
 /* print.c */
 void	 print_user(struct iked_user *);
+void	 print_radius(struct iked_radserver *);
+void	 print_redirect(struct iked_redirgw *);
 void	 print_policy(struct iked_policy *);
 const char *print_xf(unsigned int, unsigned int, const struct ipsec_xf *);
 
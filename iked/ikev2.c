@@ -43,6 +43,7 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_IKEV2
 #include "iked.h"
 #include "ikev2.h"
 #include "eap.h"
@@ -54,12 +55,30 @@
 #include "apparmor.h"
 #endif
 
-void	 ikev2_info(struct iked *, struct imsg *, int);
-void	 ikev2_info_sa(struct iked *, struct imsg *, int, const char *,
+/* IMSG_CTL_SHOW_SA in progress, one per request */
+struct ikev2_sawalk {
+	uint32_t		 sw_peerid;
+	struct iked_sa_filter	 sw_filter;
+	uint64_t		 sw_ispi;	/* last SA looked at */
+	int			 sw_initiator;	/* -1 before the first */
+	unsigned int		 sw_count;
+	struct iked_timer	 sw_timer;
+	size_t			 sw_len;
+	uint8_t			 sw_buf[MAX_IMSGSIZE - IMSG_HEADER_SIZE];
+};
+#define IKED_CTL_WALK_SA	 64	/* IKE SAs sent per loop turn */
+#define IKED_CTL_WALK_MAX	 1024	/* IKE SAs looked at per loop turn */
+
+void	 ikev2_ctl_show_sa_walk(struct iked *, void *);
+int	 ikev2_ctl_sa_match(struct iked_sa_filter *, struct iked_sa *);
+int	 ikev2_ctl_rec(struct iked *, struct ikev2_sawalk *, uint16_t,
+	    struct iovec *, int);
+void	 ikev2_ctl_flush(struct iked *, struct ikev2_sawalk *);
+void	 ikev2_ctl_info_sa(struct iked *, struct ikev2_sawalk *,
 	    struct iked_sa *);
-void	 ikev2_info_csa(struct iked *, struct imsg *, int, const char *,
-	    struct iked_childsa *);
-void	 ikev2_info_flow(struct iked *, struct imsg *, int, const char *,
+void	 ikev2_ctl_info_csa(struct iked *, struct ikev2_sawalk *,
+	    struct iked_childsa *, int);
+void	 ikev2_ctl_info_flow(struct iked *, struct ikev2_sawalk *,
 	    struct iked_flow *);
 void	 ikev2_log_established(struct iked_sa *);
 void	 ikev2_log_proposal(struct iked_sa *, struct iked_proposals *);
@@ -84,11 +103,19 @@ int	 ikev2_auth_verify(struct iked *, struct iked_sa *);
 void	 ikev2_init_recv(struct iked *, struct iked_message *,
 	    struct ike_header *);
 void	 ikev2_init_ike_sa_timeout(struct iked *, void *);
+void	 ikev2_init_schedule(struct iked *, time_t);
 int	 ikev2_init_ike_sa_peer(struct iked *, struct iked_policy *,
 	    struct iked_addr *, struct iked_message *);
 int	 ikev2_init_ike_auth(struct iked *, struct iked_sa *);
 int	 ikev2_init_auth(struct iked *, struct iked_message *);
 int	 ikev2_init_done(struct iked *, struct iked_sa *);
+int	 ikev2_init_resume(struct iked *, struct iked_policy *,
+	    struct iked_addr *, struct iked_ticket *);
+int	 ikev2_init_resume_recv(struct iked *, struct iked_sa *,
+	    struct iked_message *);
+int	 ikev2_init_redirect(struct iked *, struct iked_sa *,
+	    struct sockaddr_storage *, struct sockaddr_storage *);
+void	 ikev2_init_redirect_reset(struct iked_policy *);
 
 int	 ikev2_record_dstid(struct iked *, struct iked_sa *);
 
@@ -98,15 +125,19 @@ void	 ikev2_disable_timer(struct iked *, struct iked_sa *);
 void	 ikev2_resp_recv(struct iked *, struct iked_message *,
 	    struct ike_header *);
 int	 ikev2_resp_ike_sa_init(struct iked *, struct iked_message *);
+int	 ikev2_resp_resume(struct iked *, struct iked_message *);
+int	 ikev2_resp_redirect(struct iked *, struct iked_message *);
 int	 ikev2_resp_ike_eap(struct iked *, struct iked_sa *,
 	    struct iked_message *);
+int	 ikev2_resp_ike_eap_radius(struct iked *, struct iked_sa *,
+	    struct iked_message *);
 int	 ikev2_resp_ike_eap_mschap(struct iked *, struct iked_sa *,
 	    struct iked_message *);
 int	 ikev2_resp_ike_auth(struct iked *, struct iked_sa *);
-int	 ikev2_send_auth_failed(struct iked *, struct iked_sa *);
 int	 ikev2_send_error(struct iked *, struct iked_sa *,
 	    struct iked_message *, uint8_t);
 int	 ikev2_send_init_error(struct iked *, struct iked_message *);
+int	 ikev2_send_redirect(struct iked *, struct iked_sa *);
 
 int	 ikev2_handle_certreq(struct iked*, struct iked_message *);
 ssize_t	 ikev2_handle_delete(struct iked *, struct iked_message *,
@@ -123,11 +154,16 @@ void	 ikev2_ike_sa_rekey(struct iked *, void *);
 void	 ikev2_ike_sa_rekey_timeout(struct iked *, void *);
 void	 ikev2_ike_sa_rekey_schedule(struct iked *, struct iked_sa *);
 void	 ikev2_ike_sa_rekey_schedule_fast(struct iked *, struct iked_sa *);
+int	 ikev2_rekey_admit(struct iked *, struct iked_sa *);
+void	 ikev2_rekey_started(struct iked *, struct iked_sa *);
 void	 ikev2_ike_sa_alive(struct iked *, void *);
-void	 ikev2_ike_sa_keepalive(struct iked *, void *);
+void	 ikev2_keepalive_add(struct iked *, struct iked_sa *);
+void	 ikev2_keepalive_tick(struct iked *, void *);
+int	 ikev2_keepalive_cmp(const void *, const void *);
 
 int	 ikev2_sa_negotiate_common(struct iked *, struct iked_sa *,
 	    struct iked_message *, int);
+int	 ikev2_sa_transforms(struct iked_sa *);
 int	 ikev2_sa_initiator(struct iked *, struct iked_sa *,
 	    struct iked_sa *, struct iked_message *);
 int	 ikev2_sa_responder(struct iked *, struct iked_sa *, struct iked_sa *,
@@ -142,6 +178,8 @@ int	 ikev2_sa_tag(struct iked_sa *, struct iked_id *);
 int	 ikev2_set_sa_proposal(struct iked_sa *, struct iked_policy *,
 	    unsigned int);
 
+int	 ikev2_childsa_flows(struct iked_sa *, uint8_t);
+int	 ikev2_childless_flows(struct iked_sa *);
 int	 ikev2_childsa_negotiate(struct iked *, struct iked_sa *,
 	    struct iked_kex *, struct iked_proposals *, int, int);
 int	 ikev2_childsa_delete_proposed(struct iked *, struct iked_sa *,
@@ -191,6 +229,12 @@ ssize_t	 ikev2_add_fragmentation(struct ibuf *, struct ikev2_payload **,
 	    ssize_t);
 ssize_t	 ikev2_add_transport_mode(struct iked *, struct ibuf *,
 	    struct ikev2_payload **, ssize_t, struct iked_sa *);
+ssize_t	 ikev2_add_ticket(struct iked *, struct ibuf *,
+	    struct ikev2_payload **, ssize_t, struct iked_sa *);
+ssize_t	 ikev2_add_redirect(struct ibuf *, struct ikev2_payload **,
+	    ssize_t, struct sockaddr_storage *, struct ibuf *);
+ssize_t	 ikev2_add_redirect_supported(struct ibuf *,
+	    struct ikev2_payload **, ssize_t, struct iked_policy *);
 int	 ikev2_update_sa_addresses(struct iked *, struct iked_sa *);
 int	 ikev2_resp_informational(struct iked *, struct iked_sa *,
 	    struct iked_message *);
@@ -198,6 +242,7 @@ int	 ikev2_resp_informational(struct iked *, struct iked_sa *,
 void	ikev2_ctl_reset_id(struct iked *, struct imsg *, unsigned int);
 void	ikev2_ctl_show_sa(struct iked *, struct imsg *);
 void	ikev2_ctl_show_stats(struct iked *, struct imsg *);
+void	ikev2_ctl_redirect(struct iked *, struct imsg *);
 
 static struct privsep_proc procs[] = {
 	{ "parent",	PROC_PARENT,	ikev2_dispatch_parent },
@@ -284,17 +329,22 @@ ikev2_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 			if (old != sa->sa_policy) {
 				/* Cleanup old policy */
 				TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
+				if (sa->sa_state == IKEV2_STATE_ESTABLISHED) {
+					old->pol_established--;
+					sa->sa_policy->pol_established++;
+				}
+				ikev2_init_enqueue(env, old);
 				policy_unref(env, old);
 				policy_ref(env, sa->sa_policy);
 				TAILQ_INSERT_TAIL(&sa->sa_policy->pol_sapeers, sa, sa_peer_entry);
 			}
 		}
-		if (!env->sc_passive) {
-			timer_set(env, &env->sc_inittmr, ikev2_init_ike_sa,
-			    NULL);
-			timer_add(env, &env->sc_inittmr,
-			    IKED_INITIATOR_INITIAL);
-		}
+		env->sc_initnext = 0;
+		TAILQ_FOREACH(pol, &env->sc_policies, pol_entry)
+			ikev2_init_enqueue(env, pol);
+		/* the timer for policies that were queued before is gone */
+		if ((pol = TAILQ_FIRST(&env->sc_initq)) != NULL)
+			ikev2_init_schedule(env, pol->pol_initnext);
 		return (0);
 	case IMSG_UDP_SOCKET:
 		return (config_getsocket(env, imsg, ikev2_msg_cb));
@@ -306,6 +356,12 @@ ikev2_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 		return (config_getflow(env, imsg));
 	case IMSG_CFG_USER:
 		return (config_getuser(env, imsg));
+	case IMSG_CFG_USERDB:
+		return (config_getuserdb(env, imsg));
+	case IMSG_CFG_RADIUS:
+		return (config_getradius(env, imsg));
+	case IMSG_CFG_REDIRECT:
+		return (config_getredirect(env, imsg));
 	case IMSG_COMPILE:
 		return (config_getcompile(env));
 	case IMSG_CTL_STATIC:
@@ -356,6 +412,17 @@ ikev2_dispatch_cert(int fd, struct privsep_proc *p, struct imsg *imsg)
 		    sa->sa_state < IKEV2_STATE_EAP)
 			break;
 
+		if (sa->sa_lat_cert) {
+			/* OCSP answers without echoing the certificate */
+			if (type == IKEV2_CERT_X509_CERT && len == 0)
+				ikestat_lat(env, ikes_lat_ca_ocsp,
+				    sa->sa_lat_cert);
+			else
+				ikestat_lat(env, ikes_lat_ca_cert,
+				    sa->sa_lat_cert);
+			sa->sa_lat_cert = 0;
+		}
+
 		if (sh.sh_initiator)
 			id = &sa->sa_rcert;
 		else
@@ -393,6 +460,11 @@ ikev2_dispatch_cert(int fd, struct privsep_proc *p, struct imsg *imsg)
 			log_debug("%s: invalid cert reply", __func__);
 			break;
 		}
+		if (sa->sa_lat_certreq) {
+			ikestat_lat(env, ikes_lat_ca_certreq,
+			    sa->sa_lat_certreq);
+			sa->sa_lat_certreq = 0;
+		}
 
 		/*
 		 * Ignore the message if we already got a valid certificate.
@@ -481,6 +553,10 @@ ikev2_dispatch_cert(int fd, struct privsep_proc *p, struct imsg *imsg)
 			log_debug("%s: invalid auth reply", __func__);
 			break;
 		}
+		if (sa->sa_lat_auth) {
+			ikestat_lat(env, ikes_lat_ca_auth, sa->sa_lat_auth);
+			sa->sa_lat_auth = 0;
+		}
 		if (sa_stateok(sa, IKEV2_STATE_VALID)) {
 			log_warnx("%s: ignoring AUTH in state %s",
 			    SPI_SA(sa, __func__),
@@ -532,6 +608,12 @@ ikev2_dispatch_control(int fd, struct privsep_proc *p, struct imsg *imsg)
 	case IMSG_CTL_SHOW_STATS:
 		ikev2_ctl_show_stats(env, imsg);
 		break;
+	case IMSG_CTL_SHOW_PEERS:
+		peerstat_ctl_show(env, imsg);
+		break;
+	case IMSG_CTL_REDIRECT:
+		ikev2_ctl_redirect(env, imsg);
+		break;
 	default:
 		return (-1);
 	}
@@ -586,18 +668,225 @@ ikev2_ctl_reset_id(struct iked *env, struct imsg *imsg, unsigned int type)
 	free(reset_id);
 }
 
+/* Redirect all established IKE SAs or the ones with the peer id */
+void
+ikev2_ctl_redirect(struct iked *env, struct imsg *imsg)
+{
+	struct iked_sa			*sa;
+	char				*id = NULL;
+	char				 sa_id[IKED_ID_SIZE];
+	unsigned int			 count = 0;
+
+	if (IMSG_DATA_SIZE(imsg) != 0 &&
+	    (id = get_string(imsg->data, IMSG_DATA_SIZE(imsg))) == NULL)
+		return;
+
+	RB_FOREACH(sa, iked_sas, &env->sc_sas) {
+		if (id != NULL &&
+		    (ikev2_print_id(IKESA_DSTID(sa), sa_id,
+		    sizeof(sa_id)) == -1 || strcmp(id, sa_id) != 0))
+			continue;
+		if (ikev2_send_redirect(env, sa) == 0)
+			count++;
+	}
+	log_info("%s: redirected %u IKE SA%s", __func__, count,
+	    count == 1 ? "" : "s");
+	free(id);
+}
+
 void
 ikev2_ctl_show_sa(struct iked *env, struct imsg *imsg)
 {
-	ikev2_info(env, imsg, 0);
+	struct ikev2_sawalk	*sw;
+
+	if ((sw = calloc(1, sizeof(*sw))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+		    IMSG_CTL_SHOW_SA, imsg->hdr.peerid, -1, NULL, 0);
+		return;
+	}
+	sw->sw_peerid = imsg->hdr.peerid;
+	sw->sw_initiator = -1;
+	if (IMSG_DATA_SIZE(imsg) == sizeof(sw->sw_filter)) {
+		memcpy(&sw->sw_filter, imsg->data, sizeof(sw->sw_filter));
+		sw->sw_filter.sf_policy[IKED_ID_SIZE - 1] = '\0';
+		sw->sw_filter.sf_id[IKED_ID_SIZE - 1] = '\0';
+		if (sw->sw_filter.sf_after_initiator != -1) {
+			sw->sw_initiator =
+			    sw->sw_filter.sf_after_initiator ? 1 : 0;
+			sw->sw_ispi = sw->sw_filter.sf_after_ispi;
+		}
+	} else {
+		sw->sw_filter.sf_peermask = -1;
+		sw->sw_filter.sf_state = -1;
+	}
+
+	/* Don't hold up the event loop, send the SAs in batches */
+	timer_set(env, &sw->sw_timer, ikev2_ctl_show_sa_walk, sw);
+	ikev2_ctl_show_sa_walk(env, sw);
+}
+
+void
+ikev2_ctl_show_sa_walk(struct iked *env, void *arg)
+{
+	struct ikev2_sawalk	*sw = arg;
+	struct iked_ctl_cursor	 cursor;
+	struct iovec		 iov;
+	struct iked_sa		 key, *sa;
+	unsigned int		 sent = 0, seen = 0;
+
+	if (sw->sw_initiator == -1)
+		sa = RB_MIN(iked_sas, &env->sc_sas);
+	else {
+		key.sa_hdr.sh_initiator = sw->sw_initiator;
+		key.sa_hdr.sh_ispi = sw->sw_ispi;
+		if ((sa = RB_NFIND(iked_sas, &env->sc_sas, &key)) != NULL &&
+		    sa->sa_hdr.sh_initiator == key.sa_hdr.sh_initiator &&
+		    sa->sa_hdr.sh_ispi == key.sa_hdr.sh_ispi)
+			sa = RB_NEXT(iked_sas, &env->sc_sas, sa);
+	}
+
+	for (; sa != NULL; sa = RB_NEXT(iked_sas, &env->sc_sas, sa)) {
+		if (sw->sw_filter.sf_limit &&
+		    sw->sw_count >= sw->sw_filter.sf_limit) {
+			bzero(&cursor, sizeof(cursor));
+			cursor.cc_ispi = sw->sw_ispi;
+			cursor.cc_initiator = sw->sw_initiator;
+			iov.iov_base = &cursor;
+			iov.iov_len = sizeof(cursor);
+			ikev2_ctl_rec(env, sw, IKED_CTL_REC_CURSOR, &iov, 1);
+			break;
+		}
+		if (sent >= IKED_CTL_WALK_SA || seen >= IKED_CTL_WALK_MAX) {
+			ikev2_ctl_flush(env, sw);
+			timer_add(env, &sw->sw_timer, 0);
+			return;
+		}
+		seen++;
+		sw->sw_initiator = sa->sa_hdr.sh_initiator;
+		sw->sw_ispi = sa->sa_hdr.sh_ispi;
+		if (ikev2_ctl_sa_match(&sw->sw_filter, sa) == -1)
+			continue;
+		ikev2_ctl_info_sa(env, sw, sa);
+		sent++;
+		sw->sw_count++;
+	}
+
+	ikev2_ctl_flush(env, sw);
+	/* Send empty reply to indicate end of information. */
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_SHOW_SA,
+	    sw->sw_peerid, -1, NULL, 0);
+	free(sw);
+}
+
+int
+ikev2_ctl_sa_match(struct iked_sa_filter *sf, struct iked_sa *sa)
+{
+	char		 idstr[IKED_ID_SIZE];
+	char		*s;
+
+	if (sf->sf_state != -1 && sa->sa_state != sf->sf_state)
+		return (-1);
+	if (sf->sf_policy[0] != '\0' && (sa->sa_policy == NULL ||
+	    strcmp(sa->sa_policy->pol_name, sf->sf_policy) != 0))
+		return (-1);
+	if (sf->sf_peer.ss_family != AF_UNSPEC &&
+	    (sa->sa_peer.addr.ss_family != sf->sf_peer.ss_family ||
+	    sockaddr_cmp((struct sockaddr *)&sa->sa_peer.addr,
+	    (struct sockaddr *)&sf->sf_peer, sf->sf_peermask) != 0))
+		return (-1);
+	if (sf->sf_id[0] != '\0') {
+		/* match with or without the type, e.g. FQDN/ */
+		if (ikev2_print_id(IKESA_DSTID(sa), idstr,
+		    sizeof(idstr)) == -1)
+			return (-1);
+		if (strcmp(idstr, sf->sf_id) != 0 &&
+		    ((s = strchr(idstr, '/')) == NULL ||
+		    strcmp(s + 1, sf->sf_id) != 0))
+			return (-1);
+	}
+	return (0);
+}
+
+/* append a record to the reply, flushing it when full */
+int
+ikev2_ctl_rec(struct iked *env, struct ikev2_sawalk *sw, uint16_t type,
+    struct iovec *iov, int iovcnt)
+{
+	struct iked_ctl_rec	 rec;
+	size_t			 len, off;
+	int			 i;
+
+	len = sizeof(rec);
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	len = roundup(len, 8);
+	if (len > sizeof(sw->sw_buf))
+		return (-1);
+	if (sw->sw_len + len > sizeof(sw->sw_buf))
+		ikev2_ctl_flush(env, sw);
+
+	bzero(&rec, sizeof(rec));
+	rec.cr_type = type;
+	rec.cr_len = len;
+	off = sw->sw_len;
+	memcpy(sw->sw_buf + off, &rec, sizeof(rec));
+	off += sizeof(rec);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(sw->sw_buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	bzero(sw->sw_buf + off, sw->sw_len + len - off);
+	sw->sw_len += len;
+	return (0);
+}
+
+void
+ikev2_ctl_flush(struct iked *env, struct ikev2_sawalk *sw)
+{
+	if (sw->sw_len == 0)
+		return;
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_SHOW_SA,
+	    sw->sw_peerid, -1, sw->sw_buf, sw->sw_len);
+	sw->sw_len = 0;
 }
 
 void
 ikev2_ctl_show_stats(struct iked *env, struct imsg *imsg)
 {
+	struct iked_policy_stats	 ps;
+	struct iked_policy		*pol;
+	struct iked_socket		*sock;
+	uint32_t			 drops;
+	size_t				 i;
+
+	/* the kernel counts per socket */
+	env->sc_stats.ikes_msg_rcvd_filtered = 0;
+	for (i = 0; i < nitems(env->sc_sock4); i++)
+		if ((sock = env->sc_sock4[i]) != NULL &&
+		    socket_drops(sock->sock_fd, &drops) == 0)
+			env->sc_stats.ikes_msg_rcvd_filtered += drops;
+	for (i = 0; i < nitems(env->sc_sock6); i++)
+		if ((sock = env->sc_sock6[i]) != NULL &&
+		    socket_drops(sock->sock_fd, &drops) == 0)
+			env->sc_stats.ikes_msg_rcvd_filtered += drops;
+
 	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
 	    IMSG_CTL_SHOW_STATS, imsg->hdr.peerid, -1,
 	    &env->sc_stats, sizeof(env->sc_stats));
+
+	TAILQ_FOREACH(pol, &env->sc_policies, pol_entry) {
+		bzero(&ps, sizeof(ps));
+		strlcpy(ps.ps_name, pol->pol_name, sizeof(ps.ps_name));
+		ps.ps_established = pol->pol_established;
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+		    IMSG_CTL_SHOW_STATS, imsg->hdr.peerid, -1,
+		    &ps, sizeof(ps));
+	}
+
+	/* Send empty reply to indicate end of information. */
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+	    IMSG_CTL_SHOW_STATS, imsg->hdr.peerid, -1, NULL, 0);
 }
 
 struct iked_sa *
@@ -655,6 +944,7 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 	struct iked_sa		*sa;
 	struct iked_msg_retransmit *mr;
 	unsigned int		 initiator, flag = 0;
+	uint64_t		 start;
 	int			 r;
 
 	hdr = ibuf_seek(msg->msg_data, msg->msg_offset, sizeof(*hdr));
@@ -672,9 +962,13 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 	    betoh64(hdr->ike_ispi), betoh64(hdr->ike_rspi),
 	    initiator);
 	msg->msg_msgid = betoh32(hdr->ike_msgid);
+	peerstat_msg(env, msg, IKED_PEERSTAT_MSG_RCVD, 1);
+	peerstat_msg(env, msg, IKED_PEERSTAT_BYTES_RCVD,
+	    ibuf_size(msg->msg_data));
 	if (policy_lookup(env, msg, NULL, NULL, 0) != 0) {
 		log_debug("%s: no compatible policy found", __func__);
 		ikestat_inc(env, ikes_msg_rcvd_dropped);
+		peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 		return;
 	}
 
@@ -704,15 +998,18 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 		flag = IKED_REQ_INF;
 
 	if (hdr->ike_exchange != IKEV2_EXCHANGE_IKE_SA_INIT &&
+	    hdr->ike_exchange != IKEV2_EXCHANGE_IKE_SESSION_RESUME &&
 	    hdr->ike_nextpayload != IKEV2_PAYLOAD_SK &&
 	    hdr->ike_nextpayload != IKEV2_PAYLOAD_SKF) {
 		ikestat_inc(env, ikes_msg_rcvd_dropped);
+		peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 		return;
 	}
 
 	if (msg->msg_response) {
 		if (msg->msg_msgid > sa->sa_reqid) {
 			ikestat_inc(env, ikes_msg_rcvd_dropped);
+			peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 			return;
 		}
 		mr = ikev2_msg_lookup(env, &sa->sa_requests, msg,
@@ -720,11 +1017,13 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 		if (hdr->ike_exchange != IKEV2_EXCHANGE_INFORMATIONAL &&
 		    mr == NULL && sa->sa_fragments.frag_count == 0) {
 			ikestat_inc(env, ikes_msg_rcvd_dropped);
+			peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 			return;
 		}
 		if (flag) {
 			if ((sa->sa_stateflags & flag) == 0) {
 				ikestat_inc(env, ikes_msg_rcvd_dropped);
+				peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 				return;
 			}
 			/*
@@ -759,6 +1058,7 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 		}
 		if (msg->msg_msgid < sa->sa_msgid) {
 			ikestat_inc(env, ikes_msg_rcvd_dropped);
+			peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 			return;
 		}
 		if (flag)
@@ -791,7 +1091,17 @@ ikev2_recv(struct iked *env, struct iked_message *msg)
 done:
 	if (initiator)
 		ikev2_init_recv(env, msg, hdr);
-	else
+	else if (msg->msg_exchange == IKEV2_EXCHANGE_IKE_SA_INIT &&
+	    !msg->msg_response) {
+		start = hist_now();
+		ikev2_resp_recv(env, msg, hdr);
+		ikestat_lat(env, ikes_lat_sa_init, start);
+	} else if (msg->msg_exchange == IKEV2_EXCHANGE_IKE_SESSION_RESUME &&
+	    !msg->msg_response) {
+		start = hist_now();
+		ikev2_resp_recv(env, msg, hdr);
+		ikestat_lat(env, ikes_lat_resume, start);
+	} else
 		ikev2_resp_recv(env, msg, hdr);
 
 	if (sa != NULL && !msg->msg_response && msg->msg_valid) {
@@ -955,7 +1265,7 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 	    !sa_stateok(sa, IKEV2_STATE_EAP))
 		sa_state(env, sa, IKEV2_STATE_AUTH_REQUEST);
 
-	if (!sa->sa_hdr.sh_initiator &&
+	if (!sa->sa_hdr.sh_initiator && !sa->sa_resumed &&
 	    !sa_stateok(sa, IKEV2_STATE_AUTH_REQUEST) &&
 	    sa->sa_policy->pol_auth.auth_eap)
 		sa_state(env, sa, IKEV2_STATE_EAP);
@@ -965,8 +1275,28 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 	else
 		id = &sa->sa_iid;
 
-	/* try to relookup the policy based on the peerid */
-	if (msg->msg_peerid.id_type && !sa->sa_hdr.sh_initiator) {
+	/* IDi without SA payload, the initiator wants no child SA */
+	if (!sa->sa_hdr.sh_initiator && sa->sa_childless &&
+	    msg->msg_peerid.id_type && TAILQ_EMPTY(&msg->msg_proposals)) {
+		log_debug("%s: childless IKE SA", SPI_SA(sa, __func__));
+		sa->sa_nochild = 1;
+	}
+
+	if (sa->sa_resumed && !sa->sa_hdr.sh_initiator) {
+		/* The policy is the one of the ticket, and so is IDi */
+		if (msg->msg_peerid.id_type != sa->sa_ticket->tk_id.id_type ||
+		    ibuf_length(msg->msg_peerid.id_buf) !=
+		    ibuf_length(sa->sa_ticket->tk_id.id_buf) ||
+		    memcmp(ibuf_data(msg->msg_peerid.id_buf),
+		    ibuf_data(sa->sa_ticket->tk_id.id_buf),
+		    ibuf_length(msg->msg_peerid.id_buf)) != 0) {
+			log_info("%s: IDi does not match the ticket",
+			    SPI_SA(sa, __func__));
+			ikev2_send_auth_failed(env, sa);
+			return (-1);
+		}
+	} else if (msg->msg_peerid.id_type && !sa->sa_hdr.sh_initiator) {
+		/* try to relookup the policy based on the peerid */
 		old = sa->sa_policy;
 
 		sa->sa_policy = NULL;
@@ -976,12 +1306,14 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 			    SPI_SA(sa, __func__));
 			ikev2_send_auth_failed(env, sa);
 			TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
+			ikev2_init_enqueue(env, old);
 			policy_unref(env, old);
 			return (-1);
 		}
 		if (msg->msg_policy != old) {
 			/* Clean up old policy */
 			TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
+			ikev2_init_enqueue(env, old);
 			policy_unref(env, old);
 
 			/* Update SA with new policy*/
@@ -1014,6 +1346,7 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 			log_warnx("%s: policy mismatch", SPI_SA(sa, __func__));
 			ikev2_send_auth_failed(env, sa);
 			TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
+			ikev2_init_enqueue(env, old);
 			policy_unref(env, old);
 			return (-1);
 		}
@@ -1023,7 +1356,7 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 
 	/* AUTH payload is required for non-EAP */
 	if (!msg->msg_auth.id_type &&
-	    !sa->sa_policy->pol_auth.auth_eap) {
+	    (!sa->sa_policy->pol_auth.auth_eap || sa->sa_resumed)) {
 		/* get dstid */
 		if (msg->msg_peerid.id_type) {
 			memcpy(id, &msg->msg_peerid, sizeof(*id));
@@ -1038,7 +1371,10 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 		memcpy(id, &msg->msg_peerid, sizeof(*id));
 		bzero(&msg->msg_peerid, sizeof(msg->msg_peerid));
 
-		if (!sa->sa_hdr.sh_initiator) {
+		if (!sa->sa_hdr.sh_initiator && sa->sa_resumed) {
+			if (resume_authsign(env, sa) != 0)
+				return (-1);
+		} else if (!sa->sa_hdr.sh_initiator) {
 			if ((authmsg = ikev2_msg_auth(env, sa,
 			    !sa->sa_hdr.sh_initiator)) == NULL) {
 				log_debug("%s: failed to get response "
@@ -1046,6 +1382,7 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 				return (-1);
 			}
 
+			sa->sa_lat_auth = hist_now();
 			ca_setauth(env, sa, authmsg, PROC_CERT);
 			ibuf_free(authmsg);
 		}
@@ -1108,8 +1445,11 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 		sa->sa_cp = msg->msg_cp;
 	}
 
+	/* A resumed SA is authenticated with the keys of the ticket */
+	if (sa->sa_resumed)
+		resume_authverify(env, sa);
 	/* For EAP and PSK AUTH can be verified without the CA process*/
-	if ((sa->sa_policy->pol_auth.auth_eap &&
+	else if ((sa->sa_policy->pol_auth.auth_eap &&
 	    sa->sa_eapmsk != NULL) ||
 	    sa->sa_policy->pol_auth.auth_method == IKEV2_AUTH_SHARED_KEY_MIC)
 		ikev2_auth_verify(env, sa);
@@ -1121,6 +1461,7 @@ ikev2_ike_auth_recv(struct iked *env, struct iked_sa *sa,
 			certlen = ibuf_size(msg->msg_cert.id_buf);
 		}
 		sa->sa_stateflags &= ~IKED_REQ_CERTVALID;
+		sa->sa_lat_cert = hist_now();
 		if (ca_setcert(env, &sa->sa_hdr, id, certtype, cert, certlen, PROC_CERT) == -1)
 			return (-1);
 	}
@@ -1176,6 +1517,7 @@ ikev2_init_recv(struct iked *env, struct iked_message *msg,
 
 	switch (hdr->ike_exchange) {
 	case IKEV2_EXCHANGE_IKE_SA_INIT:
+	case IKEV2_EXCHANGE_IKE_SESSION_RESUME:
 		/* Update the SPIs */
 		if ((sa = sa_new(env,
 		    betoh64(hdr->ike_ispi), betoh64(hdr->ike_rspi), 1,
@@ -1208,6 +1550,7 @@ ikev2_init_recv(struct iked *env, struct iked_message *msg,
 	    sa_address(sa, &sa->sa_local, (struct sockaddr *)&msg->msg_local)
 	    == -1) {
 		ikestat_inc(env, ikes_msg_rcvd_dropped);
+		peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 		return;
 	}
 	sa->sa_fd = msg->msg_fd;
@@ -1265,6 +1608,8 @@ ikev2_init_recv(struct iked *env, struct iked_message *msg,
 			    : &sa->sa_icert);
 			ikev2_ike_sa_setreason(sa,
 			    "authentication failed notification from peer");
+			peerstat_add(env, NULL, sa,
+			    IKED_PEERSTAT_AUTH_FAILED, 1);
 			sa_state(env, sa, IKEV2_STATE_CLOSED);
 			msg->msg_sa = NULL;
 			return;
@@ -1280,6 +1625,17 @@ ikev2_init_recv(struct iked *env, struct iked_message *msg,
 
 		(void)ikev2_ike_auth_recv(env, sa, msg);
 		break;
+	case IKEV2_EXCHANGE_IKE_SESSION_RESUME:
+		if (ikev2_init_resume_recv(env, sa, msg) != 0) {
+			ikestat_inc(env, ikes_resume_fallback);
+			ikev2_ike_sa_setreason(sa, "session resumption failed");
+			sa_state(env, sa, IKEV2_STATE_CLOSED);
+			msg->msg_sa = NULL;
+			/* not a failure, initiate without backoff */
+			sa->sa_policy->pol_initfails = 0;
+			return;
+		}
+		break;
 	case IKEV2_EXCHANGE_CREATE_CHILD_SA:
 		if (msg->msg_flags & IKED_MSG_FLAGS_NO_PROPOSAL_CHOSEN) {
 			log_info("%s: CREATE_CHILD_SA failed",
@@ -1334,12 +1690,37 @@ ikev2_enable_natt(struct iked *env, struct iked_sa *sa,
 	    print_addr(&sa->sa_peer.addr), print_addr(&sa->sa_local.addr));
 }
 
+/*
+ * Active policies without an IKE SA wait in sc_initq, sorted by the
+ * time they may be initiated.  The scheduler starts at most
+ * IKED_INITIATOR_RATE initiations per second while fewer than
+ * IKED_INITIATOR_HALFOPEN initiator SAs are half-open.
+ */
 void
 ikev2_init_ike_sa(struct iked *env, void *arg)
 {
 	struct iked_policy	*pol;
+	time_t			 now = ikev2_init_time();
+	unsigned int		 started = 0;
+
+	env->sc_initnext = 0;
+	if (env->sc_passive)
+		return;
+
+	while ((pol = TAILQ_FIRST(&env->sc_initq)) != NULL &&
+	    pol->pol_initnext <= now) {
+		if (started >= IKED_INITIATOR_RATE ||
+		    env->sc_inithalfopen >= IKED_INITIATOR_HALFOPEN) {
+			log_debug("%s: %u started, %u half-open, deferring",
+			    __func__, started, env->sc_inithalfopen);
+			ikestat_inc(env, ikes_init_deferred);
+			ikev2_init_schedule(env, now + 1);
+			return;
+		}
+
+		TAILQ_REMOVE(&env->sc_initq, pol, pol_initentry);
+		pol->pol_initqueued = 0;
 
-	TAILQ_FOREACH(pol, &env->sc_policies, pol_entry) {
 		if ((pol->pol_flags & IKED_POLICY_ACTIVE) == 0)
 			continue;
 		if (!TAILQ_EMPTY(&pol->pol_sapeers)) {
@@ -1348,15 +1729,111 @@ ikev2_init_ike_sa(struct iked *env, void *arg)
 			continue;
 		}
 
+		/* The gateway we were redirected to failed, start over */
+		if (pol->pol_initfails > 0 &&
+		    pol->pol_redirect.addr_af != AF_UNSPEC) {
+			log_info("%s: \"%s\" back to peer %s", __func__,
+			    pol->pol_name, print_addr(&pol->pol_peer.addr));
+			ikev2_init_redirect_reset(pol);
+		}
+
 		log_info("%s: initiating \"%s\"", __func__, pol->pol_name);
 
-		if (ikev2_init_ike_sa_peer(env, pol, &pol->pol_peer, NULL))
+		/* counts as failed until an SA is established */
+		pol->pol_initfails++;
+		started++;
+
+		if (ikev2_init_ike_sa_peer(env, pol, &pol->pol_peer, NULL)) {
 			log_debug("%s: failed to initiate with peer %s",
 			    __func__, print_addr(&pol->pol_peer.addr));
+			ikev2_init_enqueue(env, pol);
+		}
 	}
 
+	if (pol != NULL)
+		ikev2_init_schedule(env, pol->pol_initnext);
+}
+
+/*
+ * Queue an active policy that has no IKE SA.  After a failed attempt
+ * the policy backs off exponentially up to IKED_INITIATOR_INTERVAL,
+ * with jitter to spread out policies that failed together.
+ */
+void
+ikev2_init_enqueue(struct iked *env, struct iked_policy *pol)
+{
+	struct iked_policy	*p;
+	unsigned int		 delay;
+
+	if (env->sc_passive || pol->pol_initqueued ||
+	    (pol->pol_flags & (IKED_POLICY_ACTIVE|IKED_POLICY_REFCNT)) !=
+	    IKED_POLICY_ACTIVE || !TAILQ_EMPTY(&pol->pol_sapeers))
+		return;
+
+	if (pol->pol_initfails == 0)
+		delay = IKED_INITIATOR_INITIAL;
+	else {
+		delay = IKED_INITIATOR_INITIAL <<
+		    MINIMUM(pol->pol_initfails - 1, 8);
+		delay = MINIMUM(delay, IKED_INITIATOR_INTERVAL);
+		delay = delay / 2 + arc4random_uniform(delay / 2 + 1);
+		ikestat_inc(env, ikes_init_backoff);
+		log_debug("%s: \"%s\" failed %u time%s, retry in %us",
+		    __func__, pol->pol_name, pol->pol_initfails,
+		    pol->pol_initfails == 1 ? "" : "s", delay);
+	}
+	pol->pol_initnext = ikev2_init_time() + delay;
+	pol->pol_initqueued = 1;
+
+	/* most policies are appended */
+	TAILQ_FOREACH_REVERSE(p, &env->sc_initq, iked_initq, pol_initentry)
+		if (p->pol_initnext <= pol->pol_initnext)
+			break;
+	if (p != NULL)
+		TAILQ_INSERT_AFTER(&env->sc_initq, p, pol, pol_initentry);
+	else
+		TAILQ_INSERT_HEAD(&env->sc_initq, pol, pol_initentry);
+
+	ikev2_init_schedule(env, pol->pol_initnext);
+}
+
+/* run the scheduler at 'when' unless it runs earlier anyway */
+void
+ikev2_init_schedule(struct iked *env, time_t when)
+{
+	time_t			 now = ikev2_init_time();
+
+	if (env->sc_initnext != 0 && env->sc_initnext <= when)
+		return;
+	env->sc_initnext = when;
+
 	timer_set(env, &env->sc_inittmr, ikev2_init_ike_sa, NULL);
-	timer_add(env, &env->sc_inittmr, IKED_INITIATOR_INTERVAL);
+	timer_add(env, &env->sc_inittmr, when > now ? when - now : 0);
+}
+
+/* the initiator SA is established or gone */
+void
+ikev2_init_halfopen_done(struct iked *env, struct iked_sa *sa)
+{
+	if (!sa->sa_halfopen)
+		return;
+	sa->sa_halfopen = 0;
+	env->sc_inithalfopen--;
+	if (sa->sa_state == IKEV2_STATE_ESTABLISHED && sa->sa_policy) {
+		sa->sa_policy->pol_initfails = 0;
+		sa->sa_policy->pol_redirects = 0;
+		bzero(&sa->sa_policy->pol_redirfrom,
+		    sizeof(sa->sa_policy->pol_redirfrom));
+	}
+}
+
+time_t
+ikev2_init_time(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
 }
 
 void
@@ -1383,6 +1860,7 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 	struct ikev2_keyexchange	*ke;
 	struct ikev2_notify		*n;
 	struct iked_sa			*sa = NULL;
+	struct iked_ticket		*tk;
 	struct ibuf			*buf, *cookie = NULL, *vendor_id = NULL;
 	struct dh_group			*group;
 	ssize_t				 len;
@@ -1390,9 +1868,17 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 	struct iked_socket		*sock;
 	in_port_t			 port;
 
+	/* The gateway the configured peer redirected us to (RFC 5685) */
+	if (peer == &pol->pol_peer && pol->pol_redirect.addr_af != AF_UNSPEC)
+		peer = &pol->pol_redirect;
+
 	if ((sock = ikev2_msg_getsocket(env, peer->addr_af, 0)) == NULL)
 		return (-1);
 
+	/* Use IKE_SESSION_RESUME instead if there is a ticket */
+	if (retry == NULL && (tk = resume_ticket_get(pol)) != NULL)
+		return (ikev2_init_resume(env, pol, peer, tk));
+
 	if (retry != NULL) {
 		sa = retry->msg_sa;
 		cookie = retry->msg_cookie;
@@ -1400,9 +1886,13 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 	}
 
 	/* Create a new initiator SA */
-	if (sa == NULL &&
-	    (sa = sa_new(env, 0, 0, 1, pol)) == NULL)
-		return (-1);
+	if (sa == NULL) {
+		if ((sa = sa_new(env, 0, 0, 1, pol)) == NULL)
+			return (-1);
+		sa->sa_lat_start = hist_now();
+		sa->sa_halfopen = 1;
+		env->sc_inithalfopen++;
+	}
 
 	/* Pick peer's DH group if asked */
 	if (pol->pol_peerdh > 0 && sa->sa_dhgroup == NULL &&
@@ -1423,7 +1913,7 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 		memcpy(&ss, &pol->pol_local.addr, SS_LEN(pol->pol_local.addr));
 
 	if ((buf = ikev2_msg_init(env, &req, &peer->addr, SS_LEN(peer->addr),
-	    &ss, SS_LEN(ss), 0)) == NULL)
+	    &ss, SS_LEN(ss), 0, IKEV2_EXCHANGE_IKE_SA_INIT)) == NULL)
 		goto done;
 
 	/* Inherit the port from the 1st send socket */
@@ -1512,6 +2002,159 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 			goto done;
 	}
 
+	/* Redirect Notify */
+	if ((len = ikev2_add_redirect_supported(buf, &pld, len, pol)) == -1)
+		goto done;
+
+	/* Childless IKE SA Notify */
+	if ((pol->pol_flags & IKED_POLICY_CHILDLESS) &&
+	    (len = ikev2_add_notify(buf, &pld, len,
+	    IKEV2_N_CHILDLESS_IKEV2_SUPPORTED)) == -1)
+		goto done;
+
+	if (env->sc_nattmode != NATT_DISABLE) {
+		if (ntohs(port) == env->sc_nattport) {
+			/* Enforce NAT-T on the initiator side */
+			log_debug("%s: enforcing NAT-T", __func__);
+			req.msg_natt = sa->sa_natt = sa->sa_udpencap = 1;
+		}
+		if ((len = ikev2_add_nat_detection(env, buf, &pld, &req, len))
+		    == -1)
+			goto done;
+	}
+
+	if ((len = ikev2_add_sighashnotify(buf, &pld, len)) == -1)
+		goto done;
+
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
+		goto done;
+
+	if (ikev2_set_header(hdr, ibuf_size(buf) - sizeof(*hdr)) == -1)
+		goto done;
+
+	(void)ikev2_pld_parse(env, hdr, &req, 0);
+
+	ibuf_free(sa->sa_1stmsg);
+	if ((sa->sa_1stmsg = ibuf_dup(buf)) == NULL) {
+		log_debug("%s: failed to copy 1st message", __func__);
+		goto done;
+	}
+
+	if ((ret = ikev2_msg_send(env, &req)) == 0)
+		sa_state(env, sa, IKEV2_STATE_SA_INIT);
+
+	/* Setup exchange timeout. */
+	timer_set(env, &sa->sa_timer, ikev2_init_ike_sa_timeout, sa);
+	timer_add(env, &sa->sa_timer, IKED_IKE_SA_EXCHANGE_TIMEOUT);
+
+ done:
+	ikev2_msg_cleanup(env, &req);
+ closeonly:
+	if (ret == -1) {
+		log_debug("%s: closing SA", __func__);
+		ikev2_ike_sa_setreason(sa, "failed to send SA_INIT");
+		sa_free(env, sa);
+	}
+	ibuf_free(vendor_id);
+
+	return (ret);
+}
+
+/*
+ * Resume the IKE SA of the policy with the ticket (RFC 5723).  The
+ * ticket is used once, if the responder does not accept it the policy
+ * is initiated again with IKE_SA_INIT.
+ */
+int
+ikev2_init_resume(struct iked *env, struct iked_policy *pol,
+    struct iked_addr *peer, struct iked_ticket *tk)
+{
+	struct sockaddr_storage		 ss;
+	struct iked_message		 req;
+	struct ike_header		*hdr;
+	struct ikev2_payload		*pld;
+	struct iked_proposal		*prop;
+	struct iked_sa			*sa;
+	struct iked_socket		*sock;
+	struct ibuf			*buf;
+	ssize_t				 len;
+	int				 ret = -1;
+	in_port_t			 port;
+
+	if ((sock = ikev2_msg_getsocket(env, peer->addr_af, 0)) == NULL ||
+	    (sa = sa_new(env, 0, 0, 1, pol)) == NULL) {
+		resume_ticket_free(tk);
+		return (-1);
+	}
+	sa->sa_lat_start = hist_now();
+	sa->sa_halfopen = 1;
+	env->sc_inithalfopen++;
+
+	/* The SA is authenticated with the keys, not with the policy */
+	sa->sa_ticket = tk;
+	sa->sa_resumed = 1;
+	sa->sa_stateinit = IKED_REQ_AUTH;
+	sa->sa_statevalid = IKED_REQ_AUTHVALID|IKED_REQ_SA;
+	sa->sa_reqid = 0;
+
+	while ((prop = TAILQ_FIRST(&tk->tk_proposals)) != NULL) {
+		TAILQ_REMOVE(&tk->tk_proposals, prop, prop_entry);
+		TAILQ_INSERT_TAIL(&sa->sa_proposals, prop, prop_entry);
+	}
+	if (ikev2_sa_transforms(sa) != 0)
+		goto closeonly;
+	if ((sa->sa_inonce = ibuf_random(IKED_NONCE_SIZE)) == NULL) {
+		log_info("%s: failed to get local nonce",
+		    SPI_SA(sa, __func__));
+		goto closeonly;
+	}
+
+	if (pol->pol_local.addr.ss_family == AF_UNSPEC) {
+		if (socket_getaddr(sock->sock_fd, &ss) == -1)
+			goto closeonly;
+	} else
+		memcpy(&ss, &pol->pol_local.addr, SS_LEN(pol->pol_local.addr));
+
+	if ((buf = ikev2_msg_init(env, &req, &peer->addr, SS_LEN(peer->addr),
+	    &ss, SS_LEN(ss), 0, IKEV2_EXCHANGE_IKE_SESSION_RESUME)) == NULL)
+		goto done;
+
+	/* Inherit the port from the 1st send socket */
+	port = htons(socket_getport((struct sockaddr *)&sock->sock_addr));
+	(void)socket_af((struct sockaddr *)&req.msg_local, port);
+	(void)socket_af((struct sockaddr *)&req.msg_peer, port);
+
+	req.msg_fd = sock->sock_fd;
+	req.msg_sa = sa;
+	req.msg_sock = sock;
+	req.msg_msgid = ikev2_msg_id(env, sa);
+
+	/* IKE header */
+	if ((hdr = ikev2_add_header(buf, sa, req.msg_msgid,
+	    IKEV2_PAYLOAD_NONCE, IKEV2_EXCHANGE_IKE_SESSION_RESUME, 0)) == NULL)
+		goto done;
+
+	/* NONCE payload */
+	if ((pld = ikev2_add_payload(buf)) == NULL)
+		goto done;
+	if (ikev2_add_buf(buf, sa->sa_inonce) == -1)
+		goto done;
+	len = ibuf_size(sa->sa_inonce);
+
+	/* TICKET_OPAQUE notify */
+	if ((len = ikev2_add_notify(buf, &pld, len,
+	    IKEV2_N_TICKET_OPAQUE)) == -1 ||
+	    ikev2_add_buf(buf, tk->tk_opaque) == -1)
+		goto done;
+	len += ibuf_size(tk->tk_opaque);
+
+	/* Fragmentation Notify */
+	if (env->sc_frag) {
+		if ((len = ikev2_add_fragmentation(buf, &pld, len))
+		    == -1)
+			goto done;
+	}
+
 	if (env->sc_nattmode != NATT_DISABLE) {
 		if (ntohs(port) == env->sc_nattport) {
 			/* Enforce NAT-T on the initiator side */
@@ -1523,41 +2166,134 @@ ikev2_init_ike_sa_peer(struct iked *env, struct iked_policy *pol,
 			goto done;
 	}
 
-	if ((len = ikev2_add_sighashnotify(buf, &pld, len)) == -1)
-		goto done;
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
+		goto done;
+
+	if (ikev2_set_header(hdr, ibuf_size(buf) - sizeof(*hdr)) == -1)
+		goto done;
+
+	(void)ikev2_pld_parse(env, hdr, &req, 0);
+
+	ibuf_free(sa->sa_1stmsg);
+	if ((sa->sa_1stmsg = ibuf_dup(buf)) == NULL) {
+		log_debug("%s: failed to copy 1st message", __func__);
+		goto done;
+	}
+
+	if ((ret = ikev2_msg_send(env, &req)) == 0) {
+		sa_state(env, sa, IKEV2_STATE_SA_INIT);
+		ikestat_inc(env, ikes_resume_sent);
+	}
+
+	/* Setup exchange timeout. */
+	timer_set(env, &sa->sa_timer, ikev2_init_ike_sa_timeout, sa);
+	timer_add(env, &sa->sa_timer, IKED_IKE_SA_EXCHANGE_TIMEOUT);
+
+ done:
+	ikev2_msg_cleanup(env, &req);
+ closeonly:
+	if (ret == -1) {
+		log_debug("%s: closing SA", __func__);
+		ikev2_ike_sa_setreason(sa, "failed to send SESSION_RESUME");
+		sa_free(env, sa);
+	}
+
+	return (ret);
+}
+
+/* IKE_SESSION_RESUME response, continue with IKE_AUTH */
+int
+ikev2_init_resume_recv(struct iked *env, struct iked_sa *sa,
+    struct iked_message *msg)
+{
+	struct iked_ticket	*tk = sa->sa_ticket;
+
+	if (tk == NULL || !sa->sa_resumed)
+		return (-1);
+	if (msg->msg_flags & IKED_MSG_FLAGS_TICKET_NACK) {
+		log_info("%s: ticket was not accepted", SPI_SA(sa, __func__));
+		return (-1);
+	}
+	if (ibuf_length(msg->msg_nonce) < IKED_NONCE_MIN) {
+		log_debug("%s: failed to get peer nonce", __func__);
+		return (-1);
+	}
+	sa->sa_rnonce = msg->msg_nonce;
+	msg->msg_nonce = NULL;
+
+	ibuf_free(sa->sa_2ndmsg);
+	if ((sa->sa_2ndmsg = ibuf_dup(msg->msg_data)) == NULL) {
+		log_debug("%s: failed to copy 2nd message", __func__);
+		return (-1);
+	}
+
+	if (ikev2_sa_keys(env, sa, tk->tk_key_d) != 0) {
+		log_info("%s: failed to get IKE keys", SPI_SA(sa, __func__));
+		return (-1);
+	}
+	sa_stateflags(sa, IKED_REQ_SA);
 
-	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
-		goto done;
+	/* A new ticket may be issued in IKE_AUTH */
+	resume_ticket_free(tk);
+	sa->sa_ticket = NULL;
 
-	if (ikev2_set_header(hdr, ibuf_size(buf) - sizeof(*hdr)) == -1)
-		goto done;
+	if (resume_authsign(env, sa) != 0)
+		return (-1);
 
-	(void)ikev2_pld_parse(env, hdr, &req, 0);
+	return (ikev2_init_ike_auth(env, sa));
+}
 
-	ibuf_free(sa->sa_1stmsg);
-	if ((sa->sa_1stmsg = ibuf_dup(buf)) == NULL) {
-		log_debug("%s: failed to copy 1st message", __func__);
-		goto done;
+/*
+ * Follow a redirect from the gateway "from" (RFC 5685).  The policy is
+ * initiated with the new gateway until it fails, and goes back to the
+ * configured peer if it is redirected too often before an IKE SA is
+ * established.
+ */
+int
+ikev2_init_redirect(struct iked *env, struct iked_sa *sa,
+    struct sockaddr_storage *from, struct sockaddr_storage *gw)
+{
+	struct iked_policy	*pol = sa->sa_policy;
+
+	if (pol->pol_redirects >= IKED_REDIRECT_MAX ||
+	    sockaddr_cmp((struct sockaddr *)from,
+	    (struct sockaddr *)gw, -1) == 0) {
+		log_info("%s: redirect loop, ignoring %s",
+		    SPI_SA(sa, __func__), print_addr(gw));
+		ikestat_inc(env, ikes_redirect_loop);
+		ikev2_init_redirect_reset(pol);
+		return (-1);
+	}
+	if (ikev2_msg_getsocket(env, gw->ss_family, 0) == NULL) {
+		log_info("%s: no socket for %s", SPI_SA(sa, __func__),
+		    print_addr(gw));
+		return (-1);
 	}
 
-	if ((ret = ikev2_msg_send(env, &req)) == 0)
-		sa_state(env, sa, IKEV2_STATE_SA_INIT);
+	log_info("%s: redirected to %s", SPI_SA(sa, __func__),
+	    print_addr(gw));
+	ikestat_inc(env, ikes_redirect_followed);
 
-	/* Setup exchange timeout. */
-	timer_set(env, &sa->sa_timer, ikev2_init_ike_sa_timeout, sa);
-	timer_add(env, &sa->sa_timer, IKED_IKE_SA_EXCHANGE_TIMEOUT);
+	pol->pol_redirects++;
+	bzero(&pol->pol_redirfrom, sizeof(pol->pol_redirfrom));
+	pol->pol_redirfrom.addr_af = from->ss_family;
+	memcpy(&pol->pol_redirfrom.addr, from, sizeof(*from));
+	bzero(&pol->pol_redirect, sizeof(pol->pol_redirect));
+	pol->pol_redirect.addr_af = gw->ss_family;
+	pol->pol_redirect.addr_mask = gw->ss_family == AF_INET ? 32 : 128;
+	memcpy(&pol->pol_redirect.addr, gw, sizeof(*gw));
 
- done:
-	ikev2_msg_cleanup(env, &req);
- closeonly:
-	if (ret == -1) {
-		log_debug("%s: closing SA", __func__);
-		ikev2_ike_sa_setreason(sa, "failed to send SA_INIT");
-		sa_free(env, sa);
-	}
-	ibuf_free(vendor_id);
+	/* not a failure, initiate without backoff */
+	pol->pol_initfails = 0;
+	return (0);
+}
 
-	return (ret);
+void
+ikev2_init_redirect_reset(struct iked_policy *pol)
+{
+	bzero(&pol->pol_redirect, sizeof(pol->pol_redirect));
+	bzero(&pol->pol_redirfrom, sizeof(pol->pol_redirfrom));
+	pol->pol_redirects = 0;
 }
 
 int
@@ -1580,6 +2316,7 @@ ikev2_init_auth(struct iked *env, struct iked_message *msg)
 		return (-1);
 	}
 
+	sa->sa_lat_auth = hist_now();
 	if (ca_setauth(env, sa, authmsg, PROC_CERT) == -1) {
 		log_info("%s: failed to get cert", SPI_SA(sa, __func__));
 		ibuf_free(authmsg);
@@ -1613,7 +2350,7 @@ ikev2_init_ike_auth(struct iked *env, struct iked_sa *sa)
 	}
 
 	/* New encrypted message buffer */
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		goto done;
 
 	id = &sa->sa_iid;
@@ -1707,25 +2444,42 @@ ikev2_init_ike_auth(struct iked *env, struct iked_sa *sa)
 			goto done;
 	}
 
-	if ((pol->pol_flags & IKED_POLICY_IPCOMP) &&
+	/*
+	 * Without a child SA there is nothing to negotiate here, no SPI
+	 * or CPI is allocated and the responder can not fail IKE_AUTH
+	 * over the child proposals (RFC 6023).
+	 */
+	if ((pol->pol_flags & IKED_POLICY_CHILDLESS) && sa->sa_childless) {
+		sa->sa_nochild = 1;
+		sa_stateflags(sa, IKED_REQ_SA);
+	}
+
+	if (!sa->sa_nochild && (pol->pol_flags & IKED_POLICY_IPCOMP) &&
 	    (len = ikev2_add_ipcompnotify(env, e, &pld, len, sa, 1)) == -1)
 		goto done;
-	if ((pol->pol_flags & IKED_POLICY_TRANSPORT) &&
+	if (!sa->sa_nochild && (pol->pol_flags & IKED_POLICY_TRANSPORT) &&
 	    (len = ikev2_add_transport_mode(env, e, &pld, len, sa)) == -1)
 		goto done;
-
-	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_SA) == -1)
+	if ((pol->pol_flags & IKED_POLICY_RESUME) &&
+	    (len = ikev2_add_notify(e, &pld, len,
+	    IKEV2_N_TICKET_REQUEST)) == -1)
 		goto done;
 
-	/* SA payload */
-	if ((pld = ikev2_add_payload(e)) == NULL)
-		goto done;
-	if ((len = ikev2_add_proposals(env, sa, e, &pol->pol_proposals, 0,
-	    sa->sa_hdr.sh_initiator, 0, 1)) == -1)
-		goto done;
+	if (!sa->sa_nochild) {
+		if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_SA) == -1)
+			goto done;
 
-	if ((len = ikev2_add_ts(e, &pld, len, sa, 0)) == -1)
-		goto done;
+		/* SA payload */
+		if ((pld = ikev2_add_payload(e)) == NULL)
+			goto done;
+		if ((len = ikev2_add_proposals(env, sa, e,
+		    &pol->pol_proposals, 0, sa->sa_hdr.sh_initiator,
+		    0, 1)) == -1)
+			goto done;
+
+		if ((len = ikev2_add_ts(e, &pld, len, sa, 0)) == -1)
+			goto done;
+	}
 
 	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
 		goto done;
@@ -1746,10 +2500,8 @@ ikev2_enable_timer(struct iked *env, struct iked_sa *sa)
 	timer_set(env, &sa->sa_timer, ikev2_ike_sa_alive, sa);
 	if (env->sc_alive_timeout > 0)
 		timer_add(env, &sa->sa_timer, env->sc_alive_timeout);
-	timer_set(env, &sa->sa_keepalive, ikev2_ike_sa_keepalive, sa);
 	if (sa->sa_usekeepalive)
-		timer_add(env, &sa->sa_keepalive,
-		    IKED_IKE_SA_KEEPALIVE_TIMEOUT);
+		ikev2_keepalive_add(env, sa);
 	timer_set(env, &sa->sa_rekey, ikev2_ike_sa_rekey, sa);
 	if (sa->sa_policy->pol_rekey)
 		ikev2_ike_sa_rekey_schedule(env, sa);
@@ -1773,7 +2525,7 @@ void
 ikev2_disable_timer(struct iked *env, struct iked_sa *sa)
 {
 	timer_del(env, &sa->sa_timer);
-	timer_del(env, &sa->sa_keepalive);
+	ikev2_keepalive_del(env, sa);
 	timer_del(env, &sa->sa_rekey);
 }
 
@@ -1798,8 +2550,11 @@ ikev2_init_done(struct iked *env, struct iked_sa *sa)
 	}
 #endif
 
-	ret = ikev2_childsa_negotiate(env, sa, &sa->sa_kex, &sa->sa_proposals,
-	    sa->sa_hdr.sh_initiator, 0);
+	if (sa->sa_nochild)
+		ret = ikev2_childless_flows(sa);
+	else
+		ret = ikev2_childsa_negotiate(env, sa, &sa->sa_kex,
+		    &sa->sa_proposals, sa->sa_hdr.sh_initiator, 0);
 	if (ret == 0)
 		ret = ikev2_childsa_enable(env, sa);
 	if (ret == 0) {
@@ -1810,6 +2565,14 @@ ikev2_init_done(struct iked *env, struct iked_sa *sa)
 		ikev2_log_established(sa);
 		ikev2_record_dstid(env, sa);
 		sa_configure_iface(env, sa, 1);
+		if (sa->sa_nochild)
+			ikestat_inc(env, ikes_childless_sa);
+		/* Resume with the ticket when the SA is gone */
+		if (sa->sa_ticket != NULL) {
+			resume_ticket_free(sa->sa_policy->pol_ticket);
+			sa->sa_policy->pol_ticket = sa->sa_ticket;
+			sa->sa_ticket = NULL;
+		}
 	}
 
 	if (ret)
@@ -2305,6 +3068,68 @@ ikev2_add_transport_mode(struct iked *env, struct ibuf *e,
 	return ikev2_add_notify(e, pld, len, IKEV2_N_USE_TRANSPORT_MODE);
 }
 
+/* TICKET_LT_OPAQUE for the initiator, or TICKET_NACK if there is none */
+ssize_t
+ikev2_add_ticket(struct iked *env, struct ibuf *e,
+    struct ikev2_payload **pld, ssize_t len, struct iked_sa *sa)
+{
+	struct ibuf	*ticket;
+	ssize_t		 ret = -1;
+
+	if ((sa->sa_policy->pol_flags & IKED_POLICY_RESUME) == 0 ||
+	    (ticket = resume_ticket_seal(env, sa)) == NULL) {
+		ikestat_inc(env, ikes_resume_ticket_refused);
+		return (ikev2_add_notify(e, pld, len, IKEV2_N_TICKET_NACK));
+	}
+
+	if ((len = ikev2_add_notify(e, pld, len,
+	    IKEV2_N_TICKET_LT_OPAQUE)) == -1 ||
+	    ibuf_add_n32(e, IKED_TICKET_LIFETIME) != 0 ||
+	    ibuf_add_ibuf(e, ticket) != 0)
+		goto done;
+	ret = len + sizeof(uint32_t) + ibuf_size(ticket);
+ done:
+	ibuf_free(ticket);
+	return (ret);
+}
+
+/* REDIRECT with the new gateway, and the nonce of IKE_SA_INIT */
+ssize_t
+ikev2_add_redirect(struct ibuf *e, struct ikev2_payload **pld,
+    ssize_t len, struct sockaddr_storage *gw, struct ibuf *nonce)
+{
+	int	 gwlen;
+
+	if ((len = ikev2_add_notify(e, pld, len, IKEV2_N_REDIRECT)) == -1 ||
+	    (gwlen = redirect_addgw(e, gw)) == -1)
+		return (-1);
+	len += gwlen;
+	if (nonce != NULL) {
+		if (ibuf_add_ibuf(e, nonce) != 0)
+			return (-1);
+		len += ibuf_size(nonce);
+	}
+	return (len);
+}
+
+/* REDIRECTED_FROM after a redirect, REDIRECT_SUPPORTED otherwise */
+ssize_t
+ikev2_add_redirect_supported(struct ibuf *e, struct ikev2_payload **pld,
+    ssize_t len, struct iked_policy *pol)
+{
+	int	 gwlen;
+
+	if (pol->pol_redirfrom.addr_af == AF_UNSPEC)
+		return (ikev2_add_notify(e, pld, len,
+		    IKEV2_N_REDIRECT_SUPPORTED));
+
+	if ((len = ikev2_add_notify(e, pld, len,
+	    IKEV2_N_REDIRECTED_FROM)) == -1 ||
+	    (gwlen = redirect_addgw(e, &pol->pol_redirfrom.addr)) == -1)
+		return (-1);
+	return (len + gwlen);
+}
+
 int
 ikev2_next_payload(struct ikev2_payload *pld, size_t length,
     uint8_t nextpayload)
@@ -2871,7 +3696,7 @@ ikev2_resp_informational(struct iked *env, struct iked_sa *sa,
 	    msg->msg_responded || msg->msg_error)
 		goto done;
 
-	if ((buf = ibuf_static()) == NULL)
+	if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		goto done;
 
 	if ((len = ikev2_handle_delete(env, msg, buf, &pld,
@@ -2926,6 +3751,7 @@ ikev2_resp_informational(struct iked *env, struct iked_sa *sa,
 		    sa->sa_hdr.sh_initiator ? &sa->sa_rcert : &sa->sa_icert);
 		ikev2_ike_sa_setreason(sa,
 		    "authentication failed notification from peer");
+		peerstat_add(env, NULL, sa, IKED_PEERSTAT_AUTH_FAILED, 1);
 		sa_state(env, sa, IKEV2_STATE_CLOSED);
 	}
  done:
@@ -2941,6 +3767,7 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 
 	switch (hdr->ike_exchange) {
 	case IKEV2_EXCHANGE_IKE_SA_INIT:
+	case IKEV2_EXCHANGE_IKE_SESSION_RESUME:
 		if (msg->msg_sa != NULL) {
 			log_debug("%s: SA already exists", __func__);
 			return;
@@ -2951,6 +3778,7 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 			log_debug("%s: failed to get new SA", __func__);
 			return;
 		}
+		msg->msg_sa->sa_lat_start = hist_now();
 		/* Setup exchange timeout. */
 		timer_set(env, &msg->msg_sa->sa_timer,
 		    ikev2_init_ike_sa_timeout, msg->msg_sa);
@@ -2996,6 +3824,7 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 	    sa_address(sa, &sa->sa_local, (struct sockaddr *)&msg->msg_local)
 	    == -1) {
 		ikestat_inc(env, ikes_msg_rcvd_dropped);
+		peerstat_msg(env, msg, IKED_PEERSTAT_DROPPED, 1);
 		return;
 	}
 	sa->sa_fd = msg->msg_fd;
@@ -3014,6 +3843,11 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 
 	switch (hdr->ike_exchange) {
 	case IKEV2_EXCHANGE_IKE_SA_INIT:
+		if (ikev2_resp_redirect(env, msg) == 0) {
+			ikev2_ike_sa_setreason(sa, "redirected");
+			sa_state(env, sa, IKEV2_STATE_CLOSED);
+			return;
+		}
 		if (ikev2_sa_responder(env, sa, NULL, msg) != 0) {
 			log_info("%s: failed to negotiate IKE SA",
 			    SPI_SA(sa, __func__));
@@ -3031,6 +3865,19 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 			return;
 		}
 		break;
+	case IKEV2_EXCHANGE_IKE_SESSION_RESUME:
+		if (ikev2_resp_resume(env, msg) != 0) {
+			log_info("%s: failed to resume IKE SA",
+			    SPI_SA(sa, __func__));
+			ikestat_inc(env, ikes_resume_rejected);
+			if (msg->msg_error == 0)
+				msg->msg_error = IKEV2_N_TICKET_NACK;
+			ikev2_send_init_error(env, msg);
+			ikev2_ike_sa_setreason(sa, "session resumption failed");
+			sa_state(env, sa, IKEV2_STATE_CLOSED);
+			return;
+		}
+		break;
 	case IKEV2_EXCHANGE_IKE_AUTH:
 		if (!sa_stateok(sa, IKEV2_STATE_SA_INIT)) {
 			log_debug("%s: state mismatch", __func__);
@@ -3070,6 +3917,17 @@ ikev2_resp_recv(struct iked *env, struct iked_message *msg,
 		if (msg->msg_update_sa_addresses)
 			ikev2_update_sa_addresses(env, sa);
 		(void)ikev2_resp_informational(env, sa, msg);
+		if (msg->msg_redirect != NULL &&
+		    sa->sa_state == IKEV2_STATE_ESTABLISHED &&
+		    ikev2_init_redirect(env, sa, &sa->sa_peer.addr,
+		    msg->msg_redirect) == 0) {
+			/* The policy is initiated again when the SA is gone */
+			ikev2_disable_timer(env, sa);
+			ikev2_ike_sa_setreason(sa, "redirected");
+			ikev2_ikesa_delete(env, sa, 1);
+			timer_add(env, &sa->sa_timer,
+			    3 * IKED_RETRANSMIT_TIMEOUT);
+		}
 		break;
 	default:
 		break;
@@ -3253,6 +4111,28 @@ ikev2_handle_notifies(struct iked *env, struct iked_message *msg)
 		sa->sa_frag = 1;
 	}
 
+	if ((msg->msg_flags & (IKED_MSG_FLAGS_REDIRECT_SUPPORTED|
+	    IKED_MSG_FLAGS_REDIRECTED_FROM)) && !sa->sa_hdr.sh_initiator)
+		sa->sa_redirect = 1;
+
+	if ((msg->msg_flags & IKED_MSG_FLAGS_CHILDLESS) &&
+	    msg->msg_exchange == IKEV2_EXCHANGE_IKE_SA_INIT) {
+		log_debug("%s: childless IKE SA supported", __func__);
+		sa->sa_childless = 1;
+	}
+
+	if (msg->msg_redirect != NULL && sa->sa_hdr.sh_initiator &&
+	    msg->msg_exchange == IKEV2_EXCHANGE_IKE_SA_INIT) {
+		if (ikev2_init_redirect(env, sa, &msg->msg_peer,
+		    msg->msg_redirect) == 0)
+			ikev2_ike_sa_setreason(sa, "redirected");
+		else
+			ikev2_ike_sa_setreason(sa, "redirect not followed");
+		sa_state(env, sa, IKEV2_STATE_CLOSED);
+		msg->msg_sa = NULL;
+		return (-1);
+	}
+
 	if ((msg->msg_flags & IKED_MSG_FLAGS_MOBIKE) && env->sc_mobike) {
 		log_debug("%s: mobike enabled", __func__);
 		sa->sa_mobike = 1;
@@ -3307,8 +4187,8 @@ ikev2_handle_notifies(struct iked *env, struct iked_message *msg)
 			sa_state(env, sa, IKEV2_STATE_CLOSED);
 			msg->msg_sa = NULL;
 			msg->msg_policy->pol_peerdh = groupid;
-			timer_set(env, &env->sc_inittmr, ikev2_init_ike_sa, NULL);
-			timer_add(env, &env->sc_inittmr, IKED_INITIATOR_INITIAL);
+			/* not a failure, reinitiate without backoff */
+			msg->msg_policy->pol_initfails = 0;
 			return (-1);
 		case IKEV2_EXCHANGE_CREATE_CHILD_SA:
 			if (!(sa->sa_stateflags & IKED_REQ_CHILDSA)) {
@@ -3378,20 +4258,180 @@ ikev2_handle_notifies(struct iked *env, struct iked_message *msg)
 	    && sa->sa_nexti != NULL)
 		sa->sa_tmpfail = 1;
 
-	return (0);
+	if ((msg->msg_flags & IKED_MSG_FLAGS_TICKET_REQUEST) &&
+	    !sa->sa_hdr.sh_initiator)
+		sa->sa_ticketreq = 1;
+
+	/* The ticket is kept for the policy once the SA is established */
+	if (ibuf_length(msg->msg_ticket) && sa->sa_hdr.sh_initiator &&
+	    msg->msg_exchange == IKEV2_EXCHANGE_IKE_AUTH &&
+	    (sa->sa_policy->pol_flags & IKED_POLICY_RESUME) &&
+	    resume_ticket_save(sa, msg->msg_ticket,
+	    msg->msg_ticket_lifetime) != 0)
+		log_debug("%s: failed to keep ticket", __func__);
+
+	return (0);
+}
+
+int
+ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
+{
+	struct iked_message		 resp;
+	struct ike_header		*hdr;
+	struct ikev2_payload		*pld;
+	struct ikev2_keyexchange	*ke;
+	struct iked_sa			*sa = msg->msg_sa;
+	struct ibuf			*buf;
+	struct ibuf			*vendor_id = NULL;
+	struct dh_group			*group;
+	ssize_t				 len;
+	int				 ret = -1;
+
+	if (sa->sa_hdr.sh_initiator) {
+		log_debug("%s: called by initiator", __func__);
+		return (-1);
+	}
+	if (msg->msg_nat_detected && sa->sa_udpencap == 0) {
+		log_debug("%s: detected NAT, enabling UDP encapsulation",
+		    __func__);
+		sa->sa_udpencap = 1;
+	}
+
+	if ((buf = ikev2_msg_init(env, &resp,
+	    &msg->msg_peer, msg->msg_peerlen,
+	    &msg->msg_local, msg->msg_locallen, 1,
+	    IKEV2_EXCHANGE_IKE_SA_INIT)) == NULL)
+		goto done;
+
+	resp.msg_sa = sa;
+	resp.msg_fd = msg->msg_fd;
+	resp.msg_natt = msg->msg_natt;
+	resp.msg_msgid = 0;
+	resp.msg_policy = sa->sa_policy;
+
+	/* IKE header */
+	if ((hdr = ikev2_add_header(buf, sa, resp.msg_msgid,
+	    IKEV2_PAYLOAD_SA, IKEV2_EXCHANGE_IKE_SA_INIT,
+	    IKEV2_FLAG_RESPONSE)) == NULL)
+		goto done;
+
+	/* SA payload */
+	if ((pld = ikev2_add_payload(buf)) == NULL)
+		goto done;
+	if ((len = ikev2_add_proposals(env, sa, buf, &sa->sa_proposals,
+	    IKEV2_SAPROTO_IKE, sa->sa_hdr.sh_initiator, 0, 0)) == -1)
+		goto done;
+
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_KE) == -1)
+		goto done;
+
+	/* KE payload */
+	if ((pld = ikev2_add_payload(buf)) == NULL)
+		goto done;
+	if ((ke = ibuf_reserve(buf, sizeof(*ke))) == NULL)
+		goto done;
+	if ((group = sa->sa_dhgroup) == NULL) {
+		log_debug("%s: invalid dh", __func__);
+		goto done;
+	}
+	ke->kex_dhgroup = htobe16(group->id);
+	if (ikev2_add_buf(buf, sa->sa_dhrexchange) == -1)
+		goto done;
+	len = sizeof(*ke) + ibuf_size(sa->sa_dhrexchange);
+
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONCE) == -1)
+		goto done;
+
+	/* NONCE payload */
+	if ((pld = ikev2_add_payload(buf)) == NULL)
+		goto done;
+	if (ikev2_add_buf(buf, sa->sa_rnonce) == -1)
+		goto done;
+	len = ibuf_size(sa->sa_rnonce);
+
+	if (env->sc_vendorid != 0) {
+		vendor_id = ibuf_new(IKED_VENDOR_ID, strlen(IKED_VENDOR_ID));
+		ibuf_add(vendor_id, IKED_VERSION, strlen(IKED_VERSION));
+		if ((len = ikev2_add_vendor_id(buf, &pld, len, vendor_id))
+		    == -1)
+			goto done;
+	}
+
+	/* Fragmentation Notify*/
+	if (sa->sa_frag) {
+		if ((len = ikev2_add_fragmentation(buf, &pld, len))
+		    == -1)
+			goto done;
+	}
+
+	/* Childless IKE SA Notify */
+	if (sa->sa_childless &&
+	    (len = ikev2_add_notify(buf, &pld, len,
+	    IKEV2_N_CHILDLESS_IKEV2_SUPPORTED)) == -1)
+		goto done;
+
+	if ((env->sc_nattmode != NATT_DISABLE) &&
+	    msg->msg_local.ss_family != AF_UNSPEC) {
+		if ((len = ikev2_add_nat_detection(env, buf, &pld, &resp, len))
+		    == -1)
+			goto done;
+	}
+	if (sa->sa_statevalid & IKED_REQ_CERT) {
+		/* CERTREQ payload(s) */
+		if ((len = ikev2_add_certreq(buf, &pld,
+		    len, env->sc_certreq, env->sc_certreqtype)) == -1)
+			goto done;
+
+		if (env->sc_certreqtype != sa->sa_policy->pol_certreqtype &&
+		    (len = ikev2_add_certreq(buf, &pld,
+		    len, NULL, sa->sa_policy->pol_certreqtype)) == -1)
+			goto done;
+	}
+
+	if (sa->sa_sigsha2 &&
+	    (len = ikev2_add_sighashnotify(buf, &pld, len)) == -1)
+		goto done;
+
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
+		goto done;
+
+	if (ikev2_set_header(hdr, ibuf_size(buf) - sizeof(*hdr)) == -1)
+		goto done;
+
+	(void)ikev2_pld_parse(env, hdr, &resp, 0);
+
+	ibuf_free(sa->sa_2ndmsg);
+	if ((sa->sa_2ndmsg = ibuf_dup(buf)) == NULL) {
+		log_debug("%s: failed to copy 2nd message", __func__);
+		goto done;
+	}
+
+	ret = ikev2_msg_send(env, &resp);
+
+ done:
+	ibuf_free(vendor_id);
+	ikev2_msg_cleanup(env, &resp);
+
+	return (ret);
 }
 
+/*
+ * IKE_SESSION_RESUME request (RFC 5723): the ticket takes the place of
+ * the IKE_SA_INIT exchange.  The new SA gets the policy, the transforms
+ * and the keys derived from SK_d of the old SA, the peer proves that it
+ * holds them with the AUTH payload of the IKE_AUTH exchange.
+ */
 int
-ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
+ikev2_resp_resume(struct iked *env, struct iked_message *msg)
 {
 	struct iked_message		 resp;
 	struct ike_header		*hdr;
 	struct ikev2_payload		*pld;
-	struct ikev2_keyexchange	*ke;
 	struct iked_sa			*sa = msg->msg_sa;
+	struct iked_policy		*pol, *old;
+	struct iked_proposal		*prop;
+	struct iked_ticket		*tk;
 	struct ibuf			*buf;
-	struct ibuf			*vendor_id = NULL;
-	struct dh_group			*group;
 	ssize_t				 len;
 	int				 ret = -1;
 
@@ -3399,6 +4439,74 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 		log_debug("%s: called by initiator", __func__);
 		return (-1);
 	}
+	if (!ibuf_length(msg->msg_ticket) ||
+	    ibuf_length(msg->msg_nonce) < IKED_NONCE_MIN) {
+		log_debug("%s: missing ticket or nonce", __func__);
+		return (-1);
+	}
+	if ((tk = resume_ticket_open(env, msg->msg_ticket)) == NULL)
+		return (-1);
+	sa->sa_ticket = tk;
+
+	TAILQ_FOREACH(pol, &env->sc_policies, pol_entry)
+		if (strcmp(pol->pol_name, tk->tk_policy) == 0)
+			break;
+	if (pol == NULL || (pol->pol_flags & IKED_POLICY_RESUME) == 0) {
+		log_info("%s: no resumable policy '%s'",
+		    SPI_SA(sa, __func__), tk->tk_policy);
+		return (-1);
+	}
+
+	/* move sa to the policy of the ticket */
+	if ((old = sa->sa_policy) != pol) {
+		sa->sa_policy = msg->msg_policy = pol;
+		TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
+		TAILQ_INSERT_TAIL(&pol->pol_sapeers, sa, sa_peer_entry);
+		policy_ref(env, pol);
+		ikev2_init_enqueue(env, old);
+		policy_unref(env, old);
+		if (ikev2_policy2id(&pol->pol_localid, &sa->sa_rid, 1) != 0) {
+			log_debug("%s: failed to get local id", __func__);
+			return (-1);
+		}
+	}
+
+	/* The SA is authenticated with the keys, not with the policy */
+	sa->sa_resumed = 1;
+	sa->sa_stateinit = 0;
+	sa->sa_statevalid = IKED_REQ_AUTH|IKED_REQ_AUTHVALID|IKED_REQ_SA;
+	if (tk->tk_eapid != NULL) {
+		free(sa->sa_eapid);
+		if ((sa->sa_eapid = strdup(tk->tk_eapid)) == NULL)
+			return (-1);
+	}
+
+	config_free_proposals(&sa->sa_proposals, 0);
+	while ((prop = TAILQ_FIRST(&tk->tk_proposals)) != NULL) {
+		TAILQ_REMOVE(&tk->tk_proposals, prop, prop_entry);
+		TAILQ_INSERT_TAIL(&sa->sa_proposals, prop, prop_entry);
+	}
+	if (ikev2_sa_transforms(sa) != 0)
+		return (-1);
+
+	sa_state(env, sa, IKEV2_STATE_SA_INIT);
+	sa_stateflags(sa, IKED_REQ_SA);
+
+	ibuf_free(sa->sa_1stmsg);
+	if ((sa->sa_1stmsg = ibuf_dup(msg->msg_data)) == NULL) {
+		log_debug("%s: failed to copy 1st message", __func__);
+		return (-1);
+	}
+	sa->sa_inonce = msg->msg_nonce;
+	msg->msg_nonce = NULL;
+	if (sa->sa_rnonce == NULL &&
+	    (sa->sa_rnonce = ibuf_random(IKED_NONCE_SIZE)) == NULL) {
+		log_debug("%s: failed to get local nonce", __func__);
+		return (-1);
+	}
+	if (ikev2_sa_keys(env, sa, tk->tk_key_d) != 0)
+		return (-1);
+
 	if (msg->msg_nat_detected && sa->sa_udpencap == 0) {
 		log_debug("%s: detected NAT, enabling UDP encapsulation",
 		    __func__);
@@ -3407,7 +4515,8 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 
 	if ((buf = ikev2_msg_init(env, &resp,
 	    &msg->msg_peer, msg->msg_peerlen,
-	    &msg->msg_local, msg->msg_locallen, 1)) == NULL)
+	    &msg->msg_local, msg->msg_locallen, 1,
+	    IKEV2_EXCHANGE_IKE_SESSION_RESUME)) == NULL)
 		goto done;
 
 	resp.msg_sa = sa;
@@ -3418,37 +4527,10 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 
 	/* IKE header */
 	if ((hdr = ikev2_add_header(buf, sa, resp.msg_msgid,
-	    IKEV2_PAYLOAD_SA, IKEV2_EXCHANGE_IKE_SA_INIT,
+	    IKEV2_PAYLOAD_NONCE, IKEV2_EXCHANGE_IKE_SESSION_RESUME,
 	    IKEV2_FLAG_RESPONSE)) == NULL)
 		goto done;
 
-	/* SA payload */
-	if ((pld = ikev2_add_payload(buf)) == NULL)
-		goto done;
-	if ((len = ikev2_add_proposals(env, sa, buf, &sa->sa_proposals,
-	    IKEV2_SAPROTO_IKE, sa->sa_hdr.sh_initiator, 0, 0)) == -1)
-		goto done;
-
-	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_KE) == -1)
-		goto done;
-
-	/* KE payload */
-	if ((pld = ikev2_add_payload(buf)) == NULL)
-		goto done;
-	if ((ke = ibuf_reserve(buf, sizeof(*ke))) == NULL)
-		goto done;
-	if ((group = sa->sa_dhgroup) == NULL) {
-		log_debug("%s: invalid dh", __func__);
-		goto done;
-	}
-	ke->kex_dhgroup = htobe16(group->id);
-	if (ikev2_add_buf(buf, sa->sa_dhrexchange) == -1)
-		goto done;
-	len = sizeof(*ke) + ibuf_size(sa->sa_dhrexchange);
-
-	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONCE) == -1)
-		goto done;
-
 	/* NONCE payload */
 	if ((pld = ikev2_add_payload(buf)) == NULL)
 		goto done;
@@ -3456,14 +4538,6 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 		goto done;
 	len = ibuf_size(sa->sa_rnonce);
 
-	if (env->sc_vendorid != 0) {
-		vendor_id = ibuf_new(IKED_VENDOR_ID, strlen(IKED_VENDOR_ID));
-		ibuf_add(vendor_id, IKED_VERSION, strlen(IKED_VERSION));
-		if ((len = ikev2_add_vendor_id(buf, &pld, len, vendor_id))
-		    == -1)
-			goto done;
-	}
-
 	/* Fragmentation Notify*/
 	if (sa->sa_frag) {
 		if ((len = ikev2_add_fragmentation(buf, &pld, len))
@@ -3477,21 +4551,6 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 		    == -1)
 			goto done;
 	}
-	if (sa->sa_statevalid & IKED_REQ_CERT) {
-		/* CERTREQ payload(s) */
-		if ((len = ikev2_add_certreq(buf, &pld,
-		    len, env->sc_certreq, env->sc_certreqtype)) == -1)
-			goto done;
-
-		if (env->sc_certreqtype != sa->sa_policy->pol_certreqtype &&
-		    (len = ikev2_add_certreq(buf, &pld,
-		    len, NULL, sa->sa_policy->pol_certreqtype)) == -1)
-			goto done;
-	}
-
-	if (sa->sa_sigsha2 &&
-	    (len = ikev2_add_sighashnotify(buf, &pld, len)) == -1)
-		goto done;
 
 	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
 		goto done;
@@ -3507,10 +4566,13 @@ ikev2_resp_ike_sa_init(struct iked *env, struct iked_message *msg)
 		goto done;
 	}
 
-	ret = ikev2_msg_send(env, &resp);
+	if ((ret = ikev2_msg_send(env, &resp)) == 0) {
+		log_info("%s: resuming policy '%s'", SPI_SA(sa, __func__),
+		    pol->pol_name);
+		ikestat_inc(env, ikes_resume_accepted);
+	}
 
  done:
-	ibuf_free(vendor_id);
 	ikev2_msg_cleanup(env, &resp);
 
 	return (ret);
@@ -3528,13 +4590,14 @@ ikev2_send_auth_failed(struct iked *env, struct iked_sa *sa)
 		bzero(dstid, sizeof(dstid));
 	log_info("%s: authentication failed for %s",
 	    SPI_SA(sa, __func__), dstid);
+	peerstat_add(env, NULL, sa, IKED_PEERSTAT_AUTH_FAILED, 1);
 
 	/* Log certificate information */
 	ikev2_log_cert_info(SPI_SA(sa, __func__),
 	    sa->sa_hdr.sh_initiator ? &sa->sa_rcert : &sa->sa_icert);
 
 	/* Notify payload */
-	if ((buf = ibuf_static()) == NULL)
+	if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		goto done;
 	if ((n = ibuf_reserve(buf, sizeof(*n))) == NULL)
 		goto done;
@@ -3584,6 +4647,7 @@ ikev2_add_error(struct iked *env, struct ibuf *buf, struct iked_message *msg)
 		ikev2_log_proposal(msg->msg_sa, &msg->msg_proposals);
 		break;
 	case IKEV2_N_INVALID_KE_PAYLOAD:
+	case IKEV2_N_TICKET_NACK:
 		break;
 	default:
 		return (-1);
@@ -3680,7 +4744,7 @@ ikev2_send_error(struct iked *env, struct iked_sa *sa,
 
 	if (msg->msg_error == 0)
 		return (0);
-	if ((buf = ibuf_static()) == NULL)
+	if ((buf = ikev2_msg_buf(exchange)) == NULL)
 		goto done;
 	if (ikev2_add_error(env, buf, msg) == 0)
 		goto done;
@@ -3691,6 +4755,110 @@ ikev2_send_error(struct iked *env, struct iked_sa *sa,
 	return (ret);
 }
 
+/*
+ * Redirect a new IKE SA to another gateway (RFC 5685).  This is done
+ * before any DH computation, the response only has the REDIRECT.
+ * Returns 0 if the peer was redirected.
+ */
+int
+ikev2_resp_redirect(struct iked *env, struct iked_message *msg)
+{
+	struct iked_message		 resp;
+	struct ike_header		*hdr;
+	struct ikev2_payload		*pld = NULL;
+	struct iked_sa			*sa = msg->msg_sa;
+	struct sockaddr_storage		*gw;
+	struct ibuf			*buf;
+	ssize_t				 len;
+	int				 ret = -1;
+
+	/* A peer that was redirected to us stays */
+	if ((msg->msg_flags & IKED_MSG_FLAGS_REDIRECT_SUPPORTED) == 0 ||
+	    (msg->msg_flags & IKED_MSG_FLAGS_REDIRECTED_FROM) ||
+	    ibuf_length(msg->msg_nonce) == 0 ||
+	    (gw = redirect_select(env, 0)) == NULL)
+		return (-1);
+
+	if ((buf = ikev2_msg_init(env, &resp,
+	    &msg->msg_peer, msg->msg_peerlen,
+	    &msg->msg_local, msg->msg_locallen, 1,
+	    IKEV2_EXCHANGE_IKE_SA_INIT)) == NULL)
+		goto done;
+
+	resp.msg_sa = sa;
+	resp.msg_fd = msg->msg_fd;
+	resp.msg_natt = msg->msg_natt;
+	resp.msg_msgid = 0;
+	resp.msg_policy = sa->sa_policy;
+
+	/* IKE header */
+	if ((hdr = ikev2_add_header(buf, sa, resp.msg_msgid,
+	    IKEV2_PAYLOAD_NOTIFY, IKEV2_EXCHANGE_IKE_SA_INIT,
+	    IKEV2_FLAG_RESPONSE)) == NULL)
+		goto done;
+
+	/* NOTIFY payload */
+	if ((len = ikev2_add_redirect(buf, &pld, 0, gw,
+	    msg->msg_nonce)) == -1)
+		goto done;
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
+		goto done;
+	if (ikev2_set_header(hdr, ibuf_size(buf) - sizeof(*hdr)) == -1)
+		goto done;
+
+	(void)ikev2_pld_parse(env, hdr, &resp, 0);
+	if ((ret = ikev2_msg_send(env, &resp)) == 0) {
+		log_info("%s: redirected to %s", SPI_SA(sa, __func__),
+		    print_addr(gw));
+		ikestat_inc(env, ikes_redirect_sa_init);
+	}
+
+ done:
+	ikev2_msg_cleanup(env, &resp);
+
+	return (ret);
+}
+
+/*
+ * Move an established IKE SA to another gateway with an INFORMATIONAL
+ * exchange, the peer sets up a new IKE SA there and deletes this one.
+ */
+int
+ikev2_send_redirect(struct iked *env, struct iked_sa *sa)
+{
+	struct sockaddr_storage		*gw;
+	struct ikev2_payload		*pld = NULL;
+	struct ibuf			*buf = NULL;
+	ssize_t				 len;
+	int				 ret = -1;
+
+	if (sa->sa_hdr.sh_initiator || !sa->sa_redirect ||
+	    sa->sa_redirected || sa->sa_state != IKEV2_STATE_ESTABLISHED ||
+	    (sa->sa_stateflags & IKED_REQ_INF))
+		return (-1);
+	if ((gw = redirect_select(env, 1)) == NULL)
+		return (-1);
+
+	if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
+		goto done;
+	if ((len = ikev2_add_redirect(buf, &pld, 0, gw, NULL)) == -1)
+		goto done;
+	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
+		goto done;
+	if ((ret = ikev2_msg_send_encrypt(env, sa, &buf,
+	    IKEV2_EXCHANGE_INFORMATIONAL, IKEV2_PAYLOAD_NOTIFY, 0)) == -1)
+		goto done;
+
+	log_info("%s: redirected to %s", SPI_SA(sa, __func__),
+	    print_addr(gw));
+	ikestat_inc(env, ikes_redirect_informational);
+	sa->sa_stateflags |= IKED_REQ_INF;
+	sa->sa_redirected = 1;
+ done:
+	ibuf_free(buf);
+	return (ret);
+}
+
 /*
  * Variant of ikev2_send_error() that can be used before encryption
  * is enabled. Based on ikev2_resp_ike_sa_init() code.
@@ -3715,7 +4883,8 @@ ikev2_send_init_error(struct iked *env, struct iked_message *msg)
 
 	if ((buf = ikev2_msg_init(env, &resp,
 	    &msg->msg_peer, msg->msg_peerlen,
-	    &msg->msg_local, msg->msg_locallen, 1)) == NULL)
+	    &msg->msg_local, msg->msg_locallen, 1,
+	    msg->msg_exchange)) == NULL)
 		goto done;
 
 	resp.msg_sa = sa;
@@ -3726,7 +4895,7 @@ ikev2_send_init_error(struct iked *env, struct iked_message *msg)
 
 	/* IKE header */
 	if ((hdr = ikev2_add_header(buf, sa, resp.msg_msgid,
-	    IKEV2_PAYLOAD_NOTIFY, IKEV2_EXCHANGE_IKE_SA_INIT,
+	    IKEV2_PAYLOAD_NOTIFY, msg->msg_exchange,
 	    IKEV2_FLAG_RESPONSE)) == NULL)
 		goto done;
 
@@ -3769,6 +4938,8 @@ ikev2_handle_certreq(struct iked* env, struct iked_message *msg)
 	else
 		sa->sa_statevalid |= IKED_REQ_CERT;
 
+	sa->sa_lat_certreq = hist_now();
+
 	/*
 	 * If we have to send a local certificate but did not receive an
 	 * optional CERTREQ, use our own certreq to find a local certificate.
@@ -3810,6 +4981,7 @@ ikev2_resp_ike_eap_mschap(struct iked *env, struct iked_sa *sa,
 {
 	uint8_t			 successmsg[EAP_MSCHAP_SUCCESS_SZ];
 	uint8_t			 ntresponse[EAP_MSCHAP_NTRESPONSE_SZ];
+	uint8_t			 nthash[MSCHAP_HASH_SZ];
 	struct eap_msg		*eap = &msg->msg_eap;
 	struct iked_user	*usr;
 	uint8_t			*pass;
@@ -3832,24 +5004,29 @@ ikev2_resp_ike_eap_mschap(struct iked *env, struct iked_sa *sa,
 			    SPI_SA(sa, __func__));
 			return (-1);
 		}
-		if ((usr = user_lookup(env, name)) == NULL) {
+
+		/* Users from iked.conf take precedence over the database */
+		if ((usr = user_lookup(env, name)) != NULL) {
+			if ((pass = string2unicode(usr->usr_pass,
+			    &passlen)) == NULL)
+				return (-1);
+			mschap_ntpassword_hash(pass, passlen, nthash);
+			freezero(pass, passlen);
+		} else if (userdb_lookup(env->sc_userdb, name, nthash) == -1) {
 			log_info("%s: unknown user '%s'", SPI_SA(sa, __func__),
 			    name);
 			return (-1);
 		}
 
-		if ((pass = string2unicode(usr->usr_pass, &passlen)) == NULL)
-			return (-1);
-
 		mschap_nt_response(ibuf_data(sa->sa_eap.id_buf),
-		    eap->eam_challenge, usr->usr_name, strlen(usr->usr_name),
-		    pass, passlen, ntresponse);
+		    eap->eam_challenge, name, strlen(name),
+		    nthash, ntresponse);
 
 		if (memcmp(ntresponse, eap->eam_ntresponse,
 		    sizeof(ntresponse)) != 0) {
 			log_info("%s: '%s' authentication failed",
-			   SPI_SA(sa, __func__), usr->usr_name);
-			freezero(pass, passlen);
+			   SPI_SA(sa, __func__), name);
+			explicit_bzero(nthash, sizeof(nthash));
 
 			/* XXX should we send an EAP failure packet? */
 			return (-1);
@@ -3857,20 +5034,19 @@ ikev2_resp_ike_eap_mschap(struct iked *env, struct iked_sa *sa,
 
 		bzero(&successmsg, sizeof(successmsg));
 
-		mschap_auth_response(pass, passlen,
+		mschap_auth_response(nthash,
 		    ntresponse, ibuf_data(sa->sa_eap.id_buf),
-		    eap->eam_challenge, usr->usr_name, strlen(usr->usr_name),
+		    eap->eam_challenge, name, strlen(name),
 		    successmsg);
 		if ((sa->sa_eapmsk = ibuf_new(NULL, MSCHAP_MSK_SZ)) == NULL) {
 			log_info("%s: failed to get MSK", SPI_SA(sa, __func__));
-			freezero(pass, passlen);
+			explicit_bzero(nthash, sizeof(nthash));
 			return (-1);
 		}
-		mschap_msk(pass, passlen, ntresponse,
-		    ibuf_data(sa->sa_eapmsk));
-		freezero(pass, passlen);
+		mschap_msk(nthash, ntresponse, ibuf_data(sa->sa_eapmsk));
+		explicit_bzero(nthash, sizeof(nthash));
 
-		log_info("%s: '%s' authenticated", __func__, usr->usr_name);
+		log_info("%s: '%s' authenticated", __func__, name);
 
 		ret = eap_mschap_challenge(env, sa, eap->eam_id, eap->eam_msrid,
 		    successmsg, EAP_MSCHAP_SUCCESS_SZ);
@@ -3890,6 +5066,27 @@ ikev2_resp_ike_eap_mschap(struct iked *env, struct iked_sa *sa,
 	return 0;
 }
 
+int
+ikev2_resp_ike_eap_radius(struct iked *env, struct iked_sa *sa,
+    struct iked_message *msg)
+{
+	struct eap_msg		*eap = &msg->msg_eap;
+
+	switch (eap->eam_state) {
+	case EAP_STATE_IDENTITY:
+		sa->sa_eapid = eap->eam_identity;
+		break;
+	case EAP_STATE_RADIUS:
+		break;
+	default:
+		log_info("%s: eap ignored.", __func__);
+		return (0);
+	}
+
+	/* The response is sent when the server answers */
+	return (radius_request(env, sa, &eap->eam_msg));
+}
+
 int
 ikev2_resp_ike_eap(struct iked *env, struct iked_sa *sa,
     struct iked_message *msg)
@@ -3900,6 +5097,8 @@ ikev2_resp_ike_eap(struct iked *env, struct iked_sa *sa,
 	switch (sa->sa_policy->pol_auth.auth_eap) {
 	case EAP_TYPE_MSCHAP_V2:
 		return ikev2_resp_ike_eap_mschap(env, sa, msg);
+	case EAP_TYPE_RADIUS:
+		return ikev2_resp_ike_eap_radius(env, sa, msg);
 	}
 	return -1;
 }
@@ -3930,12 +5129,15 @@ ikev2_resp_ike_auth(struct iked *env, struct iked_sa *sa)
 	    ikev2_cp_setaddr(env, sa, AF_INET6) < 0)
 		return (-1);
 
-	if (ikev2_childsa_negotiate(env, sa, &sa->sa_kex, &sa->sa_proposals,
-	    sa->sa_hdr.sh_initiator, 0) < 0)
+	if (sa->sa_nochild) {
+		if (ikev2_childless_flows(sa) < 0)
+			return (-1);
+	} else if (ikev2_childsa_negotiate(env, sa, &sa->sa_kex,
+	    &sa->sa_proposals, sa->sa_hdr.sh_initiator, 0) < 0)
 		return (-1);
 
 	/* New encrypted message buffer */
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_IKE_AUTH)) == NULL)
 		goto done;
 
 	if (!sa->sa_localauth.id_type) {
@@ -4033,18 +5235,26 @@ ikev2_resp_ike_auth(struct iked *env, struct iked_sa *sa)
 	    (len = ikev2_add_mobike(e, &pld, len)) == -1)
 		goto done;
 
-	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_SA) == -1)
+	/* Session resumption */
+	if (sa->sa_ticketreq &&
+	    (len = ikev2_add_ticket(env, e, &pld, len, sa)) == -1)
 		goto done;
 
-	/* SA payload */
-	if ((pld = ikev2_add_payload(e)) == NULL)
-		goto done;
-	if ((len = ikev2_add_proposals(env, sa, e, &sa->sa_proposals, 0,
-	    sa->sa_hdr.sh_initiator, 0, 1)) == -1)
-		goto done;
+	if (!sa->sa_nochild) {
+		if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_SA) == -1)
+			goto done;
 
-	if ((len = ikev2_add_ts(e, &pld, len, sa, 0)) == -1)
-		goto done;
+		/* SA payload */
+		if ((pld = ikev2_add_payload(e)) == NULL)
+			goto done;
+		if ((len = ikev2_add_proposals(env, sa, e,
+		    &sa->sa_proposals, 0, sa->sa_hdr.sh_initiator,
+		    0, 1)) == -1)
+			goto done;
+
+		if ((len = ikev2_add_ts(e, &pld, len, sa, 0)) == -1)
+			goto done;
+	}
 
 	if (ikev2_next_payload(pld, len, IKEV2_PAYLOAD_NONE) == -1)
 		goto done;
@@ -4060,6 +5270,8 @@ ikev2_resp_ike_auth(struct iked *env, struct iked_sa *sa)
 		ikev2_enable_timer(env, sa);
 		ikev2_log_established(sa);
 		ikev2_record_dstid(env, sa);
+		if (sa->sa_nochild)
+			ikestat_inc(env, ikes_childless_sa);
 	}
 
  done:
@@ -4078,7 +5290,7 @@ ikev2_send_ike_e(struct iked *env, struct iked_sa *sa, struct ibuf *buf,
 	int				 ret = -1;
 
 	/* New encrypted message buffer */
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(exchange)) == NULL)
 		goto done;
 
 	if (buf) {
@@ -4183,7 +5395,7 @@ ikev2_send_create_child_sa(struct iked *env, struct iked_sa *sa,
 	ibuf_free(sa->sa_inonce);
 	sa->sa_inonce = nonce;
 
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_CREATE_CHILD_SA)) == NULL)
 		goto done;
 
 	if ((pol->pol_flags & IKED_POLICY_IPCOMP) &&
@@ -4337,6 +5549,12 @@ ikev2_ike_sa_rekey(struct iked *env, void *arg)
 		ikev2_ike_sa_rekey_schedule_fast(env, sa);
 		return;
 	}
+	if (ikev2_rekey_admit(env, sa) == -1) {
+		log_debug("%s: too many rekeys, delaying rekey",
+		    SPI_SA(sa, __func__));
+		ikev2_ike_sa_rekey_schedule_fast(env, sa);
+		return;
+	}
 
 	/* We need to make sure the rekeying finishes in time */
 	timer_set(env, &sa->sa_rekey, ikev2_ike_sa_rekey_timeout, sa);
@@ -4354,7 +5572,7 @@ ikev2_ike_sa_rekey(struct iked *env, void *arg)
 	sa_state(env, nsa, IKEV2_STATE_AUTH_SUCCESS);
 	nonce = nsa->sa_inonce;
 
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_CREATE_CHILD_SA)) == NULL)
 		goto done;
 
 	/* SA payload */
@@ -4404,6 +5622,7 @@ ikev2_ike_sa_rekey(struct iked *env, void *arg)
 		nsa->sa_previ = sa;
 		sa->sa_tmpfail = 0;
 		nsa = NULL;
+		ikev2_rekey_started(env, sa);
 	}
 done:
 	if (nsa) {
@@ -4560,6 +5779,10 @@ ikev2_init_create_child_sa(struct iked *env, struct iked_message *msg)
 		/* unlink sa_nexti */
 		sa->sa_nexti->sa_previ = NULL;
 		sa->sa_nexti = NULL;
+		if (sa->sa_lat_rekey) {
+			ikestat_lat(env, ikes_lat_rekey, sa->sa_lat_rekey);
+			sa->sa_lat_rekey = 0;
+		}
 		return (ikev2_ikesa_enable(env, sa, nsa));
 	}
 
@@ -4629,7 +5852,8 @@ ikev2_init_create_child_sa(struct iked *env, struct iked_message *msg)
 	if (csa) {
 		/* Child SA rekeying */
 
-		if ((buf = ibuf_static()) == NULL)
+		if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_CREATE_CHILD_SA)) ==
+		    NULL)
 			goto done;
 
 		if ((del = ibuf_reserve(buf, sizeof(*del))) == NULL)
@@ -4654,6 +5878,9 @@ ikev2_init_create_child_sa(struct iked *env, struct iked_message *msg)
 
 done:
 	sa->sa_stateflags &= ~IKED_REQ_CHILDSA;
+	if (ret == 0 && csa && sa->sa_lat_rekey)
+		ikestat_lat(env, ikes_lat_rekey, sa->sa_lat_rekey);
+	sa->sa_lat_rekey = 0;
 
 	if (ret)
 		ikev2_childsa_delete(env, sa, 0, 0, NULL, 1);
@@ -4690,6 +5917,7 @@ ikev2_ikesa_enable(struct iked *env, struct iked_sa *sa, struct iked_sa *nsa)
 	nsa->sa_usekeepalive = sa->sa_usekeepalive;
 	nsa->sa_mobike = sa->sa_mobike;
 	nsa->sa_frag = sa->sa_frag;
+	nsa->sa_nochild = sa->sa_nochild;
 
 	/* Transfer old addresses */
 	memcpy(&nsa->sa_local, &sa->sa_local, sizeof(nsa->sa_local));
@@ -4829,7 +6057,8 @@ ikev2_ikesa_delete(struct iked *env, struct iked_sa *sa, int initiator)
 		if (sa->sa_stateflags & IKED_REQ_INF)
 			goto done;
 		/* Send PAYLOAD_DELETE */
-		if ((buf = ibuf_static()) == NULL)
+		if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) ==
+		    NULL)
 			goto done;
 		if ((del = ibuf_reserve(buf, sizeof(*del))) == NULL)
 			goto done;
@@ -4935,10 +6164,12 @@ ikev2_resp_create_child_sa(struct iked *env, struct iked_message *msg)
 		}
 	}
 
-	if (rekeying)
+	if (rekeying) {
 		log_debug("%s: rekey %s spi %s", __func__,
 		    print_map(rekey->spi_protoid, ikev2_saproto_map),
 		    print_spi(rekey->spi, rekey->spi_size));
+		peerstat_msg(env, msg, IKED_PEERSTAT_REKEY, 1);
+	}
 	else
 		log_debug("%s: creating new %s SA", __func__,
 		    print_map(protoid, ikev2_saproto_map));
@@ -5073,7 +6304,7 @@ ikev2_resp_create_child_sa(struct iked *env, struct iked_message *msg)
 		}
 	}
 
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_CREATE_CHILD_SA)) == NULL)
 		goto done;
 
 	if (!nsa && sa->sa_ipcompr.ic_transform &&
@@ -5201,11 +6432,75 @@ ikev2_ike_sa_rekey_timeout(struct iked *env, void *arg)
 	sa_free(env, sa);
 }
 
+/* rekey at a random point of the rekey window, up to 95% of the lifetime */
 void
 ikev2_ike_sa_rekey_schedule(struct iked *env, struct iked_sa *sa)
 {
-	timer_add(env, &sa->sa_rekey, (sa->sa_policy->pol_rekey * 850 +
-	    arc4random_uniform(100)) / 1000);
+	uint64_t	 window = env->sc_rekeywindow * 10;
+
+	timer_add(env, &sa->sa_rekey, (sa->sa_policy->pol_rekey *
+	    (950 - window + arc4random_uniform(window + 1))) / 1000);
+}
+
+/*
+ * CREATE_CHILD_SA exchanges for rekeying are admitted while fewer than
+ * IKED_REKEY_MAX are in flight, and fewer than IKED_REKEY_PEER_MAX with
+ * the same peer.  Rekeys that are not admitted are retried later, so
+ * the DH computations and kernel updates of SAs that were established
+ * together are spread out.  Finished exchanges are pruned lazily.
+ */
+int
+ikev2_rekey_admit(struct iked *env, struct iked_sa *sa)
+{
+	struct iked_sa		*tmp, *next;
+	unsigned int		 count = 0, peer = 0;
+
+	TAILQ_FOREACH_SAFE(tmp, &env->sc_rekeys, sa_rekey_entry, next) {
+		if ((tmp->sa_stateflags & IKED_REQ_CHILDSA) == 0) {
+			TAILQ_REMOVE(&env->sc_rekeys, tmp, sa_rekey_entry);
+			tmp->sa_rekeying = 0;
+			continue;
+		}
+		count++;
+		if (sockaddr_cmp((struct sockaddr *)&tmp->sa_peer.addr,
+		    (struct sockaddr *)&sa->sa_peer.addr, -1) == 0)
+			peer++;
+	}
+	if (count >= IKED_REKEY_MAX || peer >= IKED_REKEY_PEER_MAX) {
+		ikestat_inc(env, ikes_rekey_deferred);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+ikev2_rekey_started(struct iked *env, struct iked_sa *sa)
+{
+	time_t		 now = ikev2_init_time();
+
+	sa->sa_lat_rekey = hist_now();
+	if (!sa->sa_rekeying) {
+		TAILQ_INSERT_TAIL(&env->sc_rekeys, sa, sa_rekey_entry);
+		sa->sa_rekeying = 1;
+	}
+
+	ikestat_inc(env, ikes_rekey_started);
+	peerstat_add(env, NULL, sa, IKED_PEERSTAT_REKEY, 1);
+	if (env->sc_rekeysec != now) {
+		env->sc_rekeysec = now;
+		env->sc_rekeysec_count = 0;
+	}
+	if (++env->sc_rekeysec_count > env->sc_stats.ikes_rekey_rate_max)
+		env->sc_stats.ikes_rekey_rate_max = env->sc_rekeysec_count;
+}
+
+void
+ikev2_rekey_done(struct iked *env, struct iked_sa *sa)
+{
+	if (sa->sa_rekeying) {
+		TAILQ_REMOVE(&env->sc_rekeys, sa, sa_rekey_entry);
+		sa->sa_rekeying = 0;
+	}
 }
 
 /* rekey delayed, so re-try after short delay (1% of configured) */
@@ -5279,29 +6574,119 @@ ikev2_ike_sa_alive(struct iked *env, void *arg)
 		ikestat_inc(env, ikes_dpd_sent);
 	}
 
-	/* re-register */
-	timer_add(env, &sa->sa_timer, env->sc_alive_timeout);
+	/* re-register */
+	timer_add(env, &sa->sa_timer, env->sc_alive_timeout);
+}
+
+/*
+ * Schedule NAT-T keepalives for the SA.  Each SA gets a random offset
+ * on the keepalive wheel so that SAs which have been established at
+ * the same time don't send their keepalives in the same tick.
+ */
+void
+ikev2_keepalive_add(struct iked *env, struct iked_sa *sa)
+{
+	struct iked_keepalive_slot	*ks;
+	unsigned int			 slot;
+
+	if (sa->sa_keepalive != NULL)
+		return;
+
+	/* The current slot is due in one second */
+	slot = (env->sc_keepalive_cur + IKED_KEEPALIVE_SLOTS - 1 -
+	    arc4random_uniform(IKED_KEEPALIVE_JITTER)) % IKED_KEEPALIVE_SLOTS;
+	ks = &env->sc_keepalive[slot];
+	TAILQ_INSERT_TAIL(&ks->ks_sas, sa, sa_keepalive_entry);
+	ks->ks_count++;
+	sa->sa_keepalive = ks;
+
+	if (env->sc_keepalive_count++ == 0) {
+		timer_set(env, &env->sc_keepalivetmr,
+		    ikev2_keepalive_tick, NULL);
+		timer_add(env, &env->sc_keepalivetmr, 1);
+	}
+}
+
+void
+ikev2_keepalive_del(struct iked *env, struct iked_sa *sa)
+{
+	struct iked_keepalive_slot	*ks = sa->sa_keepalive;
+
+	if (ks == NULL)
+		return;
+
+	TAILQ_REMOVE(&ks->ks_sas, sa, sa_keepalive_entry);
+	ks->ks_count--;
+	sa->sa_keepalive = NULL;
+
+	if (--env->sc_keepalive_count == 0)
+		timer_del(env, &env->sc_keepalivetmr);
+}
+
+int
+ikev2_keepalive_cmp(const void *a, const void *b)
+{
+	const struct iked_sa	*sa = *(struct iked_sa * const *)a;
+	const struct iked_sa	*sb = *(struct iked_sa * const *)b;
+
+	return (sa->sa_fd < sb->sa_fd ? -1 : sa->sa_fd > sb->sa_fd);
 }
 
+/*
+ * Send the keepalives of the current slot, grouped by socket to
+ * send them with as few system calls as possible.
+ */
 void
-ikev2_ike_sa_keepalive(struct iked *env, void *arg)
+ikev2_keepalive_tick(struct iked *env, void *arg)
 {
-	struct iked_sa			*sa = arg;
+	struct iked_keepalive_slot	*ks;
+	struct iked_sa			*sa, **sas = NULL;
+	struct sockaddr_storage		**to = NULL, **from = NULL;
 	uint8_t				 marker = 0xff;
+	unsigned int			 i, j, n, sent = 0, calls = 0;
 
-	if (sendtofrom(sa->sa_fd, &marker, sizeof(marker), 0,
-	    (struct sockaddr *)&sa->sa_peer.addr, SS_LEN(sa->sa_peer.addr),
-	    (struct sockaddr *)&sa->sa_local.addr, SS_LEN(sa->sa_local.addr))
-	    == -1)
-		log_warn("%s: sendtofrom: peer %s local %s", __func__,
-		    print_addr(&sa->sa_peer.addr),
-		    print_addr(&sa->sa_local.addr));
-	else
-		log_debug("%s: peer %s local %s", __func__,
-		    print_addr(&sa->sa_peer.addr),
-		    print_addr(&sa->sa_local.addr));
-	ikestat_inc(env, ikes_keepalive_sent);
-	timer_add(env, &sa->sa_keepalive, IKED_IKE_SA_KEEPALIVE_TIMEOUT);
+	ks = &env->sc_keepalive[env->sc_keepalive_cur];
+	env->sc_keepalive_cur = (env->sc_keepalive_cur + 1) %
+	    IKED_KEEPALIVE_SLOTS;
+
+	if ((n = ks->ks_count) == 0)
+		goto done;
+
+	if ((sas = reallocarray(NULL, n, sizeof(*sas))) == NULL ||
+	    (to = reallocarray(NULL, n, sizeof(*to))) == NULL ||
+	    (from = reallocarray(NULL, n, sizeof(*from))) == NULL) {
+		log_warn("%s: reallocarray", __func__);
+		goto done;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(sa, &ks->ks_sas, sa_keepalive_entry)
+		sas[i++] = sa;
+	qsort(sas, n, sizeof(*sas), ikev2_keepalive_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && sas[j]->sa_fd == sas[i]->sa_fd; j++) {
+			to[j - i] = &sas[j]->sa_peer.addr;
+			from[j - i] = &sas[j]->sa_local.addr;
+		}
+		sent += sendtofrom_peers(sas[i]->sa_fd, &marker,
+		    sizeof(marker), to, from, j - i, &calls);
+	}
+
+	log_debug("%s: %u of %u keepalives sent with %u system calls",
+	    __func__, sent, n, calls);
+	ikestat_add(env, ikes_keepalive_sent, sent);
+	ikestat_add(env, ikes_keepalive_syscalls, calls);
+	ikestat_inc(env, ikes_keepalive_ticks);
+	if (n > env->sc_stats.ikes_keepalive_tick_max)
+		env->sc_stats.ikes_keepalive_tick_max = n;
+
+ done:
+	free(sas);
+	free(to);
+	free(from);
+	if (env->sc_keepalive_count > 0)
+		timer_add(env, &env->sc_keepalivetmr, 1);
 }
 
 int
@@ -5320,11 +6705,12 @@ ikev2_send_informational(struct iked *env, struct iked_message *msg)
 
 	if ((buf = ikev2_msg_init(env, &resp,
 	    &msg->msg_peer, msg->msg_peerlen,
-	    &msg->msg_local, msg->msg_locallen, 0)) == NULL)
+	    &msg->msg_local, msg->msg_locallen, 0,
+	    IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		goto done;
 
 	/* New encrypted message buffer */
-	if ((e = ibuf_static()) == NULL)
+	if ((e = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		goto done;
 
 	/* NOTIFY payload */
@@ -5496,8 +6882,6 @@ int
 ikev2_sa_negotiate_common(struct iked *env, struct iked_sa *sa,
     struct iked_message *msg, int groupid)
 {
-	struct iked_transform	*xform;
-
 	/* XXX we need a better way to get this */
 	if (proposals_negotiate(&sa->sa_proposals,
 	    &msg->msg_policy->pol_proposals, &msg->msg_proposals, 0, groupid) != 0) {
@@ -5508,6 +6892,18 @@ ikev2_sa_negotiate_common(struct iked *env, struct iked_sa *sa,
 	if (sa_stateok(sa, IKEV2_STATE_SA_INIT))
 		sa_stateflags(sa, IKED_REQ_SA);
 
+	return (ikev2_sa_transforms(sa));
+}
+
+/*
+ * Set up the algorithms of the IKE SA from the negotiated proposal,
+ * or from the one that was kept in a resumption ticket.
+ */
+int
+ikev2_sa_transforms(struct iked_sa *sa)
+{
+	struct iked_transform	*xform;
+
 	if (sa->sa_encr == NULL) {
 		if ((xform = config_findtransform(&sa->sa_proposals,
 		    IKEV2_XFORMTYPE_ENCR, 0)) == NULL) {
@@ -5680,6 +7076,7 @@ ikev2_sa_responder(struct iked *env, struct iked_sa *sa, struct iked_sa *osa,
 		TAILQ_REMOVE(&old->pol_sapeers, sa, sa_peer_entry);
 		TAILQ_INSERT_TAIL(&sa->sa_policy->pol_sapeers,
 		    sa, sa_peer_entry);
+		ikev2_init_enqueue(env, old);
 		policy_unref(env, old);
 		policy_ref(env, sa->sa_policy);
 	}
@@ -5732,7 +7129,8 @@ ikev2_sa_keys(struct iked *env, struct iked_sa *sa, struct ibuf *key)
 	if ((encr = sa->sa_encr) == NULL ||
 	    (prf = sa->sa_prf) == NULL ||
 	    (integr = sa->sa_integr) == NULL ||
-	    (group = sa->sa_dhgroup) == NULL) {
+	    ((group = sa->sa_dhgroup) == NULL && !sa->sa_resumed) ||
+	    (sa->sa_resumed && key == NULL)) {
 		log_info("%s: failed to get key input data",
 		    SPI_SA(sa, __func__));
 		return (-1);
@@ -5773,24 +7171,35 @@ ikev2_sa_keys(struct iked *env, struct iked_sa *sa, struct ibuf *key)
 	 *  is used and PRF is performed on the concatenation of DH
 	 *  exchange result and nonces (g^ir | Ni | Nr).  See sections
 	 *  2.14 and 2.18 of RFC7296 for more information.
+	 *  A resumed SA has no DH exchange, the "key" is the SK_d of
+	 *  the old SA and the "Resumption" string takes the place of
+	 *  g^ir (see section 5.1 of RFC5723).
 	 */
+	if (sa->sa_resumed) {
+		if ((dhsecret = ibuf_new(IKEV2_RESUMPTION,
+		    strlen(IKEV2_RESUMPTION))) == NULL) {
+			log_info("%s: failed to get resumption buffer",
+			    SPI_SA(sa, __func__));
+			goto done;
+		}
+	} else {
+		/*
+		 *  Generate g^ir
+		 */
+		if (dh_create_shared(group, &dhsecret, sa->sa_dhpeer) == -1) {
+			log_info("%s: failed to get dh secret"
+			    " group %d secret %zu exchange %zu",
+			    SPI_SA(sa, __func__),
+			    group->id, ibuf_length(dhsecret),
+			    ibuf_length(sa->sa_dhpeer));
+			goto done;
+		}
 
-	/*
-	 *  Generate g^ir
-	 */
-	if (dh_create_shared(group, &dhsecret, sa->sa_dhpeer) == -1) {
-		log_info("%s: failed to get dh secret"
-		    " group %d secret %zu exchange %zu",
-		    SPI_SA(sa, __func__),
-		    group->id, ibuf_length(dhsecret),
-		    ibuf_length(sa->sa_dhpeer));
-		goto done;
+		log_debug("%s: DHSECRET with %zu bytes", SPI_SA(sa, __func__),
+		    ibuf_size(dhsecret));
+		print_hexbuf(dhsecret);
 	}
 
-	log_debug("%s: DHSECRET with %zu bytes", SPI_SA(sa, __func__),
-	    ibuf_size(dhsecret));
-	print_hexbuf(dhsecret);
-
 	if (!key) {
 		/*
 		 * Set PRF key to generate SKEYSEED = prf(Ni | Nr, g^ir)
@@ -6130,7 +7539,7 @@ ikev2_childsa_delete_proposed(struct iked *env, struct iked_sa *sa,
 	}
 	if (count == 0)
 		return (0);
-	if ((buf = ibuf_static()) == NULL)
+	if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		return (-1);
 	if ((del = ibuf_reserve(buf, sizeof(*del))) == NULL)
 		goto done;
@@ -6158,6 +7567,112 @@ ikev2_childsa_delete_proposed(struct iked *env, struct iked_sa *sa,
 	return (ret);
 }
 
+/*
+ * Add the flows of the policy to the IKE SA, the ones that are already
+ * there are skipped.
+ */
+int
+ikev2_childsa_flows(struct iked_sa *sa, uint8_t saproto)
+{
+	struct iked_flow	*flow, *saflow, *flowa, *flowb;
+	int			 skip;
+
+	RB_FOREACH(flow, iked_flows, &sa->sa_policy->pol_flows) {
+		if ((flowa = calloc(1, sizeof(*flowa))) == NULL) {
+			log_debug("%s: failed to get flow", __func__);
+			return (-1);
+		}
+
+		memcpy(flowa, flow, sizeof(*flow));
+		flowa->flow_dir = IPSP_DIRECTION_OUT;
+		flowa->flow_saproto = saproto;
+		flowa->flow_rdomain = sa->sa_policy->pol_rdomain;
+		flowa->flow_local = &sa->sa_local;
+		flowa->flow_peer = &sa->sa_peer;
+		flowa->flow_ikesa = sa;
+		flowa->flow_transport =
+		    sa->sa_policy->pol_flags & IKED_POLICY_TRANSPORT;
+		if (ikev2_cp_fixflow(sa, flow, flowa) == -1) {
+			flow_free(flowa);
+			continue;
+		}
+
+		skip = 0;
+		TAILQ_FOREACH(saflow, &sa->sa_flows, flow_entry) {
+			if (flow_equal(saflow, flowa)) {
+				skip = 1;
+				break;
+			}
+		}
+		if (skip) {
+			flow_free(flowa);
+			continue;
+		}
+
+		if ((flowb = calloc(1, sizeof(*flowb))) == NULL) {
+			log_debug("%s: failed to get flow", __func__);
+			flow_free(flowa);
+			return (-1);
+		}
+
+		memcpy(flowb, flowa, sizeof(*flow));
+
+		flowb->flow_dir = IPSP_DIRECTION_IN;
+		memcpy(&flowb->flow_src, &flow->flow_dst,
+		    sizeof(flow->flow_dst));
+		memcpy(&flowb->flow_dst, &flow->flow_src,
+		    sizeof(flow->flow_src));
+		if (ikev2_cp_fixflow(sa, flow, flowb) == -1) {
+			flow_free(flowa);
+			flow_free(flowb);
+			continue;
+		}
+
+#if defined(HAVE_LINUX_IPSEC_H)
+		struct iked_flow	*flowc;
+
+		if ((flowc = calloc(1, sizeof(*flowc))) == NULL) {
+			log_debug("%s: failed to get flow", __func__);
+			flow_free(flowa);
+			flow_free(flowb);
+			return (-1);
+		}
+
+		/* Linux is special and requires a FWD flow */
+		memcpy(flowc, flowb, sizeof(*flow));
+		flowc->flow_dir = IPSEC_DIR_FWD;
+
+		TAILQ_INSERT_TAIL(&sa->sa_flows, flowc, flow_entry);
+#endif
+		TAILQ_INSERT_TAIL(&sa->sa_flows, flowa, flow_entry);
+		TAILQ_INSERT_TAIL(&sa->sa_flows, flowb, flow_entry);
+	}
+
+	return (0);
+}
+
+/*
+ * An IKE SA without child SA gets the flows of the policy anyway.  The
+ * kernel sends an ACQUIRE for them on the first packet and the child SA
+ * is created by ikev2_child_sa_acquire().
+ */
+int
+ikev2_childless_flows(struct iked_sa *sa)
+{
+	struct iked_proposal	*prop;
+
+	TAILQ_FOREACH(prop, &sa->sa_policy->pol_proposals, prop_entry) {
+		if (prop->prop_protoid == IKEV2_SAPROTO_ESP ||
+		    prop->prop_protoid == IKEV2_SAPROTO_AH)
+			break;
+	}
+	if (prop == NULL) {
+		log_debug("%s: no child SA proposal", SPI_SA(sa, __func__));
+		return (0);
+	}
+	return (ikev2_childsa_flows(sa, prop->prop_protoid));
+}
+
 int
 ikev2_childsa_negotiate(struct iked *env, struct iked_sa *sa,
     struct iked_kex *kex, struct iked_proposals *proposals, int initiator,
@@ -6167,14 +7682,13 @@ ikev2_childsa_negotiate(struct iked *env, struct iked_sa *sa,
 	struct iked_transform	*xform, *encrxf = NULL, *integrxf = NULL;
 	struct iked_childsa	*csa = NULL, *csb = NULL;
 	struct iked_childsa	*csa2 = NULL, *csb2 = NULL;
-	struct iked_flow	*flow, *saflow, *flowa, *flowb;
 	struct iked_ipcomp	*ic;
 	struct ibuf		*keymat = NULL, *seed = NULL, *dhsecret = NULL;
 	struct dh_group		*group = NULL;
 	uint32_t		 spi = 0;
 	unsigned int		 i;
 	size_t			 ilen = 0;
-	int			 esn, skip, ret = -1;
+	int			 esn, ret = -1;
 
 	if (!sa_stateok(sa, IKEV2_STATE_VALID))
 		return (-1);
@@ -6257,78 +7771,9 @@ ikev2_childsa_negotiate(struct iked *env, struct iked_sa *sa,
 	TAILQ_FOREACH(prop, proposals, prop_entry) {
 		if (ikev2_valid_proposal(prop, NULL, NULL, NULL) != 0)
 			continue;
-
-		RB_FOREACH(flow, iked_flows, &sa->sa_policy->pol_flows) {
-
-			if ((flowa = calloc(1, sizeof(*flowa))) == NULL) {
-				log_debug("%s: failed to get flow", __func__);
-				goto done;
-			}
-
-			memcpy(flowa, flow, sizeof(*flow));
-			flowa->flow_dir = IPSP_DIRECTION_OUT;
-			flowa->flow_saproto = ic ? IKEV2_SAPROTO_IPCOMP :
-			    prop->prop_protoid;
-			flowa->flow_rdomain = sa->sa_policy->pol_rdomain;
-			flowa->flow_local = &sa->sa_local;
-			flowa->flow_peer = &sa->sa_peer;
-			flowa->flow_ikesa = sa;
-			flowa->flow_transport = sa->sa_policy->pol_flags & IKED_POLICY_TRANSPORT;
-			if (ikev2_cp_fixflow(sa, flow, flowa) == -1) {
-				flow_free(flowa);
-				continue;
-			}
-
-			skip = 0;
-			TAILQ_FOREACH(saflow, &sa->sa_flows, flow_entry) {
-				if (flow_equal(saflow, flowa)) {
-					skip = 1;
-					break;
-				}
-			}
-			if (skip) {
-				flow_free(flowa);
-				continue;
-			}
-
-			if ((flowb = calloc(1, sizeof(*flowb))) == NULL) {
-				log_debug("%s: failed to get flow", __func__);
-				flow_free(flowa);
-				goto done;
-			}
-
-			memcpy(flowb, flowa, sizeof(*flow));
-
-			flowb->flow_dir = IPSP_DIRECTION_IN;
-			memcpy(&flowb->flow_src, &flow->flow_dst,
-			    sizeof(flow->flow_dst));
-			memcpy(&flowb->flow_dst, &flow->flow_src,
-			    sizeof(flow->flow_src));
-			if (ikev2_cp_fixflow(sa, flow, flowb) == -1) {
-				flow_free(flowa);
-				flow_free(flowb);
-				continue;
-			}
-
-#if defined(HAVE_LINUX_IPSEC_H)
-			struct iked_flow	*flowc;
-
-			if ((flowc = calloc(1, sizeof(*flowc))) == NULL) {
-				log_debug("%s: failed to get flow", __func__);
-				flow_free(flowa);
-				flow_free(flowb);
-				goto done;
-			}
-
-			/* Linux is special and requires a FWD flow */
-			memcpy(flowc, flowb, sizeof(*flow));
-			flowc->flow_dir = IPSEC_DIR_FWD;
-
-			TAILQ_INSERT_TAIL(&sa->sa_flows, flowc, flow_entry);
-#endif
-			TAILQ_INSERT_TAIL(&sa->sa_flows, flowa, flow_entry);
-			TAILQ_INSERT_TAIL(&sa->sa_flows, flowb, flow_entry);
-		}
+		if (ikev2_childsa_flows(sa, ic ? IKEV2_SAPROTO_IPCOMP :
+		    prop->prop_protoid) == -1)
+			goto done;
 	}
 
 	/* create the CHILD SAs using the key material */
@@ -6505,6 +7950,8 @@ ikev2_childsa_negotiate(struct iked *env, struct iked_sa *sa,
 int
 ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 {
+	struct ipsec_batch	 batch;
+	struct ipsec_batch_op	*op;
 	struct iked_childsa	*csa, *ocsa, *ipcomp;
 	struct iked_flow	*flow, *oflow;
 	int			 peer_changed, reload;
@@ -6516,6 +7963,8 @@ ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 	int			 esn = 0;
 	int			 ret = -1;
 
+	ipsec_batch_init(&batch);
+
 	spif = open_memstream(&spibuf, &spisz);
 	if (spif == NULL) {
 		log_warn("%s", __func__);
@@ -6540,20 +7989,45 @@ ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 			continue;
 		}
 
-		if (ipsec_sa_add(env, csa, NULL) != 0) {
-			log_debug("%s: failed to load CHILD SA spi %s",
-			    __func__, print_spi(csa->csa_spi.spi,
-			    csa->csa_spi.spi_size));
+		if (ipsec_batch_sa_add(&batch, csa, NULL) != 0 ||
+		    (ipcomp && ipsec_batch_sa_add(&batch, ipcomp, csa) != 0))
 			goto done;
-		}
-		if (ipcomp) {
-			if (ipsec_sa_add(env, ipcomp, csa) != 0) {
-				log_debug("%s: failed to load IPCOMP spi %s",
-				    __func__, print_spi(ipcomp->csa_spi.spi,
-				    ipcomp->csa_spi.spi_size));
-				ipcomp = NULL;
+	}
+
+	peer_changed = (memcmp(&sa->sa_peer_loaded, &sa->sa_peer,
+	    sizeof(sa->sa_peer_loaded)) != 0);
+	/* flows loaded before are re-loaded if the peer has changed */
+	reload = peer_changed &&
+	    sa->sa_peer_loaded.addr.ss_family != AF_UNSPEC;
+
+	if (!(sa->sa_policy->pol_flags & IKED_POLICY_ROUTING)) {
+		TAILQ_FOREACH(flow, &sa->sa_flows, flow_entry) {
+			if (flow->flow_loaded) {
+				if (!peer_changed) {
+					log_debug("%s: flow already loaded %p",
+					    __func__, flow);
+					continue;
+				}
+				RB_REMOVE(iked_flows, &env->sc_activeflows, flow);
+				ikestat_dec(env, ikes_flow_active);
+				(void)ipsec_flow_delete(env, flow);
+				flow->flow_loaded = 0; /* we did RB_REMOVE */
 			}
+
+			if (ipsec_batch_flow_add(&batch, flow) != 0)
+				goto done;
 		}
+	}
+
+	if (ipsec_batch_commit(env, &batch) != 0) {
+		log_debug("%s: failed to load CHILD SAs and flows", __func__);
+		goto done;
+	}
+
+	TAILQ_FOREACH(op, &batch, bo_entry) {
+		if ((csa = op->bo_sa) == NULL || op->bo_last != NULL)
+			continue;
+		ipcomp = csa->csa_bundled;
 
 		if ((ocsa = RB_FIND(iked_activesas, &env->sc_activesas, csa))
 		    != NULL) {
@@ -6563,9 +8037,11 @@ ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 			ocsa->csa_loaded = 0;
 			ocsa->csa_rekey = 1;	/* prevent re-loading */
 			RB_REMOVE(iked_activesas, &env->sc_activesas, ocsa);
+			ikestat_dec(env, ikes_csa_active);
 		}
 
 		RB_INSERT(iked_activesas, &env->sc_activesas, csa);
+		ikestat_inc(env, ikes_csa_active);
 
 		log_debug("%s: loaded CHILD SA spi %s", __func__,
 		    print_spi(csa->csa_spi.spi, csa->csa_spi.spi_size));
@@ -6596,68 +8072,49 @@ ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 		}
 	}
 
-	peer_changed = (memcmp(&sa->sa_peer_loaded, &sa->sa_peer,
-	    sizeof(sa->sa_peer_loaded)) != 0);
-
-	if (!(sa->sa_policy->pol_flags & IKED_POLICY_ROUTING)) {
-		TAILQ_FOREACH(flow, &sa->sa_flows, flow_entry) {
-			/* re-load the flow if the peer for the flow has changed */
-			reload = 0;
-			if (flow->flow_loaded) {
-				if (!peer_changed) {
-					log_debug("%s: flow already loaded %p",
-					    __func__, flow);
-					continue;
-				}
-				RB_REMOVE(iked_flows, &env->sc_activeflows, flow);
-				(void)ipsec_flow_delete(env, flow);
-				flow->flow_loaded = 0; /* we did RB_REMOVE */
-				reload = 1;
-			}
-
-			if (ipsec_flow_add(env, flow) != 0) {
-				log_debug("%s: failed to load flow", __func__);
-				goto done;
-			}
+	TAILQ_FOREACH(op, &batch, bo_entry) {
+		if ((flow = op->bo_flow) == NULL)
+			continue;
 
-			if ((oflow = RB_FIND(iked_flows, &env->sc_activeflows, flow))
-			    != NULL) {
-				log_debug("%s: replaced old flow %p with %p",
-				    __func__, oflow, flow);
-				oflow->flow_loaded = 0;
-				RB_REMOVE(iked_flows, &env->sc_activeflows, oflow);
-			}
+		if ((oflow = RB_FIND(iked_flows, &env->sc_activeflows, flow))
+		    != NULL) {
+			log_debug("%s: replaced old flow %p with %p",
+			    __func__, oflow, flow);
+			oflow->flow_loaded = 0;
+			RB_REMOVE(iked_flows, &env->sc_activeflows, oflow);
+			ikestat_dec(env, ikes_flow_active);
+		}
 
-			RB_INSERT(iked_flows, &env->sc_activeflows, flow);
+		RB_INSERT(iked_flows, &env->sc_activeflows, flow);
+		ikestat_inc(env, ikes_flow_active);
 
-			log_debug("%s: %sloaded flow %p", __func__,
-			    reload ? "re" : "", flow);
+		log_debug("%s: %sloaded flow %p", __func__,
+		    reload ? "re" : "", flow);
 
-			/* append flow to log buffer */
-			if (flow->flow_dir == IPSP_DIRECTION_OUT &&
-			    flow->flow_prenat.addr_af != 0)
-				snprintf(prenat_mask, sizeof(prenat_mask), "%d",
-				    flow->flow_prenat.addr_mask);
-			else
-				prenat_mask[0] = '\0';
-			if (flow->flow_dir == IPSP_DIRECTION_OUT) {
-				if (ftello(flowf) > 0)
-					fputs(", ", flowf);
-				fprintf(flowf, "%s-%s/%d%s%s%s%s%s=%s/%d(%u)%s",
-				    print_map(flow->flow_saproto, ikev2_saproto_map),
-				    print_addr(&flow->flow_src.addr),
-				    flow->flow_src.addr_mask,
-				    flow->flow_prenat.addr_af != 0 ? "[": "",
-				    flow->flow_prenat.addr_af != 0 ?
-				    print_addr(&flow->flow_prenat.addr) : "",
-				    flow->flow_prenat.addr_af != 0 ? "/" : "",
-				    flow->flow_prenat.addr_af != 0 ? prenat_mask : "",
-				    flow->flow_prenat.addr_af != 0 ? "]": "",
-				    print_addr(&flow->flow_dst.addr),
-				    flow->flow_dst.addr_mask,
-				    flow->flow_ipproto,
-				    reload ? "-R" : "");
-			}
+		/* append flow to log buffer */
+		if (flow->flow_dir == IPSP_DIRECTION_OUT &&
+		    flow->flow_prenat.addr_af != 0)
+			snprintf(prenat_mask, sizeof(prenat_mask), "%d",
+			    flow->flow_prenat.addr_mask);
+		else
+			prenat_mask[0] = '\0';
+		if (flow->flow_dir == IPSP_DIRECTION_OUT) {
+			if (ftello(flowf) > 0)
+				fputs(", ", flowf);
+			fprintf(flowf, "%s-%s/%d%s%s%s%s%s=%s/%d(%u)%s",
+			    print_map(flow->flow_saproto, ikev2_saproto_map),
+			    print_addr(&flow->flow_src.addr),
+			    flow->flow_src.addr_mask,
+			    flow->flow_prenat.addr_af != 0 ? "[": "",
+			    flow->flow_prenat.addr_af != 0 ?
+			    print_addr(&flow->flow_prenat.addr) : "",
+			    flow->flow_prenat.addr_af != 0 ? "/" : "",
+			    flow->flow_prenat.addr_af != 0 ? prenat_mask : "",
+			    flow->flow_prenat.addr_af != 0 ? "]": "",
+			    print_addr(&flow->flow_dst.addr),
+			    flow->flow_dst.addr_mask,
+			    flow->flow_ipproto,
+			    reload ? "-R" : "");
 		}
 	}
 
@@ -6687,6 +8144,7 @@ ikev2_childsa_enable(struct iked *env, struct iked_sa *sa)
 
 	ret = 0;
  done:
+	ipsec_batch_clear(&batch);
 	fclose(spif);
 	fclose(flowf);
 	free(spibuf);
@@ -6709,8 +8167,10 @@ ikev2_childsa_delete(struct iked *env, struct iked_sa *sa, uint8_t saproto,
 		    (cleanup && csa->csa_loaded))
 			continue;
 
-		if (csa->csa_loaded)
+		if (csa->csa_loaded) {
 			RB_REMOVE(iked_activesas, &env->sc_activesas, csa);
+			ikestat_dec(env, ikes_csa_active);
+		}
 
 		if (ipsec_sa_delete(env, csa) != 0)
 			log_info("%s: failed to delete CHILD SA spi %s",
@@ -6850,6 +8310,8 @@ ikev2_child_sa_acquire(struct iked *env, struct iked_flow *acquire)
 		    flow->flow_saproto, 0) != 0)
 			log_warnx("%s: failed to initiate a "
 			    "CREATE_CHILD_SA exchange", SPI_SA(sa, __func__));
+		else if (sa->sa_nochild)
+			ikestat_inc(env, ikes_childless_acquire);
 	}
 	return (0);
 }
@@ -6901,11 +8363,19 @@ ikev2_child_sa_rekey(struct iked *env, struct iked_spi *rekey)
 		    print_spi(rekey->spi, rekey->spi_size));
 		return (-1);	/* peer is busy, retry later */
 	}
+	if (ikev2_rekey_admit(env, sa) == -1) {
+		log_debug("%s: too many rekeys, retrying, SPI %s",
+		    SPI_SA(sa, __func__), print_spi(rekey->spi,
+		    rekey->spi_size));
+		return (-1);	/* retry later */
+	}
 	if (csa->csa_allocated)	/* Peer SPI died first, get the local one */
 		rekey->spi = csa->csa_peerspi;
 	if (ikev2_send_create_child_sa(env, sa, rekey, rekey->spi_protoid, 0))
 		log_warnx("%s: failed to initiate a CREATE_CHILD_SA exchange",
 		    SPI_SA(sa, __func__));
+	else
+		ikev2_rekey_started(env, sa);
 	return (0);
 }
 
@@ -6932,6 +8402,7 @@ ikev2_child_sa_drop(struct iked *env, struct iked_spi *drop)
 	}
 
 	RB_REMOVE(iked_activesas, &env->sc_activesas, csa);
+	ikestat_dec(env, ikes_csa_active);
 	csa->csa_loaded = 0;
 	csa->csa_rekey = 1;	/* prevent re-loading */
 	if (sa == NULL) {
@@ -6951,7 +8422,7 @@ ikev2_child_sa_drop(struct iked *env, struct iked_spi *drop)
 
 	/* Send PAYLOAD_DELETE */
 
-	if ((buf = ibuf_static()) == NULL)
+	if ((buf = ikev2_msg_buf(IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
 		return (0);
 	if ((del = ibuf_reserve(buf, sizeof(*del))) == NULL)
 		goto done;
@@ -7452,6 +8923,7 @@ ikev2_update_sa_addresses(struct iked *env, struct iked_sa *sa)
 	struct iked_flow		*flow, *oflow;
 	struct iked_message		*msg;
 	struct iked_msg_retransmit	*mr;
+	unsigned int			 i;
 
 	if (!sa_stateok(sa, IKEV2_STATE_ESTABLISHED))
 		return -1;
@@ -7476,6 +8948,7 @@ ikev2_update_sa_addresses(struct iked *env, struct iked_sa *sa)
 	TAILQ_FOREACH(flow, &sa->sa_flows, flow_entry) {
 		if (flow->flow_loaded) {
 			RB_REMOVE(iked_flows, &env->sc_activeflows, flow);
+			ikestat_dec(env, ikes_flow_active);
 			(void)ipsec_flow_delete(env, flow);
 			flow->flow_loaded = 0;
 		}
@@ -7489,20 +8962,20 @@ ikev2_update_sa_addresses(struct iked *env, struct iked_sa *sa)
 			    __func__, oflow, flow);
 			oflow->flow_loaded = 0;
 			RB_REMOVE(iked_flows, &env->sc_activeflows, oflow);
+			ikestat_dec(env, ikes_flow_active);
 		}
 		RB_INSERT(iked_flows, &env->sc_activeflows, flow);
+		ikestat_inc(env, ikes_flow_active);
 	}
 
 	/* update pending requests and responses */
-	TAILQ_FOREACH(mr, &sa->sa_requests, mrt_entry) {
-		TAILQ_FOREACH(msg, &mr->mrt_frags, msg_entry) {
-			msg->msg_local = sa->sa_local.addr;
-			msg->msg_locallen = SS_LEN(sa->sa_local.addr);
-			msg->msg_peer = sa->sa_peer.addr;
-			msg->msg_peerlen = SS_LEN(sa->sa_peer.addr);
-		}
-	}
-	TAILQ_FOREACH(mr, &sa->sa_responses, mrt_entry) {
+	for (i = 0; i < IKED_MSGQUEUE_WINDOW * 2; i++) {
+		if (i < IKED_MSGQUEUE_WINDOW)
+			mr = sa->sa_requests.mq_slot[i];
+		else
+			mr = sa->sa_responses.mq_slot[i - IKED_MSGQUEUE_WINDOW];
+		if (mr == NULL)
+			continue;
 		TAILQ_FOREACH(msg, &mr->mrt_frags, msg_entry) {
 			msg->msg_local = sa->sa_local.addr;
 			msg->msg_locallen = SS_LEN(sa->sa_local.addr);
@@ -7518,165 +8991,116 @@ ikev2_update_sa_addresses(struct iked *env, struct iked_sa *sa)
 }
 
 void
-ikev2_info_sa(struct iked *env, struct imsg *imsg, int dolog, const char *msg,
+ikev2_ctl_info_sa(struct iked *env, struct ikev2_sawalk *sw,
     struct iked_sa *sa)
 {
-	char		 idstr[IKED_ID_SIZE];
-	char		*buf;
-	int		 buflen;
+	struct iked_ctl_sa	 cs;
+	struct iked_childsa	*csa;
+	struct iked_flow	*flow;
+	struct iovec		 iov[3];
+	char			 idstr[IKED_ID_SIZE];
+	char			 nopol[1] = "", *pol;
 
 	if (ikev2_print_id(IKESA_DSTID(sa), idstr, sizeof(idstr)) == -1)
 		bzero(idstr, sizeof(idstr));
-
-	buflen = asprintf(&buf,
-	    "%s: %p rspi %s ispi %s %s->%s<%s>[%s] %s %c%s%s nexti %p pol %p\n",
-	    msg, sa,
-	    print_spi(sa->sa_hdr.sh_rspi, 8),
-	    print_spi(sa->sa_hdr.sh_ispi, 8),
-	    print_addr(&sa->sa_local.addr),
-	    print_addr(&sa->sa_peer.addr),
-	    idstr,
-	    sa->sa_addrpool ? print_addr(&sa->sa_addrpool->addr) : "",
-	    print_map(sa->sa_state, ikev2_state_map),
-	    sa->sa_hdr.sh_initiator ? 'i' : 'r',
-	    sa->sa_natt ? " natt" : "",
-	    sa->sa_udpencap ? " udpecap" : "",
-	    sa->sa_nexti, sa->sa_policy);
-
-	if (buflen == -1 || buf == NULL)
+	pol = sa->sa_policy ? sa->sa_policy->pol_name : nopol;
+
+	bzero(&cs, sizeof(cs));
+	cs.cs_ispi = sa->sa_hdr.sh_ispi;
+	cs.cs_rspi = sa->sa_hdr.sh_rspi;
+	ctl_addr_pack(&cs.cs_local, (struct sockaddr *)&sa->sa_local.addr,
+	    sa->sa_local.addr_mask);
+	ctl_addr_pack(&cs.cs_peer, (struct sockaddr *)&sa->sa_peer.addr,
+	    sa->sa_peer.addr_mask);
+	if (sa->sa_addrpool)
+		ctl_addr_pack(&cs.cs_addrpool,
+		    (struct sockaddr *)&sa->sa_addrpool->addr,
+		    sa->sa_addrpool->addr_mask);
+	cs.cs_state = sa->sa_state;
+	if (sa->sa_hdr.sh_initiator)
+		cs.cs_flags |= IKED_CTL_SA_INITIATOR;
+	if (sa->sa_natt)
+		cs.cs_flags |= IKED_CTL_SA_NATT;
+	if (sa->sa_udpencap)
+		cs.cs_flags |= IKED_CTL_SA_UDPENCAP;
+	cs.cs_idlen = strlen(idstr) + 1;
+	cs.cs_policylen = strlen(pol) + 1;
+
+	iov[0].iov_base = &cs;
+	iov[0].iov_len = sizeof(cs);
+	iov[1].iov_base = idstr;
+	iov[1].iov_len = cs.cs_idlen;
+	iov[2].iov_base = pol;
+	iov[2].iov_len = cs.cs_policylen;
+	if (ikev2_ctl_rec(env, sw, IKED_CTL_REC_SA, iov, 3) == -1)
 		return;
 
-	if (dolog) {
-		if (buflen > 1)
-			buf[buflen - 1] = '\0';
-		log_debug("%s", buf);
-	} else
-		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
-		    IMSG_CTL_SHOW_SA, imsg->hdr.peerid, -1,
-		    buf, buflen + 1);
-	free(buf);
+	TAILQ_FOREACH(csa, &sa->sa_childsas, csa_entry) {
+		ikev2_ctl_info_csa(env, sw, csa, 0);
+		if (csa->csa_bundled != NULL)
+			ikev2_ctl_info_csa(env, sw, csa->csa_bundled, 1);
+	}
+	TAILQ_FOREACH(flow, &sa->sa_flows, flow_entry)
+		ikev2_ctl_info_flow(env, sw, flow);
 }
 
 void
-ikev2_info_csa(struct iked *env, struct imsg *imsg, int dolog, const char *msg,
-    struct iked_childsa *csa)
-{
-	char		*buf;
-	int		 buflen;
-
-	buflen = asprintf(&buf,
-	    "%s: %p %s %s %s %s -> %s (%s%s%s%s) B=%p P=%p @%p\n", msg, csa,
-	    print_map(csa->csa_saproto, ikev2_saproto_map),
-	    print_spi(csa->csa_spi.spi, csa->csa_spi.spi_size),
-	    csa->csa_dir == IPSP_DIRECTION_IN ? "in" : "out",
-	    print_addr(&csa->csa_local->addr),
-	    print_addr(&csa->csa_peer->addr),
-	    csa->csa_loaded ? "L" : "",
-	    csa->csa_rekey ? "R" : "",
-	    csa->csa_allocated ? "A" : "",
-	    csa->csa_persistent ? "P" : "",
-	    csa->csa_bundled,
-	    csa->csa_peersa,
-	    csa->csa_ikesa);
-
-	if (buflen == -1 || buf == NULL)
-		return;
-
-	if (dolog) {
-		if (buflen > 1)
-			buf[buflen - 1] = '\0';
-		log_debug("%s", buf);
-	} else
-		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
-		    IMSG_CTL_SHOW_SA, imsg->hdr.peerid, -1,
-		    buf, buflen + 1);
-	free(buf);
+ikev2_ctl_info_csa(struct iked *env, struct ikev2_sawalk *sw,
+    struct iked_childsa *csa, int bundled)
+{
+	struct iked_ctl_childsa	 cc;
+	struct iovec		 iov;
+
+	bzero(&cc, sizeof(cc));
+	cc.cc_spi = csa->csa_spi.spi;
+	cc.cc_spisize = csa->csa_spi.spi_size;
+	cc.cc_saproto = csa->csa_saproto;
+	cc.cc_dir = csa->csa_dir;
+	ctl_addr_pack(&cc.cc_local, (struct sockaddr *)&csa->csa_local->addr,
+	    csa->csa_local->addr_mask);
+	ctl_addr_pack(&cc.cc_peer, (struct sockaddr *)&csa->csa_peer->addr,
+	    csa->csa_peer->addr_mask);
+	if (csa->csa_loaded)
+		cc.cc_flags |= IKED_CTL_CSA_LOADED;
+	if (csa->csa_rekey)
+		cc.cc_flags |= IKED_CTL_CSA_REKEY;
+	if (csa->csa_allocated)
+		cc.cc_flags |= IKED_CTL_CSA_ALLOCATED;
+	if (csa->csa_persistent)
+		cc.cc_flags |= IKED_CTL_CSA_PERSISTENT;
+	if (bundled)
+		cc.cc_flags |= IKED_CTL_CSA_BUNDLED;
+
+	iov.iov_base = &cc;
+	iov.iov_len = sizeof(cc);
+	ikev2_ctl_rec(env, sw, IKED_CTL_REC_CHILDSA, &iov, 1);
 }
 
 void
-ikev2_info_flow(struct iked *env, struct imsg *imsg, int dolog, const char *msg,
+ikev2_ctl_info_flow(struct iked *env, struct ikev2_sawalk *sw,
     struct iked_flow *flow)
 {
-	char		prenat_mask[10];
-	char		*buf;
-	int		buflen;
-
+	struct iked_ctl_flow	 cf;
+	struct iovec		 iov;
+
+	bzero(&cf, sizeof(cf));
+	ctl_addr_pack(&cf.cf_src, (struct sockaddr *)&flow->flow_src.addr,
+	    flow->flow_src.addr_mask);
+	ctl_addr_pack(&cf.cf_dst, (struct sockaddr *)&flow->flow_dst.addr,
+	    flow->flow_dst.addr_mask);
 	if (flow->flow_prenat.addr_af != 0)
-		snprintf(prenat_mask, sizeof(prenat_mask), "%d",
+		ctl_addr_pack(&cf.cf_prenat,
+		    (struct sockaddr *)&flow->flow_prenat.addr,
 		    flow->flow_prenat.addr_mask);
-	else
-		prenat_mask[0] = '\0';
-
-	buflen = asprintf(&buf,
-	    "%s: %p %s %s %s/%d -> %s/%d %s%s%s%s%s[%u]@%d (%s) @%p\n", msg, flow,
-	    print_map(flow->flow_saproto, ikev2_saproto_map),
-	    flow->flow_dir == IPSP_DIRECTION_IN ? "in" : "out",
-	    print_addr(&flow->flow_src.addr),
-	    flow->flow_src.addr_mask,
-	    print_addr(&flow->flow_dst.addr),
-	    flow->flow_dst.addr_mask,
-	    flow->flow_prenat.addr_af != 0 ? "[": "",
-	    flow->flow_prenat.addr_af != 0 ?
-	    print_addr(&flow->flow_prenat.addr) : "",
-	    flow->flow_prenat.addr_af != 0 ? "/" : "",
-	    flow->flow_prenat.addr_af != 0 ? prenat_mask : "",
-	    flow->flow_prenat.addr_af != 0 ? "] ": "",
-	    flow->flow_ipproto,
-	    flow->flow_rdomain,
-	    flow->flow_loaded ? "L" : "",
-	    flow->flow_ikesa);
-
-	if (buflen == -1 || buf == NULL)
-		return;
-
-	if (dolog) {
-		if (buflen > 1)
-			buf[buflen - 1] = '\0';
-		log_debug("%s", buf);
-	} else
-		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
-		    IMSG_CTL_SHOW_SA, imsg->hdr.peerid, -1,
-		    buf, buflen + 1);
-	free(buf);
-}
-
-void
-ikev2_info(struct iked *env, struct imsg *imsg, int dolog)
-{
-	struct iked_sa			*sa;
-	struct iked_childsa		*csa, *ipcomp;
-	struct iked_flow		*flow;
-
-	log_debug("%s: called", __func__);
-
-	RB_FOREACH(sa, iked_sas, &env->sc_sas) {
-		ikev2_info_sa(env, imsg, dolog, "iked_sas", sa);
-		TAILQ_FOREACH(csa, &sa->sa_childsas, csa_entry) {
-			ikev2_info_csa(env, imsg, dolog, "  sa_childsas", csa);
-			if ((ipcomp = csa->csa_bundled) != NULL)
-				ikev2_info_csa(env, imsg, dolog, "             ",
-				    ipcomp);
-		}
-		TAILQ_FOREACH(flow, &sa->sa_flows, flow_entry) {
-			ikev2_info_flow(env, imsg, dolog, "  sa_flows", flow);
-		}
-	}
-	RB_FOREACH(csa, iked_activesas, &env->sc_activesas) {
-		ikev2_info_csa(env, imsg, dolog, "iked_activesas", csa);
-		if ((ipcomp = csa->csa_bundled) != NULL)
-			ikev2_info_csa(env, imsg, dolog, "              ", ipcomp);
-	}
-	RB_FOREACH(flow, iked_flows, &env->sc_activeflows) {
-		ikev2_info_flow(env, imsg, dolog, "iked_flows", flow);
-	}
-	RB_FOREACH(sa, iked_dstid_sas, &env->sc_dstid_sas) {
-		ikev2_info_sa(env, imsg, dolog, "iked_dstid_sas", sa);
-	}
-	if (dolog)
-		return;
-	/* Send empty reply to indicate end of information. */
-	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_SHOW_SA,
-	    imsg->hdr.peerid, -1, NULL, 0);
+	cf.cf_rdomain = flow->flow_rdomain;
+	cf.cf_saproto = flow->flow_saproto;
+	cf.cf_dir = flow->flow_dir;
+	cf.cf_ipproto = flow->flow_ipproto;
+	cf.cf_loaded = flow->flow_loaded;
+
+	iov.iov_base = &cf;
+	iov.iov_len = sizeof(cf);
+	ikev2_ctl_rec(env, sw, IKED_CTL_REC_FLOW, &iov, 1);
 }
 
 const char *
@@ -7718,6 +9142,7 @@ ikev2_log_established(struct iked_sa *sa)
 	    sa->sa_encr->encr_authid ? "" : " auth ",
 	    sa->sa_encr->encr_authid ? "" : print_xf(sa->sa_integr->hash_id,
 	    hash_keylength(sa->sa_integr), authxfs),
+	    sa->sa_dhgroup == NULL ? "none (resumed)" :
 	    print_xf(sa->sa_dhgroup->id, 0, groupxfs),
 	    print_xf(sa->sa_prf->hash_id, hash_keylength(sa->sa_prf), prfxfs));
 }
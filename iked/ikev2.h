@@ -26,6 +26,7 @@
 #define IKEV1_VERSION		0x10	/* IKE version 1.0 */
 
 #define IKEV2_KEYPAD		"Key Pad for IKEv2"	/* don't change! */
+#define IKEV2_RESUMPTION	"Resumption"		/* RFC 5723 */
 
 /*
  * IKEv2 pseudo states
@@ -373,6 +374,11 @@ struct ikev2_notify {
 
 extern struct iked_constmap ikev2_n_map[];
 
+/* New Gateway Identity of REDIRECT and REDIRECTED_FROM (RFC5685) */
+#define IKEV2_GW_IPV4				1
+#define IKEV2_GW_IPV6				2
+#define IKEV2_GW_FQDN				3
+
 /*
  * DELETE payload
  */
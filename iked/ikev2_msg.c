@@ -39,6 +39,7 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_MSG
 #include "iked.h"
 #include "ikev2.h"
 #include "eap.h"
@@ -46,7 +47,14 @@
 
 void	 ikev1_recv(struct iked *, struct iked_message *);
 void	 ikev2_msg_response_timeout(struct iked *, void *);
+void	 ikev2_msg_response_trim(struct iked *, struct iked_msg_retransmit *);
 void	 ikev2_msg_retransmit_timeout(struct iked *, void *);
+int	 ikev2_msg_prepare_send(struct iked *, struct iked_message *,
+	    uint8_t *, uint8_t *);
+struct iked_msg_retransmit *
+	 ikev2_msg_store(struct iked *, struct iked_message *, uint8_t,
+	    uint8_t);
+void	 ikev2_msg_send_failed(struct iked *, struct iked_sa *);
 int	 ikev2_check_frag_oversize(struct iked_sa *, struct ibuf *);
 int	 ikev2_send_encrypted_fragments(struct iked *, struct iked_sa *,
 	    struct ibuf *, uint8_t, uint8_t, int);
@@ -137,7 +145,8 @@ ikev1_recv(struct iked *env, struct iked_message *msg)
 struct ibuf *
 ikev2_msg_init(struct iked *env, struct iked_message *msg,
     struct sockaddr_storage *peer, socklen_t peerlen,
-    struct sockaddr_storage *local, socklen_t locallen, int response)
+    struct sockaddr_storage *local, socklen_t locallen, int response,
+    uint8_t exchange)
 {
 	bzero(msg, sizeof(*msg));
 	memcpy(&msg->msg_peer, peer, peerlen);
@@ -146,7 +155,7 @@ ikev2_msg_init(struct iked *env, struct iked_message *msg,
 	msg->msg_locallen = locallen;
 	msg->msg_response = response ? 1 : 0;
 	msg->msg_fd = -1;
-	msg->msg_data = ibuf_static();
+	msg->msg_data = ikev2_msg_buf(exchange);
 	msg->msg_e = 0;
 	msg->msg_parent = msg;	/* has to be set */
 	TAILQ_INIT(&msg->msg_proposals);
@@ -154,37 +163,172 @@ ikev2_msg_init(struct iked *env, struct iked_message *msg,
 	return (msg->msg_data);
 }
 
+/*
+ * New buffer for building a message or an encrypted payload of the
+ * exchange, sized so that the common cases do not have to grow it.
+ */
+struct ibuf *
+ikev2_msg_buf(uint8_t exchange)
+{
+	switch (exchange) {
+	case IKEV2_EXCHANGE_IKE_SA_INIT:
+	case IKEV2_EXCHANGE_IKE_AUTH:
+		return (ibuf_message(2048));
+	case IKEV2_EXCHANGE_CREATE_CHILD_SA:
+		return (ibuf_message(1024));
+	default:
+		return (ibuf_message(256));
+	}
+}
+
+/*
+ * Create a retransmit copy of a sent message.  The encoded datagram is
+ * not copied but shared with the original message.
+ */
 struct iked_message *
 ikev2_msg_copy(struct iked *env, struct iked_message *msg)
 {
 	struct iked_message		*m = NULL;
-	struct ibuf			*buf;
-	size_t				 len;
-	void				*ptr;
+	struct iked_wirebuf		*wb;
 
 	if (ibuf_size(msg->msg_data) < msg->msg_offset)
 		return (NULL);
-	len = ibuf_size(msg->msg_data) - msg->msg_offset;
 
-	if ((m = malloc(sizeof(*m))) == NULL)
+	if ((wb = ikev2_msg_wire(msg)) == NULL)
 		return (NULL);
 
-	if ((ptr = ibuf_seek(msg->msg_data, msg->msg_offset, len)) == NULL ||
-	    (buf = ikev2_msg_init(env, m, &msg->msg_peer, msg->msg_peerlen,
-	     &msg->msg_local, msg->msg_locallen, msg->msg_response)) == NULL ||
-	    ibuf_add(buf, ptr, len)) {
-		free(m);
+	if ((m = calloc(1, sizeof(*m))) == NULL)
 		return (NULL);
-	}
+
+	memcpy(&m->msg_peer, &msg->msg_peer, msg->msg_peerlen);
+	m->msg_peerlen = msg->msg_peerlen;
+	memcpy(&m->msg_local, &msg->msg_local, msg->msg_locallen);
+	m->msg_locallen = msg->msg_locallen;
+	m->msg_response = msg->msg_response;
+	m->msg_parent = m;
+	TAILQ_INIT(&m->msg_proposals);
+	SIMPLEQ_INIT(&m->msg_certreqs);
+
+	wb->wb_refcnt++;
+	m->msg_wire = wb;
+	m->msg_data = wb->wb_buf;
 
 	m->msg_fd = msg->msg_fd;
 	m->msg_msgid = msg->msg_msgid;
 	m->msg_offset = msg->msg_offset;
 	m->msg_sa = msg->msg_sa;
+	m->msg_natt = msg->msg_natt;
 
 	return (m);
 }
 
+/*
+ * Turn the message data into a shared wire buffer that is owned by
+ * the message.
+ */
+struct iked_wirebuf *
+ikev2_msg_wire(struct iked_message *msg)
+{
+	struct iked_wirebuf		*wb;
+
+	if ((wb = msg->msg_wire) != NULL)
+		return (wb);
+	if (msg->msg_data == NULL)
+		return (NULL);
+
+	if ((wb = calloc(1, sizeof(*wb))) == NULL)
+		return (NULL);
+	wb->wb_buf = msg->msg_data;
+	wb->wb_refcnt = 1;
+	msg->msg_wire = wb;
+
+	return (wb);
+}
+
+void
+ikev2_msg_wire_unref(struct iked_wirebuf *wb)
+{
+	if (wb == NULL || --wb->wb_refcnt > 0)
+		return;
+	ibuf_free(wb->wb_buf);
+	free(wb);
+}
+
+/*
+ * Send the encoded message.  The NAT-T non-ESP marker is prepended
+ * with a separate iovec to avoid copying the message.
+ */
+ssize_t
+ikev2_msg_sendtofrom(struct iked_message *msg)
+{
+	uint32_t		 natt = 0x00000000;
+	struct iovec		 iov[2];
+	int			 iovcnt = 0;
+
+	if (msg->msg_natt) {
+		iov[iovcnt].iov_base = &natt;
+		iov[iovcnt].iov_len = sizeof(natt);
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = (uint8_t *)ibuf_data(msg->msg_data) +
+	    msg->msg_offset;
+	iov[iovcnt].iov_len = ibuf_size(msg->msg_data) - msg->msg_offset;
+	iovcnt++;
+
+	return (sendtofromv(msg->msg_fd, iov, iovcnt, 0,
+	    (struct sockaddr *)&msg->msg_peer, msg->msg_peerlen,
+	    (struct sockaddr *)&msg->msg_local, msg->msg_locallen));
+}
+
+/*
+ * Send all datagrams of a queued message, i.e. all of its fragments,
+ * with as few system calls as possible.  They share the socket and
+ * the addresses of the first one.
+ */
+int
+ikev2_msg_sendqueue(struct iked *env, struct iked_msg_fragqueue *frags)
+{
+	uint32_t		 natt = 0x00000000;
+	struct iked_message	*msg, *first = TAILQ_FIRST(frags);
+	struct iovec		*iov;
+	unsigned int		 n = 0;
+	size_t			 len = 0;
+	int			 iovcnt, i = 0, ret;
+
+	if (first == NULL)
+		return (0);
+
+	TAILQ_FOREACH(msg, frags, msg_entry)
+		n++;
+	iovcnt = first->msg_natt ? 2 : 1;
+	if ((iov = reallocarray(NULL, n, iovcnt * sizeof(*iov))) == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(msg, frags, msg_entry) {
+		if (first->msg_natt) {
+			iov[i].iov_base = &natt;
+			iov[i].iov_len = sizeof(natt);
+			i++;
+		}
+		iov[i].iov_base = (uint8_t *)ibuf_data(msg->msg_data) +
+		    msg->msg_offset;
+		iov[i].iov_len = ibuf_size(msg->msg_data) - msg->msg_offset;
+		len += iov[i].iov_len;
+		i++;
+	}
+
+	ret = sendmtofrom(first->msg_fd, iov, iovcnt, n,
+	    (struct sockaddr *)&first->msg_peer, first->msg_peerlen,
+	    (struct sockaddr *)&first->msg_local, first->msg_locallen);
+	free(iov);
+	if (ret != -1) {
+		peerstat_msg(env, first, IKED_PEERSTAT_MSG_SENT, n);
+		peerstat_msg(env, first, IKED_PEERSTAT_BYTES_SENT, len);
+	}
+
+	return (ret);
+}
+
 void
 ikev2_msg_cleanup(struct iked *env, struct iked_message *msg)
 {
@@ -202,8 +346,11 @@ ikev2_msg_cleanup(struct iked *env, struct iked_message *msg)
 			ibuf_free(msg->msg_scert[i].id_buf);
 		ibuf_free(msg->msg_cookie);
 		ibuf_free(msg->msg_cookie2);
+		ibuf_free(msg->msg_ticket);
+		free(msg->msg_redirect);
 		ibuf_free(msg->msg_del_buf);
 		free(msg->msg_eap.eam_user);
+		ibuf_free(msg->msg_eap.eam_msg);
 		free(msg->msg_cp_addr);
 		free(msg->msg_cp_addr6);
 		free(msg->msg_cp_dns);
@@ -218,8 +365,11 @@ ikev2_msg_cleanup(struct iked *env, struct iked_message *msg)
 			msg->msg_scert[i].id_buf = NULL;
 		msg->msg_cookie = NULL;
 		msg->msg_cookie2 = NULL;
+		msg->msg_ticket = NULL;
+		msg->msg_redirect = NULL;
 		msg->msg_del_buf = NULL;
 		msg->msg_eap.eam_user = NULL;
+		msg->msg_eap.eam_msg = NULL;
 		msg->msg_cp_addr = NULL;
 		msg->msg_cp_addr6 = NULL;
 		msg->msg_cp_dns = NULL;
@@ -232,7 +382,11 @@ ikev2_msg_cleanup(struct iked *env, struct iked_message *msg)
 		}
 	}
 
-	if (msg->msg_data != NULL) {
+	if (msg->msg_wire != NULL) {
+		ikev2_msg_wire_unref(msg->msg_wire);
+		msg->msg_wire = NULL;
+		msg->msg_data = NULL;
+	} else if (msg->msg_data != NULL) {
 		ibuf_free(msg->msg_data);
 		msg->msg_data = NULL;
 	}
@@ -265,16 +419,18 @@ ikev2_msg_valid_ike_sa(struct iked *env, struct ike_header *oldhdr,
 	return (-1);
 }
 
+/*
+ * Log the message that is about to be sent and mark it for NAT-T
+ * encapsulation if required.
+ */
 int
-ikev2_msg_send(struct iked *env, struct iked_message *msg)
+ikev2_msg_prepare_send(struct iked *env, struct iked_message *msg,
+    uint8_t *exchange, uint8_t *flags)
 {
 	struct iked_sa		*sa = msg->msg_sa;
 	struct ibuf		*buf = msg->msg_data;
-	uint32_t		 natt = 0x00000000;
 	int			 isnatt = 0;
-	uint8_t			 exchange, flags;
 	struct ike_header	*hdr;
-	struct iked_message	*m;
 
 	if (buf == NULL || (hdr = ibuf_seek(msg->msg_data,
 	    msg->msg_offset, sizeof(*hdr))) == NULL)
@@ -282,74 +438,99 @@ ikev2_msg_send(struct iked *env, struct iked_message *msg)
 
 	isnatt = (msg->msg_natt || (sa && sa->sa_natt));
 
-	exchange = hdr->ike_exchange;
-	flags = hdr->ike_flags;
-	logit(exchange == IKEV2_EXCHANGE_INFORMATIONAL ?  LOG_DEBUG : LOG_INFO,
+	*exchange = hdr->ike_exchange;
+	*flags = hdr->ike_flags;
+	logit(*exchange == IKEV2_EXCHANGE_INFORMATIONAL ?  LOG_DEBUG : LOG_INFO,
 	    "%ssend %s %s %u peer %s local %s, %zu bytes%s",
 	    SPI_IH(hdr),
-	    print_map(exchange, ikev2_exchange_map),
-	    (flags & IKEV2_FLAG_RESPONSE) ? "res" : "req",
+	    print_map(*exchange, ikev2_exchange_map),
+	    (*flags & IKEV2_FLAG_RESPONSE) ? "res" : "req",
 	    betoh32(hdr->ike_msgid),
 	    print_addr(&msg->msg_peer),
 	    print_addr(&msg->msg_local),
 	    ibuf_size(buf), isnatt ? ", NAT-T" : "");
 
-	if (isnatt) {
-		struct ibuf *new;
-		if ((new = ibuf_new(&natt, sizeof(natt))) == NULL) {
-			log_debug("%s: failed to set NAT-T", __func__);
-			return (-1);
-		}
-		if (ibuf_add_ibuf(new, buf) == -1) {
-			ibuf_free(new);
-			log_debug("%s: failed to set NAT-T", __func__);
-			return (-1);
-		}
-		ibuf_free(buf);
-		buf = msg->msg_data = new;
-	}
-
-	if (sendtofrom(msg->msg_fd, ibuf_data(buf), ibuf_size(buf), 0,
-	    (struct sockaddr *)&msg->msg_peer, msg->msg_peerlen,
-	    (struct sockaddr *)&msg->msg_local, msg->msg_locallen) == -1) {
-		log_warn("%s: sendtofrom", __func__);
-		if (sa != NULL && errno == EADDRNOTAVAIL) {
-			sa_state(env, sa, IKEV2_STATE_CLOSING);
-			timer_del(env, &sa->sa_timer);
-			timer_set(env, &sa->sa_timer,
-			    ikev2_ike_sa_timeout, sa);
-			timer_add(env, &sa->sa_timer,
-			    IKED_IKE_SA_DELETE_TIMEOUT);
-		}
-		ikestat_inc(env, ikes_msg_send_failures);
-	} else
-		ikestat_inc(env, ikes_msg_sent);
+	msg->msg_natt = isnatt;
+	return (0);
+}
 
-	if (sa == NULL)
-		return (0);
+/*
+ * Keep a copy of the sent message for retransmission.
+ */
+struct iked_msg_retransmit *
+ikev2_msg_store(struct iked *env, struct iked_message *msg, uint8_t exchange,
+    uint8_t flags)
+{
+	struct iked_sa		*sa = msg->msg_sa;
+	struct iked_msgqueue	*queue;
+	struct iked_message	*m;
 
 	if ((m = ikev2_msg_copy(env, msg)) == NULL) {
 		log_debug("%s: failed to copy a message", __func__);
-		return (-1);
+		return (NULL);
 	}
 	m->msg_exchange = exchange;
 
 	if (flags & IKEV2_FLAG_RESPONSE) {
-		if (ikev2_msg_enqueue(env, &sa->sa_responses, m,
+		queue = &sa->sa_responses;
+		if (ikev2_msg_enqueue(env, queue, m,
 		    IKED_RESPONSE_TIMEOUT) != 0) {
 			ikev2_msg_cleanup(env, m);
 			free(m);
-			return (-1);
+			return (NULL);
 		}
 	} else {
-		if (ikev2_msg_enqueue(env, &sa->sa_requests, m,
+		queue = &sa->sa_requests;
+		if (ikev2_msg_enqueue(env, queue, m,
 		    IKED_RETRANSMIT_TIMEOUT) != 0) {
 			ikev2_msg_cleanup(env, m);
 			free(m);
-			return (-1);
+			return (NULL);
 		}
 	}
 
+	return (ikev2_msg_lookup(env, queue, m, exchange));
+}
+
+void
+ikev2_msg_send_failed(struct iked *env, struct iked_sa *sa)
+{
+	if (sa != NULL && errno == EADDRNOTAVAIL) {
+		sa_state(env, sa, IKEV2_STATE_CLOSING);
+		timer_del(env, &sa->sa_timer);
+		timer_set(env, &sa->sa_timer,
+		    ikev2_ike_sa_timeout, sa);
+		timer_add(env, &sa->sa_timer,
+		    IKED_IKE_SA_DELETE_TIMEOUT);
+	}
+	ikestat_inc(env, ikes_msg_send_failures);
+}
+
+int
+ikev2_msg_send(struct iked *env, struct iked_message *msg)
+{
+	struct iked_sa		*sa = msg->msg_sa;
+	uint8_t			 exchange, flags;
+
+	if (ikev2_msg_prepare_send(env, msg, &exchange, &flags) == -1)
+		return (-1);
+
+	if (ikev2_msg_sendtofrom(msg) == -1) {
+		log_warn("%s: sendtofrom", __func__);
+		ikev2_msg_send_failed(env, sa);
+	} else {
+		ikestat_inc(env, ikes_msg_sent);
+		peerstat_msg(env, msg, IKED_PEERSTAT_MSG_SENT, 1);
+		peerstat_msg(env, msg, IKED_PEERSTAT_BYTES_SENT,
+		    ibuf_size(msg->msg_data) - msg->msg_offset);
+	}
+
+	if (sa == NULL)
+		return (0);
+
+	if (ikev2_msg_store(env, msg, exchange, flags) == NULL)
+		return (-1);
+
 	return (0);
 }
 
@@ -569,18 +750,47 @@ ikev2_msg_integr(struct iked *env, struct iked_sa *sa, struct ibuf *src)
 struct ibuf *
 ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
     struct ibuf *msg, struct ibuf *src)
+{
+	struct ibuf		*out = NULL;
+	ssize_t			 len;
+
+	if ((len = ikev2_msg_decrypt_buf(env, sa, msg, ibuf_data(src),
+	    ibuf_size(src), NULL, 0)) == -1 ||
+	    (out = ibuf_new(NULL, len)) == NULL ||
+	    (len = ikev2_msg_decrypt_buf(env, sa, msg, ibuf_data(src),
+	    ibuf_size(src), ibuf_data(out), ibuf_size(out))) == -1 ||
+	    ibuf_setsize(out, len) != 0) {
+		ibuf_free(out);
+		out = NULL;
+	}
+
+	ibuf_free(src);
+	return (out);
+}
+
+/*
+ * Verify and decrypt the encrypted payload src of the message msg
+ * into the buffer dst.  Returns the length of the decrypted payload
+ * without padding or -1 on error.  If dst is NULL, the size of the
+ * output buffer that is required for src is returned instead.
+ */
+ssize_t
+ikev2_msg_decrypt_buf(struct iked *env, struct iked_sa *sa,
+    struct ibuf *msg, uint8_t *src, size_t srclen, uint8_t *dst,
+    size_t dstlen)
 {
 	ssize_t			 ivlen, encrlen, integrlen, blocklen,
 				    outlen, tmplen;
-	uint8_t			 pad = 0, *ptr, *integrdata;
-	struct ibuf		*integr, *encr, *tmp = NULL, *out = NULL;
+	uint8_t			 pad = 0, *integrdata;
+	struct ibuf		*integr, *encr, *tmp = NULL;
 	off_t			 ivoff, encroff, integroff;
+	ssize_t			 ret = -1;
 
 	if (sa == NULL ||
 	    sa->sa_encr == NULL ||
 	    sa->sa_integr == NULL) {
 		log_debug("%s: invalid SA", __func__);
-		print_hexbuf(src);
+		print_hex(src, 0, srclen);
 		goto done;
 	}
 
@@ -596,21 +806,29 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 	ivlen = cipher_ivlength(sa->sa_encr);
 	ivoff = 0;
 	integrlen = hash_length(sa->sa_integr);
-	integroff = ibuf_size(src) - integrlen;
+	integroff = srclen - integrlen;
 	encroff = ivlen;
-	encrlen = ibuf_size(src) - integrlen - ivlen;
+	encrlen = srclen - integrlen - ivlen;
 
 	if (encrlen < 0 || integroff < 0) {
 		log_debug("%s: invalid integrity value", __func__);
 		goto done;
 	}
 
+	outlen = cipher_outlength(sa->sa_encr, encrlen);
+	if (dst == NULL)
+		return (outlen);
+	if (dstlen < (size_t)outlen) {
+		log_debug("%s: output buffer too small", __func__);
+		goto done;
+	}
+
 	log_debug("%s: IV length %zd", __func__, ivlen);
-	print_hex(ibuf_data(src), 0, ivlen);
+	print_hex(src, 0, ivlen);
 	log_debug("%s: encrypted payload length %zd", __func__, encrlen);
-	print_hex(ibuf_data(src), encroff, encrlen);
+	print_hex(src, encroff, encrlen);
 	log_debug("%s: integrity checksum length %zd", __func__, integrlen);
-	print_hex(ibuf_data(src), integroff, integrlen);
+	print_hex(src, integroff, integrlen);
 
 	/*
 	 * Validate packet checksum
@@ -626,9 +844,7 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 		    ibuf_size(msg) - integrlen);
 		hash_final(sa->sa_integr, ibuf_data(tmp), &tmplen);
 
-		integrdata = ibuf_seek(src, integroff, integrlen);
-		if (integrdata == NULL)
-			goto done;
+		integrdata = src + integroff;
 		if (memcmp(ibuf_data(tmp), integrdata, integrlen) != 0) {
 			log_debug("%s: integrity check failed", __func__);
 			goto done;
@@ -650,7 +866,7 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 	}
 
 	cipher_setkey(sa->sa_encr, ibuf_data(encr), ibuf_size(encr));
-	cipher_setiv(sa->sa_encr, ibuf_seek(src, ivoff, ivlen), ivlen);
+	cipher_setiv(sa->sa_encr, src + ivoff, ivlen);
 	if (cipher_init_decrypt(sa->sa_encr) == -1) {
 		log_info("%s: error initiating cipher.", __func__);
 		goto done;
@@ -658,39 +874,32 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 
 	/* Set AEAD tag */
 	if (sa->sa_integr->hash_isaead) {
-		integrdata = ibuf_seek(src, integroff, integrlen);
-		if (integrdata == NULL)
-			goto done;
+		integrdata = src + integroff;
 		if (cipher_settag(sa->sa_encr, integrdata, integrlen)) {
 			log_info("%s: failed to set tag.", __func__);
 			goto done;
 		}
 	}
 
-	if ((out = ibuf_new(NULL, cipher_outlength(sa->sa_encr,
-	    encrlen))) == NULL)
-		goto done;
-
 	/*
 	 * Add additional authenticated data for AEAD ciphers
 	 */
 	if (sa->sa_integr->hash_isaead) {
 		log_debug("%s: AAD length %zu", __func__,
-		    ibuf_size(msg) - ibuf_size(src));
-		print_hex(ibuf_data(msg), 0, ibuf_size(msg) - ibuf_size(src));
+		    ibuf_size(msg) - srclen);
+		print_hex(ibuf_data(msg), 0, ibuf_size(msg) - srclen);
 		cipher_aad(sa->sa_encr, ibuf_data(msg),
-		    ibuf_size(msg) - ibuf_size(src), &outlen);
+		    ibuf_size(msg) - srclen, &outlen);
 	}
 
-	if ((outlen = ibuf_size(out)) != 0) {
-		if (cipher_update(sa->sa_encr, ibuf_seek(src, encroff, encrlen),
-		    encrlen, ibuf_data(out), &outlen) == -1) {
+	if ((outlen = cipher_outlength(sa->sa_encr, encrlen)) != 0) {
+		if (cipher_update(sa->sa_encr, src + encroff,
+		    encrlen, dst, &outlen) == -1) {
 			log_info("%s: error updating cipher.", __func__);
 			goto done;
 		}
 
-		ptr = ibuf_seek(out, outlen - 1, 1);
-		pad = *ptr;
+		pad = dst[outlen - 1];
 	}
 
 	if (cipher_final(sa->sa_encr) == -1) {
@@ -700,19 +909,16 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 
 	log_debug("%s: decrypted payload length %zd/%zd padding %d",
 	    __func__, outlen, encrlen, pad);
-	print_hexbuf(out);
+	print_hex(dst, 0, outlen);
 
 	/* Strip padding and padding length */
-	if (ibuf_setsize(out, outlen - pad - 1) != 0)
+	if (outlen < pad + 1)
 		goto done;
 
-	ibuf_free(src);
-	return (out);
+	ret = outlen - pad - 1;
  done:
 	ibuf_free(tmp);
-	ibuf_free(out);
-	ibuf_free(src);
-	return (NULL);
+	return (ret);
 }
 
 int
@@ -760,7 +966,7 @@ ikev2_msg_send_encrypt(struct iked *env, struct iked_sa *sa, struct ibuf **ep,
 
 	if ((buf = ikev2_msg_init(env, &resp, &sa->sa_peer.addr,
 	    SS_LEN(sa->sa_peer.addr), &sa->sa_local.addr,
-	    SS_LEN(sa->sa_local.addr), response)) == NULL)
+	    SS_LEN(sa->sa_local.addr), response, exchange)) == NULL)
 		goto done;
 
 	resp.msg_msgid = response ? sa->sa_msgid_current : ikev2_msg_id(env, sa);
@@ -811,6 +1017,7 @@ int
 ikev2_send_encrypted_fragments(struct iked *env, struct iked_sa *sa,
     struct ibuf *in, uint8_t exchange, uint8_t firstpayload, int response) {
 	struct iked_message		 resp;
+	struct iked_msg_retransmit	*mr = NULL;
 	struct ibuf			*buf, *e = NULL;
 	struct ike_header		*hdr;
 	struct ikev2_payload		*pld;
@@ -820,6 +1027,7 @@ ikev2_send_encrypted_fragments(struct iked *env, struct iked_sa *sa,
 	size_t				 max_len, left,  offset=0;
 	size_t				 frag_num = 1, frag_total;
 	uint8_t				*data;
+	uint8_t				 xchg, flags;
 	uint32_t			 msgid;
 	int				 ret = -1;
 
@@ -851,7 +1059,7 @@ ikev2_send_encrypted_fragments(struct iked *env, struct iked_sa *sa,
 	while (frag_num <= frag_total) {
 		if ((buf = ikev2_msg_init(env, &resp, &sa->sa_peer.addr,
 		    SS_LEN(sa->sa_peer.addr), &sa->sa_local.addr,
-		    SS_LEN(sa->sa_local.addr), response)) == NULL)
+		    SS_LEN(sa->sa_local.addr), response, exchange)) == NULL)
 			goto done;
 
 		resp.msg_msgid = msgid;
@@ -908,11 +1116,11 @@ ikev2_send_encrypted_fragments(struct iked *env, struct iked_sa *sa,
 		resp.msg_fd = sa->sa_fd;
 		TAILQ_INIT(&resp.msg_proposals);
 
-		if (ikev2_msg_send(env, &resp) == -1)
+		/* Queue the fragment, all of them are sent at once below */
+		if (ikev2_msg_prepare_send(env, &resp, &xchg, &flags) == -1 ||
+		    (mr = ikev2_msg_store(env, &resp, xchg, flags)) == NULL)
 			goto done;
 
-		ikestat_inc(env, ikes_frag_sent);
-
 		offset += MINIMUM(left, max_len);
 		left -= MINIMUM(left, max_len);
 		frag_num++;
@@ -925,6 +1133,14 @@ ikev2_send_encrypted_fragments(struct iked *env, struct iked_sa *sa,
 		e = NULL;
 	}
 
+	if (ikev2_msg_sendqueue(env, &mr->mrt_frags) == -1) {
+		log_warn("%s: sendtofrom", __func__);
+		ikev2_msg_send_failed(env, sa);
+	} else {
+		ikestat_add(env, ikes_msg_sent, frag_total);
+		ikestat_add(env, ikes_frag_sent, frag_total);
+	}
+
 	return 0;
 done:
 	ikev2_msg_cleanup(env, &resp);
@@ -1197,36 +1413,89 @@ int
 ikev2_msg_enqueue(struct iked *env, struct iked_msgqueue *queue,
     struct iked_message *msg, int timeout)
 {
-	struct iked_msg_retransmit *mr;
+	struct iked_msg_retransmit	*mr;
+	unsigned int			 slot;
 
 	if ((mr = ikev2_msg_lookup(env, queue, msg, msg->msg_exchange)) ==
 	    NULL) {
+		/* The slot may still hold an older, superseded exchange */
+		slot = IKED_MSGQUEUE_SLOT(msg->msg_msgid);
+		if (queue->mq_slot[slot] != NULL)
+			ikev2_msg_dispose(env, queue, queue->mq_slot[slot]);
+
 		if ((mr = calloc(1, sizeof(*mr))) == NULL)
 			return (-1);
 		TAILQ_INIT(&mr->mrt_frags);
 		mr->mrt_tries = 0;
+		mr->mrt_msgid = msg->msg_msgid;
+		mr->mrt_exchange = msg->msg_exchange;
+		mr->mrt_response = msg->msg_response;
+
+		if (mr->mrt_response) {
+			/*
+			 * Responses are expired by a shared aging sweep,
+			 * the list is ordered by expiry time.
+			 */
+			mr->mrt_expire = ikev2_init_time() + timeout;
+			if (TAILQ_EMPTY(&env->sc_responses)) {
+				timer_set(env, &env->sc_responsetmr,
+				    ikev2_msg_response_timeout, NULL);
+				timer_add(env, &env->sc_responsetmr,
+				    IKED_RESPONSE_SWEEP_INTERVAL);
+			}
+			TAILQ_INSERT_TAIL(&env->sc_responses, mr, mrt_entry);
+		} else {
+			timer_set(env, &mr->mrt_timer,
+			    ikev2_msg_retransmit_timeout, mr);
+			timer_add(env, &mr->mrt_timer, timeout);
+		}
 
-		timer_set(env, &mr->mrt_timer, msg->msg_response ?
-		    ikev2_msg_response_timeout : ikev2_msg_retransmit_timeout,
-		    mr);
-		timer_add(env, &mr->mrt_timer, timeout);
-
-		TAILQ_INSERT_TAIL(queue, mr, mrt_entry);
+		queue->mq_slot[slot] = mr;
+		queue->mq_count++;
 	}
 
 	TAILQ_INSERT_TAIL(&mr->mrt_frags, msg, msg_entry);
 
+	if (mr->mrt_response) {
+		mr->mrt_size += ibuf_size(msg->msg_data);
+		env->sc_responses_size += ibuf_size(msg->msg_data);
+		ikev2_msg_response_trim(env, mr);
+	}
+
 	return 0;
 }
 
+/*
+ * Keep the total size of all cached responses below the limit by
+ * evicting the oldest responses first.
+ */
+void
+ikev2_msg_response_trim(struct iked *env, struct iked_msg_retransmit *keep)
+{
+	struct iked_msg_retransmit	*mr;
+	struct iked_sa			*sa;
+
+	while (env->sc_responses_size > IKED_RESPONSE_CACHE_MAX &&
+	    (mr = TAILQ_FIRST(&env->sc_responses)) != NULL && mr != keep) {
+		sa = TAILQ_FIRST(&mr->mrt_frags)->msg_sa;
+		log_debug("%s: evicting res %u, %zu bytes cached",
+		    SPI_SA(sa, __func__), mr->mrt_msgid,
+		    env->sc_responses_size);
+		ikev2_msg_dispose(env, &sa->sa_responses, mr);
+		ikestat_inc(env, ikes_response_cache_evicted);
+	}
+}
+
 void
 ikev2_msg_prevail(struct iked *env, struct iked_msgqueue *queue,
     struct iked_message *msg)
 {
-	struct iked_msg_retransmit	*mr, *mrtmp;
+	struct iked_msg_retransmit	*mr;
+	unsigned int			 i;
 
-	TAILQ_FOREACH_SAFE(mr, queue, mrt_entry, mrtmp) {
-		if (TAILQ_FIRST(&mr->mrt_frags)->msg_msgid < msg->msg_msgid)
+	for (i = 0; i < IKED_MSGQUEUE_WINDOW && queue->mq_count > 0; i++) {
+		if ((mr = queue->mq_slot[i]) != NULL &&
+		    mr->mrt_msgid < msg->msg_msgid)
 			ikev2_msg_dispose(env, queue, mr);
 	}
 }
@@ -1236,6 +1505,7 @@ ikev2_msg_dispose(struct iked *env, struct iked_msgqueue *queue,
     struct iked_msg_retransmit *mr)
 {
 	struct iked_message	*m;
+	unsigned int		 slot;
 
 	while ((m = TAILQ_FIRST(&mr->mrt_frags)) != NULL) {
 		TAILQ_REMOVE(&mr->mrt_frags, m, msg_entry);
@@ -1243,32 +1513,43 @@ ikev2_msg_dispose(struct iked *env, struct iked_msgqueue *queue,
 		free(m);
 	}
 
-	timer_del(env, &mr->mrt_timer);
-	TAILQ_REMOVE(queue, mr, mrt_entry);
+	if (mr->mrt_response) {
+		TAILQ_REMOVE(&env->sc_responses, mr, mrt_entry);
+		env->sc_responses_size -= mr->mrt_size;
+	} else
+		timer_del(env, &mr->mrt_timer);
+
+	slot = IKED_MSGQUEUE_SLOT(mr->mrt_msgid);
+	if (queue->mq_slot[slot] == mr) {
+		queue->mq_slot[slot] = NULL;
+		queue->mq_count--;
+	}
 	free(mr);
 }
 
 void
 ikev2_msg_flushqueue(struct iked *env, struct iked_msgqueue *queue)
 {
-	struct iked_msg_retransmit	*mr = NULL;
+	struct iked_msg_retransmit	*mr;
+	unsigned int			 i;
 
-	while ((mr = TAILQ_FIRST(queue)) != NULL)
-		ikev2_msg_dispose(env, queue, mr);
+	for (i = 0; i < IKED_MSGQUEUE_WINDOW && queue->mq_count > 0; i++) {
+		if ((mr = queue->mq_slot[i]) != NULL)
+			ikev2_msg_dispose(env, queue, mr);
+	}
 }
 
 struct iked_msg_retransmit *
 ikev2_msg_lookup(struct iked *env, struct iked_msgqueue *queue,
     struct iked_message *msg, uint8_t exchange)
 {
-	struct iked_msg_retransmit	*mr = NULL;
+	struct iked_msg_retransmit	*mr;
 
-	TAILQ_FOREACH(mr, queue, mrt_entry) {
-		if (TAILQ_FIRST(&mr->mrt_frags)->msg_msgid ==
-		    msg->msg_msgid &&
-		    TAILQ_FIRST(&mr->mrt_frags)->msg_exchange == exchange)
-			break;
-	}
+	mr = queue->mq_slot[IKED_MSGQUEUE_SLOT(msg->msg_msgid)];
+	if (mr == NULL ||
+	    mr->mrt_msgid != msg->msg_msgid ||
+	    mr->mrt_exchange != exchange)
+		return (NULL);
 
 	return (mr);
 }
@@ -1294,15 +1575,12 @@ ikev2_msg_retransmit_response(struct iked *env, struct iked_sa *sa,
 		log_debug("%s: first fragment", SPI_SA(sa, __func__));
 	}
 
+	if (ikev2_msg_sendqueue(env, &mr->mrt_frags) == -1) {
+		log_warn("%s: sendtofrom", __func__);
+		ikestat_inc(env, ikes_msg_send_failures);
+		return (-1);
+	}
 	TAILQ_FOREACH(m, &mr->mrt_frags, msg_entry) {
-		if (sendtofrom(m->msg_fd, ibuf_data(m->msg_data),
-		    ibuf_size(m->msg_data), 0,
-		    (struct sockaddr *)&m->msg_peer, m->msg_peerlen,
-		    (struct sockaddr *)&m->msg_local, m->msg_locallen) == -1) {
-			log_warn("%s: sendtofrom", __func__);
-			ikestat_inc(env, ikes_msg_send_failures);
-			return (-1);
-		}
 		log_info("%sretransmit %s res %u local %s peer %s",
 		    SPI_SA(sa, NULL),
 		    print_map(hdr->ike_exchange, ikev2_exchange_map),
@@ -1311,19 +1589,31 @@ ikev2_msg_retransmit_response(struct iked *env, struct iked_sa *sa,
 		    print_addr(&m->msg_peer));
 	}
 
-	timer_add(env, &mr->mrt_timer, IKED_RESPONSE_TIMEOUT);
+	/* Refresh the response and move it to the end of the aging list */
+	mr->mrt_expire = ikev2_init_time() + IKED_RESPONSE_TIMEOUT;
+	TAILQ_REMOVE(&env->sc_responses, mr, mrt_entry);
+	TAILQ_INSERT_TAIL(&env->sc_responses, mr, mrt_entry);
 	ikestat_inc(env, ikes_retransmit_response);
+	peerstat_add(env, NULL, sa, IKED_PEERSTAT_RETRANSMIT, 1);
 	return (0);
 }
 
 void
 ikev2_msg_response_timeout(struct iked *env, void *arg)
 {
-	struct iked_msg_retransmit	*mr = arg;
-	struct iked_sa		*sa;
+	struct iked_msg_retransmit	*mr;
+	struct iked_sa			*sa;
+	time_t				 now = ikev2_init_time();
+
+	while ((mr = TAILQ_FIRST(&env->sc_responses)) != NULL &&
+	    mr->mrt_expire <= now) {
+		sa = TAILQ_FIRST(&mr->mrt_frags)->msg_sa;
+		ikev2_msg_dispose(env, &sa->sa_responses, mr);
+	}
 
-	sa = TAILQ_FIRST(&mr->mrt_frags)->msg_sa;
-	ikev2_msg_dispose(env, &sa->sa_responses, mr);
+	if (!TAILQ_EMPTY(&env->sc_responses))
+		timer_add(env, &env->sc_responsetmr,
+		    IKED_RESPONSE_SWEEP_INTERVAL);
 }
 
 void
@@ -1334,18 +1624,14 @@ ikev2_msg_retransmit_timeout(struct iked *env, void *arg)
 	struct iked_sa		*sa = msg->msg_sa;
 
 	if (mr->mrt_tries < IKED_RETRANSMIT_TRIES) {
+		if (ikev2_msg_sendqueue(env, &mr->mrt_frags) == -1) {
+			log_warn("%s: sendtofrom", __func__);
+			ikev2_ike_sa_setreason(sa, "retransmit failed");
+			sa_free(env, sa);
+			ikestat_inc(env, ikes_msg_send_failures);
+			return;
+		}
 		TAILQ_FOREACH(msg, &mr->mrt_frags, msg_entry) {
-			if (sendtofrom(msg->msg_fd, ibuf_data(msg->msg_data),
-			    ibuf_size(msg->msg_data), 0,
-			    (struct sockaddr *)&msg->msg_peer, msg->msg_peerlen,
-			    (struct sockaddr *)&msg->msg_local,
-			    msg->msg_locallen) == -1) {
-				log_warn("%s: sendtofrom", __func__);
-				ikev2_ike_sa_setreason(sa, "retransmit failed");
-				sa_free(env, sa);
-				ikestat_inc(env, ikes_msg_send_failures);
-				return;
-			}
 			log_info("%sretransmit %d %s req %u peer %s "
 			    "local %s", SPI_SA(sa, NULL), mr->mrt_tries + 1,
 			    print_map(msg->msg_exchange, ikev2_exchange_map),
@@ -1357,6 +1643,7 @@ ikev2_msg_retransmit_timeout(struct iked *env, void *arg)
 		timer_add(env, &mr->mrt_timer,
 		    IKED_RETRANSMIT_TIMEOUT * (2 << (mr->mrt_tries++)));
 		ikestat_inc(env, ikes_retransmit_request);
+		peerstat_add(env, NULL, sa, IKED_PEERSTAT_RETRANSMIT, 1);
 	} else {
 		log_debug("%s: retransmit limit reached for req %u",
 		    __func__, msg->msg_msgid);
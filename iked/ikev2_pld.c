@@ -38,6 +38,7 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_PAYLOAD
 #include "iked.h"
 #include "ikev2.h"
 #include "eap.h"
@@ -101,6 +102,9 @@ int	 ikev2_pld_e(struct iked *, struct ikev2_payload *,
 	    struct iked_message *, size_t, size_t);
 int	 ikev2_pld_ef(struct iked *env, struct ikev2_payload *pld,
 	    struct iked_message *msg, size_t offset, size_t left);
+int	 ikev2_frags_init(struct iked_frag *, size_t, size_t);
+int	 ikev2_frags_grow(struct iked_frag *, size_t);
+void	 ikev2_frags_place(struct iked_frag *, size_t);
 int	 ikev2_frags_reassemble(struct iked *env,
 	    struct ikev2_payload *pld, struct iked_message *msg);
 int	 ikev2_validate_cp(struct iked_message *, size_t, size_t,
@@ -1054,6 +1058,8 @@ ikev2_pld_notify(struct iked *env, struct ikev2_payload *pld,
 	struct iked_spi		*rekey;
 	uint16_t		 type;
 	uint16_t		 signature_hash;
+	struct sockaddr_storage	 ss;
+	ssize_t			 len;
 
 	if (ikev2_validate_notify(msg, offset, left, &n))
 		return (-1);
@@ -1340,6 +1346,122 @@ ikev2_pld_notify(struct iked *env, struct ikev2_payload *pld,
 		}
 		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_FRAGMENTATION;
 		break;
+	case IKEV2_N_TICKET_REQUEST:
+		if (!msg->msg_e) {
+			log_debug("%s: N_TICKET_REQUEST not encrypted",
+			    __func__);
+			return (-1);
+		}
+		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_TICKET_REQUEST;
+		break;
+	case IKEV2_N_TICKET_LT_OPAQUE:
+		if (!msg->msg_e) {
+			log_debug("%s: N_TICKET_LT_OPAQUE not encrypted",
+			    __func__);
+			return (-1);
+		}
+		if (left <= sizeof(spi32) ||
+		    left > sizeof(spi32) + IKED_TICKET_MAX) {
+			log_debug("%s: ignoring malformed ticket"
+			    " notification: %zu", __func__, left);
+			return (0);
+		}
+		memcpy(&spi32, buf, sizeof(spi32));
+		ibuf_free(msg->msg_ticket);
+		if ((msg->msg_ticket = ibuf_new(buf + sizeof(spi32),
+		    left - sizeof(spi32))) == NULL) {
+			log_debug("%s: failed to get ticket", __func__);
+			return (-1);
+		}
+		msg->msg_parent->msg_ticket = msg->msg_ticket;
+		msg->msg_parent->msg_ticket_lifetime = betoh32(spi32);
+		break;
+	case IKEV2_N_TICKET_OPAQUE:
+		if (msg->msg_e) {
+			log_debug("%s: N_TICKET_OPAQUE encrypted",
+			    __func__);
+			return (-1);
+		}
+		if (left == 0 || left > IKED_TICKET_MAX) {
+			log_debug("%s: ignoring malformed ticket"
+			    " notification: %zu", __func__, left);
+			return (0);
+		}
+		ibuf_free(msg->msg_ticket);
+		if ((msg->msg_ticket = ibuf_new(buf, left)) == NULL) {
+			log_debug("%s: failed to get ticket", __func__);
+			return (-1);
+		}
+		msg->msg_parent->msg_ticket = msg->msg_ticket;
+		break;
+	case IKEV2_N_TICKET_NACK:
+		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_TICKET_NACK;
+		break;
+	case IKEV2_N_REDIRECT_SUPPORTED:
+		if (msg->msg_e) {
+			log_debug("%s: N_REDIRECT_SUPPORTED encrypted",
+			    __func__);
+			return (-1);
+		}
+		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_REDIRECT_SUPPORTED;
+		break;
+	case IKEV2_N_CHILDLESS_IKEV2_SUPPORTED:
+		if (msg->msg_e) {
+			log_debug("%s: N_CHILDLESS_IKEV2_SUPPORTED encrypted",
+			    __func__);
+			return (-1);
+		}
+		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_CHILDLESS;
+		break;
+	case IKEV2_N_REDIRECTED_FROM:
+		if (msg->msg_e) {
+			log_debug("%s: N_REDIRECTED_FROM encrypted",
+			    __func__);
+			return (-1);
+		}
+		if (redirect_getgw(buf, left, &ss) != (ssize_t)left) {
+			log_debug("%s: ignoring malformed redirected from"
+			    " notification: %zu", __func__, left);
+			return (0);
+		}
+		log_debug("%s: redirected from %s", __func__,
+		    print_addr(&ss));
+		msg->msg_parent->msg_flags |= IKED_MSG_FLAGS_REDIRECTED_FROM;
+		break;
+	case IKEV2_N_REDIRECT:
+		if (sa == NULL || !sa->sa_hdr.sh_initiator) {
+			log_debug("%s: N_REDIRECT not for an initiator",
+			    __func__);
+			return (0);
+		}
+		if ((len = redirect_getgw(buf, left, &ss)) == -1) {
+			log_debug("%s: ignoring malformed redirect"
+			    " notification: %zu", __func__, left);
+			return (0);
+		}
+		if (msg->msg_parent->msg_exchange ==
+		    IKEV2_EXCHANGE_IKE_SA_INIT) {
+			/* Our nonce, the response is not authenticated */
+			if (msg->msg_e || sa->sa_inonce == NULL ||
+			    left - len != ibuf_size(sa->sa_inonce) ||
+			    memcmp(buf + len, ibuf_data(sa->sa_inonce),
+			    left - len) != 0) {
+				log_debug("%s: N_REDIRECT nonce mismatch",
+				    __func__);
+				return (0);
+			}
+		} else if (!msg->msg_e || (size_t)len != left) {
+			log_debug("%s: invalid N_REDIRECT", __func__);
+			return (0);
+		}
+		free(msg->msg_parent->msg_redirect);
+		if ((msg->msg_parent->msg_redirect =
+		    malloc(sizeof(ss))) == NULL) {
+			log_debug("%s: malloc failed", __func__);
+			return (-1);
+		}
+		memcpy(msg->msg_parent->msg_redirect, &ss, sizeof(ss));
+		break;
 	case IKEV2_N_SIGNATURE_HASH_ALGORITHMS:
 		if (msg->msg_e) {
 			log_debug("%s: SIGNATURE_HASH_ALGORITHMS: encrypted",
@@ -1625,15 +1747,14 @@ ikev2_pld_ef(struct iked *env, struct ikev2_payload *pld,
 {
 	struct iked_sa			*sa = msg->msg_sa;
 	struct iked_frag		*sa_frag = &sa->sa_fragments;
-	struct iked_frag_entry		*el;
 	struct ikev2_frag_payload	 frag;
 	uint8_t				*msgbuf = ibuf_data(msg->msg_data);
-	uint8_t				*buf;
-	struct ibuf			*e = NULL;
+	uint8_t				*buf, *ptr;
+	uint8_t				 scratch[IKED_MSGBUF_MAX];
 	size_t				 frag_num, frag_total;
-	size_t				 len;
+	size_t				 len, off;
 	int				 ret = -1;
-	int				 processed = 0;
+	int				 processed = 0, inplace;
 	ssize_t				 elen;
 
 	buf = msgbuf + offset;
@@ -1667,62 +1788,73 @@ ikev2_pld_ef(struct iked *env, struct ikev2_payload *pld,
 	if (frag_num > frag_total)
 		goto done;
 
-	/* Decrypt fragment */
-	if ((e = ibuf_new(buf, len)) == NULL)
+	/* Space needed to decrypt the fragment */
+	if ((elen = ikev2_msg_decrypt_buf(env, sa, msg->msg_data,
+	    buf, len, NULL, 0)) == -1)
 		goto done;
 
-	if ((e = ikev2_msg_decrypt(env, msg->msg_sa, msg->msg_data, e))
-	    == NULL ) {
-		log_debug("%s: Failed to decrypt fragment: %zu of %zu",
-		    __func__, frag_num, frag_total);
+	/* Silent drop if fragment already stored */
+	if (sa_frag->frag_buf != NULL &&
+	    frag_total == sa_frag->frag_total &&
+	    IKED_FRAG_ISSET(sa_frag, frag_num - 1))
 		goto done;
-	}
-	elen = ibuf_size(e);
 
-	/* Check new fragmented message */
-	if (sa_frag->frag_arr == NULL) {
-		sa_frag->frag_arr = recallocarray(NULL, 0, frag_total,
-		    sizeof(struct iked_frag_entry*));
-		if (sa_frag->frag_arr == NULL) {
-			log_info("%s: recallocarray sa_frag->frag_arr.", __func__);
+	/*
+	 * A fragment that changes the reassembly state is authenticated
+	 * before, so it is decrypted into a scratch buffer first.  The
+	 * others are decrypted in place, directly at their final offset
+	 * if all previous fragments have been received.
+	 */
+	inplace = sa_frag->frag_buf != NULL &&
+	    frag_total == sa_frag->frag_total &&
+	    (size_t)elen <= sa_frag->frag_slot;
+	if (!inplace) {
+		if ((elen = ikev2_msg_decrypt_buf(env, sa, msg->msg_data,
+		    buf, len, scratch, sizeof(scratch))) == -1) {
+			log_debug("%s: Failed to decrypt fragment: %zu of %zu",
+			    __func__, frag_num, frag_total);
 			goto done;
 		}
-		sa_frag->frag_total = frag_total;
-	} else {
-		/* Drop all fragments if frag_total doesn't match previous */
-		if (frag_total != sa_frag->frag_total)
-			goto dropall;
 
-		/* Silent drop if fragment already stored */
-		if (sa_frag->frag_arr[frag_num-1] != NULL)
-			goto done;
+		if (sa_frag->frag_buf == NULL) {
+			if (ikev2_frags_init(sa_frag, frag_total,
+			    elen) == -1) {
+				log_info("%s: failed to allocate reassembly "
+				    "buffer", __func__);
+				goto done;
+			}
+		} else if (frag_total != sa_frag->frag_total) {
+			/* Drop all fragments if frag_total doesn't match */
+			goto dropall;
+		} else if ((size_t)elen > sa_frag->frag_slot &&
+		    ikev2_frags_grow(sa_frag, elen) == -1)
+			goto dropall;
 	}
 
-	/* The first fragments IKE header determines pld_nextpayload */
-	if (frag_num == 1)
-		sa_frag->frag_nextpayload = pld->pld_nextpayload;
-
-	/* Insert new list element */
-	el = calloc(1, sizeof(struct iked_frag_entry));
-	if (el == NULL) {
-		log_info("%s: Failed allocating new fragment: %zu of %zu",
-		    __func__, frag_num, frag_total);
+	if (frag_num == sa_frag->frag_placed + 1)
+		off = sa_frag->frag_placed_size;
+	else
+		off = (frag_num - 1) * sa_frag->frag_slot;
+	if ((ptr = ibuf_seek(sa_frag->frag_buf, off, elen)) == NULL)
 		goto done;
-	}
-
-	sa_frag->frag_arr[frag_num-1] = el;
-	el->frag_size = elen;
-	el->frag_data = calloc(1, elen);
-	if (el->frag_data == NULL) {
-		log_debug("%s: Failed allocating new fragment data: %zu of %zu",
+	if (!inplace)
+		memcpy(ptr, scratch, elen);
+	else if ((elen = ikev2_msg_decrypt_buf(env, sa, msg->msg_data,
+	    buf, len, ptr, elen)) == -1) {
+		log_debug("%s: Failed to decrypt fragment: %zu of %zu",
 		    __func__, frag_num, frag_total);
 		goto done;
 	}
 
-	/* Copy plaintext to fragment */
-	memcpy(el->frag_data, ibuf_seek(e, 0, 0), elen);
+	/* The first fragments IKE header determines pld_nextpayload */
+	if (frag_num == 1)
+		sa_frag->frag_nextpayload = pld->pld_nextpayload;
+
+	IKED_FRAG_SET(sa_frag, frag_num - 1);
+	sa_frag->frag_len[frag_num - 1] = elen;
 	sa_frag->frag_total_size += elen;
 	sa_frag->frag_count++;
+	ikev2_frags_place(sa_frag, frag_num);
 
 	/* If all frags are received start reassembly */
 	if (sa_frag->frag_count == sa_frag->frag_total) {
@@ -1737,47 +1869,111 @@ ikev2_pld_ef(struct iked *env, struct ikev2_payload *pld,
 done:
 	if (!processed)
 		ikestat_inc(env, ikes_frag_rcvd_drop);
-	ibuf_free(e);
 	return (ret);
 dropall:
 	ikestat_add(env, ikes_frag_rcvd_drop, sa_frag->frag_count + 1);
 	config_free_fragments(sa_frag);
-	ibuf_free(e);
 	return -1;
 }
 
+/*
+ * Allocate the reassembly buffer, assuming that no fragment is larger
+ * than the first one that has been received.
+ */
+int
+ikev2_frags_init(struct iked_frag *sa_frag, size_t frag_total, size_t slot)
+{
+	struct ibuf			*buf;
+
+	if ((buf = ibuf_dynamic(frag_total * slot,
+	    frag_total * IKED_MSGBUF_MAX)) == NULL)
+		return (-1);
+	if (ibuf_reserve(buf, frag_total * slot) == NULL ||
+	    (sa_frag->frag_len = calloc(frag_total,
+	    sizeof(*sa_frag->frag_len))) == NULL) {
+		ibuf_free(buf);
+		return (-1);
+	}
+
+	sa_frag->frag_buf = buf;
+	sa_frag->frag_slot = slot;
+	sa_frag->frag_total = frag_total;
+
+	return (0);
+}
+
+/*
+ * Grow the slots if a fragment is larger than expected and move the
+ * fragments that are not at their final offset yet.
+ */
+int
+ikev2_frags_grow(struct iked_frag *sa_frag, size_t slot)
+{
+	uint8_t				*ptr;
+	size_t				 i, oslot = sa_frag->frag_slot;
+
+	if (ibuf_reserve(sa_frag->frag_buf,
+	    sa_frag->frag_total * (slot - oslot)) == NULL)
+		return (-1);
+	ptr = ibuf_data(sa_frag->frag_buf);
+
+	for (i = sa_frag->frag_total; i > sa_frag->frag_placed; i--) {
+		if (!IKED_FRAG_ISSET(sa_frag, i - 1))
+			continue;
+		memmove(ptr + (i - 1) * slot, ptr + (i - 1) * oslot,
+		    sa_frag->frag_len[i - 1]);
+	}
+	sa_frag->frag_slot = slot;
+
+	return (0);
+}
+
+/*
+ * Advance the contiguous range of fragments at their final offset,
+ * frag_num is the fragment that has just been received.
+ */
+void
+ikev2_frags_place(struct iked_frag *sa_frag, size_t frag_num)
+{
+	uint8_t				*ptr = ibuf_data(sa_frag->frag_buf);
+	size_t				 i;
+
+	if (frag_num != sa_frag->frag_placed + 1)
+		return;
+
+	/* The new fragment has been decrypted at its final offset */
+	sa_frag->frag_placed_size += sa_frag->frag_len[frag_num - 1];
+	sa_frag->frag_placed++;
+
+	/* Move down the following fragments that are in their slots */
+	for (i = sa_frag->frag_placed; i < sa_frag->frag_total &&
+	    IKED_FRAG_ISSET(sa_frag, i); i++) {
+		memmove(ptr + sa_frag->frag_placed_size,
+		    ptr + i * sa_frag->frag_slot, sa_frag->frag_len[i]);
+		sa_frag->frag_placed_size += sa_frag->frag_len[i];
+		sa_frag->frag_placed++;
+	}
+}
+
 int
 ikev2_frags_reassemble(struct iked *env, struct ikev2_payload *pld,
     struct iked_message *msg)
 {
 	struct iked_frag		*sa_frag = &msg->msg_sa->sa_fragments;
 	struct ibuf			*e = NULL;
-	struct iked_frag_entry		*el;
-	uint8_t				*ptr;
-	size_t				 offset;
-	size_t				 i;
 	struct iked_message		 emsg;
 	int				 ret = -1;
 	int				 processed = 0;
 
-	/* Reassemble fragments to single buffer */
-	if ((e = ibuf_new(NULL, sa_frag->frag_total_size)) == NULL) {
-		log_debug("%s: Failed allocating SK buffer.", __func__);
-		goto done;
-	}
+	if (sa_frag->frag_placed != sa_frag->frag_total)
+		fatalx("Tried to reassemble incomplete fragments");
 
-	/* Empty queue to new buffer */
-	offset = 0;
-	for (i = 0; i < sa_frag->frag_total; i++) {
-		if ((el = sa_frag->frag_arr[i]) == NULL)
-			fatalx("Tried to reassemble shallow frag_arr");
-		ptr = ibuf_seek(e, offset, el->frag_size);
-		if (ptr == NULL) {
-			log_info("%s: failed to reassemble fragments", __func__);
-			goto done;
-		}
-		memcpy(ptr, el->frag_data, el->frag_size);
-		offset += el->frag_size;
+	/* The reassembly buffer already holds the complete message */
+	e = sa_frag->frag_buf;
+	sa_frag->frag_buf = NULL;
+	if (ibuf_setsize(e, sa_frag->frag_total_size) != 0) {
+		log_info("%s: failed to reassemble fragments", __func__);
+		goto done;
 	}
 
 	log_debug("%s: Defragmented length %zd", __func__,
@@ -1826,7 +2022,7 @@ ikev2_pld_e(struct iked *env, struct ikev2_payload *pld,
 	size_t			 len;
 	int			 ret = -1;
 
-	if (sa->sa_fragments.frag_arr != NULL) {
+	if (sa->sa_fragments.frag_buf != NULL) {
 		log_warn("%s: Received SK payload when SKFs are in queue.",
 		    __func__);
 		config_free_fragments(&sa->sa_fragments);
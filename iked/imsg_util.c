@@ -63,10 +63,24 @@ ibuf_new(const void *data, size_t len)
 	return (buf);
 }
 
+/*
+ * Buffer for building a message: it starts with the size hint and
+ * grows geometrically.  Unlike the buffers holding key material it is
+ * not zeroed when freed.
+ */
 struct ibuf *
-ibuf_static(void)
+ibuf_message(size_t hint)
 {
-	return ibuf_open(IKED_MSGBUF_MAX);
+	struct ibuf	*buf;
+
+	if (hint > IKED_MSGBUF_MAX)
+		hint = IKED_MSGBUF_MAX;
+	if ((buf = ibuf_dynamic(hint, IKED_MSGBUF_MAX)) == NULL)
+		return (NULL);
+#ifdef IBUF_F_GROW
+	buf->flags = IBUF_F_GROW;
+#endif
+	return (buf);
 }
 
 size_t
@@ -19,8 +19,11 @@
 
 #include <sys/queue.h>
 #include <sys/socket.h>
+
+#include <stdlib.h>
 #include <event.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_IPSEC
 #include "iked.h"
 
 int
@@ -71,6 +74,69 @@ ipsec_sa_delete(struct iked *env, struct iked_childsa *sa)
 	return pfkey_sa_delete(env, sa);
 }
 
+/*
+ * The SAs and flows of a negotiation are collected in a batch and
+ * handed to the kernel together by ipsec_batch_commit().  If one of
+ * them can not be installed, the others are removed again.
+ */
+void
+ipsec_batch_init(struct ipsec_batch *batch)
+{
+	TAILQ_INIT(batch);
+}
+
+int
+ipsec_batch_sa_add(struct ipsec_batch *batch, struct iked_childsa *sa,
+    struct iked_childsa *last)
+{
+	struct ipsec_batch_op	*op;
+
+	if ((op = calloc(1, sizeof(*op))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	op->bo_sa = sa;
+	op->bo_last = last;
+	op->bo_errno = -1;
+	TAILQ_INSERT_TAIL(batch, op, bo_entry);
+	return (0);
+}
+
+int
+ipsec_batch_flow_add(struct ipsec_batch *batch, struct iked_flow *flow)
+{
+	struct ipsec_batch_op	*op;
+
+	if ((op = calloc(1, sizeof(*op))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	op->bo_flow = flow;
+	op->bo_errno = -1;
+	TAILQ_INSERT_TAIL(batch, op, bo_entry);
+	return (0);
+}
+
+/* The ops stay in the batch until ipsec_batch_clear() */
+int
+ipsec_batch_commit(struct iked *env, struct ipsec_batch *batch)
+{
+	if (TAILQ_EMPTY(batch))
+		return (0);
+	return pfkey_batch(env, batch);
+}
+
+void
+ipsec_batch_clear(struct ipsec_batch *batch)
+{
+	struct ipsec_batch_op	*op;
+
+	while ((op = TAILQ_FIRST(batch)) != NULL) {
+		TAILQ_REMOVE(batch, op, bo_entry);
+		free(op);
+	}
+}
+
 int
 ipsec_socket(struct iked *env)
 {
@@ -24,30 +24,23 @@
 #include <errno.h>
 #include <time.h>
 
+#include "log.h"
+
 static int	 debug;
 static int	 verbose;
 const char	*log_procname;
-
-void	log_init(int, int);
-void	log_procinit(const char *);
-void	log_setverbose(int);
-int	log_getverbose(void);
-void	log_warn(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_warnx(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_info(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	log_debug(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-void	logit(int, const char *, ...)
-	    __attribute__((__format__ (printf, 2, 3)));
-void	vlog(int, const char *, va_list)
-	    __attribute__((__format__ (printf, 2, 0)));
-__dead void fatal(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
-__dead void fatalx(const char *, ...)
-	    __attribute__((__format__ (printf, 1, 2)));
+int		 log_level[LOG_SUBSYS_MAX];
+
+static const char *log_subsys_names[LOG_SUBSYS_MAX] = {
+	"general",
+	"ikev2",
+	"msg",
+	"payload",
+	"ca",
+	"ipsec",
+	"policy",
+	"eap"
+};
 
 void
 log_init(int n_debug, int facility)
@@ -55,7 +48,7 @@ log_init(int n_debug, int facility)
 	extern char	*__progname;
 
 	debug = n_debug;
-	verbose = n_debug;
+	log_setverbose(n_debug);
 	log_procinit(__progname);
 
 	if (!debug)
@@ -74,7 +67,39 @@ log_procinit(const char *procname)
 void
 log_setverbose(int v)
 {
+	int	 i;
+
 	verbose = v;
+	for (i = 0; i < LOG_SUBSYS_MAX; i++)
+		log_level[i] = v;
+}
+
+void
+log_setverbose_subsys(int subsys, int v)
+{
+	if (subsys == -1)
+		log_setverbose(v);
+	else if (subsys >= 0 && subsys < LOG_SUBSYS_MAX)
+		log_level[subsys] = v;
+}
+
+int
+log_subsys_lookup(const char *name)
+{
+	int	 i;
+
+	for (i = 0; i < LOG_SUBSYS_MAX; i++)
+		if (strcmp(log_subsys_names[i], name) == 0)
+			return (i);
+	return (-1);
+}
+
+const char *
+log_subsys_name(int subsys)
+{
+	if (subsys < 0 || subsys >= LOG_SUBSYS_MAX)
+		return ("all");
+	return (log_subsys_names[subsys]);
 }
 
 int
@@ -84,7 +109,7 @@ log_getverbose(void)
 }
 
 void
-logit(int pri, const char *fmt, ...)
+(logit)(int pri, const char *fmt, ...)
 {
 	va_list	ap;
 
@@ -163,18 +188,6 @@ log_info(const char *emsg, ...)
 	va_end(ap);
 }
 
-void
-log_debug(const char *emsg, ...)
-{
-	va_list	 ap;
-
-	if (verbose > 1) {
-		va_start(ap, emsg);
-		vlog(LOG_DEBUG, emsg, ap);
-		va_end(ap);
-	}
-}
-
 static void
 vfatalc(int code, const char *emsg, va_list ap)
 {
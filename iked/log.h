@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IKED_LOG_H
+#define IKED_LOG_H
+
+#include <stdarg.h>
+#include <syslog.h>
+
+/*
+ * Subsystems with their own verbosity.  A source file selects its
+ * subsystem by defining LOG_SUBSYS before including iked.h.
+ */
+#define LOG_SUBSYS_GENERAL	0
+#define LOG_SUBSYS_IKEV2	1	/* ikev2.c */
+#define LOG_SUBSYS_MSG		2	/* ikev2_msg.c */
+#define LOG_SUBSYS_PAYLOAD	3	/* ikev2_pld.c */
+#define LOG_SUBSYS_CA		4	/* ca.c, ocsp.c */
+#define LOG_SUBSYS_IPSEC	5	/* pfkey.c, ipsec.c, vroute */
+#define LOG_SUBSYS_POLICY	6	/* policy.c, config.c */
+#define LOG_SUBSYS_EAP		7	/* eap.c */
+#define LOG_SUBSYS_MAX		8
+
+#ifndef LOG_SUBSYS
+#define LOG_SUBSYS		LOG_SUBSYS_GENERAL
+#endif
+
+extern int	 log_level[LOG_SUBSYS_MAX];
+
+#define log_level_ok(_l)	(log_level[LOG_SUBSYS] >= (_l))
+
+/*
+ * Debug messages are checked before their arguments are evaluated,
+ * so print_spi(), print_addr() and friends cost nothing when disabled.
+ */
+#define log_debug(...) do {						\
+	if (log_level_ok(2))						\
+		(logit)(LOG_DEBUG, __VA_ARGS__);			\
+} while (0)
+#define logit(_pri, ...) do {						\
+	int	 _p = (_pri);						\
+	if (_p != LOG_DEBUG || log_level_ok(2))				\
+		(logit)(_p, __VA_ARGS__);				\
+} while (0)
+
+void	log_init(int, int);
+void	log_procinit(const char *);
+void	log_setverbose(int);
+void	log_setverbose_subsys(int, int);
+int	log_getverbose(void);
+int	log_subsys_lookup(const char *);
+const char *
+	log_subsys_name(int);
+void	log_warn(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+void	log_warnx(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+void	log_info(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+void	(logit)(int, const char *, ...)
+	    __attribute__((__format__ (printf, 2, 3)));
+void	vlog(int, const char *, va_list)
+	    __attribute__((__format__ (printf, 2, 0)));
+__dead void fatal(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+__dead void fatalx(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+
+#endif /* IKED_LOG_H */
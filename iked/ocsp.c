@@ -22,6 +22,7 @@
 #include <sys/uio.h>
 #include <sys/stat.h>
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -29,6 +30,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <openssl/pem.h>
 #include <openssl/ocsp.h>
@@ -37,38 +40,201 @@
 
 #include <event.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_CA
 #include "iked.h"
 
+#define OCSP_TIMEOUT	30
+#define OCSP_BATCH_MAX	16		/* certs per request */
+#define OCSP_POOL_MAX	2		/* idle connections per responder */
+#define OCSP_IDLE_TIMEOUT 30
+#define OCSP_RESPONSE_MAX (64 * 1024)
+
+/* an ike sa waiting for the status of a certificate */
+struct ocsp_waiter {
+	TAILQ_ENTRY(ocsp_waiter) ow_entry;
+	struct iked_sahdr	 ow_sh;		/* ike sa */
+	uint8_t			 ow_type;	/* auth type */
+};
+TAILQ_HEAD(ocsp_waiters, ocsp_waiter);
+
+/* a certificate in a request and all ike sas waiting for it */
+struct ocsp_query {
+	OCSP_CERTID		*oq_id;		/* ocsp-id for cert */
+	struct ocsp_waiters	 oq_waiters;
+};
+
+/*
+ * A request to the ocsp-responder.  Certificates for the same
+ * responder are added to the request until it is sent.
+ */
 struct iked_ocsp {
 	struct iked		*ocsp_env;	/* back pointer to env */
-	struct iked_sahdr	 ocsp_sh;	/* ike sa */
-	uint8_t			 ocsp_type;	/* auth type */
-	struct iked_socket	*ocsp_sock;	/* socket to ocsp responder */
-	BIO			*ocsp_cbio;	/* matching OpenSSL obj */
-	OCSP_CERTID		*ocsp_id;	/* ocsp-id for cert */
-	OCSP_REQUEST		*ocsp_req;	/* ocsp-request */
-	OCSP_REQ_CTX		*ocsp_req_ctx;	/* async ocsp-request */
+	struct iked_sahdr	 ocsp_sh;	/* to match the parent's fd */
+	char			*ocsp_url;	/* responder url */
+	char			*ocsp_host;
+	char			*ocsp_path;
+	struct iked_ocsp_conn	*ocsp_conn;	/* socket to ocsp responder */
+	struct ocsp_query	 ocsp_queries[OCSP_BATCH_MAX];
+	int			 ocsp_nqueries;
+	int			 ocsp_sent;	/* no more certs can be added */
+	OCSP_REQUEST		*ocsp_req;	/* request that was sent */
+	struct ibuf		*ocsp_buf;	/* http request or response */
+	size_t			 ocsp_off;	/* request bytes written */
+};
+
+/* keep-alive connection to the ocsp-responder */
+struct iked_ocsp_conn {
+	TAILQ_ENTRY(iked_ocsp_conn) conn_entry;	/* idle connections */
+	struct iked_socket	 conn_sock;
+	char			*conn_url;
+	int			 conn_reused;
+};
+
+#define OCSP_ADDR_MAX	8		/* addresses tried per responder */
+#define OCSP_HE_DELAY	250000		/* usec before the next address */
+#define OCSP_ADDRCACHE_MAX 32
+#define OCSP_ADDRCACHE_TTL 300		/* getaddrinfo() hides the dns ttl */
+
+/* a connection attempt to one of the responder's addresses */
+struct ocsp_attempt {
+	struct ocsp_connect	*oa_oc;		/* NULL if not pending */
+	int			 oa_fd;
+	struct event		 oa_ev;
 };
 
 struct ocsp_connect {
+	TAILQ_ENTRY(ocsp_connect) oc_entry;	/* waiting for lookup */
+	struct iked		*oc_env;
 	struct iked_sahdr	 oc_sh;
-	struct iked_socket	 oc_sock;
+	char			*oc_host;
+	char			*oc_port;
 	char			*oc_path;
 	char			*oc_url;
+	struct sockaddr_storage	 oc_addrs[OCSP_ADDR_MAX];
+	struct ocsp_attempt	 oc_attempts[OCSP_ADDR_MAX];
+	unsigned int		 oc_naddrs;
+	unsigned int		 oc_next;	/* next address to try */
+	unsigned int		 oc_pending;	/* attempts in progress */
+	struct event		 oc_timer;	/* happy eyeballs delay */
 };
 
-#define OCSP_TIMEOUT	30
+/* a responder name being resolved in the resolver thread */
+struct ocsp_lookup {
+	TAILQ_ENTRY(ocsp_lookup) ol_entry;
+	char			*ol_host;
+	char			*ol_port;
+	int			 ol_fd;		/* to pass back the result */
+	int			 ol_error;
+	struct addrinfo		*ol_res;
+	TAILQ_HEAD(, ocsp_connect) ol_waiters;
+};
+
+/* resolved addresses of a responder */
+struct ocsp_addrcache {
+	TAILQ_ENTRY(ocsp_addrcache) oa_entry;
+	char			*oa_host;
+	char			*oa_port;
+	time_t			 oa_expire;
+	struct sockaddr_storage	 oa_addrs[OCSP_ADDR_MAX];
+	unsigned int		 oa_naddrs;
+};
+TAILQ_HEAD(ocsp_addrcaches, ocsp_addrcache);
+
+struct iked_ocsp_resolver {
+	int			 res_fd[2];	/* lookups are passed back */
+	struct event		 res_ev;
+	TAILQ_HEAD(, ocsp_lookup) res_lookups;
+	struct ocsp_addrcaches	 res_cache;	/* most recent first */
+	unsigned int		 res_ncache;
+};
+
+/*
+ * Cache of verified OCSP statuses in the ca process, keyed by the DER
+ * encoded OCSP_CERTID.  Entries are valid until nextUpdate, bounded
+ * by the configured maxage.
+ */
+struct iked_ocsp_cache_entry {
+	RB_ENTRY(iked_ocsp_cache_entry)	 oce_entry;
+	time_t				 oce_expire;
+	int				 oce_status;	/* V_OCSP_CERTSTATUS_* */
+	size_t				 oce_idlen;
+	uint8_t				*oce_id;
+};
+
+#define OCSP_CACHE_MAX		 10000
+#define OCSP_CACHE_IDMAX	 1024
+#define OCSP_CACHE_SAVE_INTERVAL 60
+#define OCSP_CACHE_MAGIC	 0x4f435331	/* "OCS1" */
+
+/* cache file format, all fields in host byte order */
+struct ocsp_cache_hdr {
+	uint32_t		 och_magic;
+	uint32_t		 och_count;
+};
+
+struct ocsp_cache_rec {
+	int64_t			 ocr_expire;
+	int32_t			 ocr_status;
+	uint32_t		 ocr_idlen;
+	/* followed by the DER encoded OCSP_CERTID */
+};
 
 /* priv */
+int		 ocsp_resolve(struct iked *, struct ocsp_connect *);
+void		*ocsp_resolve_thread(void *);
+void		 ocsp_resolve_cb(int, short, void *);
+struct ocsp_addrcache *
+		 ocsp_addrcache_lookup(struct iked *, const char *,
+		    const char *);
+struct ocsp_addrcache *
+		 ocsp_addrcache_add(struct iked *, const char *, const char *,
+		    struct addrinfo *);
+void		 ocsp_addrcache_free(struct iked_ocsp_resolver *,
+		    struct ocsp_addrcache *);
+void		 ocsp_connect_next(struct ocsp_connect *);
+void		 ocsp_connect_delay_cb(int, short, void *);
 void		 ocsp_connect_cb(int, short, void *);
+void		 ocsp_connect_done(struct ocsp_connect *, int);
 int		 ocsp_connect_finish(struct iked *, int, struct ocsp_connect *);
 
 /* unpriv */
+int		 ocsp_add_query(struct iked *, OCSP_CERTID *, const char *,
+		    struct iked_sahdr, uint8_t);
+struct iked_ocsp *
+		 ocsp_new(struct iked *, const char *, struct iked_sahdr);
+int		 ocsp_request_fd(struct iked_ocsp *);
+int		 ocsp_send(struct iked_ocsp *, struct iked_ocsp_conn *);
 void		 ocsp_free(struct iked_ocsp *);
 void		 ocsp_callback(int, short, void *);
+int		 ocsp_http_response(struct iked_ocsp *, OCSP_RESPONSE **,
+		    int *);
+int		 ocsp_http_chunked(struct iked_ocsp *, const char *, size_t,
+		    struct ibuf **, size_t *);
 void		 ocsp_parse_response(struct iked_ocsp *, OCSP_RESPONSE *);
 STACK_OF(X509)	*ocsp_load_certs(const char *);
 int		 ocsp_validate_finish(struct iked_ocsp *, int);
+void		 ocsp_query_finish(struct iked *, struct ocsp_query *, int);
+int		 ocsp_notify(struct iked *, struct iked_sahdr *, uint8_t, int);
+struct iked_ocsp_conn *
+		 ocsp_conn_get(struct iked *, const char *);
+void		 ocsp_conn_put(struct iked *, struct iked_ocsp_conn *);
+void		 ocsp_conn_free(struct iked_ocsp_conn *);
+void		 ocsp_conn_idle_cb(int, short, void *);
+int		 ocsp_cache_cmp(struct iked_ocsp_cache_entry *,
+		    struct iked_ocsp_cache_entry *);
+int		 ocsp_cache_lookup(struct iked *, OCSP_CERTID *);
+int		 ocsp_cache_insert(struct iked *, uint8_t *, size_t, int,
+		    time_t);
+void		 ocsp_cache_add(struct iked *, OCSP_CERTID *, int,
+		    ASN1_GENERALIZEDTIME *, ASN1_GENERALIZEDTIME *);
+void		 ocsp_cache_remove(struct iked *,
+		    struct iked_ocsp_cache_entry *);
+void		 ocsp_cache_expire(struct iked *, time_t);
+void		 ocsp_cache_load(struct iked *);
+void		 ocsp_cache_save(struct iked *, void *);
+
+RB_PROTOTYPE(iked_ocsp_cache, iked_ocsp_cache_entry, oce_entry,
+    ocsp_cache_cmp);
 
 
 /* priv */
@@ -78,14 +244,13 @@ int
 ocsp_connect(struct iked *env, struct imsg *imsg)
 {
 	struct ocsp_connect	*oc = NULL;
+	struct ocsp_addrcache	*oa;
 	struct iked_sahdr	 sh;
-	struct addrinfo		 hints, *res0 = NULL, *res;
-	struct timeval		 tv;
 	uint8_t			*ptr;
 	size_t			 len;
 	char			*host = NULL, *port = NULL, *path = NULL;
 	char			*url, *freeme = NULL;
-	int			use_ssl, fd = -1, ret = -1, error;
+	int			 use_ssl, ret = -1;
 
 	IMSG_SIZE_CHECK(imsg, &sh);
 
@@ -116,107 +281,398 @@ ocsp_connect(struct iked *env, struct imsg *imsg)
 		goto done;
 	}
 
-	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
-		log_debug("%s: socket failed", SPI_SH(&sh, __func__));
-		goto done;
-	}
 	if ((oc = calloc(1, sizeof(*oc))) == NULL) {
 		log_debug("%s: calloc failed", __func__);
 		goto done;
 	}
-
-	bzero(&hints, sizeof(struct addrinfo));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	error = getaddrinfo(host, port, &hints, &res0);
-	if (error) {
-		log_warn("%s: getaddrinfo(%s, %s) failed",
-		    SPI_SH(&sh, __func__), host, port);
-		goto done;
-	}
-	/* XXX just pick the first answer. we could loop instead */
-	for (res = res0; res; res = res->ai_next)
-		if (res->ai_family == AF_INET)
-			break;
-	if (res == NULL) {
-		log_debug("%s: no addr to connect to for %s:%s",
-		    SPI_SH(&sh, __func__), host, port);
-		goto done;
-	}
-
-	oc->oc_sock.sock_fd = fd;
-	oc->oc_sock.sock_env = env;
+	oc->oc_env = env;
 	oc->oc_sh = sh;
+	evtimer_set(&oc->oc_timer, ocsp_connect_delay_cb, oc);
+	oc->oc_host = host;
+	oc->oc_port = port;
 	oc->oc_path = path;
-	oc->oc_url = strdup(url);
-	if (oc->oc_url == NULL) {
+	host = port = path = NULL;
+	if ((oc->oc_url = strdup(url)) == NULL) {
 		log_warn("%s: strdup failed", SPI_SH(&sh, __func__));
 		goto done;
 	}
-	path = NULL;
-
-	log_debug("%s: connect(%s, %s)", __func__, host, port);
-	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
-		/* register callback for ansync connect */
-		if (errno == EINPROGRESS) {
-			tv.tv_sec = OCSP_TIMEOUT;
-			tv.tv_usec = 0;
-			event_set(&oc->oc_sock.sock_ev, fd, EV_WRITE,
-			    ocsp_connect_cb, oc);
-			event_add(&oc->oc_sock.sock_ev, &tv);
-			ret = 0;
-		} else
-			log_warn("%s: connect(%s, %s)",
-			    SPI_SH(&oc->oc_sh, __func__), host, port);
-	} else {
-		ocsp_connect_finish(env, fd, oc);
+
+	if ((oa = ocsp_addrcache_lookup(env, oc->oc_host,
+	    oc->oc_port)) != NULL) {
+		log_debug("%s: %s:%s cached", __func__, oc->oc_host,
+		    oc->oc_port);
+		memcpy(oc->oc_addrs, oa->oa_addrs, sizeof(oc->oc_addrs));
+		oc->oc_naddrs = oa->oa_naddrs;
+		ocsp_connect_next(oc);
 		ret = 0;
-	}
+	} else
+		ret = ocsp_resolve(env, oc);
  done:
-	if (res0)
-		freeaddrinfo(res0);
 	free(freeme);
 	free(host);
 	free(port);
 	free(path);
-	if (ret == -1) {
+	if (ret == -1)
 		ocsp_connect_finish(env, -1, oc);
-		if (fd >= 0)
+	return (ret);
+}
+
+/*
+ * getaddrinfo() blocks, so the responder name is resolved in a
+ * detached thread that passes the finished lookup back through a pipe.
+ * Concurrent connects to the same responder share one lookup.
+ */
+int
+ocsp_resolve(struct iked *env, struct ocsp_connect *oc)
+{
+	struct iked_ocsp_resolver	*res;
+	struct ocsp_lookup		*ol;
+	pthread_attr_t			 attr;
+	pthread_t			 thread;
+	int				 error;
+
+	if ((res = env->sc_ocsp_resolver) == NULL) {
+		if ((res = calloc(1, sizeof(*res))) == NULL) {
+			log_warn("%s: calloc", __func__);
+			return (-1);
+		}
+		if (pipe(res->res_fd) == -1) {
+			log_warn("%s: pipe", __func__);
+			free(res);
+			return (-1);
+		}
+		fcntl(res->res_fd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(res->res_fd[1], F_SETFD, FD_CLOEXEC);
+		fcntl(res->res_fd[0], F_SETFL, O_NONBLOCK);
+		TAILQ_INIT(&res->res_lookups);
+		TAILQ_INIT(&res->res_cache);
+		event_set(&res->res_ev, res->res_fd[0], EV_READ | EV_PERSIST,
+		    ocsp_resolve_cb, env);
+		event_add(&res->res_ev, NULL);
+		env->sc_ocsp_resolver = res;
+	}
+
+	TAILQ_FOREACH(ol, &res->res_lookups, ol_entry) {
+		if (strcmp(ol->ol_host, oc->oc_host) == 0 &&
+		    strcmp(ol->ol_port, oc->oc_port) == 0) {
+			log_debug("%s: joining lookup of %s:%s", __func__,
+			    oc->oc_host, oc->oc_port);
+			TAILQ_INSERT_TAIL(&ol->ol_waiters, oc, oc_entry);
+			return (0);
+		}
+	}
+
+	if ((ol = calloc(1, sizeof(*ol))) == NULL ||
+	    (ol->ol_host = strdup(oc->oc_host)) == NULL ||
+	    (ol->ol_port = strdup(oc->oc_port)) == NULL) {
+		log_warn("%s: calloc", __func__);
+		goto fail;
+	}
+	ol->ol_fd = res->res_fd[1];
+	TAILQ_INIT(&ol->ol_waiters);
+
+	log_debug("%s: resolving %s:%s", __func__, ol->ol_host, ol->ol_port);
+
+	if ((error = pthread_attr_init(&attr)) != 0 ||
+	    (error = pthread_attr_setdetachstate(&attr,
+	    PTHREAD_CREATE_DETACHED)) != 0 ||
+	    (error = pthread_create(&thread, &attr, ocsp_resolve_thread,
+	    ol)) != 0) {
+		log_warnx("%s: pthread_create: %s", __func__, strerror(error));
+		pthread_attr_destroy(&attr);
+		goto fail;
+	}
+	pthread_attr_destroy(&attr);
+
+	TAILQ_INSERT_TAIL(&ol->ol_waiters, oc, oc_entry);
+	TAILQ_INSERT_TAIL(&res->res_lookups, ol, ol_entry);
+	return (0);
+ fail:
+	if (ol != NULL) {
+		free(ol->ol_host);
+		free(ol->ol_port);
+		free(ol);
+	}
+	return (-1);
+}
+
+/* runs in the resolver thread, must not touch any other state */
+void *
+ocsp_resolve_thread(void *arg)
+{
+	struct ocsp_lookup	*ol = arg;
+	struct addrinfo		 hints;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	ol->ol_error = getaddrinfo(ol->ol_host, ol->ol_port, &hints,
+	    &ol->ol_res);
+
+	/* the pointer is smaller than PIPE_BUF and written atomically */
+	if (write(ol->ol_fd, &ol, sizeof(ol)) != sizeof(ol))
+		abort();
+	return (NULL);
+}
+
+/* a lookup has finished, start connecting for all waiting requests */
+void
+ocsp_resolve_cb(int fd, short event, void *arg)
+{
+	struct iked			*env = arg;
+	struct iked_ocsp_resolver	*res = env->sc_ocsp_resolver;
+	struct ocsp_lookup		*ol;
+	struct ocsp_addrcache		*oa = NULL;
+	struct ocsp_connect		*oc;
+
+	while (read(fd, &ol, sizeof(ol)) == sizeof(ol)) {
+		TAILQ_REMOVE(&res->res_lookups, ol, ol_entry);
+
+		if (ol->ol_error != 0)
+			log_warnx("%s: getaddrinfo(%s, %s) failed: %s",
+			    __func__, ol->ol_host, ol->ol_port,
+			    gai_strerror(ol->ol_error));
+		else if ((oa = ocsp_addrcache_add(env, ol->ol_host,
+		    ol->ol_port, ol->ol_res)) == NULL)
+			log_debug("%s: no addr to connect to for %s:%s",
+			    __func__, ol->ol_host, ol->ol_port);
+
+		while ((oc = TAILQ_FIRST(&ol->ol_waiters)) != NULL) {
+			TAILQ_REMOVE(&ol->ol_waiters, oc, oc_entry);
+			if (oa == NULL) {
+				ocsp_connect_finish(env, -1, oc);
+				continue;
+			}
+			memcpy(oc->oc_addrs, oa->oa_addrs,
+			    sizeof(oc->oc_addrs));
+			oc->oc_naddrs = oa->oa_naddrs;
+			ocsp_connect_next(oc);
+		}
+
+		if (ol->ol_res != NULL)
+			freeaddrinfo(ol->ol_res);
+		free(ol->ol_host);
+		free(ol->ol_port);
+		free(ol);
+		oa = NULL;
+	}
+}
+
+/* return the cached addresses of a responder unless they are expired */
+struct ocsp_addrcache *
+ocsp_addrcache_lookup(struct iked *env, const char *host, const char *port)
+{
+	struct iked_ocsp_resolver	*res = env->sc_ocsp_resolver;
+	struct ocsp_addrcache		*oa, *next;
+	time_t				 now = time(NULL);
+
+	if (res == NULL)
+		return (NULL);
+
+	TAILQ_FOREACH_SAFE(oa, &res->res_cache, oa_entry, next) {
+		if (oa->oa_expire <= now) {
+			ocsp_addrcache_free(res, oa);
+			continue;
+		}
+		if (strcmp(oa->oa_host, host) == 0 &&
+		    strcmp(oa->oa_port, port) == 0)
+			return (oa);
+	}
+	return (NULL);
+}
+
+/*
+ * Cache the addresses of a responder.  The addresses are ordered for
+ * happy eyeballs: families alternate, starting with the family of the
+ * first address returned by getaddrinfo().
+ */
+struct ocsp_addrcache *
+ocsp_addrcache_add(struct iked *env, const char *host, const char *port,
+    struct addrinfo *res0)
+{
+	struct iked_ocsp_resolver	*res = env->sc_ocsp_resolver;
+	struct ocsp_addrcache		*oa;
+	struct addrinfo			*ai, *next[2];
+	int				 fam[2], i;
+
+	if (res0 == NULL)
+		return (NULL);
+
+	if ((oa = ocsp_addrcache_lookup(env, host, port)) != NULL)
+		ocsp_addrcache_free(res, oa);
+	if (res->res_ncache >= OCSP_ADDRCACHE_MAX)
+		ocsp_addrcache_free(res, TAILQ_LAST(&res->res_cache,
+		    ocsp_addrcaches));
+
+	if ((oa = calloc(1, sizeof(*oa))) == NULL ||
+	    (oa->oa_host = strdup(host)) == NULL ||
+	    (oa->oa_port = strdup(port)) == NULL) {
+		log_warn("%s: calloc", __func__);
+		if (oa != NULL)
+			free(oa->oa_host);
+		free(oa);
+		return (NULL);
+	}
+
+	fam[0] = res0->ai_family;
+	fam[1] = fam[0] == AF_INET6 ? AF_INET : AF_INET6;
+	next[0] = next[1] = res0;
+	for (i = 0; oa->oa_naddrs < OCSP_ADDR_MAX; i = !i) {
+		for (ai = next[i]; ai != NULL; ai = ai->ai_next)
+			if (ai->ai_family == fam[i] &&
+			    ai->ai_addrlen <= sizeof(oa->oa_addrs[0]))
+				break;
+		if (ai == NULL) {
+			if (next[!i] == NULL)
+				break;
+			next[i] = NULL;
+			continue;
+		}
+		memcpy(&oa->oa_addrs[oa->oa_naddrs++], ai->ai_addr,
+		    ai->ai_addrlen);
+		next[i] = ai->ai_next;
+	}
+	if (oa->oa_naddrs == 0) {
+		free(oa->oa_host);
+		free(oa->oa_port);
+		free(oa);
+		return (NULL);
+	}
+
+	oa->oa_expire = time(NULL) + OCSP_ADDRCACHE_TTL;
+	TAILQ_INSERT_HEAD(&res->res_cache, oa, oa_entry);
+	res->res_ncache++;
+
+	return (oa);
+}
+
+void
+ocsp_addrcache_free(struct iked_ocsp_resolver *res, struct ocsp_addrcache *oa)
+{
+	TAILQ_REMOVE(&res->res_cache, oa, oa_entry);
+	res->res_ncache--;
+	free(oa->oa_host);
+	free(oa->oa_port);
+	free(oa);
+}
+
+/*
+ * Start a connection attempt to the next address.  If it doesn't
+ * complete within OCSP_HE_DELAY, the attempt to the following address
+ * is started in parallel and the first connection wins.
+ */
+void
+ocsp_connect_next(struct ocsp_connect *oc)
+{
+	struct ocsp_attempt	*att;
+	struct sockaddr		*sa;
+	struct timeval		 tv;
+	int			 fd;
+
+	evtimer_del(&oc->oc_timer);
+
+	while (oc->oc_next < oc->oc_naddrs) {
+		att = &oc->oc_attempts[oc->oc_next];
+		sa = (struct sockaddr *)&oc->oc_addrs[oc->oc_next++];
+
+		if ((fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK,
+		    0)) == -1) {
+			log_debug("%s: socket failed",
+			    SPI_SH(&oc->oc_sh, __func__));
+			continue;
+		}
+
+		log_debug("%s: connect(%s)", __func__, print_addr(sa));
+		if (connect(fd, sa, SA_LEN(sa)) == 0) {
+			ocsp_connect_done(oc, fd);
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			log_warn("%s: connect(%s)",
+			    SPI_SH(&oc->oc_sh, __func__), print_addr(sa));
 			close(fd);
+			continue;
+		}
+
+		/* register callback for async connect */
+		att->oa_oc = oc;
+		att->oa_fd = fd;
+		tv.tv_sec = OCSP_TIMEOUT;
+		tv.tv_usec = 0;
+		event_set(&att->oa_ev, fd, EV_WRITE, ocsp_connect_cb, att);
+		event_add(&att->oa_ev, &tv);
+		oc->oc_pending++;
+
+		if (oc->oc_next < oc->oc_naddrs) {
+			tv.tv_sec = 0;
+			tv.tv_usec = OCSP_HE_DELAY;
+			evtimer_add(&oc->oc_timer, &tv);
+		}
+		return;
 	}
-	return (ret);
+
+	if (oc->oc_pending == 0)
+		ocsp_connect_finish(oc->oc_env, -1, oc);
+}
+
+void
+ocsp_connect_delay_cb(int fd, short event, void *arg)
+{
+	ocsp_connect_next(arg);
 }
 
 /* callback triggered if connection to ocsp-responder completes/fails */
 void
 ocsp_connect_cb(int fd, short event, void *arg)
 {
-	struct ocsp_connect	*oc = arg;
-	int			 error, send_fd = -1;
+	struct ocsp_attempt	*att = arg;
+	struct ocsp_connect	*oc = att->oa_oc;
+	int			 error;
 	socklen_t		 len;
 
+	oc->oc_pending--;
+	att->oa_oc = NULL;
+
 	if (event == EV_TIMEOUT) {
 		log_info("%s: timeout, giving up",
 		    SPI_SH(&oc->oc_sh, __func__));
-		goto done;
-	}
-
-	len = sizeof(error);
-	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
-		log_warn("%s: getsockopt SOL_SOCKET SO_ERROR",
-		    SPI_SH(&oc->oc_sh, __func__));
-	} else if (error) {
-		log_warnx("%s: error while connecting: %s",
-		    SPI_SH(&oc->oc_sh, __func__), strerror(error));
 	} else {
-		send_fd = fd;
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+			log_warn("%s: getsockopt SOL_SOCKET SO_ERROR",
+			    SPI_SH(&oc->oc_sh, __func__));
+		} else if (error) {
+			log_warnx("%s: error while connecting: %s",
+			    SPI_SH(&oc->oc_sh, __func__), strerror(error));
+		} else {
+			ocsp_connect_done(oc, fd);
+			return;
+		}
 	}
- done:
-	ocsp_connect_finish(oc->oc_sock.sock_env, send_fd, oc);
+	close(fd);
 
-	/* if we did not send the fd, we need to close it ourself */
-	if (send_fd == -1)
-		close(fd);
+	/* try the next address right away */
+	ocsp_connect_next(oc);
+}
+
+/* one attempt connected, cancel the others and pass on the socket */
+void
+ocsp_connect_done(struct ocsp_connect *oc, int fd)
+{
+	struct ocsp_attempt	*att;
+	unsigned int		 i;
+
+	evtimer_del(&oc->oc_timer);
+	for (i = 0; i < oc->oc_next; i++) {
+		att = &oc->oc_attempts[i];
+		if (att->oa_oc == NULL || att->oa_fd == fd)
+			continue;
+		event_del(&att->oa_ev);
+		close(att->oa_fd);
+		att->oa_oc = NULL;
+	}
+	ocsp_connect_finish(oc->oc_env, fd, oc);
 }
 
 /* send FD+path or error back to CA process */
@@ -251,6 +707,8 @@ ocsp_connect_finish(struct iked *env, int fd, struct ocsp_connect *oc)
 	}
 	if (oc) {
 		free(oc->oc_url);
+		free(oc->oc_host);
+		free(oc->oc_port);
 		free(oc->oc_path);
 		free(oc);
 	}
@@ -265,91 +723,224 @@ int
 ocsp_validate_cert(struct iked *env, void *data, size_t len,
     struct iked_sahdr sh, uint8_t type, X509 *issuer)
 {
-	struct iovec		 iov[2];
 	STACK_OF(OPENSSL_STRING) *aia; /* Authority Information Access */
-	struct iked_ocsp_entry	*ioe;
-	struct iked_ocsp	*ocsp;
 	OCSP_CERTID		*id = NULL;
-	char			*url;
+	const char		*url;
 	BIO			*rawcert = NULL;
 	X509			*cert = NULL;
-	int			 ret, iovcnt = 0;
+	int			 ret = -1, status;
 
 	if (issuer == NULL)
 		return (-1);
-	if ((ioe = calloc(1, sizeof(*ioe))) == NULL)
+
+	if ((rawcert = BIO_new_mem_buf(data, len)) == NULL ||
+	    (cert = d2i_X509_bio(rawcert, NULL)) == NULL ||
+	    (id = OCSP_cert_to_id(NULL, cert, issuer)) == NULL) {
+		ca_sslerror(__func__);
+		BIO_free(rawcert);
+		X509_free(cert);
 		return (-1);
-	if ((ocsp = calloc(1, sizeof(*ocsp))) == NULL) {
-		free(ioe);
+	}
+	BIO_free(rawcert);
+	X509_free(cert);
+
+	/* Answer from the cache without asking the responder */
+	if ((status = ocsp_cache_lookup(env, id)) != -1) {
+		log_debug("%s: cached status: %s", SPI_SH(&sh, __func__),
+		    OCSP_cert_status_str(status));
+		OCSP_CERTID_free(id);
+		ocsp_notify(env, &sh, type, status == V_OCSP_CERTSTATUS_GOOD);
+		return (0);
+	}
+
+	/* optional ocsp-url from issuer, falls back to the default */
+	if ((aia = X509_get1_ocsp(issuer)) != NULL) {
+		url = sk_OPENSSL_STRING_value(aia, 0);
+		log_debug("%s: aia %s", __func__, url);
+	} else
+		url = env->sc_ocsp_url;
+
+	if (url == NULL) {
+		log_warnx("%s: no ocsp url", SPI_SH(&sh, __func__));
+		OCSP_CERTID_free(id);
+	} else
+		ret = ocsp_add_query(env, id, url, sh, type);
+
+	X509_email_free(aia);	/* free stack of openssl strings */
+
+	return (ret);
+}
+
+/*
+ * Add the certificate to a pending request: wait for a request that
+ * already asks for the same certificate, or add it to a request for
+ * the same responder that hasn't been sent yet.  Takes ownership
+ * of the id.
+ */
+int
+ocsp_add_query(struct iked *env, OCSP_CERTID *id, const char *url,
+    struct iked_sahdr sh, uint8_t type)
+{
+	struct iked_ocsp_entry	*ioe;
+	struct iked_ocsp	*ocsp, *batch = NULL;
+	struct iked_ocsp_conn	*conn;
+	struct ocsp_query	*oq = NULL;
+	struct ocsp_waiter	*ow;
+	int			 i;
+
+	if ((ow = calloc(1, sizeof(*ow))) == NULL) {
+		OCSP_CERTID_free(id);
 		return (-1);
 	}
+	ow->ow_sh = sh;
+	ow->ow_type = type;
 
-	ocsp->ocsp_env = env;
-	ocsp->ocsp_sh = sh;
-	ocsp->ocsp_type = type;
+	TAILQ_FOREACH(ioe, &env->sc_ocsp, ioe_entry) {
+		ocsp = ioe->ioe_ocsp;
+		if (strcmp(ocsp->ocsp_url, url) != 0)
+			continue;
+		for (i = 0; i < ocsp->ocsp_nqueries; i++) {
+			if (OCSP_id_cmp(ocsp->ocsp_queries[i].oq_id,
+			    id) == 0) {
+				oq = &ocsp->ocsp_queries[i];
+				break;
+			}
+		}
+		if (oq != NULL)
+			break;
+		if (batch == NULL && !ocsp->ocsp_sent &&
+		    ocsp->ocsp_nqueries < OCSP_BATCH_MAX)
+			batch = ocsp;
+	}
 
-	if ((rawcert = BIO_new_mem_buf(data, len)) == NULL ||
-	    (cert = d2i_X509_bio(rawcert, NULL)) == NULL ||
-	    (ocsp->ocsp_cbio = BIO_new(BIO_s_socket())) == NULL ||
-	    (ocsp->ocsp_req = OCSP_REQUEST_new()) == NULL ||
-	    (id = OCSP_cert_to_id(NULL, cert, issuer)) == NULL ||
-	    !OCSP_request_add0_id(ocsp->ocsp_req, id))
-		goto err;
+	if (oq != NULL) {
+		log_debug("%s: joining pending request",
+		    SPI_SH(&sh, __func__));
+		OCSP_CERTID_free(id);
+		TAILQ_INSERT_TAIL(&oq->oq_waiters, ow, ow_entry);
+		return (0);
+	}
+
+	if ((ocsp = batch) != NULL) {
+		log_debug("%s: adding to pending request with %d cert%s",
+		    SPI_SH(&sh, __func__), ocsp->ocsp_nqueries,
+		    ocsp->ocsp_nqueries == 1 ? "" : "s");
+	} else if ((ocsp = ocsp_new(env, url, sh)) == NULL) {
+		OCSP_CERTID_free(id);
+		free(ow);
+		return (-1);
+	}
 
-	/* id is owned by and freed together with ocsp_req */
-	ocsp->ocsp_id = id;
+	oq = &ocsp->ocsp_queries[ocsp->ocsp_nqueries++];
+	oq->oq_id = id;
+	TAILQ_INIT(&oq->oq_waiters);
+	TAILQ_INSERT_TAIL(&oq->oq_waiters, ow, ow_entry);
 
-	BIO_free(rawcert);
-	X509_free(cert);
+	if (batch != NULL)
+		return (0);
+
+	/*
+	 * Reuse an idle connection or ask the parent for a new one.
+	 * On failure the waiters have already been notified.
+	 */
+	if ((conn = ocsp_conn_get(env, url)) != NULL)
+		ocsp_send(ocsp, conn);
+	else
+		ocsp_request_fd(ocsp);
+	return (0);
+}
+
+/* allocate a new request and add it to the list of pending requests */
+struct iked_ocsp *
+ocsp_new(struct iked *env, const char *url, struct iked_sahdr sh)
+{
+	struct iked_ocsp_entry	*ioe;
+	struct iked_ocsp	*ocsp;
+	char			*port = NULL;
+	int			 use_ssl;
+
+	if ((ioe = calloc(1, sizeof(*ioe))) == NULL)
+		return (NULL);
+	if ((ocsp = calloc(1, sizeof(*ocsp))) == NULL) {
+		free(ioe);
+		return (NULL);
+	}
+
+	ocsp->ocsp_env = env;
+	ocsp->ocsp_sh = sh;
+	if ((ocsp->ocsp_url = strdup(url)) == NULL ||
+	    !OCSP_parse_url(url, &ocsp->ocsp_host, &port, &ocsp->ocsp_path,
+	    &use_ssl)) {
+		log_warnx("%s: error parsing OCSP-request-URL: %s",
+		    SPI_SH(&sh, __func__), url);
+		free(port);
+		free(ioe);
+		ocsp_free(ocsp);
+		return (NULL);
+	}
+	free(port);
 
 	ioe->ioe_ocsp = ocsp;
 	TAILQ_INSERT_TAIL(&env->sc_ocsp, ioe, ioe_entry);
 
+	return (ocsp);
+}
+
+/* request a connection to the ocsp-responder from the parent */
+int
+ocsp_request_fd(struct iked_ocsp *ocsp)
+{
+	struct iked		*env = ocsp->ocsp_env;
+	struct iovec		 iov[2];
+	int			 iovcnt = 0;
+
 	/* pass SA header */
 	iov[iovcnt].iov_base = &ocsp->ocsp_sh;
 	iov[iovcnt].iov_len = sizeof(ocsp->ocsp_sh);
 	iovcnt++;
 
-	/* pass optional ocsp-url from issuer */
-	if ((aia = X509_get1_ocsp(issuer)) != NULL) {
-		url = sk_OPENSSL_STRING_value(aia, 0);
-		log_debug("%s: aia %s", __func__, url);
-		iov[iovcnt].iov_base = url;
-		iov[iovcnt].iov_len = strlen(url);
-		iovcnt++;
-	}
-	/* request connection to ocsp-responder */
-	ret = proc_composev(&env->sc_ps, PROC_PARENT, IMSG_OCSP_FD,
-	    iov, iovcnt);
-
-	X509_email_free(aia);	/* free stack of openssl strings */
-
-	return (ret);
+	/* pass ocsp-url */
+	iov[iovcnt].iov_base = ocsp->ocsp_url;
+	iov[iovcnt].iov_len = strlen(ocsp->ocsp_url);
+	iovcnt++;
 
- err:
-	ca_sslerror(__func__);
-	free(ioe);
-	BIO_free(rawcert);
-	X509_free(cert);
-	OCSP_CERTID_free(id);
-	ocsp_validate_finish(ocsp, 0);	/* failed */
-	return (-1);
+	if (proc_composev(&env->sc_ps, PROC_PARENT, IMSG_OCSP_FD,
+	    iov, iovcnt) == -1) {
+		ocsp_validate_finish(ocsp, 0);
+		return (-1);
+	}
+	return (0);
 }
 
 /* free ocsp query context */
 void
 ocsp_free(struct iked_ocsp *ocsp)
 {
-	if (ocsp != NULL) {
-		if (ocsp->ocsp_sock != NULL) {
-			close(ocsp->ocsp_sock->sock_fd);
-			free(ocsp->ocsp_sock);
+	struct iked		*env;
+	struct iked_ocsp_entry	*ioe;
+	int			 i;
+
+	if (ocsp == NULL)
+		return;
+
+	env = ocsp->ocsp_env;
+	TAILQ_FOREACH(ioe, &env->sc_ocsp, ioe_entry) {
+		if (ioe->ioe_ocsp == ocsp) {
+			TAILQ_REMOVE(&env->sc_ocsp, ioe, ioe_entry);
+			free(ioe);
+			break;
 		}
-		BIO_free_all(ocsp->ocsp_cbio);
-		OCSP_REQ_CTX_free(ocsp->ocsp_req_ctx);
-		OCSP_REQUEST_free(ocsp->ocsp_req);
-		free(ocsp);
 	}
+
+	for (i = 0; i < ocsp->ocsp_nqueries; i++)
+		OCSP_CERTID_free(ocsp->ocsp_queries[i].oq_id);
+	ocsp_conn_free(ocsp->ocsp_conn);
+	OCSP_REQUEST_free(ocsp->ocsp_req);
+	ibuf_free(ocsp->ocsp_buf);
+	free(ocsp->ocsp_url);
+	free(ocsp->ocsp_host);
+	free(ocsp->ocsp_path);
+	free(ocsp);
 }
 
 /* we got a connection to the ocsp responder */
@@ -357,28 +948,18 @@ int
 ocsp_receive_fd(struct iked *env, struct imsg *imsg)
 {
 	struct iked_ocsp_entry	*ioe = NULL;
-	struct iked_ocsp	*ocsp = NULL, *ocsp_tmp;
-	struct iked_socket	*sock;
+	struct iked_ocsp	*ocsp = NULL;
+	struct iked_ocsp_conn	*conn;
 	struct iked_sahdr	 sh;
-	struct timeval		 tv;
-	uint8_t			*ptr;
-	char			*path = NULL;
-	size_t			 len;
-	int			 fd, ret = -1;
+	int			 fd;
 
 	IMSG_SIZE_CHECK(imsg, &sh);
-
-	ptr = (uint8_t *)imsg->data;
-	len = IMSG_DATA_SIZE(imsg);
-
-	memcpy(&sh, ptr, sizeof(sh));
-
-	ptr += sizeof(sh);
-	len -= sizeof(sh);
+	memcpy(&sh, imsg->data, sizeof(sh));
 
 	TAILQ_FOREACH(ioe, &env->sc_ocsp, ioe_entry) {
-		ocsp_tmp = ioe->ioe_ocsp;
-		if (memcmp(&ocsp_tmp->ocsp_sh, &sh, sizeof(sh)) == 0)
+		ocsp = ioe->ioe_ocsp;
+		if (ocsp->ocsp_conn == NULL && !ocsp->ocsp_sent &&
+		    memcmp(&ocsp->ocsp_sh, &sh, sizeof(sh)) == 0)
 			break;
 	}
 	if (ioe == NULL) {
@@ -387,44 +968,90 @@ ocsp_receive_fd(struct iked *env, struct imsg *imsg)
 			close(fd);
 		return (-1);
 	}
-	TAILQ_REMOVE(&env->sc_ocsp, ioe, ioe_entry);
-	ocsp = ioe->ioe_ocsp;
-	free(ioe);
 
-	if ((fd = imsg_get_fd(imsg)) == -1)
-		goto done;
+	if ((fd = imsg_get_fd(imsg)) == -1) {
+		ocsp_validate_finish(ocsp, 0);	/* failed */
+		return (-1);
+	}
 
-	if ((sock = calloc(1, sizeof(*sock))) == NULL)
-		fatal("ocsp_receive_fd: calloc sock");
+	if ((conn = calloc(1, sizeof(*conn))) == NULL ||
+	    (conn->conn_url = strdup(ocsp->ocsp_url)) == NULL)
+		fatal("ocsp_receive_fd: calloc conn");
 
 	/* note that sock_addr is not set */
-	sock->sock_fd = fd;
-	sock->sock_env = env;
-	ocsp->ocsp_sock = sock;
+	conn->conn_sock.sock_fd = fd;
+	conn->conn_sock.sock_env = env;
 
-	log_debug("%s: received socket fd %d", __func__, sock->sock_fd);
+	log_debug("%s: received socket fd %d", __func__, fd);
 
-	/* fetch 'path' and 'fd' from imsg */
-	if ((path = get_string(ptr, len)) == NULL)
-		goto done;
+	return (ocsp_send(ocsp, conn));
+}
 
-	BIO_set_fd(ocsp->ocsp_cbio, sock->sock_fd, BIO_NOCLOSE);
+/*
+ * Send the request for all certificates that have been added so far
+ * as HTTP/1.1 POST that keeps the connection open.
+ */
+int
+ocsp_send(struct iked_ocsp *ocsp, struct iked_ocsp_conn *conn)
+{
+	struct iked_socket	*sock = &conn->conn_sock;
+	OCSP_REQUEST		*req = NULL;
+	OCSP_CERTID		*id;
+	struct timeval		 tv;
+	unsigned char		*der = NULL;
+	char			*hdr = NULL;
+	int			 i, len, hdrlen, ret = -1;
+
+	ocsp->ocsp_conn = conn;
+	ocsp->ocsp_sent = 1;
 
-	if ((ocsp->ocsp_req_ctx = OCSP_sendreq_new(ocsp->ocsp_cbio,
-	    path, NULL, -1)) == NULL)
+	OCSP_REQUEST_free(ocsp->ocsp_req);
+	if ((ocsp->ocsp_req = req = OCSP_REQUEST_new()) == NULL)
 		goto done;
-	if (!OCSP_REQ_CTX_set1_req(ocsp->ocsp_req_ctx, ocsp->ocsp_req))
+	for (i = 0; i < ocsp->ocsp_nqueries; i++) {
+		if ((id = OCSP_CERTID_dup(ocsp->ocsp_queries[i].oq_id)) ==
+		    NULL || !OCSP_request_add0_id(req, id)) {
+			OCSP_CERTID_free(id);
+			goto done;
+		}
+	}
+	if ((len = i2d_OCSP_REQUEST(req, &der)) <= 0)
 		goto done;
 
+	if ((hdrlen = asprintf(&hdr, "POST %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "Content-Type: application/ocsp-request\r\n"
+	    "Content-Length: %d\r\n"
+	    "Connection: keep-alive\r\n"
+	    "\r\n", ocsp->ocsp_path, ocsp->ocsp_host, len)) == -1) {
+		hdr = NULL;
+		goto done;
+	}
+
+	ibuf_free(ocsp->ocsp_buf);
+	if ((ocsp->ocsp_buf = ibuf_open(hdrlen + len)) == NULL ||
+	    ibuf_add(ocsp->ocsp_buf, hdr, hdrlen) != 0 ||
+	    ibuf_add(ocsp->ocsp_buf, der, len) != 0)
+		goto done;
+	ocsp->ocsp_off = 0;
+
+	log_debug("%s: sending request for %d cert%s on %s connection",
+	    SPI_SH(&ocsp->ocsp_sh, __func__), ocsp->ocsp_nqueries,
+	    ocsp->ocsp_nqueries == 1 ? "" : "s",
+	    conn->conn_reused ? "reused" : "new");
+
 	tv.tv_sec = OCSP_TIMEOUT;
 	tv.tv_usec = 0;
 	event_set(&sock->sock_ev, sock->sock_fd, EV_WRITE, ocsp_callback, ocsp);
 	event_add(&sock->sock_ev, &tv);
 	ret = 0;
  done:
-	if (ret == -1)
+	if (ret == -1) {
+		ca_sslerror(__func__);
 		ocsp_validate_finish(ocsp, 0);	/* failed */
-	free(path);
+	}
+	OPENSSL_free(der);
+	free(hdr);
 	return (ret);
 }
 
@@ -475,9 +1102,13 @@ void
 ocsp_callback(int fd, short event, void *arg)
 {
 	struct iked_ocsp	*ocsp = arg;
-	struct iked_socket	*sock = ocsp->ocsp_sock;
+	struct iked_ocsp_conn	*conn = ocsp->ocsp_conn;
+	struct iked_socket	*sock = &conn->conn_sock;
 	struct timeval		 tv;
 	OCSP_RESPONSE		*resp = NULL;
+	uint8_t			 buf[4096];
+	ssize_t			 n;
+	int			 keepalive = 0, ret;
 
 	if (event == EV_TIMEOUT) {
 		log_info("%s: timeout, giving up",
@@ -485,25 +1116,250 @@ ocsp_callback(int fd, short event, void *arg)
 		ocsp_validate_finish(ocsp, 0);
 		return;
 	}
-	/*
-	 * Only call OCSP_sendreq_nbio() if should_read/write is
-	 * either not requested or read/write can be called.
-	 */
-	if ((!BIO_should_read(ocsp->ocsp_cbio) || (event & EV_READ)) &&
-	    (!BIO_should_write(ocsp->ocsp_cbio) || (event & EV_WRITE)) &&
-	    OCSP_sendreq_nbio(&resp, ocsp->ocsp_req_ctx) != -1 ) {
-		ocsp_parse_response(ocsp, resp);
-		return;
+
+	if (event & EV_WRITE) {
+		n = write(fd, (uint8_t *)ibuf_data(ocsp->ocsp_buf) +
+		    ocsp->ocsp_off, ibuf_size(ocsp->ocsp_buf) - ocsp->ocsp_off);
+		if (n == -1 && errno != EAGAIN && errno != EINTR)
+			goto retry;
+		if (n > 0)
+			ocsp->ocsp_off += n;
+		if (ocsp->ocsp_off == ibuf_size(ocsp->ocsp_buf)) {
+			/* request sent, now read the response */
+			ibuf_free(ocsp->ocsp_buf);
+			if ((ocsp->ocsp_buf = ibuf_dynamic(sizeof(buf),
+			    OCSP_RESPONSE_MAX)) == NULL) {
+				ocsp_validate_finish(ocsp, 0);
+				return;
+			}
+			event_set(&sock->sock_ev, fd, EV_READ,
+			    ocsp_callback, ocsp);
+		}
+	} else {
+		n = read(fd, buf, sizeof(buf));
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			goto again;
+		if (n == -1 || (n == 0 && ibuf_size(ocsp->ocsp_buf) == 0))
+			goto retry;
+		if (n > 0 && ibuf_add(ocsp->ocsp_buf, buf, n) != 0) {
+			log_info("%s: response too large",
+			    SPI_SH(&ocsp->ocsp_sh, __func__));
+			ocsp_validate_finish(ocsp, 0);
+			return;
+		}
+		if ((ret = ocsp_http_response(ocsp, &resp, &keepalive)) == 0 &&
+		    n == 0)
+			ret = -1;	/* connection closed too early */
+		if (ret != 0) {
+			if (ret == 1 && keepalive) {
+				ocsp_conn_put(ocsp->ocsp_env, conn);
+				ocsp->ocsp_conn = NULL;
+			}
+			ocsp_parse_response(ocsp, resp);
+			return;
+		}
 	}
-	if (BIO_should_read(ocsp->ocsp_cbio))
-		event_set(&sock->sock_ev, sock->sock_fd, EV_READ,
-		    ocsp_callback, ocsp);
-	else if (BIO_should_write(ocsp->ocsp_cbio))
-		event_set(&sock->sock_ev, sock->sock_fd, EV_WRITE,
-		    ocsp_callback, ocsp);
+
+ again:
 	tv.tv_sec = OCSP_TIMEOUT;
 	tv.tv_usec = 0;
 	event_add(&sock->sock_ev, &tv);
+	return;
+
+ retry:
+	/* the responder may have closed an idle connection */
+	if (conn->conn_reused) {
+		log_debug("%s: reused connection failed, reconnecting",
+		    SPI_SH(&ocsp->ocsp_sh, __func__));
+		ocsp_conn_free(conn);
+		ocsp->ocsp_conn = NULL;
+		ocsp->ocsp_sent = 0;
+		ocsp_request_fd(ocsp);
+		return;
+	}
+	log_info("%s: connection failed", SPI_SH(&ocsp->ocsp_sh, __func__));
+	ocsp_validate_finish(ocsp, 0);
+}
+
+/*
+ * Parse the HTTP response in ocsp_buf.  Returns 0 if more data is
+ * needed, 1 if the response is complete, -1 on error.  The body is
+ * either chunked, has a Content-Length or ends with the connection.
+ */
+int
+ocsp_http_response(struct iked_ocsp *ocsp, OCSP_RESPONSE **resp,
+    int *keepalive)
+{
+	const unsigned char	*body;
+	struct ibuf		*chunks = NULL;
+	char			*data = ibuf_data(ocsp->ocsp_buf);
+	char			*hdr, *p, *line, *val;
+	size_t			 size = ibuf_size(ocsp->ocsp_buf), i;
+	size_t			 hdrlen = 0, clen = 0;
+	const char		*errstr = NULL;
+	int			 minor, status, have_clen = 0, conn_close = 0;
+	int			 chunked = 0, ret;
+
+	for (i = 0; i + 4 <= size; i++) {
+		if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+			hdrlen = i + 4;
+			break;
+		}
+	}
+	if (hdrlen == 0)
+		return (0);
+
+	if ((hdr = strndup(data, hdrlen)) == NULL)
+		return (-1);
+	p = hdr;
+
+	/* status line */
+	line = strsep(&p, "\n");
+	if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) {
+		log_info("%s: invalid HTTP response",
+		    SPI_SH(&ocsp->ocsp_sh, __func__));
+		free(hdr);
+		return (-1);
+	}
+	if (status != 200) {
+		log_info("%s: HTTP status %d",
+		    SPI_SH(&ocsp->ocsp_sh, __func__), status);
+		free(hdr);
+		return (-1);
+	}
+	if (minor == 0)
+		conn_close = 1;
+
+	while ((line = strsep(&p, "\n")) != NULL && *line != '\r') {
+		line[strcspn(line, "\r")] = '\0';
+		if ((val = strchr(line, ':')) == NULL)
+			continue;
+		*val++ = '\0';
+		val += strspn(val, " \t");
+		if (strcasecmp(line, "Content-Length") == 0) {
+			clen = strtonum(val, 0, OCSP_RESPONSE_MAX, &errstr);
+			if (errstr != NULL) {
+				errstr = "invalid Content-Length";
+				break;
+			}
+			have_clen = 1;
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			if (strcasecmp(val, "chunked") != 0) {
+				errstr = "unsupported Transfer-Encoding";
+				break;
+			}
+			chunked = 1;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			if (strcasecmp(val, "close") == 0)
+				conn_close = 1;
+			else if (strcasecmp(val, "keep-alive") == 0)
+				conn_close = 0;
+		}
+	}
+	free(hdr);
+	if (errstr != NULL) {
+		log_info("%s: %s", SPI_SH(&ocsp->ocsp_sh, __func__), errstr);
+		return (-1);
+	}
+
+	/* the chunked encoding overrides any Content-Length */
+	if (chunked) {
+		if ((ret = ocsp_http_chunked(ocsp, data + hdrlen,
+		    size - hdrlen, &chunks, &clen)) != 1)
+			return (ret);
+		body = ibuf_data(chunks);
+		*resp = d2i_OCSP_RESPONSE(NULL, &body, ibuf_size(chunks));
+		ibuf_free(chunks);
+		if (*resp == NULL)
+			return (-1);
+		*keepalive = !conn_close && size == hdrlen + clen;
+		return (1);
+	}
+
+	if (have_clen) {
+		if (size < hdrlen + clen)
+			return (0);
+	} else {
+		/* wait for EOF */
+		clen = size - hdrlen;
+		conn_close = 1;
+	}
+
+	body = (unsigned char *)data + hdrlen;
+	if ((*resp = d2i_OCSP_RESPONSE(NULL, &body, clen)) == NULL)
+		return (have_clen ? -1 : 0);
+
+	*keepalive = !conn_close && size == hdrlen + clen;
+	return (1);
+}
+
+/*
+ * Decode the chunked body in data.  Returns 0 if more data is needed,
+ * 1 if the last chunk and the trailer are complete, -1 on error.  The
+ * decoded body is returned in body and the encoded length in used.
+ */
+int
+ocsp_http_chunked(struct iked_ocsp *ocsp, const char *data, size_t size,
+    struct ibuf **body, size_t *used)
+{
+	struct ibuf		*buf;
+	size_t			 off = 0, eol, i, len;
+	int			 c, last = 0;
+
+	if ((buf = ibuf_dynamic(0, OCSP_RESPONSE_MAX)) == NULL)
+		return (-1);
+
+	for (;;) {
+		for (eol = off; eol + 1 < size; eol++)
+			if (data[eol] == '\r' && data[eol + 1] == '\n')
+				break;
+		if (eol + 1 >= size)
+			goto more;
+
+		/* skip the trailer fields up to the empty line */
+		if (last) {
+			if (eol == off)
+				break;
+			off = eol + 2;
+			continue;
+		}
+
+		/* chunk-size [ chunk-ext ] CRLF */
+		for (len = 0, i = off; i < eol &&
+		    isxdigit((unsigned char)data[i]); i++) {
+			c = tolower((unsigned char)data[i]);
+			len = len * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+			if (len > OCSP_RESPONSE_MAX)
+				goto fail;
+		}
+		if (i == off || (i < eol && data[i] != ';' &&
+		    data[i] != ' ' && data[i] != '\t'))
+			goto fail;
+		off = eol + 2;
+		if (len == 0) {
+			last = 1;
+			continue;
+		}
+
+		/* chunk-data CRLF */
+		if (size - off < len + 2)
+			goto more;
+		if (memcmp(data + off + len, "\r\n", 2) != 0 ||
+		    ibuf_add(buf, data + off, len) != 0)
+			goto fail;
+		off += len + 2;
+	}
+
+	*body = buf;
+	*used = off + 2;
+	return (1);
+ more:
+	ibuf_free(buf);
+	return (0);
+ fail:
+	log_info("%s: invalid chunked body", SPI_SH(&ocsp->ocsp_sh, __func__));
+	ibuf_free(buf);
+	return (-1);
 }
 
 /* parse the actual OCSP response */
@@ -511,13 +1367,14 @@ void
 ocsp_parse_response(struct iked_ocsp *ocsp, OCSP_RESPONSE *resp)
 {
 	struct iked		*env = ocsp->ocsp_env;
+	struct ocsp_query	*oq;
 	X509_STORE		*store = NULL;
 	STACK_OF(X509)		*verify_other = NULL;
 	OCSP_BASICRESP		*bs = NULL;
 	ASN1_GENERALIZEDTIME	*rev, *thisupd, *nextupd;
-	const char		*errstr;
-	int			 reason = 0, valid = 0, verify_flags = 0;
-	int			 status;
+	const char		*errstr = NULL;
+	int			 reason = 0, valid, verify_flags = 0;
+	int			 i, status;
 
 	if (!resp) {
 		errstr = "error querying OCSP responder";
@@ -565,55 +1422,434 @@ ocsp_parse_response(struct iked_ocsp *ocsp, OCSP_RESPONSE *resp)
 	}
 	log_debug("%s: response verify ok", SPI_SH(&ocsp->ocsp_sh, __func__));
 
-	if (!OCSP_resp_find_status(bs, ocsp->ocsp_id, &status, &reason,
-	    &rev, &thisupd, &nextupd)) {
-		errstr = "no status found";
-		goto done;
-	}
-	if (env->sc_ocsp_tolerate &&
-	    !OCSP_check_validity(thisupd, nextupd, env->sc_ocsp_tolerate,
-	    env->sc_ocsp_maxage)) {
-		ca_sslerror(SPI_SH(&ocsp->ocsp_sh, __func__));
-		errstr = "status times invalid";
-		goto done;
-	}
-	errstr = OCSP_cert_status_str(status);
-	if (status == V_OCSP_CERTSTATUS_GOOD) {
+	/* the response is verified once for all certificates */
+	for (i = 0; i < ocsp->ocsp_nqueries; i++) {
+		oq = &ocsp->ocsp_queries[i];
+		valid = 0;
+		if (!OCSP_resp_find_status(bs, oq->oq_id, &status, &reason,
+		    &rev, &thisupd, &nextupd)) {
+			log_debug("%s: status: no status found", __func__);
+			ocsp_query_finish(env, oq, 0);
+			continue;
+		}
+		if (env->sc_ocsp_tolerate &&
+		    !OCSP_check_validity(thisupd, nextupd,
+		    env->sc_ocsp_tolerate, env->sc_ocsp_maxage)) {
+			ca_sslerror(SPI_SH(&ocsp->ocsp_sh, __func__));
+			log_debug("%s: status: status times invalid",
+			    __func__);
+			ocsp_query_finish(env, oq, 0);
+			continue;
+		}
+		if (status == V_OCSP_CERTSTATUS_GOOD ||
+		    status == V_OCSP_CERTSTATUS_REVOKED)
+			ocsp_cache_add(env, oq->oq_id, status, thisupd,
+			    nextupd);
+		if (status == V_OCSP_CERTSTATUS_GOOD)
+			valid = 1;
 		log_debug("%s: status: %s", SPI_SH(&ocsp->ocsp_sh, __func__),
-		    errstr);
-		valid = 1;
+		    OCSP_cert_status_str(status));
+		ocsp_query_finish(env, oq, valid);
 	}
  done:
-	if (!valid) {
+	if (errstr != NULL)
 		log_debug("%s: status: %s", __func__, errstr);
-	}
 	X509_STORE_free(store);
 	sk_X509_pop_free(verify_other, X509_free);
 	OCSP_RESPONSE_free(resp);
 	OCSP_BASICRESP_free(bs);
 
-	ocsp_validate_finish(ocsp, valid);
+	ocsp_validate_finish(ocsp, 0);
 }
 
 /*
- * finish the ocsp_validate_cert() RPC by sending the appropriate
- * message back to the IKEv2 process
+ * finish the ocsp_validate_cert() RPC for all certificates in the
+ * request that are still waiting and free the request
  */
 int
 ocsp_validate_finish(struct iked_ocsp *ocsp, int valid)
 {
-	struct iked		*env = ocsp->ocsp_env;
+	int			 i;
+
+	for (i = 0; i < ocsp->ocsp_nqueries; i++)
+		ocsp_query_finish(ocsp->ocsp_env, &ocsp->ocsp_queries[i],
+		    valid);
+
+	ocsp_free(ocsp);
+	return (0);
+}
+
+/* send the appropriate message back to every waiting IKEv2 SA */
+void
+ocsp_query_finish(struct iked *env, struct ocsp_query *oq, int valid)
+{
+	struct ocsp_waiter	*ow;
+
+	while ((ow = TAILQ_FIRST(&oq->oq_waiters)) != NULL) {
+		TAILQ_REMOVE(&oq->oq_waiters, ow, ow_entry);
+		ocsp_notify(env, &ow->ow_sh, ow->ow_type, valid);
+		free(ow);
+	}
+}
+
+int
+ocsp_notify(struct iked *env, struct iked_sahdr *sh, uint8_t type, int valid)
+{
 	struct iovec		 iov[2];
-	int			 iovcnt = 2, ret, cmd;
+	int			 iovcnt = 2, cmd;
 
-	iov[0].iov_base = &ocsp->ocsp_sh;
-	iov[0].iov_len = sizeof(ocsp->ocsp_sh);
-	iov[1].iov_base = &ocsp->ocsp_type;
-	iov[1].iov_len = sizeof(ocsp->ocsp_type);
+	iov[0].iov_base = sh;
+	iov[0].iov_len = sizeof(*sh);
+	iov[1].iov_base = &type;
+	iov[1].iov_len = sizeof(type);
 
 	cmd = valid ? IMSG_CERTVALID : IMSG_CERTINVALID;
-	ret = proc_composev(&env->sc_ps, PROC_IKEV2, cmd, iov, iovcnt);
+	return (proc_composev(&env->sc_ps, PROC_IKEV2, cmd, iov, iovcnt));
+}
 
-	ocsp_free(ocsp);
-	return (ret);
+/* take an idle keep-alive connection to the responder from the pool */
+struct iked_ocsp_conn *
+ocsp_conn_get(struct iked *env, const char *url)
+{
+	struct iked_ocsp_conn	*conn;
+
+	TAILQ_FOREACH(conn, &env->sc_ocsp_conns, conn_entry) {
+		if (strcmp(conn->conn_url, url) == 0)
+			break;
+	}
+	if (conn == NULL)
+		return (NULL);
+
+	TAILQ_REMOVE(&env->sc_ocsp_conns, conn, conn_entry);
+	event_del(&conn->conn_sock.sock_ev);
+	conn->conn_reused = 1;
+
+	log_debug("%s: reusing connection fd %d to %s", __func__,
+	    conn->conn_sock.sock_fd, url);
+
+	return (conn);
+}
+
+/* return a connection to the pool after a complete response */
+void
+ocsp_conn_put(struct iked *env, struct iked_ocsp_conn *conn)
+{
+	struct iked_ocsp_conn	*c;
+	struct timeval		 tv;
+	int			 count = 0;
+
+	TAILQ_FOREACH(c, &env->sc_ocsp_conns, conn_entry) {
+		if (strcmp(c->conn_url, conn->conn_url) == 0)
+			count++;
+	}
+	if (count >= OCSP_POOL_MAX) {
+		ocsp_conn_free(conn);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&env->sc_ocsp_conns, conn, conn_entry);
+
+	/* the responder closing the connection or the timeout drops it */
+	tv.tv_sec = OCSP_IDLE_TIMEOUT;
+	tv.tv_usec = 0;
+	event_set(&conn->conn_sock.sock_ev, conn->conn_sock.sock_fd, EV_READ,
+	    ocsp_conn_idle_cb, conn);
+	event_add(&conn->conn_sock.sock_ev, &tv);
+}
+
+void
+ocsp_conn_free(struct iked_ocsp_conn *conn)
+{
+	if (conn == NULL)
+		return;
+	close(conn->conn_sock.sock_fd);
+	free(conn->conn_url);
+	free(conn);
+}
+
+/* idle connection was closed by the responder or timed out */
+void
+ocsp_conn_idle_cb(int fd, short event, void *arg)
+{
+	struct iked_ocsp_conn	*conn = arg;
+	struct iked		*env = conn->conn_sock.sock_env;
+
+	log_debug("%s: closing idle connection fd %d to %s", __func__,
+	    fd, conn->conn_url);
+
+	TAILQ_REMOVE(&env->sc_ocsp_conns, conn, conn_entry);
+	ocsp_conn_free(conn);
+}
+
+int
+ocsp_cache_cmp(struct iked_ocsp_cache_entry *a,
+    struct iked_ocsp_cache_entry *b)
+{
+	if (a->oce_idlen < b->oce_idlen)
+		return (-1);
+	if (a->oce_idlen > b->oce_idlen)
+		return (1);
+	return (memcmp(a->oce_id, b->oce_id, a->oce_idlen));
+}
+
+/* return the cached status for the id or -1 */
+int
+ocsp_cache_lookup(struct iked *env, OCSP_CERTID *id)
+{
+	struct iked_ocsp_cache_entry	 key, *oce;
+	unsigned char			*der = NULL;
+	int				 len;
+
+	if (RB_EMPTY(&env->sc_ocsp_cache))
+		return (-1);
+	if ((len = i2d_OCSP_CERTID(id, &der)) <= 0)
+		return (-1);
+
+	key.oce_id = der;
+	key.oce_idlen = len;
+	oce = RB_FIND(iked_ocsp_cache, &env->sc_ocsp_cache, &key);
+	OPENSSL_free(der);
+
+	if (oce == NULL)
+		return (-1);
+	if (oce->oce_expire <= time(NULL)) {
+		ocsp_cache_remove(env, oce);
+		return (-1);
+	}
+	return (oce->oce_status);
 }
+
+int
+ocsp_cache_insert(struct iked *env, uint8_t *id, size_t idlen, int status,
+    time_t expire)
+{
+	struct iked_ocsp_cache_entry	*oce, *old;
+
+	if (env->sc_ocsp_cachesize >= OCSP_CACHE_MAX) {
+		ocsp_cache_expire(env, time(NULL));
+		if (env->sc_ocsp_cachesize >= OCSP_CACHE_MAX)
+			return (-1);
+	}
+
+	if ((oce = calloc(1, sizeof(*oce))) == NULL)
+		return (-1);
+	if ((oce->oce_id = malloc(idlen)) == NULL) {
+		free(oce);
+		return (-1);
+	}
+	memcpy(oce->oce_id, id, idlen);
+	oce->oce_idlen = idlen;
+	oce->oce_status = status;
+	oce->oce_expire = expire;
+
+	if ((old = RB_INSERT(iked_ocsp_cache, &env->sc_ocsp_cache,
+	    oce)) != NULL) {
+		old->oce_status = status;
+		old->oce_expire = expire;
+		free(oce->oce_id);
+		free(oce);
+		return (0);
+	}
+	env->sc_ocsp_cachesize++;
+	return (0);
+}
+
+/* cache a verified status until nextUpdate, bounded by maxage */
+void
+ocsp_cache_add(struct iked *env, OCSP_CERTID *id, int status,
+    ASN1_GENERALIZEDTIME *thisupd, ASN1_GENERALIZEDTIME *nextupd)
+{
+	unsigned char		*der = NULL;
+	time_t			 now = time(NULL), expire, maxage;
+	int			 len, day, sec;
+
+	if (nextupd != NULL) {
+		if (!ASN1_TIME_diff(&day, &sec, NULL, nextupd))
+			return;
+		expire = now + (time_t)day * 24 * 60 * 60 + sec;
+	} else if (env->sc_ocsp_maxage == -1) {
+		/* newer status information is always available */
+		return;
+	} else
+		expire = 0;
+
+	if (env->sc_ocsp_maxage != -1) {
+		if (!ASN1_TIME_diff(&day, &sec, NULL, thisupd))
+			return;
+		maxage = now + (time_t)day * 24 * 60 * 60 + sec +
+		    env->sc_ocsp_maxage;
+		if (expire == 0 || maxage < expire)
+			expire = maxage;
+	}
+	if (expire <= now)
+		return;
+
+	if ((len = i2d_OCSP_CERTID(id, &der)) <= 0)
+		return;
+	if (ocsp_cache_insert(env, der, len, status, expire) == 0) {
+		log_debug("%s: caching status for %lld seconds", __func__,
+		    (long long)(expire - now));
+		if (env->sc_ocsp_cachefd != -1 && !env->sc_ocsp_cachedirty) {
+			env->sc_ocsp_cachedirty = 1;
+			timer_add(env, &env->sc_ocsp_cachetmr,
+			    OCSP_CACHE_SAVE_INTERVAL);
+		}
+	}
+	OPENSSL_free(der);
+}
+
+void
+ocsp_cache_remove(struct iked *env, struct iked_ocsp_cache_entry *oce)
+{
+	RB_REMOVE(iked_ocsp_cache, &env->sc_ocsp_cache, oce);
+	env->sc_ocsp_cachesize--;
+	free(oce->oce_id);
+	free(oce);
+}
+
+void
+ocsp_cache_expire(struct iked *env, time_t now)
+{
+	struct iked_ocsp_cache_entry	*oce, *next;
+
+	RB_FOREACH_SAFE(oce, iked_ocsp_cache, &env->sc_ocsp_cache, next) {
+		if (oce->oce_expire <= now)
+			ocsp_cache_remove(env, oce);
+	}
+}
+
+/* we got the cache file from the parent */
+int
+ocsp_cache_open(struct iked *env, struct imsg *imsg)
+{
+	int		 fd;
+
+	if ((fd = imsg_get_fd(imsg)) == -1)
+		return (-1);
+	if (env->sc_ocsp_cachefd != -1) {
+		/* the file is only opened once at startup */
+		close(fd);
+		return (0);
+	}
+
+	env->sc_ocsp_cachefd = fd;
+	timer_set(env, &env->sc_ocsp_cachetmr, ocsp_cache_save, NULL);
+	ocsp_cache_load(env);
+	return (0);
+}
+
+void
+ocsp_cache_load(struct iked *env)
+{
+	struct ocsp_cache_hdr	 hdr;
+	struct ocsp_cache_rec	 rec;
+	struct stat		 st;
+	uint8_t			*buf = NULL, *ptr;
+	size_t			 len;
+	time_t			 now = time(NULL);
+	uint32_t		 i, loaded = 0;
+
+	if (fstat(env->sc_ocsp_cachefd, &st) == -1) {
+		log_warn("%s: fstat", __func__);
+		return;
+	}
+	if ((size_t)st.st_size < sizeof(hdr))
+		return;
+	len = st.st_size;
+	if ((buf = malloc(len)) == NULL) {
+		log_warn("%s: malloc", __func__);
+		return;
+	}
+	if (pread(env->sc_ocsp_cachefd, buf, len, 0) != (ssize_t)len) {
+		log_warn("%s: pread", __func__);
+		goto done;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.och_magic != OCSP_CACHE_MAGIC) {
+		log_warnx("%s: invalid cache file", __func__);
+		goto done;
+	}
+	ptr = buf + sizeof(hdr);
+	len -= sizeof(hdr);
+
+	for (i = 0; i < hdr.och_count; i++) {
+		if (len < sizeof(rec))
+			break;
+		memcpy(&rec, ptr, sizeof(rec));
+		ptr += sizeof(rec);
+		len -= sizeof(rec);
+		if (rec.ocr_idlen > len || rec.ocr_idlen > OCSP_CACHE_IDMAX)
+			break;
+		if (rec.ocr_expire > now &&
+		    (rec.ocr_status == V_OCSP_CERTSTATUS_GOOD ||
+		    rec.ocr_status == V_OCSP_CERTSTATUS_REVOKED) &&
+		    ocsp_cache_insert(env, ptr, rec.ocr_idlen,
+		    rec.ocr_status, rec.ocr_expire) == 0)
+			loaded++;
+		ptr += rec.ocr_idlen;
+		len -= rec.ocr_idlen;
+	}
+	log_debug("%s: loaded %u cached OCSP status%s", __func__,
+	    loaded, loaded == 1 ? "" : "es");
+ done:
+	free(buf);
+}
+
+/* write the unexpired entries back to the cache file */
+void
+ocsp_cache_save(struct iked *env, void *arg)
+{
+	struct iked_ocsp_cache_entry	*oce;
+	struct ocsp_cache_hdr		 hdr;
+	struct ocsp_cache_rec		 rec;
+	struct ibuf			*buf;
+	int				 fd;
+
+	env->sc_ocsp_cachedirty = 0;
+	ocsp_cache_expire(env, time(NULL));
+
+	if ((buf = ibuf_dynamic(sizeof(hdr), SIZE_MAX)) == NULL) {
+		log_warn("%s: ibuf_dynamic", __func__);
+		return;
+	}
+	bzero(&hdr, sizeof(hdr));
+	if (ibuf_add(buf, &hdr, sizeof(hdr)) != 0)
+		goto done;
+	RB_FOREACH(oce, iked_ocsp_cache, &env->sc_ocsp_cache) {
+		bzero(&rec, sizeof(rec));
+		rec.ocr_expire = oce->oce_expire;
+		rec.ocr_status = oce->oce_status;
+		rec.ocr_idlen = oce->oce_idlen;
+		if (ibuf_add(buf, &rec, sizeof(rec)) != 0 ||
+		    ibuf_add(buf, oce->oce_id, oce->oce_idlen) != 0)
+			goto done;
+	}
+
+	/*
+	 * The file is rewritten in place, it can't be replaced after
+	 * pledge.  Invalidate it first and only write the valid header
+	 * once the records are on disk, an interrupted save loses the
+	 * cache instead of mixing new and old records.
+	 */
+	fd = env->sc_ocsp_cachefd;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fsync(fd) == -1 ||
+	    pwrite(fd, ibuf_data(buf), ibuf_size(buf), 0) !=
+	    (ssize_t)ibuf_size(buf) ||
+	    fsync(fd) == -1) {
+		log_warn("%s: write", __func__);
+		goto done;
+	}
+	hdr.och_magic = OCSP_CACHE_MAGIC;
+	hdr.och_count = env->sc_ocsp_cachesize;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    ftruncate(fd, ibuf_size(buf)) == -1 ||
+	    fsync(fd) == -1)
+		log_warn("%s: write", __func__);
+ done:
+	ibuf_free(buf);
+}
+
+RB_GENERATE(iked_ocsp_cache, iked_ocsp_cache_entry, oce_entry,
+    ocsp_cache_cmp);
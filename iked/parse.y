@@ -105,10 +105,17 @@ static int		 stickyaddress = 0;
 static int		 fragmentation = 0;
 static int		 vendorid = 1;
 static int		 dpd_interval = IKED_IKE_SA_ALIVE_TIMEOUT;
+static int		 rekeywindow = IKED_REKEY_WINDOW;
 static char		*ocsp_url = NULL;
 static long		 ocsp_tolerate = 0;
 static long		 ocsp_maxage = -1;
+static char		*ocsp_cachefile = NULL;
+static char		*userdb_file = NULL;
 static int		 cert_partial_chain = 0;
+static int		 radius_timeout = IKED_RADIUS_TIMEOUT;
+static int		 radius_maxtries = IKED_RADIUS_MAXTRIES;
+static int		 redirect_mode = REDIRECT_NONE;
+static uint64_t		 redirect_maxsas = 0;
 
 struct iked_transform ikev2_default_ike_transforms[] = {
 	{ IKEV2_XFORMTYPE_ENCR, IKEV2_XFORMENCR_AES_CBC, 256 },
@@ -392,6 +399,8 @@ int			 create_ike(char *, int, struct ipsec_addr_wrap *,
 			    struct iked_auth *, struct ipsec_filters *,
 			    struct ipsec_addr_wrap *, char *);
 int			 create_user(const char *, const char *);
+int			 create_radius(const char *, in_port_t, const char *);
+int			 create_redirect(const char *, unsigned int);
 int			 get_id_type(char *);
 uint8_t			 x2i(unsigned char *);
 int			 parsekey(unsigned char *, size_t, struct iked_auth *);
@@ -452,9 +461,11 @@ typedef struct {
 %token	ENFORCESINGLEIKESA NOENFORCESINGLEIKESA
 %token	STICKYADDRESS NOSTICKYADDRESS
 %token	VENDORID NOVENDORID
-%token	TOLERATE MAXAGE DYNAMIC
-%token	CERTPARTIALCHAIN
-%token	REQUEST IFACE
+%token	TOLERATE MAXAGE DYNAMIC OCSPCACHE REKEYWINDOW
+%token	CERTPARTIALCHAIN USERDB
+%token	RADIUS SERVER SECRET TIMEOUT MAXTRIES
+%token	REDIRECT GATEWAY MODE STATIC WEIGHTED WEIGHT MAXSAS
+%token	REQUEST IFACE RESUME CHILDLESS
 %token  NATT
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
@@ -463,7 +474,7 @@ typedef struct {
 %type	<v.proto>		proto proto_list protoval
 %type	<v.hosts>		hosts hosts_list
 %type	<v.port>		port
-%type	<v.number>		portval af rdomain
+%type	<v.number>		portval af rdomain weight
 %type	<v.peers>		peers
 %type	<v.anyhost>		anyhost
 %type	<v.host>		host host_spec
@@ -472,7 +483,8 @@ typedef struct {
 %type	<v.transforms>		transforms
 %type	<v.filters>		filters
 %type	<v.ikemode>		ikeflags
-%type	<v.ikemode>		ikematch ikemode ipcomp tmode natt_force
+%type	<v.ikemode>		ikematch ikemode ipcomp tmode natt_force resume
+%type	<v.ikemode>		childless
 %type	<v.ikeauth>		ikeauth
 %type	<v.ikekey>		keyspec
 %type	<v.mode>		ike_sas child_sas
@@ -488,6 +500,8 @@ grammar		: /* empty */
 		| grammar '\n'
 		| grammar set '\n'
 		| grammar user '\n'
+		| grammar radius '\n'
+		| grammar redirect '\n'
 		| grammar ikev2rule '\n'
 		| grammar varset '\n'
 		| grammar otherrule skipline '\n'
@@ -539,6 +553,13 @@ set		: SET ACTIVE	{ passive = 0; }
 			ocsp_tolerate = $5;
 			ocsp_maxage = $7;
 		}
+		| SET OCSPCACHE STRING		{
+			ocsp_cachefile = $3;
+		}
+		| SET USERDB STRING		{
+			free(userdb_file);
+			userdb_file = $3;
+		}
 		| SET CERTPARTIALCHAIN		{
 			cert_partial_chain = 1;
 		}
@@ -549,6 +570,13 @@ set		: SET ACTIVE	{ passive = 0; }
 			}
 			dpd_interval = $3;
 		}
+		| SET REKEYWINDOW NUMBER {
+			if ($3 < 1 || $3 > 50) {
+				yyerror("rekey window outside range");
+				YYERROR;
+			}
+			rekeywindow = $3;
+		}
 		;
 
 user		: USER STRING STRING		{
@@ -559,6 +587,59 @@ user		: USER STRING STRING		{
 		}
 		;
 
+radius		: RADIUS SERVER STRING port SECRET STRING {
+			if (create_radius($3, $4, $6) == -1)
+				YYERROR;
+			free($3);
+			freezero($6, strlen($6));
+		}
+		| RADIUS TIMEOUT NUMBER {
+			if ($3 < 1 || $3 > 60) {
+				yyerror("radius timeout outside range");
+				YYERROR;
+			}
+			radius_timeout = $3;
+		}
+		| RADIUS MAXTRIES NUMBER {
+			if ($3 < 1 || $3 > 10) {
+				yyerror("radius max-tries outside range");
+				YYERROR;
+			}
+			radius_maxtries = $3;
+		}
+		;
+
+redirect	: REDIRECT GATEWAY STRING weight {
+			if (create_redirect($3, $4) == -1)
+				YYERROR;
+			free($3);
+		}
+		| REDIRECT MODE STATIC {
+			redirect_mode = REDIRECT_STATIC;
+		}
+		| REDIRECT MODE WEIGHTED {
+			redirect_mode = REDIRECT_WEIGHTED;
+		}
+		| REDIRECT MODE MAXSAS NUMBER {
+			if ($4 < 0) {
+				yyerror("redirect max-sas outside range");
+				YYERROR;
+			}
+			redirect_mode = REDIRECT_MAXSAS;
+			redirect_maxsas = $4;
+		}
+		;
+
+weight		: /* empty */			{ $$ = IKED_REDIRECT_WEIGHT; }
+		| WEIGHT NUMBER			{
+			if ($2 < 1 || $2 > IKED_REDIRECT_WEIGHT_MAX) {
+				yyerror("redirect weight outside range");
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
 ikev2rule	: IKEV2 name ikeflags satype af proto rdomain hosts_list peers
 		    ike_sas child_sas ids ikelifetime lifetime ikeauth ikecfg
 		    iface filters {
@@ -1021,8 +1102,8 @@ child_sa	: CHILDSA	{
 		}
 		;
 
-ikeflags	: ikematch ikemode ipcomp tmode natt_force {
-			$$ = $1 | $2 | $3 | $4 | $5;
+ikeflags	: ikematch ikemode ipcomp tmode natt_force resume childless {
+			$$ = $1 | $2 | $3 | $4 | $5 | $6 | $7;
 		}
 		;
 
@@ -1050,6 +1131,14 @@ natt_force	: /* empty */			{ $$ = 0; }
 		| NATT				{ $$ = IKED_POLICY_NATT_FORCE; }
 		;
 
+resume		: /* empty */			{ $$ = 0; }
+		| RESUME			{ $$ = IKED_POLICY_RESUME; }
+		;
+
+childless	: /* empty */			{ $$ = 0; }
+		| CHILDLESS			{ $$ = IKED_POLICY_CHILDLESS; }
+		;
+
 ikeauth		: /* empty */			{
 			$$.auth_method = IKEV2_AUTH_SIG_ANY;	/* default */
 			$$.auth_eap = 0;
@@ -1068,7 +1157,11 @@ ikeauth		: /* empty */			{
 				if ($2[i] == '-')
 					$2[i] = '_';
 
-			if (strcasecmp("mschap_v2", $2) != 0) {
+			if (strcasecmp("mschap_v2", $2) == 0)
+				$$.auth_eap = EAP_TYPE_MSCHAP_V2;
+			else if (strcasecmp("radius", $2) == 0)
+				$$.auth_eap = EAP_TYPE_RADIUS;
+			else {
 				yyerror("unsupported EAP method: %s", $2);
 				free($2);
 				YYERROR;
@@ -1076,7 +1169,6 @@ ikeauth		: /* empty */			{
 			free($2);
 
 			$$.auth_method = IKEV2_AUTH_SIG_ANY;
-			$$.auth_eap = EAP_TYPE_MSCHAP_V2;
 			$$.auth_length = 0;
 		}
 		| STRING			{
@@ -1366,6 +1458,7 @@ lookup(char *s)
 		{ "auth",		AUTHXF },
 		{ "bytes",		BYTES },
 		{ "cert_partial_chain",	CERTPARTIALCHAIN },
+		{ "childless",		CHILDLESS },
 		{ "childsa",		CHILDSA },
 		{ "config",		CONFIG },
 		{ "couple",		COUPLE },
@@ -1383,6 +1476,7 @@ lookup(char *s)
 		{ "flow",		FLOW },
 		{ "fragmentation",	FRAGMENTATION },
 		{ "from",		FROM },
+		{ "gateway",		GATEWAY },
 		{ "group",		GROUP },
 		{ "iface",		IFACE },
 		{ "ike",		IKEV1 },
@@ -1395,8 +1489,11 @@ lookup(char *s)
 		{ "ipcomp",		IPCOMP },
 		{ "lifetime",		LIFETIME },
 		{ "local",		LOCAL },
+		{ "max-sas",		MAXSAS },
+		{ "max-tries",		MAXTRIES },
 		{ "maxage",		MAXAGE },
 		{ "mobike",		MOBIKE },
+		{ "mode",		MODE },
 		{ "name",		NAME },
 		{ "natt",		NATT },
 		{ "noenforcesingleikesa",	NOENFORCESINGLEIKESA },
@@ -1406,6 +1503,7 @@ lookup(char *s)
 		{ "nostickyaddress",	NOSTICKYADDRESS },
 		{ "novendorid",		NOVENDORID },
 		{ "ocsp",		OCSP },
+		{ "ocspcache",		OCSPCACHE },
 		{ "passive",		PASSIVE },
 		{ "peer",		PEER },
 		{ "port",		PORT },
@@ -1413,22 +1511,33 @@ lookup(char *s)
 		{ "proto",		PROTO },
 		{ "psk",		PSK },
 		{ "quick",		QUICK },
+		{ "radius",		RADIUS },
 		{ "rdomain",		RDOMAIN },
+		{ "redirect",		REDIRECT },
+		{ "rekeywindow",	REKEYWINDOW },
 		{ "request",		REQUEST },
+		{ "resume",		RESUME },
 		{ "sa",			SA },
+		{ "secret",		SECRET },
+		{ "server",		SERVER },
 		{ "set",		SET },
 		{ "skip",		SKIP },
 		{ "srcid",		SRCID },
+		{ "static",		STATIC },
 		{ "stickyaddress",	STICKYADDRESS },
 		{ "tag",		TAG },
 		{ "tap",		TAP },
 		{ "tcpmd5",		TCPMD5 },
+		{ "timeout",		TIMEOUT },
 		{ "to",			TO },
 		{ "tolerate",		TOLERATE },
 		{ "transport",		TRANSPORT },
 		{ "tunnel",		TUNNEL },
 		{ "user",		USER },
-		{ "vendorid",		VENDORID }
+		{ "userdb",		USERDB },
+		{ "vendorid",		VENDORID },
+		{ "weight",		WEIGHT },
+		{ "weighted",		WEIGHTED }
 	};
 	const struct keywords	*p;
 
@@ -1806,6 +1915,8 @@ parse_config(const char *filename, struct iked *x_env)
 	topfile = file;
 
 	free(ocsp_url);
+	free(ocsp_cachefile);
+	free(userdb_file);
 
 	mobike = 1;
 	enforcesingleikesa = stickyaddress = 0;
@@ -1813,8 +1924,15 @@ parse_config(const char *filename, struct iked *x_env)
 	ocsp_tolerate = 0;
 	ocsp_url = NULL;
 	ocsp_maxage = -1;
+	ocsp_cachefile = NULL;
+	userdb_file = NULL;
+	radius_timeout = IKED_RADIUS_TIMEOUT;
+	radius_maxtries = IKED_RADIUS_MAXTRIES;
+	redirect_mode = REDIRECT_NONE;
+	redirect_maxsas = 0;
 	fragmentation = 0;
 	dpd_interval = IKED_IKE_SA_ALIVE_TIMEOUT;
+	rekeywindow = IKED_REKEY_WINDOW;
 	decouple = passive = 0;
 	ocsp_url = NULL;
 
@@ -1832,9 +1950,16 @@ parse_config(const char *filename, struct iked *x_env)
 	env->sc_stickyaddress = stickyaddress;
 	env->sc_frag = fragmentation;
 	env->sc_alive_timeout = dpd_interval;
+	env->sc_rekeywindow = rekeywindow;
 	env->sc_ocsp_url = ocsp_url;
 	env->sc_ocsp_tolerate = ocsp_tolerate;
 	env->sc_ocsp_maxage = ocsp_maxage;
+	env->sc_ocsp_cachefile = ocsp_cachefile;
+	env->sc_userdbfile = userdb_file;
+	env->sc_radius_timeout = radius_timeout;
+	env->sc_radius_maxtries = radius_maxtries;
+	env->sc_redirect_mode = redirect_mode;
+	env->sc_redirect_maxsas = redirect_maxsas;
 	env->sc_cert_partial_chain = cert_partial_chain;
 	env->sc_vendorid = vendorid;
 
@@ -3166,6 +3291,67 @@ create_user(const char *user, const char *pass)
 	return (0);
 }
 
+int
+create_radius(const char *host, in_port_t port, const char *secret)
+{
+	struct iked_radserver	 srv;
+	struct addrinfo		 hints, *res;
+	int			 error;
+
+	bzero(&srv, sizeof(srv));
+
+	if (*secret == '\0' || (strlcpy(srv.rs_secret, secret,
+	    sizeof(srv.rs_secret)) >= sizeof(srv.rs_secret))) {
+		yyerror("invalid radius secret");
+		explicit_bzero(&srv, sizeof(srv));
+		return (-1);
+	}
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((error = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+		yyerror("invalid radius server %s: %s", host,
+		    gai_strerror(error));
+		explicit_bzero(&srv, sizeof(srv));
+		return (-1);
+	}
+	memcpy(&srv.rs_sockaddr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	socket_setport((struct sockaddr *)&srv.rs_sockaddr,
+	    port != 0 ? ntohs(port) : IKED_RADIUS_PORT);
+
+	config_setradius(env, &srv, PROC_IKEV2);
+
+	explicit_bzero(&srv, sizeof(srv));
+	return (0);
+}
+
+int
+create_redirect(const char *host, unsigned int weight)
+{
+	struct iked_redirgw	 gw;
+	struct addrinfo		 hints, *res;
+	int			 error;
+
+	bzero(&gw, sizeof(gw));
+	gw.rg_weight = weight;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((error = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+		yyerror("invalid redirect gateway %s: %s", host,
+		    gai_strerror(error));
+		return (-1);
+	}
+	memcpy(&gw.rg_addr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+
+	config_setredirect(env, &gw, PROC_IKEV2);
+	return (0);
+}
+
 void
 iaw_free(struct ipsec_addr_wrap *head)
 {
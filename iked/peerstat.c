@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <event.h>
+
+#include "iked.h"
+#include "ikev2.h"
+
+/*
+ * The entries of a table are kept in an RB tree for lookups and in a
+ * min-heap ordered by pe_events.  Counts only grow, so an update moves
+ * the entry down the heap and the root is always the one to evict.
+ */
+struct peerstat {
+	struct iked_peer_stats	 p_stats;
+	RB_ENTRY(peerstat)	 p_node;
+	unsigned int		 p_heap;
+	uint32_t		 p_gen;		/* bumped on eviction */
+};
+RB_HEAD(peerstat_tree, peerstat);
+
+struct iked_peerstat_table {
+	struct peerstat_tree	 t_tree;
+	unsigned int		 t_count;
+	struct peerstat		*t_heap[IKED_PEERSTAT_ENTRIES];
+	struct peerstat		 t_entries[IKED_PEERSTAT_ENTRIES];
+};
+
+static __inline int
+	 peerstat_cmp(struct peerstat *, struct peerstat *);
+RB_PROTOTYPE(peerstat_tree, peerstat, p_node, peerstat_cmp);
+
+struct iked_peerstat_table *
+	 peerstat_table(struct iked *, unsigned int);
+struct peerstat *
+	 peerstat_get(struct iked_peerstat_table *, struct sockaddr *,
+	    const char *);
+struct peerstat *
+	 peerstat_sa(struct iked *, struct iked_sa *);
+void	 peerstat_count(struct iked_peerstat_table *, struct peerstat *,
+	    unsigned int, uint64_t);
+void	 peerstat_heap_swap(struct iked_peerstat_table *, unsigned int,
+	    unsigned int);
+void	 peerstat_heap_up(struct iked_peerstat_table *, unsigned int);
+void	 peerstat_heap_down(struct iked_peerstat_table *, unsigned int);
+int	 peerstat_sort(const void *, const void *);
+
+static unsigned int	 peerstat_sort_metric;
+
+struct iked_peerstat_table *
+peerstat_table(struct iked *env, unsigned int table)
+{
+	struct iked_peerstat_table	*t;
+
+	if ((t = env->sc_peerstats[table]) != NULL)
+		return (t);
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	RB_INIT(&t->t_tree);
+	env->sc_peerstats[table] = t;
+	return (t);
+}
+
+struct peerstat *
+peerstat_get(struct iked_peerstat_table *t, struct sockaddr *addr,
+    const char *id)
+{
+	struct peerstat		 key, *p;
+	uint64_t		 events;
+
+	bzero(&key.p_stats.pe_addr, sizeof(key.p_stats.pe_addr));
+	if (addr != NULL)
+		memcpy(&key.p_stats.pe_addr, addr, SA_LEN(addr));
+	socket_setport((struct sockaddr *)&key.p_stats.pe_addr, 0);
+	strlcpy(key.p_stats.pe_id, id, sizeof(key.p_stats.pe_id));
+
+	if ((p = RB_FIND(peerstat_tree, &t->t_tree, &key)) != NULL)
+		return (p);
+
+	if (t->t_count < IKED_PEERSTAT_ENTRIES) {
+		p = &t->t_entries[t->t_count];
+		p->p_heap = t->t_count;
+		t->t_heap[t->t_count++] = p;
+		events = 0;
+	} else {
+		/* Replace the entry with the fewest events */
+		p = t->t_heap[0];
+		RB_REMOVE(peerstat_tree, &t->t_tree, p);
+		p->p_gen++;
+		events = p->p_stats.pe_events;
+	}
+
+	memcpy(&p->p_stats.pe_addr, &key.p_stats.pe_addr,
+	    sizeof(p->p_stats.pe_addr));
+	memcpy(p->p_stats.pe_id, key.p_stats.pe_id,
+	    sizeof(p->p_stats.pe_id));
+	bzero(p->p_stats.pe_count, sizeof(p->p_stats.pe_count));
+	p->p_stats.pe_events = events;
+	p->p_stats.pe_error = events;
+	RB_INSERT(peerstat_tree, &t->t_tree, p);
+	peerstat_heap_up(t, p->p_heap);
+
+	return (p);
+}
+
+struct peerstat *
+peerstat_sa(struct iked *env, struct iked_sa *sa)
+{
+	struct iked_peerstat_table	*t;
+	struct peerstat			*p;
+	char				 idstr[IKED_ID_SIZE];
+
+	if ((t = peerstat_table(env, IKED_PEERSTAT_ID)) == NULL)
+		return (NULL);
+
+	/* Cached until the entry gets evicted */
+	if (sa->sa_peerstat != 0) {
+		p = &t->t_entries[sa->sa_peerstat - 1];
+		if (p->p_gen == sa->sa_peerstat_gen)
+			return (p);
+	}
+
+	if (ikev2_print_id(IKESA_DSTID(sa), idstr, sizeof(idstr)) == -1)
+		return (NULL);
+	if ((p = peerstat_get(t, NULL, idstr)) == NULL)
+		return (NULL);
+	sa->sa_peerstat = (p - t->t_entries) + 1;
+	sa->sa_peerstat_gen = p->p_gen;
+	return (p);
+}
+
+void
+peerstat_add(struct iked *env, struct sockaddr *peer, struct iked_sa *sa,
+    unsigned int metric, uint64_t n)
+{
+	struct iked_peerstat_table	*t;
+	struct peerstat			*p;
+
+	if (peer == NULL && sa != NULL)
+		peer = (struct sockaddr *)&sa->sa_peer.addr;
+	if (peer != NULL && peer->sa_family != AF_UNSPEC &&
+	    (t = peerstat_table(env, IKED_PEERSTAT_ADDR)) != NULL &&
+	    (p = peerstat_get(t, peer, "")) != NULL)
+		peerstat_count(t, p, metric, n);
+
+	/* The peer ID is only known after IKE_AUTH */
+	if (sa != NULL && IKESA_DSTID(sa)->id_type != 0 &&
+	    (p = peerstat_sa(env, sa)) != NULL)
+		peerstat_count(env->sc_peerstats[IKED_PEERSTAT_ID], p,
+		    metric, n);
+}
+
+void
+peerstat_msg(struct iked *env, struct iked_message *msg,
+    unsigned int metric, uint64_t n)
+{
+	peerstat_add(env, (struct sockaddr *)&msg->msg_peer, msg->msg_sa,
+	    metric, n);
+}
+
+void
+peerstat_count(struct iked_peerstat_table *t, struct peerstat *p,
+    unsigned int metric, uint64_t n)
+{
+	p->p_stats.pe_count[metric] += n;
+	if (metric == IKED_PEERSTAT_BYTES_RCVD ||
+	    metric == IKED_PEERSTAT_BYTES_SENT)
+		return;
+	p->p_stats.pe_events += n;
+	peerstat_heap_down(t, p->p_heap);
+}
+
+void
+peerstat_heap_swap(struct iked_peerstat_table *t, unsigned int a,
+    unsigned int b)
+{
+	struct peerstat	*p = t->t_heap[a];
+
+	t->t_heap[a] = t->t_heap[b];
+	t->t_heap[b] = p;
+	t->t_heap[a]->p_heap = a;
+	t->t_heap[b]->p_heap = b;
+}
+
+void
+peerstat_heap_up(struct iked_peerstat_table *t, unsigned int i)
+{
+	unsigned int	 parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (t->t_heap[parent]->p_stats.pe_events <=
+		    t->t_heap[i]->p_stats.pe_events)
+			break;
+		peerstat_heap_swap(t, i, parent);
+		i = parent;
+	}
+}
+
+void
+peerstat_heap_down(struct iked_peerstat_table *t, unsigned int i)
+{
+	unsigned int	 c;
+
+	while ((c = 2 * i + 1) < t->t_count) {
+		if (c + 1 < t->t_count &&
+		    t->t_heap[c + 1]->p_stats.pe_events <
+		    t->t_heap[c]->p_stats.pe_events)
+			c++;
+		if (t->t_heap[i]->p_stats.pe_events <=
+		    t->t_heap[c]->p_stats.pe_events)
+			break;
+		peerstat_heap_swap(t, i, c);
+		i = c;
+	}
+}
+
+int
+peerstat_sort(const void *a, const void *b)
+{
+	struct iked_peer_stats *const	*ppa = a, *const *ppb = b;
+	const struct iked_peer_stats	*pa = *ppa, *pb = *ppb;
+	unsigned int			 m = peerstat_sort_metric;
+
+	if (pa->pe_count[m] != pb->pe_count[m])
+		return (pa->pe_count[m] > pb->pe_count[m] ? -1 : 1);
+	if (pa->pe_events != pb->pe_events)
+		return (pa->pe_events > pb->pe_events ? -1 : 1);
+	return (0);
+}
+
+void
+peerstat_ctl_show(struct iked *env, struct imsg *imsg)
+{
+	struct iked_peerstat_req	 req;
+	struct iked_peerstat_table	*t;
+	struct iked_peer_stats		*sorted[IKED_PEERSTAT_ENTRIES];
+	unsigned int			 i, n = 0;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(req))
+		goto done;
+	memcpy(&req, imsg->data, sizeof(req));
+	if (req.pr_table > IKED_PEERSTAT_ID ||
+	    req.pr_metric >= IKED_PEERSTAT_MAX)
+		goto done;
+	if ((t = env->sc_peerstats[req.pr_table]) == NULL)
+		goto done;
+
+	for (i = 0; i < t->t_count; i++)
+		sorted[n++] = &t->t_entries[i].p_stats;
+	peerstat_sort_metric = req.pr_metric;
+	qsort(sorted, n, sizeof(sorted[0]), peerstat_sort);
+	if (req.pr_limit != 0 && req.pr_limit < n)
+		n = req.pr_limit;
+
+	for (i = 0; i < n; i++)
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+		    IMSG_CTL_SHOW_PEERS, imsg->hdr.peerid, -1,
+		    sorted[i], sizeof(*sorted[i]));
+
+ done:
+	/* Send empty reply to indicate end of information. */
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+	    IMSG_CTL_SHOW_PEERS, imsg->hdr.peerid, -1, NULL, 0);
+}
+
+static __inline int
+peerstat_cmp(struct peerstat *a, struct peerstat *b)
+{
+	int	 diff;
+
+	/* One of the two keys is unset in each table */
+	if ((diff = sockaddr_cmp((struct sockaddr *)&a->p_stats.pe_addr,
+	    (struct sockaddr *)&b->p_stats.pe_addr, -1)) != 0)
+		return (diff);
+	return (strcmp(a->p_stats.pe_id, b->p_stats.pe_id));
+}
+
+RB_GENERATE(peerstat_tree, peerstat, p_node, peerstat_cmp);
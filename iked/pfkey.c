@@ -37,9 +37,11 @@
 #include <poll.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <event.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_IPSEC
 #include "iked.h"
 #include "ikev2.h"
 
@@ -48,27 +50,84 @@
 
 #define PFKEYV2_CHUNK sizeof(uint64_t)
 #define PFKEY_REPLY_TIMEOUT 1000
+#define PFKEY_BATCH_WINDOW 16	/* replies must fit in the socket buffer */
 
 /* only used internally */
 #define IKED_SADB_UPDATE_SA_ADDRESSES 0xff
 
 static uint32_t sadb_msg_seq = 0;
 static unsigned int sadb_decoupled = 0;
+static int pfkey_batching = 0;	/* pfkey_write() does not wait */
 
 static int iked_rdomain = 0;
 
 static struct event pfkey_timer_ev;
 static struct timeval pfkey_timer_tv;
 
+/*
+ * Inbound SPIs are reserved from the kernel in advance, so that the
+ * negotiation of a child SA does not wait for an SADB_GETSPI round trip.
+ * There is a pool per protocol and local address, the SPIs are reserved
+ * with an unspecified source address as SADB_UPDATE only looks up the
+ * destination.  A pool that falls below the low watermark is refilled
+ * from a timer.  The kernel drops larval SAs after a while (60 seconds
+ * on OpenBSD, 30 on Linux by default), so a reserved SPI is only handed
+ * out for PFKEY_SPIPOOL_LIFETIME seconds and then deleted.
+ */
+#define PFKEY_SPIPOOL_SIZE	16
+#define PFKEY_SPIPOOL_LOWAT	4
+#define PFKEY_SPIPOOL_LIFETIME	20	/* seconds */
+#define PFKEY_SPIPOOL_IDLE	300	/* free an unused pool after */
+
+struct pfkey_spipool {
+	uint8_t			 sp_saproto;
+	struct sockaddr_storage	 sp_local;
+	uint32_t		 sp_spi[PFKEY_SPIPOOL_SIZE];	/* oldest first */
+	time_t			 sp_expire[PFKEY_SPIPOOL_SIZE];
+	unsigned int		 sp_count;
+	time_t			 sp_used;
+	TAILQ_ENTRY(pfkey_spipool) sp_entry;
+};
+TAILQ_HEAD(, pfkey_spipool) pfkey_spipools =
+    TAILQ_HEAD_INITIALIZER(pfkey_spipools);
+
+static struct event pfkey_spipool_ev;
+
+/*
+ * Messages that pfkey_process() could not handle yet, mostly ACQUIREs
+ * while the IKE SA is busy.  Traffic towards a peer that does not
+ * answer causes a storm of ACQUIREs, so only one ACQUIRE per flow is
+ * kept, it is retried with an exponential backoff and the number of
+ * pending ACQUIREs is bounded.
+ */
+#define PFKEY_ACQUIRE_MAX	256
+#define PFKEY_BACKOFF_MAX	32	/* seconds */
+
 struct pfkey_message {
 	SIMPLEQ_ENTRY(pfkey_message)
 			 pm_entry;
 	uint8_t		*pm_data;
 	ssize_t		 pm_length;
+	time_t		 pm_due;	/* monotonic, not retried before */
+	unsigned int	 pm_backoff;	/* seconds */
 };
 SIMPLEQ_HEAD(, pfkey_message) pfkey_retry, pfkey_postponed =
     SIMPLEQ_HEAD_INITIALIZER(pfkey_postponed);
 
+/*
+ * The flow of an ACQUIRE, as far as the message tells.  OpenBSD only
+ * sends the SA endpoints, Linux also the index of the policy.
+ */
+struct pfkey_acqkey {
+	uint8_t			 ak_satype;
+#ifndef __OpenBSD__
+	uint8_t			 ak_dir;
+	uint32_t		 ak_policy;
+#endif
+	struct sockaddr_storage	 ak_src;
+	struct sockaddr_storage	 ak_dst;
+};
+
 struct pfkey_constmap {
 	uint8_t		 pfkey_id;
 	unsigned int	 pfkey_ikeid;
@@ -131,12 +190,18 @@ static const struct pfkey_constmap pfkey_satype[] = {
 int	pfkey_map(const struct pfkey_constmap *, uint16_t, uint8_t *);
 int	pfkey_flow(struct iked *, uint8_t, uint8_t, struct iked_flow *);
 int	pfkey_sa(struct iked *, uint8_t, uint8_t, struct iked_childsa *);
-int	pfkey_sa_getspi(struct iked *, uint8_t, struct iked_childsa *, uint32_t *);
+int	pfkey_sa_getspi(struct iked *, uint8_t, struct sockaddr_storage *,
+	    struct sockaddr_storage *, uint32_t *);
+int	pfkey_sa_delspi(struct iked *, uint8_t, struct sockaddr_storage *,
+	    struct sockaddr_storage *, uint32_t);
 int	pfkey_sagroup(struct iked *, uint8_t, uint8_t,
 	    struct iked_childsa *, struct iked_childsa *);
 int	pfkey_write(struct iked *, struct sadb_msg *, struct iovec *, int,
 	    uint8_t **, ssize_t *);
-int	pfkey_reply(int, uint8_t **, ssize_t *);
+int	pfkey_recv(int, struct sadb_msg *, uint8_t **, ssize_t *);
+int	pfkey_postpone(struct iked *, uint8_t *, ssize_t, unsigned int);
+int	pfkey_reply(struct iked *, uint8_t **, ssize_t *);
+int	pfkey_batch_reply(struct iked *, struct ipsec_batch *, int);
 void	pfkey_dispatch(int, short, void *);
 int	pfkey_sa_lookup(struct iked *, struct iked_childsa *, uint64_t *);
 int	pfkey_sa_check_exists(struct iked *, struct iked_childsa *);
@@ -146,8 +211,20 @@ struct sadb_ident *
 void	*pfkey_find_ext(uint8_t *, ssize_t, int);
 
 void	pfkey_timer_cb(int, short, void *);
+void	pfkey_timer_schedule(time_t);
+int	pfkey_acquire_key(uint8_t *, ssize_t, struct pfkey_acqkey *);
+int	pfkey_acquire_pending(uint8_t *, ssize_t);
 int	pfkey_process(struct iked *, struct pfkey_message *);
 
+struct pfkey_spipool *
+	pfkey_spipool_lookup(uint8_t, struct sockaddr_storage *, int);
+int	pfkey_spipool_get(struct iked *, uint8_t, struct sockaddr_storage *,
+	    uint32_t *);
+void	pfkey_spipool_fill(struct iked *, struct pfkey_spipool *, time_t);
+void	pfkey_spipool_expire(struct iked *, struct pfkey_spipool *, time_t);
+void	pfkey_spipool_schedule(int);
+void	pfkey_spipool_cb(int, short, void *);
+
 int
 pfkey_couple(struct iked *env, struct iked_sas *sas, int couple)
 {
@@ -920,8 +997,9 @@ pfkey_sa(struct iked *env, uint8_t satype, uint8_t action, struct iked_childsa *
 
 		sa_ltime_soft.sadb_lifetime_exttype = SADB_EXT_LIFETIME_SOFT;
 		sa_ltime_soft.sadb_lifetime_len = sizeof(sa_ltime_soft) / 8;
-		/* set randomly to 85-95% */
-		jitter = 850 + arc4random_uniform(100);
+		/* set randomly within the rekey window, up to 95% */
+		jitter = 950 - env->sc_rekeywindow * 10 +
+		    arc4random_uniform(env->sc_rekeywindow * 10 + 1);
 		sa_ltime_soft.sadb_lifetime_bytes =
 		    (sa_ltime_hard.sadb_lifetime_bytes * jitter) / 1000;
 		sa_ltime_soft.sadb_lifetime_addtime =
@@ -1412,8 +1490,8 @@ pfkey_sa_check_exists(struct iked *env, struct iked_childsa *sa)
 }
 
 int
-pfkey_sa_getspi(struct iked *env, uint8_t satype, struct iked_childsa *sa,
-    uint32_t *spip)
+pfkey_sa_getspi(struct iked *env, uint8_t satype, struct sockaddr_storage *src,
+    struct sockaddr_storage *dst, uint32_t *spip)
 {
 	struct sadb_msg		*msg, smsg;
 	struct sadb_address	 sa_src, sa_dst;
@@ -1428,14 +1506,14 @@ pfkey_sa_getspi(struct iked *env, uint8_t satype, struct iked_childsa *sa,
 	int			 iov_cnt, ret = -1;
 
 	bzero(&ssrc, sizeof(ssrc));
-	memcpy(&ssrc, &sa->csa_local->addr, sizeof(ssrc));
+	memcpy(&ssrc, src, sizeof(ssrc));
 	if (socket_af((struct sockaddr *)&ssrc, 0) == -1) {
 		log_warn("%s: invalid address", __func__);
 		return (-1);
 	}
 
 	bzero(&sdst, sizeof(sdst));
-	memcpy(&sdst, &sa->csa_peer->addr, sizeof(sdst));
+	memcpy(&sdst, dst, sizeof(sdst));
 	if (socket_af((struct sockaddr *)&sdst, 0) == -1) {
 		log_warn("%s: invalid address", __func__);
 		return (-1);
@@ -1534,6 +1612,104 @@ done:
 	return (ret);
 }
 
+/* Delete a larval SA that was reserved with SADB_GETSPI */
+int
+pfkey_sa_delspi(struct iked *env, uint8_t satype, struct sockaddr_storage *src,
+    struct sockaddr_storage *dst, uint32_t spi)
+{
+	struct sadb_msg		 smsg;
+	struct sadb_sa		 sadb;
+	struct sadb_address	 sa_src, sa_dst;
+	struct sockaddr_storage	 ssrc, sdst;
+	struct iovec		 iov[IOV_CNT];
+	uint64_t		 pad = 0;
+	size_t			 padlen;
+	int			 iov_cnt;
+
+	bzero(&ssrc, sizeof(ssrc));
+	memcpy(&ssrc, src, sizeof(ssrc));
+	if (socket_af((struct sockaddr *)&ssrc, 0) == -1) {
+		log_warn("%s: invalid address", __func__);
+		return (-1);
+	}
+
+	bzero(&sdst, sizeof(sdst));
+	memcpy(&sdst, dst, sizeof(sdst));
+	if (socket_af((struct sockaddr *)&sdst, 0) == -1) {
+		log_warn("%s: invalid address", __func__);
+		return (-1);
+	}
+
+	bzero(&smsg, sizeof(smsg));
+	smsg.sadb_msg_version = PF_KEY_V2;
+	smsg.sadb_msg_seq = ++sadb_msg_seq;
+	smsg.sadb_msg_pid = getpid();
+	smsg.sadb_msg_len = sizeof(smsg) / 8;
+	smsg.sadb_msg_type = SADB_DELETE;
+	smsg.sadb_msg_satype = satype;
+
+	bzero(&sadb, sizeof(sadb));
+	sadb.sadb_sa_len = sizeof(sadb) / 8;
+	sadb.sadb_sa_exttype = SADB_EXT_SA;
+	sadb.sadb_sa_spi = htonl(spi);
+	sadb.sadb_sa_state = SADB_SASTATE_LARVAL;
+
+	bzero(&sa_src, sizeof(sa_src));
+	sa_src.sadb_address_len =
+	    (sizeof(sa_src) + ROUNDUP(SS_LEN(ssrc))) / 8;
+	sa_src.sadb_address_exttype = SADB_EXT_ADDRESS_SRC;
+
+	bzero(&sa_dst, sizeof(sa_dst));
+	sa_dst.sadb_address_len =
+	    (sizeof(sa_dst) + ROUNDUP(SS_LEN(sdst))) / 8;
+	sa_dst.sadb_address_exttype = SADB_EXT_ADDRESS_DST;
+
+#define PAD(len)					\
+	padlen = ROUNDUP((len)) - (len);		\
+	if (padlen) {					\
+		iov[iov_cnt].iov_base = &pad;		\
+		iov[iov_cnt].iov_len = padlen;		\
+		iov_cnt++;				\
+	}
+
+	iov_cnt = 0;
+
+	/* header */
+	iov[iov_cnt].iov_base = &smsg;
+	iov[iov_cnt].iov_len = sizeof(smsg);
+	iov_cnt++;
+
+	/* sa */
+	iov[iov_cnt].iov_base = &sadb;
+	iov[iov_cnt].iov_len = sizeof(sadb);
+	smsg.sadb_msg_len += sadb.sadb_sa_len;
+	iov_cnt++;
+
+	/* src addr */
+	iov[iov_cnt].iov_base = &sa_src;
+	iov[iov_cnt].iov_len = sizeof(sa_src);
+	iov_cnt++;
+	iov[iov_cnt].iov_base = &ssrc;
+	iov[iov_cnt].iov_len = SS_LEN(ssrc);
+	smsg.sadb_msg_len += sa_src.sadb_address_len;
+	iov_cnt++;
+	PAD(SS_LEN(ssrc));
+
+	/* dst addr */
+	iov[iov_cnt].iov_base = &sa_dst;
+	iov[iov_cnt].iov_len = sizeof(sa_dst);
+	iov_cnt++;
+	iov[iov_cnt].iov_base = &sdst;
+	iov[iov_cnt].iov_len = SS_LEN(sdst);
+	smsg.sadb_msg_len += sa_dst.sadb_address_len;
+	iov_cnt++;
+	PAD(SS_LEN(sdst));
+
+#undef PAD
+
+	return (pfkey_write(env, &smsg, iov, iov_cnt, NULL, NULL));
+}
+
 #ifdef __OpenBSD__
 int
 pfkey_sagroup(struct iked *env, uint8_t satype1, uint8_t action,
@@ -1707,6 +1883,7 @@ pfkey_write(struct iked *env, struct sadb_msg *smsg, struct iovec *iov, int iov_
     uint8_t **datap, ssize_t *lenp)
 {
 	ssize_t n, len = smsg->sadb_msg_len * 8;
+	uint64_t start;
 	int ret = -1;
 
 	if (sadb_decoupled) {
@@ -1724,6 +1901,8 @@ pfkey_write(struct iked *env, struct sadb_msg *smsg, struct iovec *iov, int iov_
 		}
 	}
 
+	start = hist_now();
+
 	/* Delete event to poll() in pfkey_reply() */
 	event_del(&env->sc_pfkeyev);
 
@@ -1736,18 +1915,22 @@ pfkey_write(struct iked *env, struct sadb_msg *smsg, struct iovec *iov, int iov_
 		goto done;
 	}
 
-	ret = pfkey_reply(env->sc_pfkey, datap, lenp);
+	if (pfkey_batching) {
+		/* collected by pfkey_batch_reply() */
+		ret = 0;
+		goto done;
+	}
+	ret = pfkey_reply(env, datap, lenp);
  done:
 	event_add(&env->sc_pfkeyev, NULL);
+	ikestat_lat(env, ikes_lat_pfkey, start);
 	return (ret);
 }
 
-/* wait for pfkey response and returns 0 for ok, -1 for error, -2 for timeout */
+/* read the next message, returns 0 for ok, -1 for error, -2 for timeout */
 int
-pfkey_reply(int fd, uint8_t **datap, ssize_t *lenp)
+pfkey_recv(int fd, struct sadb_msg *hdr, uint8_t **datap, ssize_t *lenp)
 {
-	struct pfkey_message	*pm;
-	struct sadb_msg		 hdr;
 	ssize_t			 len;
 	uint8_t			*data;
 	struct pollfd		pfd[1];
@@ -1756,46 +1939,106 @@ pfkey_reply(int fd, uint8_t **datap, ssize_t *lenp)
 	pfd[0].fd = fd;
 	pfd[0].events = POLLIN;
 
-	for (;;) {
-		/*
-		 * We should actually expect the reply to get lost
-		 * as PF_KEY is an unreliable service per the specs.
-		 * Currently we do this by setting a short timeout,
-		 * and if it is not readable in that time, we fail
-		 * the read.
-		 */
-		n = poll(pfd, 1, PFKEY_REPLY_TIMEOUT / 1000);
-		if (n == -1) {
-			log_warn("%s: poll() failed", __func__);
-			return (-1);
-		}
-		if (n == 0) {
-			log_warnx("%s: no reply from PF_KEY", __func__);
-			return (-2);	/* retry */
-		}
+	/*
+	 * We should actually expect the reply to get lost
+	 * as PF_KEY is an unreliable service per the specs.
+	 * Currently we do this by setting a short timeout,
+	 * and if it is not readable in that time, we fail
+	 * the read.
+	 */
+	n = poll(pfd, 1, PFKEY_REPLY_TIMEOUT / 1000);
+	if (n == -1) {
+		log_warn("%s: poll() failed", __func__);
+		return (-1);
+	}
+	if (n == 0) {
+		log_warnx("%s: no reply from PF_KEY", __func__);
+		return (-2);	/* retry */
+	}
 
-		if (recv(fd, &hdr, sizeof(hdr), MSG_PEEK) != sizeof(hdr)) {
-			log_warn("%s: short recv", __func__);
-			return (-1);
-		}
+	if (recv(fd, hdr, sizeof(*hdr), MSG_PEEK) != sizeof(*hdr)) {
+		log_warn("%s: short recv", __func__);
+		return (-1);
+	}
 
-		if (hdr.sadb_msg_version != PF_KEY_V2) {
-			log_warnx("%s: wrong pfkey version", __func__);
-			return (-1);
-		}
+	if (hdr->sadb_msg_version != PF_KEY_V2) {
+		log_warnx("%s: wrong pfkey version", __func__);
+		return (-1);
+	}
 
-		if ((data = reallocarray(NULL, hdr.sadb_msg_len,
-		    PFKEYV2_CHUNK)) == NULL) {
-			log_warn("%s: malloc", __func__);
-			return (-1);
-		}
-		len = hdr.sadb_msg_len * PFKEYV2_CHUNK;
+	if ((data = reallocarray(NULL, hdr->sadb_msg_len,
+	    PFKEYV2_CHUNK)) == NULL) {
+		log_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	len = hdr->sadb_msg_len * PFKEYV2_CHUNK;
+
+	if (read(fd, data, len) != len) {
+		log_warnx("%s: short read", __func__);
+		free(data);
+		return (-1);
+	}
+
+	*datap = data;
+	*lenp = len;
+	return (0);
+}
+
+/* enqueue a message for pfkey_timer_cb(), retried after delay seconds */
+int
+pfkey_postpone(struct iked *env, uint8_t *data, ssize_t len,
+    unsigned int delay)
+{
+	struct pfkey_message	*pm;
+	time_t			 now = ikev2_init_time();
+	int			 acquire;
 
-		if (read(fd, data, len) != len) {
-			log_warnx("%s: short read", __func__);
+	acquire = ((struct sadb_msg *)data)->sadb_msg_type == SADB_ACQUIRE;
+	if (acquire) {
+		if (pfkey_acquire_pending(data, len)) {
+			ikestat_inc(env, ikes_pfkey_acquire_coalesced);
 			free(data);
-			return (-1);
+			return (0);
+		}
+		if (env->sc_stats.ikes_pfkey_acquire_pending >=
+		    PFKEY_ACQUIRE_MAX) {
+			log_debug("%s: too many pending ACQUIREs, dropped",
+			    __func__);
+			ikestat_inc(env, ikes_pfkey_acquire_dropped);
+			free(data);
+			return (0);
 		}
+	}
+
+	if ((pm = malloc(sizeof(*pm))) == NULL) {
+		log_warn("%s: malloc", __func__);
+		free(data);
+		return (-1);
+	}
+	pm->pm_data = data;
+	pm->pm_length = len;
+	pm->pm_backoff = delay;
+	pm->pm_due = now + delay;
+	SIMPLEQ_INSERT_TAIL(&pfkey_postponed, pm, pm_entry);
+	if (acquire)
+		ikestat_inc(env, ikes_pfkey_acquire_pending);
+	pfkey_timer_schedule(now);
+	return (0);
+}
+
+/* wait for pfkey response and returns 0 for ok, -1 for error, -2 for timeout */
+int
+pfkey_reply(struct iked *env, uint8_t **datap, ssize_t *lenp)
+{
+	struct sadb_msg		 hdr;
+	ssize_t			 len;
+	uint8_t			*data;
+	int			 ret;
+
+	for (;;) {
+		if ((ret = pfkey_recv(env->sc_pfkey, &hdr, &data,
+		    &len)) != 0)
+			return (ret);
 
 		/* XXX: Only one message can be outstanding. */
 		if (hdr.sadb_msg_seq == sadb_msg_seq &&
@@ -1810,15 +2053,8 @@ pfkey_reply(int fd, uint8_t **datap, ssize_t *lenp)
 		}
 
 		/* not the reply, enqueue */
-		if ((pm = malloc(sizeof(*pm))) == NULL) {
-			log_warn("%s: malloc", __func__);
-			free(data);
+		if (pfkey_postpone(env, data, len, 0) == -1)
 			return (-1);
-		}
-		pm->pm_data = data;
-		pm->pm_length = len;
-		SIMPLEQ_INSERT_TAIL(&pfkey_postponed, pm, pm_entry);
-		evtimer_add(&pfkey_timer_ev, &pfkey_timer_tv);
 	}
 
 	if (datap) {
@@ -1887,7 +2123,15 @@ pfkey_sa_init(struct iked *env, struct iked_childsa *sa, uint32_t *spi)
 	if (pfkey_map(pfkey_satype, sa->csa_saproto, &satype) == -1)
 		return (-1);
 
-	if (pfkey_sa_getspi(env, satype, sa, spi) == -1)
+	/* The inbound SA is the one to the local address */
+	if (pfkey_spipool_get(env, sa->csa_saproto, &sa->csa_peer->addr,
+	    spi) == 0) {
+		log_debug("%s: reserved spi 0x%08x", __func__, *spi);
+		return (0);
+	}
+
+	if (pfkey_sa_getspi(env, satype, &sa->csa_local->addr,
+	    &sa->csa_peer->addr, spi) == -1)
 		return (-1);
 
 	log_debug("%s: new spi 0x%08x", __func__, *spi);
@@ -1895,6 +2139,163 @@ pfkey_sa_init(struct iked *env, struct iked_childsa *sa, uint32_t *spi)
 	return (0);
 }
 
+struct pfkey_spipool *
+pfkey_spipool_lookup(uint8_t saproto, struct sockaddr_storage *local,
+    int create)
+{
+	struct pfkey_spipool	*sp;
+
+	TAILQ_FOREACH(sp, &pfkey_spipools, sp_entry) {
+		if (sp->sp_saproto == saproto &&
+		    sockaddr_cmp((struct sockaddr *)&sp->sp_local,
+		    (struct sockaddr *)local, -1) == 0)
+			return (sp);
+	}
+	if (!create)
+		return (NULL);
+
+	if ((sp = calloc(1, sizeof(*sp))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	sp->sp_saproto = saproto;
+	memcpy(&sp->sp_local, local, sizeof(sp->sp_local));
+	if (socket_af((struct sockaddr *)&sp->sp_local, 0) == -1) {
+		free(sp);
+		return (NULL);
+	}
+	TAILQ_INSERT_TAIL(&pfkey_spipools, sp, sp_entry);
+
+	log_debug("%s: %s %s", __func__,
+	    print_map(saproto, ikev2_saproto_map), print_addr(local));
+	return (sp);
+}
+
+/* Take the most recently reserved SPI, returns -1 if there is none */
+int
+pfkey_spipool_get(struct iked *env, uint8_t saproto,
+    struct sockaddr_storage *local, uint32_t *spi)
+{
+	struct pfkey_spipool	*sp;
+	time_t			 now = ikev2_init_time();
+
+	if ((sp = pfkey_spipool_lookup(saproto, local, 1)) == NULL)
+		return (-1);
+	sp->sp_used = now;
+
+	if (sp->sp_count == 0 ||
+	    sp->sp_expire[sp->sp_count - 1] <= now) {
+		ikestat_inc(env, ikes_spipool_miss);
+		pfkey_spipool_schedule(0);
+		return (-1);
+	}
+
+	*spi = sp->sp_spi[--sp->sp_count];
+	ikestat_inc(env, ikes_spipool_hit);
+	ikestat_dec(env, ikes_spipool_reserved);
+
+	if (sp->sp_count < PFKEY_SPIPOOL_LOWAT)
+		pfkey_spipool_schedule(0);
+	return (0);
+}
+
+void
+pfkey_spipool_fill(struct iked *env, struct pfkey_spipool *sp, time_t now)
+{
+	struct sockaddr_storage	 any;
+	uint8_t			 satype;
+	uint32_t		 spi;
+
+	if (pfkey_map(pfkey_satype, sp->sp_saproto, &satype) == -1)
+		return;
+
+	bzero(&any, sizeof(any));
+	any.ss_family = sp->sp_local.ss_family;
+
+	while (sp->sp_count < PFKEY_SPIPOOL_SIZE) {
+		if (pfkey_sa_getspi(env, satype, &any, &sp->sp_local,
+		    &spi) == -1 || spi == 0)
+			break;
+		sp->sp_spi[sp->sp_count] = spi;
+		sp->sp_expire[sp->sp_count] = now + PFKEY_SPIPOOL_LIFETIME;
+		sp->sp_count++;
+		ikestat_inc(env, ikes_spipool_reserved);
+	}
+}
+
+/* Delete the larval SAs of the reserved SPIs that were not used in time */
+void
+pfkey_spipool_expire(struct iked *env, struct pfkey_spipool *sp, time_t now)
+{
+	struct sockaddr_storage	 any;
+	uint8_t			 satype;
+	unsigned int		 i, n;
+
+	for (n = 0; n < sp->sp_count; n++)
+		if (sp->sp_expire[n] > now)
+			break;
+	if (n == 0)
+		return;
+
+	bzero(&any, sizeof(any));
+	any.ss_family = sp->sp_local.ss_family;
+
+	if (pfkey_map(pfkey_satype, sp->sp_saproto, &satype) == 0) {
+		for (i = 0; i < n; i++)
+			(void)pfkey_sa_delspi(env, satype, &any,
+			    &sp->sp_local, sp->sp_spi[i]);
+	}
+
+	sp->sp_count -= n;
+	memmove(sp->sp_spi, sp->sp_spi + n,
+	    sp->sp_count * sizeof(sp->sp_spi[0]));
+	memmove(sp->sp_expire, sp->sp_expire + n,
+	    sp->sp_count * sizeof(sp->sp_expire[0]));
+
+	ikestat_add(env, ikes_spipool_expired, n);
+	ikestat_add(env, ikes_spipool_reserved, -(int64_t)n);
+	log_debug("%s: %s %s: %u expired", __func__,
+	    print_map(sp->sp_saproto, ikev2_saproto_map),
+	    print_addr(&sp->sp_local), n);
+}
+
+void
+pfkey_spipool_schedule(int seconds)
+{
+	struct timeval	 tv;
+
+	timerclear(&tv);
+	tv.tv_sec = seconds;
+	evtimer_add(&pfkey_spipool_ev, &tv);
+}
+
+/*
+ * Expire and refill the pools.  A pool is only refilled while it is in
+ * use, an idle pool runs dry and is freed eventually.
+ */
+void
+pfkey_spipool_cb(int unused, short event, void *arg)
+{
+	struct iked		*env = arg;
+	struct pfkey_spipool	*sp, *next;
+	time_t			 now = ikev2_init_time();
+
+	TAILQ_FOREACH_SAFE(sp, &pfkey_spipools, sp_entry, next) {
+		pfkey_spipool_expire(env, sp, now);
+		if (sp->sp_used + PFKEY_SPIPOOL_LIFETIME > now &&
+		    sp->sp_count < PFKEY_SPIPOOL_LOWAT)
+			pfkey_spipool_fill(env, sp, now);
+		else if (sp->sp_count == 0 &&
+		    sp->sp_used + PFKEY_SPIPOOL_IDLE <= now) {
+			TAILQ_REMOVE(&pfkey_spipools, sp, sp_entry);
+			free(sp);
+		}
+	}
+
+	if (!TAILQ_EMPTY(&pfkey_spipools))
+		pfkey_spipool_schedule(PFKEY_SPIPOOL_LIFETIME / 4);
+}
+
 int
 pfkey_sa_add(struct iked *env, struct iked_childsa *sa, struct iked_childsa *last)
 {
@@ -1990,6 +2391,175 @@ pfkey_sa_delete(struct iked *env, struct iked_childsa *sa)
 	return (0);
 }
 
+/*
+ * Install the SAs and flows of a batch.  PF_KEY can not take several
+ * messages in one write, but the kernel has handled each message when
+ * the write returns, so they are written back to back and the replies
+ * are collected by sequence number afterwards.  Whatever has no
+ * successful reply is retried alone by pfkey_sa_add() or
+ * pfkey_flow_add(), which know the special cases.  If that fails too,
+ * everything from the batch is removed again.
+ */
+int
+pfkey_batch(struct iked *env, struct ipsec_batch *batch)
+{
+	struct ipsec_batch_op	*op;
+	uint8_t			 satype;
+	unsigned int		 cmd;
+	int			 outstanding = 0;
+
+	if (sadb_decoupled) {
+		/* nothing is written, there are no replies to wait for */
+		TAILQ_FOREACH(op, batch, bo_entry) {
+			if (op->bo_sa != NULL)
+				(void)pfkey_sa_add(env, op->bo_sa, op->bo_last);
+			else
+				(void)pfkey_flow_add(env, op->bo_flow);
+		}
+		return (0);
+	}
+
+	ikestat_inc(env, ikes_ipsec_batch);
+
+	pfkey_batching = 1;
+	TAILQ_FOREACH(op, batch, bo_entry) {
+		if (op->bo_sa != NULL) {
+			if (pfkey_map(pfkey_satype, op->bo_sa->csa_saproto,
+			    &satype) == -1)
+				break;
+			if (op->bo_sa->csa_allocated || op->bo_sa->csa_loaded)
+				cmd = SADB_UPDATE;
+			else
+				cmd = SADB_ADD;
+			log_debug("%s: %s spi %s", __func__,
+			    cmd == SADB_ADD ? "add": "update",
+			    print_spi(op->bo_sa->csa_spi.spi, 4));
+			if (pfkey_sa(env, satype, cmd, op->bo_sa) == -1)
+				break;
+		} else {
+			if (pfkey_map(pfkey_satype, op->bo_flow->flow_saproto,
+			    &satype) == -1)
+				break;
+			if (pfkey_flow(env, satype, SADB_X_ADDFLOW,
+			    op->bo_flow) == -1)
+				break;
+		}
+		op->bo_seq = sadb_msg_seq;
+		ikestat_inc(env, ikes_ipsec_batch_msgs);
+
+		if (++outstanding == PFKEY_BATCH_WINDOW) {
+			(void)pfkey_batch_reply(env, batch, outstanding);
+			outstanding = 0;
+		}
+	}
+	pfkey_batching = 0;
+	if (outstanding)
+		(void)pfkey_batch_reply(env, batch, outstanding);
+	if (op != NULL) {
+		log_debug("%s: failed to write batch", __func__);
+		goto rollback;
+	}
+
+	/* first take note of everything the kernel has accepted */
+	TAILQ_FOREACH(op, batch, bo_entry) {
+		if (op->bo_errno != 0 && op->bo_errno != EEXIST)
+			continue;
+		if (op->bo_sa != NULL)
+			op->bo_sa->csa_loaded = 1;
+		else
+			op->bo_flow->flow_loaded = 1;
+	}
+
+	TAILQ_FOREACH(op, batch, bo_entry) {
+		if (op->bo_flow != NULL) {
+			if (!op->bo_flow->flow_loaded &&
+			    pfkey_flow_add(env, op->bo_flow) == -1)
+				goto rollback;
+			continue;
+		}
+		if (!op->bo_sa->csa_loaded) {
+			if (pfkey_sa_add(env, op->bo_sa, op->bo_last) == -1)
+				goto rollback;
+			continue;
+		}
+#ifdef __OpenBSD__
+		if (op->bo_last != NULL &&
+		    (pfkey_map(pfkey_satype, op->bo_sa->csa_saproto,
+		    &satype) == -1 ||
+		    pfkey_sagroup(env, satype, SADB_X_GRPSPIS,
+		    op->bo_sa, op->bo_last) == -1))
+			goto rollback;
+#endif
+	}
+	return (0);
+
+ rollback:
+	ikestat_inc(env, ikes_ipsec_batch_rollback);
+	TAILQ_FOREACH(op, batch, bo_entry) {
+		if (op->bo_seq != 0 && (op->bo_errno == -1 ||
+		    op->bo_errno == 0 || op->bo_errno == EEXIST)) {
+			/* installed, or no reply and it may have been */
+			if (op->bo_sa != NULL)
+				op->bo_sa->csa_loaded = 1;
+			else
+				op->bo_flow->flow_loaded = 1;
+		}
+		/* not in the active trees, must not stay marked loaded */
+		if (op->bo_sa != NULL) {
+			(void)pfkey_sa_delete(env, op->bo_sa);
+			op->bo_sa->csa_loaded = 0;
+		} else {
+			(void)pfkey_flow_delete(env, op->bo_flow);
+			op->bo_flow->flow_loaded = 0;
+		}
+	}
+	return (-1);
+}
+
+/* collect the replies for pfkey_batch(), -1 if some are missing */
+int
+pfkey_batch_reply(struct iked *env, struct ipsec_batch *batch, int outstanding)
+{
+	struct ipsec_batch_op	*op;
+	struct sadb_msg		 hdr;
+	ssize_t			 len;
+	uint8_t			*data;
+
+	event_del(&env->sc_pfkeyev);
+	while (outstanding > 0) {
+		if (pfkey_recv(env->sc_pfkey, &hdr, &data, &len) != 0)
+			break;
+
+		if (hdr.sadb_msg_pid == (uint32_t)getpid()) {
+			TAILQ_FOREACH(op, batch, bo_entry) {
+				if (op->bo_errno == -1 &&
+				    op->bo_seq == hdr.sadb_msg_seq)
+					break;
+			}
+			if (op != NULL) {
+				op->bo_errno = hdr.sadb_msg_errno;
+				if (op->bo_errno != 0)
+					log_debug("%s: seq %u: %s", __func__,
+					    op->bo_seq, strerror(op->bo_errno));
+				free(data);
+				outstanding--;
+				continue;
+			}
+		} else if (hdr.sadb_msg_pid != 0) {
+			/* ignore messages for other processes */
+			free(data);
+			continue;
+		}
+
+		/* not a reply, enqueue */
+		if (pfkey_postpone(env, data, len, 0) == -1)
+			break;
+	}
+	event_add(&env->sc_pfkeyev, NULL);
+
+	return (outstanding == 0 ? 0 : -1);
+}
+
 int
 pfkey_flush(struct iked *env)
 {
@@ -2089,6 +2659,7 @@ pfkey_init(struct iked *env, int fd)
 	pfkey_timer_tv.tv_sec = 1;
 	pfkey_timer_tv.tv_usec = 0;
 	evtimer_set(&pfkey_timer_ev, pfkey_timer_cb, env);
+	evtimer_set(&pfkey_spipool_ev, pfkey_spipool_cb, env);
 
 	/* Register the pfkey socket event handler */
 	env->sc_pfkey = fd;
@@ -2148,7 +2719,7 @@ void
 pfkey_dispatch(int fd, short event, void *arg)
 {
 	struct iked		*env = (struct iked *)arg;
-	struct pfkey_message	 pm, *pmp;
+	struct pfkey_message	 pm;
 	struct sadb_msg		 hdr;
 	ssize_t			 len;
 	uint8_t			*data;
@@ -2180,16 +2751,20 @@ pfkey_dispatch(int fd, short event, void *arg)
 	if (!SIMPLEQ_EMPTY(&pfkey_postponed))
 		pfkey_timer_cb(0, 0, env);
 
+	/* The flow is already waiting for its backoff */
+	if (hdr.sadb_msg_type == SADB_ACQUIRE &&
+	    pfkey_acquire_pending(data, len)) {
+		ikestat_inc(env, ikes_pfkey_acquire_coalesced);
+		free(data);
+		return;
+	}
+
 	pm.pm_data = data;
 	pm.pm_length = len;
 
-	if (pfkey_process(env, &pm) == -1 &&
-	    (pmp = calloc(1, sizeof(*pmp))) != NULL) {
-		pmp->pm_data = data;
-		pmp->pm_length = len;
+	if (pfkey_process(env, &pm) == -1) {
 		log_debug("%s: pfkey_process is busy, retry later", __func__);
-		SIMPLEQ_INSERT_TAIL(&pfkey_postponed, pmp, pm_entry);
-		evtimer_add(&pfkey_timer_ev, &pfkey_timer_tv);
+		(void)pfkey_postpone(env, data, len, 1);
 	} else {
 		free(data);
 	}
@@ -2200,24 +2775,126 @@ pfkey_timer_cb(int unused, short event, void *arg)
 {
 	struct iked		*env = arg;
 	struct pfkey_message	*pm;
+	struct sadb_msg		*hdr;
+	time_t			 now = ikev2_init_time();
 
 	SIMPLEQ_INIT(&pfkey_retry);
 	while (!SIMPLEQ_EMPTY(&pfkey_postponed)) {
 		pm = SIMPLEQ_FIRST(&pfkey_postponed);
 		SIMPLEQ_REMOVE_HEAD(&pfkey_postponed, pm_entry);
+		if (pm->pm_due > now) {
+			SIMPLEQ_INSERT_TAIL(&pfkey_retry, pm, pm_entry);
+			continue;
+		}
+		hdr = (struct sadb_msg *)pm->pm_data;
 		if (pfkey_process(env, pm) == -1) {
 			log_debug("%s: pfkey_process is busy, retry later",
 			    __func__);
+			if (hdr->sadb_msg_type == SADB_ACQUIRE)
+				pm->pm_backoff = pm->pm_backoff ?
+				    MINIMUM(pm->pm_backoff * 2,
+				    PFKEY_BACKOFF_MAX) : 1;
+			else
+				pm->pm_backoff = 1;
+			pm->pm_due = now + pm->pm_backoff;
 			SIMPLEQ_INSERT_TAIL(&pfkey_retry, pm, pm_entry);
 		} else {
+			if (hdr->sadb_msg_type == SADB_ACQUIRE)
+				ikestat_dec(env, ikes_pfkey_acquire_pending);
 			free(pm->pm_data);
 			free(pm);
 		}
 	}
 	/* move from retry to postponed */
 	SIMPLEQ_CONCAT(&pfkey_postponed, &pfkey_retry);
-	if (!SIMPLEQ_EMPTY(&pfkey_postponed))
-		evtimer_add(&pfkey_timer_ev, &pfkey_timer_tv);
+	pfkey_timer_schedule(now);
+}
+
+/* run pfkey_timer_cb() when the first postponed message is due */
+void
+pfkey_timer_schedule(time_t now)
+{
+	struct pfkey_message	*pm;
+	struct timeval		 tv;
+	time_t			 due = 0;
+
+	SIMPLEQ_FOREACH(pm, &pfkey_postponed, pm_entry) {
+		if (due == 0 || pm->pm_due < due)
+			due = pm->pm_due;
+	}
+	if (due == 0) {
+		evtimer_del(&pfkey_timer_ev);
+		return;
+	}
+	tv = pfkey_timer_tv;
+	if (due - now > tv.tv_sec)
+		tv.tv_sec = due - now;
+	evtimer_add(&pfkey_timer_ev, &tv);
+}
+
+int
+pfkey_acquire_key(uint8_t *data, ssize_t len, struct pfkey_acqkey *key)
+{
+	struct sadb_address	*sa_addr;
+	struct sockaddr		*sa;
+#ifndef __OpenBSD__
+	struct sadb_x_policy	*sa_pol;
+#endif
+
+	bzero(key, sizeof(*key));
+	key->ak_satype = ((struct sadb_msg *)data)->sadb_msg_satype;
+
+	if ((sa_addr = pfkey_find_ext(data, len,
+	    SADB_EXT_ADDRESS_DST)) == NULL)
+		return (-1);
+	sa = (struct sockaddr *)(sa_addr + 1);
+	if (SA_LEN(sa) > sizeof(key->ak_dst))
+		return (-1);
+	memcpy(&key->ak_dst, sa, SA_LEN(sa));
+
+	if ((sa_addr = pfkey_find_ext(data, len,
+	    SADB_EXT_ADDRESS_SRC)) != NULL) {
+		sa = (struct sockaddr *)(sa_addr + 1);
+		if (SA_LEN(sa) > sizeof(key->ak_src))
+			return (-1);
+		memcpy(&key->ak_src, sa, SA_LEN(sa));
+	}
+
+#ifndef __OpenBSD__
+	if ((sa_pol = pfkey_find_ext(data, len,
+	    SADB_X_EXT_POLICY)) != NULL) {
+		key->ak_dir = sa_pol->sadb_x_policy_dir;
+		key->ak_policy = sa_pol->sadb_x_policy_id;
+	}
+#endif
+	return (0);
+}
+
+/* returns 1 if an ACQUIRE for the same flow is already postponed */
+int
+pfkey_acquire_pending(uint8_t *data, ssize_t len)
+{
+	struct pfkey_acqkey	 key, pkey;
+	struct pfkey_message	*pm;
+	int			 i;
+
+	if (pfkey_acquire_key(data, len, &key) == -1)
+		return (0);
+
+	/* pfkey_timer_cb() keeps some of them on the retry list */
+	for (i = 0; i < 2; i++) {
+		SIMPLEQ_FOREACH(pm, i == 0 ? &pfkey_postponed : &pfkey_retry,
+		    pm_entry) {
+			if (((struct sadb_msg *)pm->pm_data)->sadb_msg_type !=
+			    SADB_ACQUIRE ||
+			    pfkey_acquire_key(pm->pm_data, pm->pm_length,
+			    &pkey) == -1)
+				continue;
+			if (memcmp(&key, &pkey, sizeof(key)) == 0)
+				return (1);
+		}
+	}
+	return (0);
 }
 
 /*
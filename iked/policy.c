@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <event.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_POLICY
 #include "iked.h"
 #include "ikev2.h"
 
@@ -58,9 +59,22 @@ static int	proposals_match(struct iked_proposal *, struct iked_proposal *,
 void
 policy_init(struct iked *env)
 {
+	unsigned int	 i;
+
 	TAILQ_INIT(&env->sc_policies);
 	TAILQ_INIT(&env->sc_ocsp);
+	TAILQ_INIT(&env->sc_ocsp_conns);
+	TAILQ_INIT(&env->sc_initq);
+	TAILQ_INIT(&env->sc_rekeys);
+	RB_INIT(&env->sc_ocsp_cache);
+	env->sc_ocsp_cachefd = -1;
+	TAILQ_INIT(&env->sc_responses);
+	for (i = 0; i < IKED_KEEPALIVE_SLOTS; i++)
+		TAILQ_INIT(&env->sc_keepalive[i].ks_sas);
 	RB_INIT(&env->sc_users);
+	TAILQ_INIT(&env->sc_radservers);
+	TAILQ_INIT(&env->sc_radwait);
+	TAILQ_INIT(&env->sc_redirgws);
 	RB_INIT(&env->sc_sas);
 	RB_INIT(&env->sc_dstid_sas);
 	RB_INIT(&env->sc_activesas);
@@ -411,16 +425,27 @@ sa_state(struct iked *env, struct iked_sa *sa, int state)
 	}
 
 	if (ostate != sa->sa_state) {
+		if (sa->sa_state >= IKEV2_STATE_ESTABLISHED)
+			ikev2_init_halfopen_done(env, sa);
 		switch (sa->sa_state) {
 		case IKEV2_STATE_ESTABLISHED:
 			ikestat_inc(env, ikes_sa_established_total);
 			ikestat_inc(env, ikes_sa_established_current);
+			if (sa->sa_policy)
+				sa->sa_policy->pol_established++;
+			if (sa->sa_lat_start) {
+				ikestat_lat(env, ikes_lat_auth,
+				    sa->sa_lat_start);
+				sa->sa_lat_start = 0;
+			}
 			break;
 		case IKEV2_STATE_CLOSED:
 		case IKEV2_STATE_CLOSING:
 			switch (ostate) {
 			case IKEV2_STATE_ESTABLISHED:
 				ikestat_dec(env, ikes_sa_established_current);
+				if (sa->sa_policy)
+					sa->sa_policy->pol_established--;
 				break;
 			case IKEV2_STATE_CLOSED:
 			case IKEV2_STATE_CLOSING:
@@ -663,8 +688,10 @@ sa_free_flows(struct iked *env, struct iked_saflows *head)
 	TAILQ_FOREACH_SAFE(flow, head, flow_entry, flowtmp) {
 		log_debug("%s: free %p", __func__, flow);
 
-		if (flow->flow_loaded)
+		if (flow->flow_loaded) {
 			RB_REMOVE(iked_flows, &env->sc_activeflows, flow);
+			ikestat_dec(env, ikes_flow_active);
+		}
 		TAILQ_REMOVE(head, flow, flow_entry);
 		(void)ipsec_flow_delete(env, flow);
 		flow_free(flow);
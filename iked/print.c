@@ -25,6 +25,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <event.h>
 
@@ -52,6 +53,26 @@ print_user(struct iked_user *usr)
 	print_verbose("user \"%s\" \"%s\"\n", usr->usr_name, usr->usr_pass);
 }
 
+void
+print_radius(struct iked_radserver *srv)
+{
+	struct sockaddr_storage	 ss;
+	in_port_t		 port;
+
+	memcpy(&ss, &srv->rs_sockaddr, sizeof(ss));
+	port = socket_getport((struct sockaddr *)&ss);
+	socket_setport((struct sockaddr *)&ss, 0);
+	print_verbose("radius server %s port %u secret \"%s\"\n",
+	    print_addr(&ss), port, srv->rs_secret);
+}
+
+void
+print_redirect(struct iked_redirgw *gw)
+{
+	print_verbose("redirect gateway %s weight %u\n",
+	    print_addr(&gw->rg_addr), gw->rg_weight);
+}
+
 void
 print_policy(struct iked_policy *pol)
 {
@@ -91,6 +112,12 @@ print_policy(struct iked_policy *pol)
 	if (pol->pol_flags & IKED_POLICY_NATT_FORCE)
 		print_verbose(" natt");
 
+	if (pol->pol_flags & IKED_POLICY_RESUME)
+		print_verbose(" resume");
+
+	if (pol->pol_flags & IKED_POLICY_CHILDLESS)
+		print_verbose(" childless");
+
 	print_verbose(" %s", print_xf(pol->pol_saproto, 0, saxfs));
 
 	if (pol->pol_nipproto > 0) {
@@ -631,7 +631,7 @@ proc_dispatch(int fd, short event, void *arg)
 	struct imsgbuf		*ibuf;
 	struct imsg		 imsg;
 	ssize_t			 n;
-	int			 verbose;
+	struct iked_verbose	 verbose;
 	const char		*title;
 	struct privsep_fd	 pf;
 
@@ -688,7 +688,8 @@ proc_dispatch(int fd, short event, void *arg)
 		case IMSG_CTL_VERBOSE:
 			IMSG_SIZE_CHECK(&imsg, &verbose);
 			memcpy(&verbose, imsg.data, sizeof(verbose));
-			log_setverbose(verbose);
+			log_setverbose_subsys(verbose.v_subsys,
+			    verbose.v_level);
 			break;
 		case IMSG_CTL_PROCFD:
 			IMSG_SIZE_CHECK(&imsg, &pf);
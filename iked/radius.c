@@ -0,0 +1,826 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define LOG_SUBSYS	LOG_SUBSYS_EAP
+#include "iked.h"
+#include "ikev2.h"
+#include "eap.h"
+#include "chap_ms.h"
+#include "radius.h"
+
+/*
+ * EAP pass-through to RADIUS servers (RFC 3579).  The EAP messages of
+ * the peer are sent in Access-Requests and the EAP messages of the
+ * server are returned in the IKE_AUTH responses, so the EAP method
+ * runs between the peer and the server.  The MSK is taken from the
+ * MS-MPPE keys of the Access-Accept.
+ *
+ * The requests of all SAs share a few UDP sockets, each with 256
+ * RADIUS identifiers.  A request that finds no free identifier waits
+ * until a reply arrives.  Requests are retransmitted to the same server
+ * and then sent to the next one, a server that did not respond is
+ * skipped by new requests for a while.
+ */
+
+#define RADIUS_RECV_MAX		32	/* datagrams per read event */
+#define RADIUS_RCVBUF_PER_ID	2048	/* a short reply with overhead */
+#define RADIUS_NAS_IDENTIFIER	"iked"
+
+static struct iked_radserver *
+	 radius_server_select(struct iked *);
+static struct iked_radserver *
+	 radius_server_next(struct iked *, struct iked_radserver *);
+static unsigned int
+	 radius_server_count(struct iked *);
+static struct iked_radsock *
+	 radius_socket(struct iked *, int);
+static int	 radius_getid(struct iked *, struct iked_radreq *);
+static void	 radius_putid(struct iked_radreq *);
+static int	 radius_request_start(struct iked *, struct iked_radreq *);
+static void	 radius_request_wait(struct iked *, struct iked_radreq *);
+static int	 radius_request_encode(struct iked_radreq *);
+static void	 radius_request_send(struct iked *, struct iked_radreq *);
+static void	 radius_request_timeout(struct iked *, void *);
+static void	 radius_wakeup(struct iked *);
+static void	 radius_fail(struct iked *, struct iked_sa *, char *);
+static int	 radius_add_attr(struct ibuf *, uint8_t, const void *, size_t);
+static int	 radius_mppe_key(struct iked_radreq *, uint8_t *, size_t,
+		    uint8_t *, size_t *);
+static int	 radius_response_auth(uint8_t *, size_t, const char *,
+		    uint8_t *);
+static void	 radius_recv(int, short, void *);
+static void	 radius_response(struct iked *, struct iked_radsock *,
+		    uint8_t *, size_t, struct sockaddr *);
+
+void
+radius_config_add(struct iked *env, struct iked_radserver *new)
+{
+	struct iked_radserver	*srv;
+
+	if ((srv = calloc(1, sizeof(*srv))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return;
+	}
+	memcpy(&srv->rs_sockaddr, &new->rs_sockaddr, sizeof(srv->rs_sockaddr));
+	strlcpy(srv->rs_secret, new->rs_secret, sizeof(srv->rs_secret));
+	TAILQ_INSERT_TAIL(&env->sc_radservers, srv, rs_entry);
+
+	log_debug("%s: server %s", __func__, print_addr(&srv->rs_sockaddr));
+}
+
+/*
+ * Pending requests lose their server and are sent to one of the new
+ * servers when they time out.
+ */
+void
+radius_config_reset(struct iked *env)
+{
+	struct iked_radserver	*srv;
+	struct iked_radsock	*rsk;
+	struct iked_radreq	*req;
+	unsigned int		 i, id;
+
+	for (i = 0; i < IKED_RADIUS_SOCKETS * 2; i++) {
+		rsk = i < IKED_RADIUS_SOCKETS ? env->sc_radsock4[i] :
+		    env->sc_radsock6[i - IKED_RADIUS_SOCKETS];
+		if (rsk == NULL)
+			continue;
+		for (id = 0; id < nitems(rsk->rsk_reqs); id++)
+			if ((req = rsk->rsk_reqs[id]) != NULL)
+				req->rr_server = NULL;
+	}
+	TAILQ_FOREACH(req, &env->sc_radwait, rr_entry)
+		req->rr_server = NULL;
+
+	while ((srv = TAILQ_FIRST(&env->sc_radservers)) != NULL) {
+		TAILQ_REMOVE(&env->sc_radservers, srv, rs_entry);
+		freezero(srv, sizeof(*srv));
+	}
+	env->sc_radnext = NULL;
+}
+
+static struct iked_radserver *
+radius_server_next(struct iked *env, struct iked_radserver *srv)
+{
+	if (srv == NULL || (srv = TAILQ_NEXT(srv, rs_entry)) == NULL)
+		srv = TAILQ_FIRST(&env->sc_radservers);
+	return (srv);
+}
+
+static unsigned int
+radius_server_count(struct iked *env)
+{
+	struct iked_radserver	*srv;
+	unsigned int		 n = 0;
+
+	TAILQ_FOREACH(srv, &env->sc_radservers, rs_entry)
+		n++;
+	return (n);
+}
+
+/* Round robin over the servers that did not time out recently */
+static struct iked_radserver *
+radius_server_select(struct iked *env)
+{
+	struct iked_radserver	*srv, *start;
+	uint64_t		 now = hist_now();
+
+	if ((start = env->sc_radnext) == NULL &&
+	    (start = TAILQ_FIRST(&env->sc_radservers)) == NULL)
+		return (NULL);
+	srv = start;
+	do {
+		if (srv->rs_deaduntil <= now)
+			break;
+		srv = radius_server_next(env, srv);
+	} while (srv != start);
+
+	/* If all of them are down, try them in turn anyway */
+	env->sc_radnext = radius_server_next(env, srv);
+	return (srv);
+}
+
+static struct iked_radsock *
+radius_socket(struct iked *env, int af)
+{
+	struct iked_radsock	*rsk;
+	int			 bufsize;
+
+	if ((rsk = calloc(1, sizeof(*rsk))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((rsk->rsk_fd = socket(af, SOCK_DGRAM | SOCK_NONBLOCK |
+	    SOCK_CLOEXEC, IPPROTO_UDP)) == -1) {
+		log_warn("%s: socket", __func__);
+		free(rsk);
+		return (NULL);
+	}
+	/* Room for the answers to all identifiers */
+	bufsize = nitems(rsk->rsk_reqs) * RADIUS_RCVBUF_PER_ID;
+	if (setsockopt(rsk->rsk_fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof(bufsize)) == -1)
+		log_debug("%s: setsockopt SO_RCVBUF", __func__);
+	rsk->rsk_env = env;
+	rsk->rsk_nextid = arc4random_uniform(nitems(rsk->rsk_reqs));
+	event_set(&rsk->rsk_ev, rsk->rsk_fd, EV_READ|EV_PERSIST,
+	    radius_recv, rsk);
+	event_add(&rsk->rsk_ev, NULL);
+
+	return (rsk);
+}
+
+/*
+ * Take the next free identifier of the sockets in turn.  Returns -1 if
+ * there is no socket and 1 if all identifiers are in use.
+ */
+static int
+radius_getid(struct iked *env, struct iked_radreq *req)
+{
+	struct iked_radsock	**socks, *rsk;
+	unsigned int		 i, idx;
+	int			 ret = -1;
+
+	if (req->rr_server->rs_sockaddr.ss_family == AF_INET)
+		socks = env->sc_radsock4;
+	else
+		socks = env->sc_radsock6;
+
+	for (i = 0; i < IKED_RADIUS_SOCKETS; i++) {
+		idx = (env->sc_radsocknext + i) % IKED_RADIUS_SOCKETS;
+		if (socks[idx] == NULL && (socks[idx] = radius_socket(env,
+		    req->rr_server->rs_sockaddr.ss_family)) == NULL)
+			continue;
+		rsk = socks[idx];
+		if (rsk->rsk_nreqs == nitems(rsk->rsk_reqs)) {
+			ret = 1;
+			continue;
+		}
+		while (rsk->rsk_reqs[rsk->rsk_nextid] != NULL)
+			rsk->rsk_nextid++;
+		req->rr_id = rsk->rsk_nextid++;
+		req->rr_sock = rsk;
+		rsk->rsk_reqs[req->rr_id] = req;
+		rsk->rsk_nreqs++;
+		env->sc_radsocknext = idx + 1;
+		return (0);
+	}
+
+	return (ret);
+}
+
+static void
+radius_putid(struct iked_radreq *req)
+{
+	struct iked_radsock	*rsk = req->rr_sock;
+
+	if (rsk == NULL)
+		return;
+	rsk->rsk_reqs[req->rr_id] = NULL;
+	rsk->rsk_nreqs--;
+	req->rr_sock = NULL;
+}
+
+/*
+ * Send the EAP message of the peer to a RADIUS server.  The answer is
+ * sent to the peer as the response to the current IKE_AUTH request,
+ * retransmits of the request are dropped in the meantime.
+ */
+int
+radius_request(struct iked *env, struct iked_sa *sa, struct ibuf **eap)
+{
+	struct iked_radreq	*req;
+
+	if (TAILQ_EMPTY(&env->sc_radservers)) {
+		log_info("%s: no RADIUS server", SPI_SA(sa, __func__));
+		return (-1);
+	}
+	if (*eap == NULL)
+		return (-1);
+	if (sa->sa_radreq != NULL) {
+		log_debug("%s: request pending", __func__);
+		return (0);
+	}
+
+	if ((req = calloc(1, sizeof(*req))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	req->rr_sa = sa;
+	req->rr_eap = *eap;
+	*eap = NULL;
+	req->rr_server = radius_server_select(env);
+	req->rr_start = hist_now();
+	timer_set(env, &req->rr_timer, radius_request_timeout, req);
+	sa->sa_radreq = req;
+	ikestat_inc(env, ikes_radius_pending);
+
+	switch (radius_request_start(env, req)) {
+	case -1:
+		return (-1);
+	case 1:
+		radius_request_wait(env, req);
+		break;
+	}
+	return (0);
+}
+
+void
+radius_request_free(struct iked *env, struct iked_radreq *req)
+{
+	if (req == NULL)
+		return;
+
+	timer_del(env, &req->rr_timer);
+	radius_putid(req);
+	if (req->rr_waiting)
+		TAILQ_REMOVE(&env->sc_radwait, req, rr_entry);
+	req->rr_sa->sa_radreq = NULL;
+	ibuf_free(req->rr_eap);
+	ibuf_free(req->rr_pkt);
+	free(req);
+	ikestat_dec(env, ikes_radius_pending);
+
+	radius_wakeup(env);
+}
+
+/* Returns 1 if the request has to wait for a free identifier */
+static int
+radius_request_start(struct iked *env, struct iked_radreq *req)
+{
+	int	 ret;
+
+	if (req->rr_server == NULL &&
+	    (req->rr_server = radius_server_select(env)) == NULL)
+		return (-1);
+
+	if ((ret = radius_getid(env, req)) != 0)
+		return (ret);
+
+	if (radius_request_encode(req) == -1)
+		return (-1);
+	req->rr_tries = 0;
+	radius_request_send(env, req);
+	return (0);
+}
+
+static void
+radius_request_wait(struct iked *env, struct iked_radreq *req)
+{
+	log_debug("%s: no free identifier", __func__);
+	ikestat_inc(env, ikes_radius_wait);
+	req->rr_waiting = 1;
+	TAILQ_INSERT_TAIL(&env->sc_radwait, req, rr_entry);
+}
+
+/* Start the waiting requests when identifiers became free */
+static void
+radius_wakeup(struct iked *env)
+{
+	struct iked_radreq	*req;
+
+	while ((req = TAILQ_FIRST(&env->sc_radwait)) != NULL) {
+		TAILQ_REMOVE(&env->sc_radwait, req, rr_entry);
+		req->rr_waiting = 0;
+		switch (radius_request_start(env, req)) {
+		case -1:
+			radius_fail(env, req->rr_sa, "RADIUS request failed");
+			break;
+		case 1:
+			/* Keep the order of the waiting requests */
+			req->rr_waiting = 1;
+			TAILQ_INSERT_HEAD(&env->sc_radwait, req, rr_entry);
+			return;
+		}
+	}
+}
+
+static int
+radius_add_attr(struct ibuf *pkt, uint8_t type, const void *val, size_t len)
+{
+	struct radius_attr	*attr;
+
+	if (len > RADIUS_ATTR_MAX)
+		return (-1);
+	if ((attr = ibuf_reserve(pkt, sizeof(*attr))) == NULL)
+		return (-1);
+	attr->ra_type = type;
+	attr->ra_length = sizeof(*attr) + len;
+	return (ibuf_add(pkt, val, len));
+}
+
+/*
+ * Encode the Access-Request for the current server.  Retransmits to the
+ * same server reuse the identifier and the Request Authenticator.
+ */
+static int
+radius_request_encode(struct iked_radreq *req)
+{
+	struct iked_sa		*sa = req->rr_sa;
+	struct iked_radserver	*srv = req->rr_server;
+	struct radius_header	*hdr;
+	struct ibuf		*pkt;
+	char			 host[NI_MAXHOST];
+	uint8_t			 mac[EVP_MAX_MD_SIZE], zero[RADIUS_AUTH_SZ];
+	uint8_t			*eap;
+	uint32_t		 porttype;
+	size_t			 left, len, maoff;
+	unsigned int		 maclen;
+
+	ibuf_free(req->rr_pkt);
+	req->rr_pkt = NULL;
+
+	if ((pkt = ibuf_dynamic(sizeof(*hdr) + ibuf_size(req->rr_eap) + 128,
+	    RADIUS_PACKET_MAX)) == NULL)
+		goto fail;
+	if ((hdr = ibuf_reserve(pkt, sizeof(*hdr))) == NULL)
+		goto fail;
+	hdr->rad_code = RADIUS_CODE_ACCESS_REQUEST;
+	hdr->rad_id = req->rr_id;
+	arc4random_buf(req->rr_auth, sizeof(req->rr_auth));
+	memcpy(hdr->rad_auth, req->rr_auth, sizeof(hdr->rad_auth));
+
+	if (sa->sa_eapid != NULL && radius_add_attr(pkt,
+	    RADIUS_TYPE_USER_NAME, sa->sa_eapid,
+	    MINIMUM(strlen(sa->sa_eapid), RADIUS_ATTR_MAX)) == -1)
+		goto fail;
+	if (radius_add_attr(pkt, RADIUS_TYPE_NAS_IDENTIFIER,
+	    RADIUS_NAS_IDENTIFIER, strlen(RADIUS_NAS_IDENTIFIER)) == -1)
+		goto fail;
+	porttype = htobe32(RADIUS_NAS_PORT_TYPE_VIRTUAL);
+	if (radius_add_attr(pkt, RADIUS_TYPE_NAS_PORT_TYPE,
+	    &porttype, sizeof(porttype)) == -1)
+		goto fail;
+	if (getnameinfo((struct sockaddr *)&sa->sa_peer.addr,
+	    SS_LEN(sa->sa_peer.addr), host, sizeof(host), NULL, 0,
+	    NI_NUMERICHOST) == 0 &&
+	    radius_add_attr(pkt, RADIUS_TYPE_CALLING_STATION_ID,
+	    host, strlen(host)) == -1)
+		goto fail;
+
+	/* RFC 3579 3.1: split into consecutive attributes */
+	eap = ibuf_data(req->rr_eap);
+	for (left = ibuf_size(req->rr_eap); left > 0; left -= len) {
+		len = MINIMUM(left, RADIUS_ATTR_MAX);
+		if (radius_add_attr(pkt, RADIUS_TYPE_EAP_MESSAGE,
+		    eap, len) == -1)
+			goto fail;
+		eap += len;
+	}
+
+	if (sa->sa_radstate != NULL && radius_add_attr(pkt,
+	    RADIUS_TYPE_STATE, ibuf_data(sa->sa_radstate),
+	    ibuf_size(sa->sa_radstate)) == -1)
+		goto fail;
+
+	/* Message-Authenticator over the packet with the value zeroed */
+	bzero(zero, sizeof(zero));
+	maoff = ibuf_size(pkt) + sizeof(struct radius_attr);
+	if (radius_add_attr(pkt, RADIUS_TYPE_MESSAGE_AUTH,
+	    zero, sizeof(zero)) == -1)
+		goto fail;
+
+	hdr = ibuf_data(pkt);
+	hdr->rad_length = htobe16(ibuf_size(pkt));
+	if (HMAC(EVP_md5(), srv->rs_secret, strlen(srv->rs_secret),
+	    ibuf_data(pkt), ibuf_size(pkt), mac, &maclen) == NULL ||
+	    maclen != RADIUS_AUTH_SZ)
+		goto fail;
+	memcpy(ibuf_seek(pkt, maoff, RADIUS_AUTH_SZ), mac, RADIUS_AUTH_SZ);
+
+	req->rr_pkt = pkt;
+	return (0);
+ fail:
+	log_debug("%s: failed to encode request", __func__);
+	ibuf_free(pkt);
+	return (-1);
+}
+
+static void
+radius_request_send(struct iked *env, struct iked_radreq *req)
+{
+	struct iked_radserver	*srv = req->rr_server;
+
+	if (sendto(req->rr_sock->rsk_fd, ibuf_data(req->rr_pkt),
+	    ibuf_size(req->rr_pkt), 0, (struct sockaddr *)&srv->rs_sockaddr,
+	    SS_LEN(srv->rs_sockaddr)) == -1)
+		log_warn("%s: sendto %s", __func__,
+		    print_addr(&srv->rs_sockaddr));
+	else
+		ikestat_inc(env, ikes_radius_sent);
+
+	timer_add(env, &req->rr_timer, env->sc_radius_timeout);
+}
+
+static void
+radius_request_timeout(struct iked *env, void *arg)
+{
+	struct iked_radreq	*req = arg;
+	struct iked_radserver	*srv = req->rr_server;
+	struct iked_sa		*sa = req->rr_sa;
+
+	if (srv != NULL &&
+	    ++req->rr_tries < (unsigned int)env->sc_radius_maxtries) {
+		log_debug("%s: retransmit id %u to %s", __func__,
+		    req->rr_id, print_addr(&srv->rs_sockaddr));
+		ikestat_inc(env, ikes_radius_retransmit);
+		radius_request_send(env, req);
+		return;
+	}
+
+	/* The next server gets a new identifier and authenticator */
+	radius_putid(req);
+	if (srv != NULL) {
+		log_info("%s: RADIUS server %s not responding",
+		    SPI_SA(sa, __func__), print_addr(&srv->rs_sockaddr));
+		srv->rs_deaduntil = hist_now() +
+		    IKED_RADIUS_DEADTIME * 1000000ULL;
+		if (++req->rr_servers >= radius_server_count(env)) {
+			ikestat_inc(env, ikes_radius_timeout);
+			radius_fail(env, sa, "RADIUS timeout");
+			return;
+		}
+		ikestat_inc(env, ikes_radius_failover);
+		req->rr_server = radius_server_next(env, srv);
+	}
+
+	switch (radius_request_start(env, req)) {
+	case -1:
+		radius_fail(env, sa, "RADIUS request failed");
+		return;
+	case 1:
+		radius_request_wait(env, req);
+		break;
+	}
+	radius_wakeup(env);
+}
+
+static void
+radius_fail(struct iked *env, struct iked_sa *sa, char *reason)
+{
+	ikev2_ike_sa_setreason(sa, reason);
+	sa_state(env, sa, IKEV2_STATE_CLOSED);
+	sa_free(env, sa);
+}
+
+static void
+radius_recv(int fd, short event, void *arg)
+{
+	struct iked_radsock	*rsk = arg;
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen;
+	uint8_t			 buf[RADIUS_PACKET_MAX];
+	ssize_t			 len;
+	int			 i;
+
+	for (i = 0; i < RADIUS_RECV_MAX; i++) {
+		sslen = sizeof(ss);
+		if ((len = recvfrom(fd, buf, sizeof(buf), 0,
+		    (struct sockaddr *)&ss, &sslen)) == -1) {
+			if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNREFUSED)
+				log_warn("%s: recvfrom", __func__);
+			return;
+		}
+		radius_response(rsk->rsk_env, rsk, buf, len,
+		    (struct sockaddr *)&ss);
+	}
+}
+
+/*
+ * RFC 2548 2.4.2: the key is encrypted in blocks of 16 bytes, chained
+ * with MD5 over the secret, the Request Authenticator and the salt.
+ */
+static int
+radius_mppe_key(struct iked_radreq *req, uint8_t *val, size_t len,
+    uint8_t *key, size_t *keylen)
+{
+	const char	*secret = req->rr_server->rs_secret;
+	EVP_MD_CTX	*ctx;
+	uint8_t		 plain[RADIUS_ATTR_MAX], b[EVP_MAX_MD_SIZE];
+	const uint8_t	*prev;
+	size_t		 i, j;
+	unsigned int	 mdlen;
+	int		 ret = -1;
+
+	/* salt and at least one block */
+	if (len < 2 + 16 || (len - 2) % 16 != 0 || (val[0] & 0x80) == 0)
+		return (-1);
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		return (-1);
+
+	prev = req->rr_auth;
+	for (i = 2; i < len; i += 16) {
+		if (!EVP_DigestInit_ex(ctx, EVP_md5(), NULL) ||
+		    !EVP_DigestUpdate(ctx, secret, strlen(secret)) ||
+		    !EVP_DigestUpdate(ctx, prev, i == 2 ?
+		    RADIUS_AUTH_SZ : 16) ||
+		    (i == 2 && !EVP_DigestUpdate(ctx, val, 2)) ||
+		    !EVP_DigestFinal_ex(ctx, b, &mdlen))
+			goto done;
+		for (j = 0; j < 16; j++)
+			plain[i - 2 + j] = val[i + j] ^ b[j];
+		prev = val + i;
+	}
+
+	/* The first byte is the key length */
+	if (plain[0] == 0 || plain[0] > len - 3 ||
+	    plain[0] > MSCHAP_MSK_KEY_SZ)
+		goto done;
+	*keylen = plain[0];
+	memcpy(key, plain + 1, *keylen);
+	ret = 0;
+ done:
+	explicit_bzero(plain, sizeof(plain));
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+/* RFC 2865 3: MD5 over the packet followed by the secret */
+static int
+radius_response_auth(uint8_t *buf, size_t len, const char *secret,
+    uint8_t *md)
+{
+	EVP_MD_CTX	*ctx;
+	unsigned int	 mdlen;
+	int		 ret = -1;
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		return (-1);
+	if (EVP_DigestInit_ex(ctx, EVP_md5(), NULL) &&
+	    EVP_DigestUpdate(ctx, buf, len) &&
+	    EVP_DigestUpdate(ctx, secret, strlen(secret)) &&
+	    EVP_DigestFinal_ex(ctx, md, &mdlen))
+		ret = 0;
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+static void
+radius_response(struct iked *env, struct iked_radsock *rsk, uint8_t *buf,
+    size_t len, struct sockaddr *from)
+{
+	struct radius_header	*hdr = (struct radius_header *)buf;
+	struct iked_radreq	*req;
+	struct iked_radserver	*srv;
+	struct iked_sa		*sa;
+	struct ibuf		*eap = NULL, *state = NULL;
+	uint8_t			 respauth[RADIUS_AUTH_SZ];
+	uint8_t			 mac[EVP_MAX_MD_SIZE];
+	uint8_t			 recvkey[MSCHAP_MSK_KEY_SZ];
+	uint8_t			 sendkey[MSCHAP_MSK_KEY_SZ];
+	uint8_t			*val, *vsa, *ma = NULL, *mpperecv = NULL;
+	uint8_t			*mppesend = NULL;
+	size_t			 off, alen, vlen, voff, recvlen = 0;
+	size_t			 sendlen = 0, mpperecvlen = 0, mppesendlen = 0;
+	unsigned int		 maclen;
+	uint32_t		 vendor;
+
+	if (len < sizeof(*hdr) || betoh16(hdr->rad_length) < sizeof(*hdr) ||
+	    betoh16(hdr->rad_length) > len) {
+		log_debug("%s: invalid length", __func__);
+		goto invalid;
+	}
+	len = betoh16(hdr->rad_length);
+
+	if ((req = rsk->rsk_reqs[hdr->rad_id]) == NULL ||
+	    (srv = req->rr_server) == NULL ||
+	    sockaddr_cmp(from, (struct sockaddr *)&srv->rs_sockaddr,
+	    -1) != 0 || socket_getport(from) !=
+	    socket_getport((struct sockaddr *)&srv->rs_sockaddr)) {
+		log_debug("%s: unexpected id %u from %s", __func__,
+		    hdr->rad_id, print_addr(from));
+		goto invalid;
+	}
+
+	/*
+	 * The Response Authenticator and the Message-Authenticator are
+	 * both calculated with the Request Authenticator in the header.
+	 */
+	memcpy(respauth, hdr->rad_auth, sizeof(respauth));
+	memcpy(hdr->rad_auth, req->rr_auth, sizeof(hdr->rad_auth));
+	if (radius_response_auth(buf, len, srv->rs_secret, mac) == -1 ||
+	    timingsafe_bcmp(mac, respauth, sizeof(respauth)) != 0) {
+		log_debug("%s: invalid Response Authenticator from %s",
+		    __func__, print_addr(from));
+		goto invalid;
+	}
+
+	for (off = sizeof(*hdr); off < len; off += alen) {
+		if (len - off < sizeof(struct radius_attr) ||
+		    (alen = buf[off + 1]) < sizeof(struct radius_attr) ||
+		    alen > len - off) {
+			log_debug("%s: invalid attribute", __func__);
+			goto invalid;
+		}
+		val = buf + off + sizeof(struct radius_attr);
+		vlen = alen - sizeof(struct radius_attr);
+
+		switch (buf[off]) {
+		case RADIUS_TYPE_EAP_MESSAGE:
+			if (eap == NULL && (eap = ibuf_dynamic(vlen,
+			    RADIUS_PACKET_MAX)) == NULL)
+				goto invalid;
+			if (ibuf_add(eap, val, vlen) != 0)
+				goto invalid;
+			break;
+		case RADIUS_TYPE_STATE:
+			ibuf_free(state);
+			if ((state = ibuf_new(val, vlen)) == NULL)
+				goto invalid;
+			break;
+		case RADIUS_TYPE_MESSAGE_AUTH:
+			if (vlen != RADIUS_AUTH_SZ)
+				goto invalid;
+			ma = val;
+			break;
+		case RADIUS_TYPE_VENDOR_SPECIFIC:
+			if (vlen < sizeof(vendor))
+				break;
+			memcpy(&vendor, val, sizeof(vendor));
+			if (betoh32(vendor) != RADIUS_VENDOR_MICROSOFT)
+				break;
+			for (voff = sizeof(vendor); voff + 2 <= vlen;
+			    voff += vsa[1]) {
+				vsa = val + voff;
+				if (vsa[1] < 2 || vsa[1] > vlen - voff)
+					break;
+				if (vsa[0] == RADIUS_VTYPE_MPPE_RECV_KEY) {
+					mpperecv = vsa + 2;
+					mpperecvlen = vsa[1] - 2;
+				} else if (vsa[0] == RADIUS_VTYPE_MPPE_SEND_KEY) {
+					mppesend = vsa + 2;
+					mppesendlen = vsa[1] - 2;
+				}
+			}
+			break;
+		}
+	}
+
+	/* RFC 3579 3.2: required with EAP */
+	if (ma == NULL) {
+		log_debug("%s: no Message-Authenticator", __func__);
+		goto invalid;
+	}
+	memcpy(respauth, ma, sizeof(respauth));
+	bzero(ma, RADIUS_AUTH_SZ);
+	if (HMAC(EVP_md5(), srv->rs_secret, strlen(srv->rs_secret),
+	    buf, len, mac, &maclen) == NULL ||
+	    timingsafe_bcmp(mac, respauth, sizeof(respauth)) != 0) {
+		log_debug("%s: invalid Message-Authenticator from %s",
+		    __func__, print_addr(from));
+		goto invalid;
+	}
+
+	sa = req->rr_sa;
+	ikestat_lat(env, ikes_lat_radius, req->rr_start);
+
+	switch (hdr->rad_code) {
+	case RADIUS_CODE_ACCESS_CHALLENGE:
+		if (eap == NULL)
+			goto invalid;
+		log_debug("%s: challenge from %s", SPI_SA(sa, __func__),
+		    print_addr(from));
+		radius_request_free(env, req);
+		ibuf_free(sa->sa_radstate);
+		sa->sa_radstate = state;
+		state = NULL;
+		if (ikev2_send_ike_e(env, sa, eap, IKEV2_PAYLOAD_EAP,
+		    IKEV2_EXCHANGE_IKE_AUTH, 1) == -1)
+			radius_fail(env, sa, "EAP response failed");
+		break;
+	case RADIUS_CODE_ACCESS_ACCEPT:
+		ikestat_inc(env, ikes_radius_accept);
+		if (eap == NULL || mpperecv == NULL || mppesend == NULL ||
+		    radius_mppe_key(req, mpperecv, mpperecvlen,
+		    recvkey, &recvlen) == -1 ||
+		    radius_mppe_key(req, mppesend, mppesendlen,
+		    sendkey, &sendlen) == -1) {
+			log_info("%s: no EAP-Success or MS-MPPE keys from %s",
+			    SPI_SA(sa, __func__), print_addr(from));
+			radius_request_free(env, req);
+			radius_fail(env, sa, "RADIUS without MSK");
+			break;
+		}
+		radius_request_free(env, req);
+
+		/* Receive key followed by send key, zero padded */
+		ibuf_free(sa->sa_eapmsk);
+		if ((sa->sa_eapmsk = ibuf_new(NULL, MSCHAP_MSK_SZ)) == NULL) {
+			radius_fail(env, sa, "failed to get MSK");
+			break;
+		}
+		memcpy(ibuf_data(sa->sa_eapmsk), recvkey, recvlen);
+		memcpy((uint8_t *)ibuf_data(sa->sa_eapmsk) + recvlen,
+		    sendkey, sendlen);
+
+		log_info("%s: '%s' authenticated by %s", SPI_SA(sa, __func__),
+		    sa->sa_eapid == NULL ? "" : sa->sa_eapid,
+		    print_addr(from));
+		if (ikev2_send_ike_e(env, sa, eap, IKEV2_PAYLOAD_EAP,
+		    IKEV2_EXCHANGE_IKE_AUTH, 1) == -1) {
+			radius_fail(env, sa, "EAP response failed");
+			break;
+		}
+		sa_state(env, sa, IKEV2_STATE_AUTH_SUCCESS);
+		break;
+	case RADIUS_CODE_ACCESS_REJECT:
+		ikestat_inc(env, ikes_radius_reject);
+		log_info("%s: '%s' rejected by %s", SPI_SA(sa, __func__),
+		    sa->sa_eapid == NULL ? "" : sa->sa_eapid,
+		    print_addr(from));
+		radius_request_free(env, req);
+		if (eap != NULL)
+			(void)ikev2_send_ike_e(env, sa, eap, IKEV2_PAYLOAD_EAP,
+			    IKEV2_EXCHANGE_IKE_AUTH, 1);
+		radius_fail(env, sa, "RADIUS reject");
+		break;
+	default:
+		log_debug("%s: unexpected code %u", __func__, hdr->rad_code);
+		goto invalid;
+	}
+
+	explicit_bzero(recvkey, sizeof(recvkey));
+	explicit_bzero(sendkey, sizeof(sendkey));
+	ibuf_free(eap);
+	ibuf_free(state);
+	return;
+
+ invalid:
+	/* The request stays pending and is retransmitted */
+	ikestat_inc(env, ikes_radius_invalid);
+	ibuf_free(eap);
+	ibuf_free(state);
+}
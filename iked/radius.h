@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IKED_RADIUS_H
+#define IKED_RADIUS_H
+
+#include "openbsd-compat.h"
+
+#define RADIUS_AUTH_SZ		16
+#define RADIUS_PACKET_MAX	4096	/* RFC2865 */
+#define RADIUS_ATTR_MAX		253	/* value length */
+
+struct radius_header {
+	uint8_t		rad_code;
+	uint8_t		rad_id;
+	uint16_t	rad_length;
+	uint8_t		rad_auth[RADIUS_AUTH_SZ];
+	/* Followed by attributes */
+} __packed;
+
+struct radius_attr {
+	uint8_t		ra_type;
+	uint8_t		ra_length;	/* including this header */
+	/* Followed by the value */
+} __packed;
+
+/* RFC2865 */
+#define RADIUS_CODE_ACCESS_REQUEST	1
+#define RADIUS_CODE_ACCESS_ACCEPT	2
+#define RADIUS_CODE_ACCESS_REJECT	3
+#define RADIUS_CODE_ACCESS_CHALLENGE	11
+
+/* RFC2865, RFC3579 */
+#define RADIUS_TYPE_USER_NAME		1
+#define RADIUS_TYPE_STATE		24
+#define RADIUS_TYPE_VENDOR_SPECIFIC	26
+#define RADIUS_TYPE_CALLING_STATION_ID	31
+#define RADIUS_TYPE_NAS_IDENTIFIER	32
+#define RADIUS_TYPE_NAS_PORT_TYPE	61
+#define RADIUS_TYPE_EAP_MESSAGE		79
+#define RADIUS_TYPE_MESSAGE_AUTH	80
+
+#define RADIUS_NAS_PORT_TYPE_VIRTUAL	5
+
+/* RFC2548 */
+#define RADIUS_VENDOR_MICROSOFT		311
+#define RADIUS_VTYPE_MPPE_SEND_KEY	16
+#define RADIUS_VTYPE_MPPE_RECV_KEY	17
+
+#endif /* IKED_RADIUS_H */
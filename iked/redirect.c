@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event.h>
+
+#define LOG_SUBSYS	LOG_SUBSYS_IKEV2
+#include "iked.h"
+#include "ikev2.h"
+
+/*
+ * Redirect of IKE SAs to the other gateways of a cluster (RFC 5685).
+ * Each mode has a test that decides whether a new IKE SA is redirected
+ * in IKE_SA_INIT, before any DH computation, and a function that picks
+ * the gateway.  Established IKE SAs are only moved with ikectl, they
+ * are redirected regardless of the test.
+ */
+
+struct redirect_mode {
+	int			 rm_mode;
+	int			(*rm_wanted)(struct iked *);
+	struct iked_redirgw	*(*rm_select)(struct iked *);
+};
+
+static int	 redirect_never(struct iked *);
+static int	 redirect_always(struct iked *);
+static int	 redirect_loaded(struct iked *);
+static struct iked_redirgw *
+	 redirect_roundrobin(struct iked *);
+static struct iked_redirgw *
+	 redirect_weighted(struct iked *);
+
+static const struct redirect_mode redirect_modes[] = {
+	{ REDIRECT_NONE,	redirect_never,		redirect_roundrobin },
+	{ REDIRECT_STATIC,	redirect_always,	redirect_roundrobin },
+	{ REDIRECT_WEIGHTED,	redirect_always,	redirect_weighted },
+	{ REDIRECT_MAXSAS,	redirect_loaded,	redirect_weighted }
+};
+
+void
+redirect_config_add(struct iked *env, struct iked_redirgw *new)
+{
+	struct iked_redirgw	*gw;
+
+	if ((gw = calloc(1, sizeof(*gw))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return;
+	}
+	memcpy(&gw->rg_addr, &new->rg_addr, sizeof(gw->rg_addr));
+	gw->rg_weight = new->rg_weight;
+	TAILQ_INSERT_TAIL(&env->sc_redirgws, gw, rg_entry);
+
+	log_debug("%s: gateway %s weight %u", __func__,
+	    print_addr(&gw->rg_addr), gw->rg_weight);
+}
+
+void
+redirect_config_reset(struct iked *env)
+{
+	struct iked_redirgw	*gw;
+
+	while ((gw = TAILQ_FIRST(&env->sc_redirgws)) != NULL) {
+		TAILQ_REMOVE(&env->sc_redirgws, gw, rg_entry);
+		free(gw);
+	}
+	env->sc_redirnext = NULL;
+}
+
+static int
+redirect_never(struct iked *env)
+{
+	return (0);
+}
+
+static int
+redirect_always(struct iked *env)
+{
+	return (1);
+}
+
+/* Keep at most sc_redirect_maxsas established IKE SAs on this gateway */
+static int
+redirect_loaded(struct iked *env)
+{
+	return (env->sc_stats.ikes_sa_established_current >=
+	    env->sc_redirect_maxsas);
+}
+
+static struct iked_redirgw *
+redirect_roundrobin(struct iked *env)
+{
+	struct iked_redirgw	*gw;
+
+	if ((gw = env->sc_redirnext) == NULL)
+		gw = TAILQ_FIRST(&env->sc_redirgws);
+	if (gw != NULL)
+		env->sc_redirnext = TAILQ_NEXT(gw, rg_entry);
+	return (gw);
+}
+
+/*
+ * Smooth weighted round robin: a gateway with weight 3 gets three of
+ * four peers next to one with weight 1, but not three in a row.
+ */
+static struct iked_redirgw *
+redirect_weighted(struct iked *env)
+{
+	struct iked_redirgw	*gw, *best = NULL;
+	int			 total = 0;
+
+	TAILQ_FOREACH(gw, &env->sc_redirgws, rg_entry) {
+		gw->rg_current += gw->rg_weight;
+		total += gw->rg_weight;
+		if (best == NULL || gw->rg_current > best->rg_current)
+			best = gw;
+	}
+	if (best != NULL)
+		best->rg_current -= total;
+	return (best);
+}
+
+/*
+ * Returns the gateway for a new IKE SA, or for an established one that
+ * is moved by the administrator.  NULL if the SA stays.
+ */
+struct sockaddr_storage *
+redirect_select(struct iked *env, int established)
+{
+	const struct redirect_mode	*rm = NULL;
+	struct iked_redirgw		*gw;
+	size_t				 i;
+
+	if (TAILQ_EMPTY(&env->sc_redirgws))
+		return (NULL);
+	for (i = 0; i < nitems(redirect_modes); i++)
+		if (redirect_modes[i].rm_mode == env->sc_redirect_mode)
+			rm = &redirect_modes[i];
+	if (rm == NULL)
+		return (NULL);
+	if (!established && !rm->rm_wanted(env))
+		return (NULL);
+	if ((gw = rm->rm_select(env)) == NULL)
+		return (NULL);
+	gw->rg_redirected++;
+
+	log_debug("%s: %s", __func__, print_addr(&gw->rg_addr));
+	return (&gw->rg_addr);
+}
+
+/* Append the New Gateway Identity, returns its length */
+int
+redirect_addgw(struct ibuf *buf, struct sockaddr_storage *ss)
+{
+	struct sockaddr_in	*in4;
+	struct sockaddr_in6	*in6;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		in4 = (struct sockaddr_in *)ss;
+		if (ibuf_add_n8(buf, IKEV2_GW_IPV4) == -1 ||
+		    ibuf_add_n8(buf, sizeof(in4->sin_addr)) == -1 ||
+		    ibuf_add(buf, &in4->sin_addr, sizeof(in4->sin_addr)) == -1)
+			return (-1);
+		return (2 + sizeof(in4->sin_addr));
+	case AF_INET6:
+		in6 = (struct sockaddr_in6 *)ss;
+		if (ibuf_add_n8(buf, IKEV2_GW_IPV6) == -1 ||
+		    ibuf_add_n8(buf, sizeof(in6->sin6_addr)) == -1 ||
+		    ibuf_add(buf, &in6->sin6_addr,
+		    sizeof(in6->sin6_addr)) == -1)
+			return (-1);
+		return (2 + sizeof(in6->sin6_addr));
+	default:
+		log_debug("%s: unsupported address family", __func__);
+		return (-1);
+	}
+}
+
+/*
+ * Parse the New Gateway Identity, returns the number of bytes used or
+ * -1.  Names are not resolved by the ikev2 process, a gateway given as
+ * FQDN can not be followed.
+ */
+ssize_t
+redirect_getgw(uint8_t *buf, size_t len, struct sockaddr_storage *ss)
+{
+	struct sockaddr_in	*in4;
+	struct sockaddr_in6	*in6;
+	uint8_t			 type, idlen;
+
+	if (len < 2) {
+		log_debug("%s: short gateway identity", __func__);
+		return (-1);
+	}
+	type = buf[0];
+	idlen = buf[1];
+	if (len - 2 < idlen) {
+		log_debug("%s: gateway identity too long", __func__);
+		return (-1);
+	}
+
+	bzero(ss, sizeof(*ss));
+	switch (type) {
+	case IKEV2_GW_IPV4:
+		in4 = (struct sockaddr_in *)ss;
+		if (idlen != sizeof(in4->sin_addr))
+			goto bad;
+		in4->sin_family = AF_INET;
+#ifdef HAVE_SOCKADDR_SA_LEN
+		in4->sin_len = sizeof(*in4);
+#endif
+		memcpy(&in4->sin_addr, buf + 2, idlen);
+		break;
+	case IKEV2_GW_IPV6:
+		in6 = (struct sockaddr_in6 *)ss;
+		if (idlen != sizeof(in6->sin6_addr))
+			goto bad;
+		in6->sin6_family = AF_INET6;
+#ifdef HAVE_SOCKADDR_SA_LEN
+		in6->sin6_len = sizeof(*in6);
+#endif
+		memcpy(&in6->sin6_addr, buf + 2, idlen);
+		break;
+	case IKEV2_GW_FQDN:
+		log_info("%s: gateway given by name, not supported",
+		    __func__);
+		return (-1);
+	default:
+		goto bad;
+	}
+	return (2 + idlen);
+ bad:
+	log_debug("%s: invalid gateway identity type %u length %u",
+	    __func__, type, idlen);
+	return (-1);
+}
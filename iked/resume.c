@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event.h>
+
+#include <openssl/evp.h>
+
+#define LOG_SUBSYS	LOG_SUBSYS_IKEV2
+#include "iked.h"
+#include "ikev2.h"
+
+/*
+ * IKEv2 session resumption (RFC 5723).  The ticket is opaque to the
+ * initiator, it is sealed with AES-256-GCM:
+ *
+ *	key id (4) | IV (12) | ciphertext | tag (16)
+ *
+ * where the key id and the IV are authenticated as AAD.  The plaintext
+ * holds the expiry, the policy, IDi, the EAP identity, SK_d and the IKE
+ * transforms of the SA it was issued for.
+ */
+
+#define RESUME_TICKET_VERSION	1
+#define RESUME_IVSZ		12
+#define RESUME_TAGSZ		16
+#define RESUME_HDRSZ		(sizeof(uint32_t) + RESUME_IVSZ)
+
+static struct iked_ticketkey *
+	 resume_key_current(struct iked *);
+static struct iked_ticketkey *
+	 resume_key_find(struct iked *, uint32_t);
+static int	 resume_proposals_copy(struct iked_proposals *,
+		    struct iked_proposals *);
+static struct ibuf *
+	 resume_prf(struct iked_sa *, struct ibuf *, int);
+
+/* The current key, replaced when it is older than a ticket lifetime */
+static struct iked_ticketkey *
+resume_key_current(struct iked *env)
+{
+	struct iked_ticketkey	*tkk = &env->sc_ticketkeys[0];
+	time_t			 now = ikev2_init_time();
+
+	if (tkk->tkk_id != 0 && now - tkk->tkk_created < IKED_TICKET_LIFETIME)
+		return (tkk);
+
+	memcpy(&env->sc_ticketkeys[1], tkk, sizeof(*tkk));
+	do {
+		tkk->tkk_id = arc4random();
+	} while (tkk->tkk_id == 0 ||
+	    tkk->tkk_id == env->sc_ticketkeys[1].tkk_id);
+	arc4random_buf(tkk->tkk_key, sizeof(tkk->tkk_key));
+	tkk->tkk_created = now;
+
+	log_debug("%s: new ticket key 0x%08x", __func__, tkk->tkk_id);
+
+	return (tkk);
+}
+
+static struct iked_ticketkey *
+resume_key_find(struct iked *env, uint32_t id)
+{
+	struct iked_ticketkey	*tkk;
+	time_t			 now = ikev2_init_time();
+	unsigned int		 i;
+
+	for (i = 0; i < nitems(env->sc_ticketkeys); i++) {
+		tkk = &env->sc_ticketkeys[i];
+		if (tkk->tkk_id == 0 || tkk->tkk_id != id)
+			continue;
+		/* No ticket sealed with this key is valid anymore */
+		if (now - tkk->tkk_created >= 2 * IKED_TICKET_LIFETIME) {
+			explicit_bzero(tkk, sizeof(*tkk));
+			return (NULL);
+		}
+		return (tkk);
+	}
+	return (NULL);
+}
+
+/* Copy the IKE transforms of the SA */
+static int
+resume_proposals_copy(struct iked_proposals *dst, struct iked_proposals *src)
+{
+	struct iked_proposal	*prop, *nprop = NULL;
+	struct iked_transform	*xform;
+	unsigned int		 i;
+
+	TAILQ_FOREACH(prop, src, prop_entry) {
+		if (prop->prop_protoid != IKEV2_SAPROTO_IKE)
+			continue;
+		if ((nprop = config_add_proposal(dst, 1,
+		    IKEV2_SAPROTO_IKE)) == NULL)
+			return (-1);
+		for (i = 0; i < prop->prop_nxforms; i++) {
+			xform = prop->prop_xforms + i;
+			if (config_add_transform(nprop, xform->xform_type,
+			    xform->xform_id, xform->xform_length,
+			    xform->xform_keylength) != 0)
+				return (-1);
+		}
+		break;
+	}
+	return (nprop == NULL ? -1 : 0);
+}
+
+struct ibuf *
+resume_ticket_seal(struct iked *env, struct iked_sa *sa)
+{
+	struct iked_policy	*pol = sa->sa_policy;
+	struct iked_ticketkey	*tkk;
+	struct iked_proposal	*prop;
+	struct iked_transform	*xform;
+	struct ibuf		*plain = NULL, *buf = NULL;
+	EVP_CIPHER_CTX		*ctx = NULL;
+	uint8_t			*ptr, iv[RESUME_IVSZ];
+	size_t			 eapidlen;
+	unsigned int		 i;
+	int			 outl, ret = -1;
+
+	if (pol == NULL || sa->sa_iid.id_type == 0 ||
+	    !ibuf_length(sa->sa_key_d))
+		return (NULL);
+	eapidlen = sa->sa_eapid == NULL ? 0 : strlen(sa->sa_eapid);
+
+	TAILQ_FOREACH(prop, &sa->sa_proposals, prop_entry)
+		if (prop->prop_protoid == IKEV2_SAPROTO_IKE)
+			break;
+	if (prop == NULL) {
+		log_debug("%s: no IKE proposal", __func__);
+		return (NULL);
+	}
+
+	/* The peer has to accept the ticket */
+	if ((plain = ibuf_dynamic(256,
+	    IKED_TICKET_MAX - RESUME_HDRSZ - RESUME_TAGSZ)) == NULL ||
+	    ibuf_add_n8(plain, RESUME_TICKET_VERSION) != 0 ||
+	    ibuf_add_n64(plain,
+	    ikev2_init_time() + IKED_TICKET_LIFETIME) != 0 ||
+	    ibuf_add_n16(plain, strlen(pol->pol_name)) != 0 ||
+	    ibuf_add(plain, pol->pol_name, strlen(pol->pol_name)) != 0 ||
+	    ibuf_add_n8(plain, sa->sa_iid.id_type) != 0 ||
+	    ibuf_add_n16(plain, ibuf_size(sa->sa_iid.id_buf)) != 0 ||
+	    ibuf_add_ibuf(plain, sa->sa_iid.id_buf) != 0 ||
+	    ibuf_add_n16(plain, eapidlen) != 0 ||
+	    (eapidlen && ibuf_add(plain, sa->sa_eapid, eapidlen) != 0) ||
+	    ibuf_add_n16(plain, ibuf_size(sa->sa_key_d)) != 0 ||
+	    ibuf_add_ibuf(plain, sa->sa_key_d) != 0 ||
+	    ibuf_add_n8(plain, prop->prop_nxforms) != 0)
+		goto done;
+	for (i = 0; i < prop->prop_nxforms; i++) {
+		xform = prop->prop_xforms + i;
+		if (ibuf_add_n8(plain, xform->xform_type) != 0 ||
+		    ibuf_add_n16(plain, xform->xform_id) != 0 ||
+		    ibuf_add_n16(plain, xform->xform_length) != 0 ||
+		    ibuf_add_n16(plain, xform->xform_keylength) != 0)
+			goto done;
+	}
+
+	tkk = resume_key_current(env);
+	arc4random_buf(iv, sizeof(iv));
+
+	if ((buf = ibuf_open(RESUME_HDRSZ + ibuf_size(plain) +
+	    RESUME_TAGSZ)) == NULL ||
+	    ibuf_add_n32(buf, tkk->tkk_id) != 0 ||
+	    ibuf_add(buf, iv, sizeof(iv)) != 0)
+		goto done;
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL ||
+	    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+	    sizeof(iv), NULL) != 1 ||
+	    EVP_EncryptInit_ex(ctx, NULL, NULL, tkk->tkk_key, iv) != 1 ||
+	    EVP_EncryptUpdate(ctx, NULL, &outl, ibuf_data(buf),
+	    ibuf_size(buf)) != 1)
+		goto done;
+	if ((ptr = ibuf_reserve(buf, ibuf_size(plain))) == NULL ||
+	    EVP_EncryptUpdate(ctx, ptr, &outl, ibuf_data(plain),
+	    ibuf_size(plain)) != 1 || (size_t)outl != ibuf_size(plain) ||
+	    EVP_EncryptFinal_ex(ctx, ptr + outl, &outl) != 1 || outl != 0)
+		goto done;
+	if ((ptr = ibuf_reserve(buf, RESUME_TAGSZ)) == NULL ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG,
+	    RESUME_TAGSZ, ptr) != 1)
+		goto done;
+
+	log_debug("%s: ticket with %zu bytes, key 0x%08x",
+	    SPI_SA(sa, __func__), ibuf_size(buf), tkk->tkk_id);
+	ikestat_inc(env, ikes_resume_ticket_issued);
+
+	ret = 0;
+ done:
+	EVP_CIPHER_CTX_free(ctx);
+	ibuf_free(plain);
+	if (ret != 0) {
+		log_debug("%s: failed to seal ticket", SPI_SA(sa, __func__));
+		ibuf_free(buf);
+		buf = NULL;
+	}
+	return (buf);
+}
+
+struct iked_ticket *
+resume_ticket_open(struct iked *env, struct ibuf *opaque)
+{
+	struct iked_ticketkey	*tkk;
+	struct iked_ticket	*tk = NULL;
+	struct iked_proposal	*prop;
+	struct ibuf		 in, ct, *plain = NULL;
+	EVP_CIPHER_CTX		*ctx = NULL;
+	uint8_t			 iv[RESUME_IVSZ], tag[RESUME_TAGSZ];
+	uint64_t		 expire;
+	uint32_t		 id;
+	uint16_t		 len, xid, xlen, xkeylen;
+	uint8_t			 version, type, nxforms, i;
+	int			 outl, ret = -1;
+
+	if (ibuf_size(opaque) < RESUME_HDRSZ + RESUME_TAGSZ + 1) {
+		log_debug("%s: short ticket", __func__);
+		return (NULL);
+	}
+	ibuf_from_ibuf(&in, opaque);
+	if (ibuf_get_n32(&in, &id) != 0 ||
+	    ibuf_get(&in, iv, sizeof(iv)) != 0 ||
+	    ibuf_get_ibuf(&in, ibuf_size(&in) - RESUME_TAGSZ, &ct) != 0 ||
+	    ibuf_get(&in, tag, sizeof(tag)) != 0)
+		return (NULL);
+
+	if ((tkk = resume_key_find(env, id)) == NULL) {
+		log_debug("%s: unknown ticket key 0x%08x", __func__, id);
+		return (NULL);
+	}
+
+	if ((plain = ibuf_new(NULL, ibuf_size(&ct))) == NULL ||
+	    (ctx = EVP_CIPHER_CTX_new()) == NULL ||
+	    EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+	    sizeof(iv), NULL) != 1 ||
+	    EVP_DecryptInit_ex(ctx, NULL, NULL, tkk->tkk_key, iv) != 1 ||
+	    EVP_DecryptUpdate(ctx, NULL, &outl, ibuf_data(opaque),
+	    RESUME_HDRSZ) != 1 ||
+	    EVP_DecryptUpdate(ctx, ibuf_data(plain), &outl, ibuf_data(&ct),
+	    ibuf_size(&ct)) != 1 || (size_t)outl != ibuf_size(&ct) ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+	    sizeof(tag), tag) != 1 ||
+	    EVP_DecryptFinal_ex(ctx, NULL, &outl) != 1) {
+		log_debug("%s: failed to open ticket", __func__);
+		goto done;
+	}
+
+	if (ibuf_get_n8(plain, &version) != 0 ||
+	    version != RESUME_TICKET_VERSION ||
+	    ibuf_get_n64(plain, &expire) != 0)
+		goto bad;
+	if ((time_t)expire <= ikev2_init_time()) {
+		log_debug("%s: expired ticket", __func__);
+		goto done;
+	}
+
+	if ((tk = calloc(1, sizeof(*tk))) == NULL)
+		goto done;
+	TAILQ_INIT(&tk->tk_proposals);
+	tk->tk_expire = expire;
+
+	if (ibuf_get_n16(plain, &len) != 0 ||
+	    len >= sizeof(tk->tk_policy) ||
+	    ibuf_get(plain, tk->tk_policy, len) != 0 ||
+	    ibuf_get_n8(plain, &tk->tk_id.id_type) != 0 ||
+	    ibuf_get_n16(plain, &len) != 0 ||
+	    (tk->tk_id.id_buf = ibuf_getdata(plain, len)) == NULL ||
+	    ibuf_get_n16(plain, &len) != 0 ||
+	    (len && (tk->tk_eapid = ibuf_get_string(plain, len)) == NULL) ||
+	    ibuf_get_n16(plain, &len) != 0 ||
+	    (tk->tk_key_d = ibuf_getdata(plain, len)) == NULL ||
+	    ibuf_get_n8(plain, &nxforms) != 0 ||
+	    (prop = config_add_proposal(&tk->tk_proposals, 1,
+	    IKEV2_SAPROTO_IKE)) == NULL)
+		goto bad;
+	for (i = 0; i < nxforms; i++) {
+		if (ibuf_get_n8(plain, &type) != 0 ||
+		    ibuf_get_n16(plain, &xid) != 0 ||
+		    ibuf_get_n16(plain, &xlen) != 0 ||
+		    ibuf_get_n16(plain, &xkeylen) != 0 ||
+		    config_add_transform(prop, type, xid, xlen, xkeylen) != 0)
+			goto bad;
+	}
+	if (ibuf_size(plain) != 0)
+		goto bad;
+
+	log_debug("%s: ticket for policy '%s', key 0x%08x", __func__,
+	    tk->tk_policy, id);
+
+	ret = 0;
+	goto done;
+ bad:
+	log_debug("%s: invalid ticket", __func__);
+ done:
+	EVP_CIPHER_CTX_free(ctx);
+	ibuf_free(plain);
+	if (ret != 0) {
+		resume_ticket_free(tk);
+		tk = NULL;
+	}
+	return (tk);
+}
+
+/*
+ * Keep the ticket that the responder issued for the initiator SA,
+ * it is used for the policy when the SA is established.
+ */
+int
+resume_ticket_save(struct iked_sa *sa, struct ibuf *opaque,
+    uint32_t lifetime)
+{
+	struct iked_ticket	*tk;
+
+	if ((tk = calloc(1, sizeof(*tk))) == NULL)
+		return (-1);
+	TAILQ_INIT(&tk->tk_proposals);
+
+	if ((tk->tk_opaque = ibuf_dup(opaque)) == NULL ||
+	    (tk->tk_key_d = ibuf_dup(sa->sa_key_d)) == NULL ||
+	    resume_proposals_copy(&tk->tk_proposals, &sa->sa_proposals) != 0) {
+		resume_ticket_free(tk);
+		return (-1);
+	}
+	tk->tk_expire = ikev2_init_time() +
+	    MINIMUM(lifetime, IKED_TICKET_LIFETIME);
+
+	log_debug("%s: ticket with %zu bytes, lifetime %u",
+	    SPI_SA(sa, __func__), ibuf_size(opaque), lifetime);
+
+	resume_ticket_free(sa->sa_ticket);
+	sa->sa_ticket = tk;
+
+	return (0);
+}
+
+/* Take the ticket of the policy, it is only used once */
+struct iked_ticket *
+resume_ticket_get(struct iked_policy *pol)
+{
+	struct iked_ticket	*tk;
+
+	if ((tk = pol->pol_ticket) == NULL)
+		return (NULL);
+	pol->pol_ticket = NULL;
+
+	if ((pol->pol_flags & IKED_POLICY_RESUME) == 0 ||
+	    tk->tk_expire <= ikev2_init_time()) {
+		resume_ticket_free(tk);
+		return (NULL);
+	}
+	return (tk);
+}
+
+void
+resume_ticket_free(struct iked_ticket *tk)
+{
+	if (tk == NULL)
+		return;
+	ibuf_free(tk->tk_opaque);
+	ibuf_free(tk->tk_key_d);
+	ibuf_free(tk->tk_id.id_buf);
+	config_free_proposals(&tk->tk_proposals, 0);
+	free(tk->tk_eapid);
+	freezero(tk, sizeof(*tk));
+}
+
+/* AUTH = prf(SK_px, <octets>) of the initiator or the responder */
+static struct ibuf *
+resume_prf(struct iked_sa *sa, struct ibuf *authmsg, int initiator)
+{
+	struct ibuf	*key, *buf;
+	size_t		 len = 0;
+
+	key = initiator ? sa->sa_key_iprf : sa->sa_key_rprf;
+	if (key == NULL || hash_setkey(sa->sa_prf, ibuf_data(key),
+	    ibuf_size(key)) == NULL)
+		return (NULL);
+	if ((buf = ibuf_new(NULL, hash_length(sa->sa_prf))) == NULL)
+		return (NULL);
+
+	hash_init(sa->sa_prf);
+	hash_update(sa->sa_prf, ibuf_data(authmsg), ibuf_size(authmsg));
+	hash_final(sa->sa_prf, ibuf_data(buf), &len);
+
+	if (len != ibuf_size(buf)) {
+		ibuf_free(buf);
+		return (NULL);
+	}
+	return (buf);
+}
+
+int
+resume_authsign(struct iked *env, struct iked_sa *sa)
+{
+	struct ibuf	*authmsg, *buf;
+	int		 initiator = sa->sa_hdr.sh_initiator;
+
+	if ((authmsg = ikev2_msg_auth(env, sa, !initiator)) == NULL) {
+		log_debug("%s: failed to get auth data", __func__);
+		return (-1);
+	}
+	buf = resume_prf(sa, authmsg, initiator);
+	ibuf_free(authmsg);
+	if (buf == NULL) {
+		log_debug("%s: failed to compute auth", __func__);
+		return (-1);
+	}
+
+	ibuf_free(sa->sa_localauth.id_buf);
+	sa->sa_localauth.id_type = IKEV2_AUTH_SHARED_KEY_MIC;
+	sa->sa_localauth.id_offset = 0;
+	sa->sa_localauth.id_buf = buf;
+	sa_stateflags(sa, IKED_REQ_AUTH);
+
+	return (0);
+}
+
+int
+resume_authverify(struct iked *env, struct iked_sa *sa)
+{
+	struct ibuf	*authmsg, *buf = NULL;
+	int		 initiator = sa->sa_hdr.sh_initiator;
+	int		 ret = -1;
+
+	if (sa->sa_peerauth.id_type != IKEV2_AUTH_SHARED_KEY_MIC) {
+		log_info("%s: unexpected auth method %s",
+		    SPI_SA(sa, __func__), print_map(sa->sa_peerauth.id_type,
+		    ikev2_auth_map));
+		goto done;
+	}
+
+	if ((authmsg = ikev2_msg_auth(env, sa, initiator)) == NULL) {
+		log_debug("%s: failed to get auth data", __func__);
+		goto done;
+	}
+	buf = resume_prf(sa, authmsg, !initiator);
+	ibuf_free(authmsg);
+
+	if (buf == NULL ||
+	    ibuf_size(buf) != ibuf_length(sa->sa_peerauth.id_buf) ||
+	    timingsafe_bcmp(ibuf_data(buf), ibuf_data(sa->sa_peerauth.id_buf),
+	    ibuf_size(buf)) != 0) {
+		log_info("%s: authentication failed", SPI_SA(sa, __func__));
+		goto done;
+	}
+
+	log_debug("%s: authentication successful", __func__);
+	sa_state(env, sa, IKEV2_STATE_AUTH_SUCCESS);
+	sa_stateflags(sa, IKED_REQ_AUTHVALID);
+
+	ret = 0;
+ done:
+	ibuf_free(buf);
+	if (ret != 0)
+		ikev2_send_auth_failed(env, sa);
+	return (ret);
+}
@@ -112,6 +112,9 @@ enum imsg_type {
 	IMSG_CFG_POLICY,
 	IMSG_CFG_FLOW,
 	IMSG_CFG_USER,
+	IMSG_CFG_USERDB,
+	IMSG_CFG_RADIUS,
+	IMSG_CFG_REDIRECT,
 	IMSG_CERTREQ,
 	IMSG_CERT,
 	IMSG_CERTVALID,
@@ -126,11 +129,14 @@ enum imsg_type {
 	IMSG_VDNS_DEL,
 	IMSG_OCSP_FD,
 	IMSG_OCSP_CFG,
+	IMSG_OCSP_CACHE,
 	IMSG_AUTH,
 	IMSG_PRIVKEY,
 	IMSG_PUBKEY,
 	IMSG_CTL_SHOW_CERTSTORE,
 	IMSG_CTL_SHOW_STATS,
+	IMSG_CTL_SHOW_PEERS,
+	IMSG_CTL_REDIRECT,
 	IMSG_CTL_PROCFD,
 	IMSG_CTL_PROCREADY,
 };
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "iked.h"
+
+/*
+ * The user database is mapped read-only by the ikev2 process.  It is
+ * replaced by mapping a new file on reload, so the file must never be
+ * modified in place; ikectl userdb writes a new one and renames it.
+ */
+
+uint32_t
+userdb_hash(const char *name, size_t len)
+{
+	uint32_t	 h = 5381;
+	size_t		 i;
+
+	for (i = 0; i < len; i++)
+		h = ((h << 5) + h) ^ (uint8_t)name[i];
+	return (h);
+}
+
+struct iked_userdb *
+userdb_open(int fd)
+{
+	struct iked_userdb	*db = NULL;
+	struct iked_userdb_hdr	*hdr;
+	struct stat		 st;
+	uint64_t		 len;
+	uint32_t		 i, prev = 0, idx;
+
+	if (fstat(fd, &st) == -1) {
+		log_warn("%s: fstat", __func__);
+		goto fail;
+	}
+	if (st.st_size < (off_t)sizeof(*hdr) || st.st_size > UINT32_MAX) {
+		log_warnx("%s: invalid file size", __func__);
+		goto fail;
+	}
+	if ((db = calloc(1, sizeof(*db))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		goto fail;
+	}
+	db->ud_size = st.st_size;
+	if ((db->ud_map = mmap(NULL, db->ud_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		db->ud_map = NULL;
+		goto fail;
+	}
+
+	hdr = (struct iked_userdb_hdr *)db->ud_map;
+	if (memcmp(hdr->uh_magic, IKED_USERDB_MAGIC,
+	    sizeof(hdr->uh_magic)) != 0) {
+		log_warnx("%s: not a user database", __func__);
+		goto fail;
+	}
+	db->ud_nbuckets = betoh32(hdr->uh_nbuckets);
+	db->ud_nrecords = betoh32(hdr->uh_nrecords);
+	len = sizeof(*hdr) + ((uint64_t)db->ud_nbuckets + 1) * sizeof(idx) +
+	    (uint64_t)db->ud_nrecords * sizeof(struct iked_userdb_rec);
+	if (db->ud_nbuckets == 0 || len > db->ud_size) {
+		log_warnx("%s: truncated user database", __func__);
+		goto fail;
+	}
+	db->ud_index = (uint32_t *)(hdr + 1);
+	db->ud_records =
+	    (struct iked_userdb_rec *)(db->ud_index + db->ud_nbuckets + 1);
+
+	/* The lookups only have to check the record offsets */
+	for (i = 0; i <= db->ud_nbuckets; i++) {
+		idx = betoh32(db->ud_index[i]);
+		if (idx < prev || idx > db->ud_nrecords ||
+		    (i == db->ud_nbuckets && idx != db->ud_nrecords)) {
+			log_warnx("%s: invalid bucket index", __func__);
+			goto fail;
+		}
+		prev = idx;
+	}
+
+	close(fd);
+	log_debug("%s: %u users in %u buckets", __func__,
+	    db->ud_nrecords, db->ud_nbuckets);
+	return (db);
+ fail:
+	close(fd);
+	userdb_close(db);
+	return (NULL);
+}
+
+void
+userdb_close(struct iked_userdb *db)
+{
+	if (db == NULL)
+		return;
+	if (db->ud_map != NULL)
+		munmap(db->ud_map, db->ud_size);
+	free(db);
+}
+
+/*
+ * Find the user and copy its NT password hash to nthash, which has to
+ * hold MSCHAP_HASH_SZ bytes.
+ */
+int
+userdb_lookup(struct iked_userdb *db, const char *name, uint8_t *nthash)
+{
+	struct iked_userdb_rec	*rec;
+	size_t			 len = strlen(name);
+	uint32_t		 h, b, i, end, off;
+
+	if (db == NULL)
+		return (-1);
+
+	h = userdb_hash(name, len);
+	b = h % db->ud_nbuckets;
+	end = betoh32(db->ud_index[b + 1]);
+	for (i = betoh32(db->ud_index[b]); i < end; i++) {
+		rec = &db->ud_records[i];
+		if (betoh32(rec->ur_hash) != h ||
+		    betoh16(rec->ur_namelen) != len)
+			continue;
+		off = betoh32(rec->ur_name);
+		if (off > db->ud_size || len > db->ud_size - off)
+			continue;
+		if (memcmp(db->ud_map + off, name, len) != 0)
+			continue;
+		memcpy(nthash, rec->ur_nthash, sizeof(rec->ur_nthash));
+		return (0);
+	}
+
+	return (-1);
+}
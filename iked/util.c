@@ -23,15 +23,23 @@
 #include <sys/uio.h>
 
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netinet/ip_ipsp.h>
 
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#endif
+
 #include <netdb.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <event.h>
@@ -205,8 +213,74 @@ socket_bypass(int s, struct sockaddr *sa)
 	return (0);
 }
 
+/*
+ * Let the kernel drop what ikev2_msg_cb() would throw away anyway:
+ * datagrams that are not longer than an IKE header, that lack the
+ * non-ESP marker on the NAT-T port, are not IKEv2 or have a length
+ * field beyond the end of the datagram.  The program sees the UDP
+ * header at offset 0.  Only Linux has filters on UDP sockets.
+ */
 int
-udp_bind(struct sockaddr *sa, in_port_t port)
+socket_filter(int s, int natt)
+{
+#ifdef HAVE_LINUX_FILTER_H
+	uint32_t		 off = sizeof(struct udphdr) +
+				    (natt ? sizeof(uint32_t) : 0);
+	struct sock_filter	 insns[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,
+		    off + sizeof(struct ike_header), 0, 12),
+		/* non-ESP marker */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, sizeof(struct udphdr)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, natt ? 10 : 0),
+		/* major version */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		    off + offsetof(struct ike_header, ike_version)),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IKEV2_VERSION, 0, 7),
+		/* sizeof(struct ike_header) <= ike_length <= payload */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		    off + offsetof(struct ike_header, ike_length)),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+		    sizeof(struct ike_header), 0, 5),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, off),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_X, 0, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, (uint32_t)-1),
+		BPF_STMT(BPF_RET | BPF_K, 0)
+	};
+	struct sock_fprog	 prog = { nitems(insns), insns };
+
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER,
+	    &prog, sizeof(prog)) == -1) {
+		log_warn("%s: SO_ATTACH_FILTER", __func__);
+		return (-1);
+	}
+#endif
+	return (0);
+}
+
+/* Datagrams dropped by the filter or for lack of buffer space */
+int
+socket_drops(int s, uint32_t *drops)
+{
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_MEMINFO)
+	uint32_t	 mem[SK_MEMINFO_VARS];
+	socklen_t	 len = sizeof(mem);
+
+	if (getsockopt(s, SOL_SOCKET, SO_MEMINFO, mem, &len) == -1 ||
+	    len <= SK_MEMINFO_DROPS * sizeof(mem[0]))
+		return (-1);
+	*drops = mem[SK_MEMINFO_DROPS];
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+int
+udp_bind(struct sockaddr *sa, in_port_t port, int natt)
 {
 	int	 s, val;
 
@@ -239,6 +313,9 @@ udp_bind(struct sockaddr *sa, in_port_t port)
 		goto bad;
 	}
 
+	/* not fatal, userland checks the messages again */
+	(void)socket_filter(s, natt);
+
 	if (sa->sa_family == AF_INET) {
 #if defined(IP_RECVORIGDSTADDR)
 		val = 1;
@@ -348,7 +425,36 @@ sendtofrom(int s, void *buf, size_t len, int flags, struct sockaddr *to,
     socklen_t tolen, struct sockaddr *from, socklen_t fromlen)
 {
 	struct iovec		 iov;
-	struct msghdr		 msg;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	return (sendtofromv(s, &iov, 1, flags, to, tolen, from, fromlen));
+}
+
+union sendtofrom_cmsgbuf {
+	struct cmsghdr	hdr;
+	char		inbuf[CMSG_SPACE(sizeof(struct in_addr))];
+	char		in6buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#ifdef UDP_SEGMENT
+	char		gsobuf[CMSG_SPACE(sizeof(struct in6_pktinfo)) +
+			    CMSG_SPACE(sizeof(uint16_t))];
+#endif
+};
+
+/*
+ * Maximum number of datagrams per sendmmsg(2) call and the limits of
+ * a single UDP GSO send as enforced by the kernel.
+ */
+#define SENDMTOFROM_BATCH	64
+#define SENDMTOFROM_GSO_SEGS	64
+#define SENDMTOFROM_GSO_BYTES	(UINT16_MAX - 48 - 8)
+
+static void
+sendtofrom_msghdr(struct msghdr *msg, union sendtofrom_cmsgbuf *cmsgbuf,
+    struct iovec *iov, int iovcnt, struct sockaddr *to, socklen_t tolen,
+    struct sockaddr *from)
+{
 	struct cmsghdr		*cmsg;
 #ifdef IP_SENDSRCADDR
 	struct sockaddr_in	*in;
@@ -357,22 +463,15 @@ sendtofrom(int s, void *buf, size_t len, int flags, struct sockaddr *to,
 	struct in6_pktinfo	*pkt6;
 	struct sockaddr_in6	*in6;
 #endif
-	union {
-		struct cmsghdr	hdr;
-		char		inbuf[CMSG_SPACE(sizeof(struct in_addr))];
-		char		in6buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-	} cmsgbuf;
 
-	bzero(&msg, sizeof(msg));
-	bzero(&cmsgbuf, sizeof(cmsgbuf));
+	bzero(msg, sizeof(*msg));
+	bzero(cmsgbuf, sizeof(*cmsgbuf));
 
-	iov.iov_base = buf;
-	iov.iov_len = len;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_name = to;
-	msg.msg_namelen = tolen;
-	msg.msg_controllen = 0;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = iovcnt;
+	msg->msg_name = to;
+	msg->msg_namelen = tolen;
+	msg->msg_controllen = 0;
 
 	switch (to->sa_family) {
 	case AF_INET:
@@ -380,9 +479,9 @@ sendtofrom(int s, void *buf, size_t len, int flags, struct sockaddr *to,
 		in = (struct sockaddr_in *)from;
 		if (in->sin_addr.s_addr == INADDR_ANY)
 			break;
-		msg.msg_control = &cmsgbuf;
-		msg.msg_controllen += sizeof(cmsgbuf.inbuf);
-		cmsg = CMSG_FIRSTHDR(&msg);
+		msg->msg_control = cmsgbuf;
+		msg->msg_controllen += sizeof(cmsgbuf->inbuf);
+		cmsg = CMSG_FIRSTHDR(msg);
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
@@ -391,9 +490,9 @@ sendtofrom(int s, void *buf, size_t len, int flags, struct sockaddr *to,
 		break;
 	case AF_INET6:
 #ifdef IPV6_PKTINFO
-		msg.msg_control = &cmsgbuf;
-		msg.msg_controllen += sizeof(cmsgbuf.in6buf);
-		cmsg = CMSG_FIRSTHDR(&msg);
+		msg->msg_control = cmsgbuf;
+		msg->msg_controllen += sizeof(cmsgbuf->in6buf);
+		cmsg = CMSG_FIRSTHDR(msg);
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
@@ -403,10 +502,216 @@ sendtofrom(int s, void *buf, size_t len, int flags, struct sockaddr *to,
 #endif
 		break;
 	}
+}
+
+ssize_t
+sendtofromv(int s, struct iovec *iov, int iovcnt, int flags,
+    struct sockaddr *to, socklen_t tolen, struct sockaddr *from,
+    socklen_t fromlen)
+{
+	struct msghdr			msg;
+	union sendtofrom_cmsgbuf	cmsgbuf;
+
+	sendtofrom_msghdr(&msg, &cmsgbuf, iov, iovcnt, to, tolen, from);
 
 	return sendmsg(s, &msg, flags);
 }
 
+#ifdef UDP_SEGMENT
+static size_t
+sendmtofrom_len(struct iovec *iov, int iovcnt)
+{
+	size_t		len = 0;
+	int		i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return (len);
+}
+
+/*
+ * Send a run of datagrams that have the same size, optionally followed
+ * by a shorter one, as a single UDP GSO send.  The kernel splits it
+ * into the original datagrams.  Returns the number of datagrams that
+ * have been sent or -1.
+ */
+static int
+sendmtofrom_gso(int s, struct iovec *iov, int iovcnt, unsigned int n,
+    struct sockaddr *to, socklen_t tolen, struct sockaddr *from)
+{
+	struct msghdr			msg;
+	struct cmsghdr			*cmsg;
+	union sendtofrom_cmsgbuf	cmsgbuf;
+	size_t				seg, total;
+	unsigned int			cnt;
+	uint16_t			gso;
+
+	seg = total = sendmtofrom_len(iov, iovcnt);
+	for (cnt = 1; cnt < n && cnt < SENDMTOFROM_GSO_SEGS; cnt++) {
+		total += sendmtofrom_len(iov + cnt * iovcnt, iovcnt);
+		if (total > SENDMTOFROM_GSO_BYTES)
+			break;
+	}
+
+	sendtofrom_msghdr(&msg, &cmsgbuf, iov, cnt * iovcnt, to, tolen, from);
+	if (cnt > 1) {
+		cmsg = (struct cmsghdr *)((char *)&cmsgbuf +
+		    msg.msg_controllen);
+		msg.msg_control = &cmsgbuf;
+		msg.msg_controllen += CMSG_SPACE(sizeof(gso));
+		cmsg->cmsg_len = CMSG_LEN(sizeof(gso));
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		gso = seg;
+		memcpy(CMSG_DATA(cmsg), &gso, sizeof(gso));
+	}
+
+	if (sendmsg(s, &msg, 0) == -1)
+		return (-1);
+	return (cnt);
+}
+#endif
+
+/*
+ * Send n datagrams from the same local address to the same peer.
+ * Each datagram consists of iovcnt consecutive elements of iov.
+ * Equally sized datagrams are sent with UDP GSO where supported,
+ * others with sendmmsg(2) in as few system calls as possible.
+ */
+int
+sendmtofrom(int s, struct iovec *iov, int iovcnt, unsigned int n,
+    struct sockaddr *to, socklen_t tolen, struct sockaddr *from,
+    socklen_t fromlen)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr			mmsg[SENDMTOFROM_BATCH];
+	union sendtofrom_cmsgbuf	cmsgbuf;
+	unsigned int			i, cnt;
+#endif
+#ifdef UDP_SEGMENT
+	static int			gso = -1;
+	int				val, segs = 1;
+	socklen_t			optlen;
+	size_t				seg;
+#endif
+	unsigned int			done = 0;
+	int				ret;
+
+	if (n == 1)
+		return (sendtofromv(s, iov, iovcnt, 0, to, tolen,
+		    from, fromlen) == -1 ? -1 : 0);
+
+#ifdef UDP_SEGMENT
+	/* Kernels without UDP GSO would send a single large datagram */
+	if (gso == -1) {
+		optlen = sizeof(val);
+		gso = getsockopt(s, SOL_UDP, UDP_SEGMENT, &val, &optlen) == 0;
+	}
+
+	/* All but the last datagram must have the same size */
+	seg = sendmtofrom_len(iov, iovcnt);
+	for (done = 1; gso && segs && done < n; done++) {
+		if (sendmtofrom_len(iov + done * iovcnt, iovcnt) > seg ||
+		    (sendmtofrom_len(iov + done * iovcnt, iovcnt) < seg &&
+		    done != n - 1))
+			segs = 0;
+	}
+
+	for (done = 0; gso && segs && done < n;) {
+		if ((ret = sendmtofrom_gso(s, iov + done * iovcnt, iovcnt,
+		    n - done, to, tolen, from)) == -1) {
+			/* Not supported by this route, try without GSO */
+			if (errno == EIO || errno == EINVAL)
+				break;
+			return (-1);
+		}
+		done += ret;
+	}
+#endif
+
+#ifdef HAVE_SENDMMSG
+	while (done < n) {
+		cnt = MINIMUM(n - done, SENDMTOFROM_BATCH);
+		for (i = 0; i < cnt; i++) {
+			/* All datagrams share the same control message */
+			sendtofrom_msghdr(&mmsg[i].msg_hdr, &cmsgbuf,
+			    iov + (done + i) * iovcnt, iovcnt, to, tolen, from);
+			mmsg[i].msg_len = 0;
+		}
+		if ((ret = sendmmsg(s, mmsg, cnt, 0)) == -1)
+			return (-1);
+		done += ret;
+	}
+#else
+	for (; done < n; done++) {
+		if (sendtofromv(s, iov + done * iovcnt, iovcnt, 0,
+		    to, tolen, from, fromlen) == -1)
+			return (-1);
+	}
+#endif
+
+	return (0);
+}
+
+/*
+ * Send the same datagram to several peers on one socket, with one
+ * sendmmsg(2) call per batch where supported.  Datagrams that cannot
+ * be sent are skipped.  Returns the number of datagrams that have
+ * been sent and adds the number of system calls to *calls.
+ */
+unsigned int
+sendtofrom_peers(int s, void *buf, size_t len, struct sockaddr_storage **to,
+    struct sockaddr_storage **from, unsigned int n, unsigned int *calls)
+{
+	struct iovec			iov;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr			mmsg[SENDMTOFROM_BATCH];
+	union sendtofrom_cmsgbuf	cmsgbuf[SENDMTOFROM_BATCH];
+	unsigned int			i, cnt;
+	int				ret;
+#endif
+	unsigned int			done = 0, sent = 0;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+#ifdef HAVE_SENDMMSG
+	while (done < n) {
+		cnt = MINIMUM(n - done, SENDMTOFROM_BATCH);
+		for (i = 0; i < cnt; i++) {
+			sendtofrom_msghdr(&mmsg[i].msg_hdr, &cmsgbuf[i], &iov,
+			    1, (struct sockaddr *)to[done + i],
+			    SS_LEN((*to[done + i])),
+			    (struct sockaddr *)from[done + i]);
+			mmsg[i].msg_len = 0;
+		}
+		(*calls)++;
+		if ((ret = sendmmsg(s, mmsg, cnt, 0)) == -1) {
+			log_warn("%s: sendmmsg: peer %s local %s", __func__,
+			    print_addr(to[done]), print_addr(from[done]));
+			done++;
+			continue;
+		}
+		done += ret;
+		sent += ret;
+	}
+#else
+	for (; done < n; done++) {
+		(*calls)++;
+		if (sendtofromv(s, &iov, 1, 0, (struct sockaddr *)to[done],
+		    SS_LEN((*to[done])), (struct sockaddr *)from[done],
+		    SS_LEN((*from[done]))) == -1) {
+			log_warn("%s: sendtofrom: peer %s local %s", __func__,
+			    print_addr(to[done]), print_addr(from[done]));
+			continue;
+		}
+		sent++;
+	}
+#endif
+
+	return (sent);
+}
+
 ssize_t
 recvfromto(int s, void *buf, size_t len, int flags, struct sockaddr *from,
     socklen_t *fromlen, struct sockaddr *to, socklen_t *tolen)
@@ -557,43 +862,43 @@ lc_idtype(char *str)
 }
 
 void
-print_hex(const uint8_t *buf, off_t offset, size_t length)
+(print_hex)(const uint8_t *buf, off_t offset, size_t length)
 {
 	unsigned int	 i;
 
-	if (log_getverbose() < 3 || !length)
+	if (!length)
 		return;
 
 	for (i = 0; i < length; i++) {
 		if (i && (i % 4) == 0) {
 			if ((i % 32) == 0)
-				print_debug("\n");
+				(print_debug)("\n");
 			else
-				print_debug(" ");
+				(print_debug)(" ");
 		}
-		print_debug("%02x", buf[offset + i]);
+		(print_debug)("%02x", buf[offset + i]);
 	}
-	print_debug("\n");
+	(print_debug)("\n");
 }
 
 void
-print_hexval(const uint8_t *buf, off_t offset, size_t length)
+(print_hexval)(const uint8_t *buf, off_t offset, size_t length)
 {
 	unsigned int	 i;
 
-	if (log_getverbose() < 2 || !length)
+	if (!length)
 		return;
 
-	print_debug("0x");
+	(print_debug)("0x");
 	for (i = 0; i < length; i++)
-		print_debug("%02x", buf[offset + i]);
-	print_debug("\n");
+		(print_debug)("%02x", buf[offset + i]);
+	(print_debug)("\n");
 }
 
 void
-print_hexbuf(struct ibuf *ibuf)
+(print_hexbuf)(struct ibuf *ibuf)
 {
-	print_hex(ibuf_data(ibuf), 0, ibuf_size(ibuf));
+	(print_hex)(ibuf_data(ibuf), 0, ibuf_size(ibuf));
 }
 
 const char *
@@ -857,15 +1162,13 @@ string2unicode(const char *ascii, size_t *outlen)
 }
 
 void
-print_debug(const char *emsg, ...)
+(print_debug)(const char *emsg, ...)
 {
 	va_list	 ap;
 
-	if (log_getverbose() > 2) {
-		va_start(ap, emsg);
-		vfprintf(stderr, emsg, ap);
-		va_end(ap);
-	}
+	va_start(ap, emsg);
+	vfprintf(stderr, emsg, ap);
+	va_end(ap);
 }
 
 void
@@ -879,3 +1182,119 @@ print_verbose(const char *emsg, ...)
 		va_end(ap);
 	}
 }
+
+/* monotonic clock in microseconds, for latency histograms */
+uint64_t
+hist_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static unsigned int
+hist_bucket(uint64_t v)
+{
+	unsigned int	 e, idx;
+
+	if (v < IKED_HIST_SUB)
+		return (v);
+	e = 63 - __builtin_clzll(v);
+	idx = (e - IKED_HIST_SUBBITS + 1) * IKED_HIST_SUB +
+	    ((v >> (e - IKED_HIST_SUBBITS)) & (IKED_HIST_SUB - 1));
+	return (MINIMUM(idx, IKED_HIST_BUCKETS - 1));
+}
+
+/* largest value that falls into bucket idx */
+uint64_t
+hist_bucket_max(unsigned int idx)
+{
+	unsigned int	 g, sub;
+
+	if (idx < IKED_HIST_SUB)
+		return (idx);
+	g = idx / IKED_HIST_SUB;
+	sub = idx % IKED_HIST_SUB;
+	return ((((uint64_t)IKED_HIST_SUB + sub + 1) << (g - 1)) - 1);
+}
+
+void
+hist_add(struct iked_hist *h, uint64_t v)
+{
+	h->h_count++;
+	h->h_sum += v;
+	if (v > h->h_max)
+		h->h_max = v;
+	h->h_bucket[hist_bucket(v)]++;
+}
+
+/* upper bound of the bucket holding the pct'th percentile */
+uint64_t
+hist_percentile(struct iked_hist *h, unsigned int pct)
+{
+	uint64_t	 rank, n = 0;
+	unsigned int	 i;
+
+	if (h->h_count == 0)
+		return (0);
+	rank = (h->h_count * pct + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < IKED_HIST_BUCKETS; i++) {
+		if ((n += h->h_bucket[i]) >= rank &&
+		    i < IKED_HIST_BUCKETS - 1)
+			return (MINIMUM(hist_bucket_max(i), h->h_max));
+	}
+	return (h->h_max);
+}
+
+/* compact address for the control records */
+void
+ctl_addr_pack(struct iked_ctl_addr *ca, struct sockaddr *sa, int mask)
+{
+	bzero(ca, sizeof(*ca));
+	switch (sa->sa_family) {
+	case AF_INET:
+		memcpy(ca->ca_addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+		break;
+	case AF_INET6:
+		memcpy(ca->ca_addr, &((struct sockaddr_in6 *)sa)->sin6_addr,
+		    16);
+		break;
+	default:
+		return;
+	}
+	ca->ca_af = sa->sa_family;
+	ca->ca_mask = mask;
+	ca->ca_port = socket_getport(sa);
+}
+
+int
+ctl_addr_unpack(struct sockaddr_storage *ss, struct iked_ctl_addr *ca)
+{
+	struct sockaddr_in	*s4 = (struct sockaddr_in *)ss;
+	struct sockaddr_in6	*s6 = (struct sockaddr_in6 *)ss;
+
+	bzero(ss, sizeof(*ss));
+	switch (ca->ca_af) {
+	case AF_INET:
+		s4->sin_family = AF_INET;
+#ifdef HAVE_SOCKADDR_SA_LEN
+		s4->sin_len = sizeof(*s4);
+#endif
+		memcpy(&s4->sin_addr, ca->ca_addr, 4);
+		break;
+	case AF_INET6:
+		s6->sin6_family = AF_INET6;
+#ifdef HAVE_SOCKADDR_SA_LEN
+		s6->sin6_len = sizeof(*s6);
+#endif
+		memcpy(&s6->sin6_addr, ca->ca_addr, 16);
+		break;
+	default:
+		return (-1);
+	}
+	socket_setport((struct sockaddr *)ss, ca->ca_port);
+	return (0);
+}
@@ -35,6 +35,7 @@
 #include "systemd/sd-bus.h"
 #endif
 
+#define LOG_SUBSYS	LOG_SUBSYS_IPSEC
 #include "iked.h"
 
 int vroute_setroute(struct iked *, uint32_t, struct sockaddr *, uint8_t,
@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <netdb.h>
 
+#define LOG_SUBSYS	LOG_SUBSYS_IPSEC
 #include <iked.h>
 
 #define ROUTE_SOCKET_BUF_SIZE	16384
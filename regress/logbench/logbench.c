@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare the logging done for one received IKE message at verbosity
+ * 0, once with the level checked inside a function after all arguments
+ * were formatted, and once with the level-checking macros.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iked.h"
+
+#define MESSAGES	200000
+#define PAYLOADS	6
+#define MSGLEN		1280
+
+void	 eager_log_debug(const char *, ...)
+	    __attribute__((__format__ (printf, 1, 2)));
+void	 eager_print_hex(const uint8_t *, off_t, size_t);
+const char *
+	 counted(const char *);
+void	 message_eager(struct sockaddr *, struct sockaddr *, uint8_t *);
+void	 message_lazy(struct sockaddr *, struct sockaddr *, uint8_t *);
+uint64_t run(void (*)(struct sockaddr *, struct sockaddr *, uint8_t *),
+	    struct sockaddr *, struct sockaddr *, uint8_t *);
+
+static struct iked_constmap bench_map[] = {
+	{ 35,	"IKE_AUTH" },
+	{ 37,	"INFORMATIONAL" },
+	{ 46,	"SK" },
+	{ 0 }
+};
+
+static unsigned int	 evaluated;
+
+/* log_debug() and print_hex() as they were: checks after formatting */
+void
+eager_log_debug(const char *emsg, ...)
+{
+	va_list	 ap;
+
+	if (log_getverbose() > 1) {
+		va_start(ap, emsg);
+		vlog(LOG_DEBUG, emsg, ap);
+		va_end(ap);
+	}
+}
+
+void
+eager_print_hex(const uint8_t *buf, off_t offset, size_t length)
+{
+	if (log_getverbose() < 3 || !length)
+		return;
+	(print_hex)(buf, offset, length);
+}
+
+const char *
+counted(const char *s)
+{
+	evaluated++;
+	return (s);
+}
+
+/* The debug messages of ikev2_recv() and the payload parser */
+void
+message_eager(struct sockaddr *peer, struct sockaddr *local, uint8_t *msg)
+{
+	unsigned int	 i;
+
+	eager_log_debug("%srecv %s %s %u peer %s local %s, %d bytes, "
+	    "policy '%s'", "", print_map(37, bench_map), "req", 7,
+	    print_addr(peer), print_addr(local), MSGLEN, counted("bench"));
+	eager_log_debug("%s: ispi %s rspi %s", __func__,
+	    print_spi(0x0123456789abcdefULL, 8),
+	    print_spi(0xfedcba9876543210ULL, 8));
+	for (i = 0; i < PAYLOADS; i++)
+		eager_log_debug("%s: %s nextpayload %s critical 0x%02x "
+		    "length %d", __func__, print_map(46, bench_map),
+		    print_map(35, bench_map), 0, 100);
+	eager_print_hex(msg, 0, MSGLEN);
+}
+
+void
+message_lazy(struct sockaddr *peer, struct sockaddr *local, uint8_t *msg)
+{
+	unsigned int	 i;
+
+	logit(LOG_DEBUG, "%srecv %s %s %u peer %s local %s, %d bytes, "
+	    "policy '%s'", "", print_map(37, bench_map), "req", 7,
+	    print_addr(peer), print_addr(local), MSGLEN, counted("bench"));
+	log_debug("%s: ispi %s rspi %s", __func__,
+	    print_spi(0x0123456789abcdefULL, 8),
+	    print_spi(0xfedcba9876543210ULL, 8));
+	for (i = 0; i < PAYLOADS; i++)
+		log_debug("%s: %s nextpayload %s critical 0x%02x "
+		    "length %d", __func__, print_map(46, bench_map),
+		    print_map(35, bench_map), 0, 100);
+	print_hex(msg, 0, MSGLEN);
+}
+
+uint64_t
+run(void (*fn)(struct sockaddr *, struct sockaddr *, uint8_t *),
+    struct sockaddr *peer, struct sockaddr *local, uint8_t *msg)
+{
+	struct timespec	 start, end;
+	unsigned int	 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < MESSAGES; i++)
+		fn(peer, local, msg);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (((end.tv_sec - start.tv_sec) * 1000000000ULL +
+	    end.tv_nsec - start.tv_nsec) / MESSAGES);
+}
+
+int
+main(void)
+{
+	static uint8_t		 msg[MSGLEN];
+	struct sockaddr_in6	 peer, local;
+	uint64_t		 eager, lazy;
+	int			 ret = 0;
+
+	log_init(0, LOG_DAEMON);
+	log_setverbose(0);
+
+	bzero(&peer, sizeof(peer));
+	peer.sin6_family = AF_INET6;
+	peer.sin6_port = htons(4500);
+	inet_pton(AF_INET6, "2001:db8::1", &peer.sin6_addr);
+	local = peer;
+	inet_pton(AF_INET6, "2001:db8::2", &local.sin6_addr);
+
+	printf("Testing arguments at verbosity 0: ");
+	evaluated = 0;
+	message_lazy((struct sockaddr *)&peer, (struct sockaddr *)&local, msg);
+	if (evaluated != 0) {
+		printf("FAILED (evaluated)\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	printf("Testing arguments with another subsystem verbose: ");
+	log_setverbose_subsys(LOG_SUBSYS_PAYLOAD, 3);
+	message_lazy((struct sockaddr *)&peer, (struct sockaddr *)&local, msg);
+	log_setverbose(0);
+	if (evaluated != 0) {
+		printf("FAILED (evaluated)\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	eager = run(message_eager, (struct sockaddr *)&peer,
+	    (struct sockaddr *)&local, msg);
+	lazy = run(message_lazy, (struct sockaddr *)&peer,
+	    (struct sockaddr *)&local, msg);
+	printf("Logging cost per message at verbosity 0: "
+	    "%llu ns checked after formatting, %llu ns with the macros\n",
+	    (unsigned long long)eager, (unsigned long long)lazy);
+
+	return (ret);
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send requests through ikev2_msg_send() over loopback and drop them
+ * from the retransmit queue again, as if the response had arrived.
+ * This is compared to the former send path, that copied every sent
+ * message for the queue and prepended the NAT-T marker by copying the
+ * message into a new buffer.  With glibc, the allocations are counted.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iked.h"
+#include "ikev2.h"
+
+#define EXCHANGES	100000
+#define MSGLEN		1280
+
+struct result {
+	uint64_t	 r_usec;
+	uint64_t	 r_allocs;
+	uint64_t	 r_bytes;
+};
+
+int	 copy_send(struct iked *, struct iked_message *);
+struct iked_message *
+	 copy_msg(struct iked *, struct iked_message *);
+int	 run_exchange(int (*)(struct iked *, struct iked_message *), uint32_t);
+int	 check_datagram(uint32_t, int);
+int	 check_shared(int);
+int	 run(int (*)(struct iked *, struct iked_message *), int,
+	    struct result *);
+
+static struct iked		 env;
+static struct iked_sa		 sa;
+static struct sockaddr_storage	 peer, local;
+static socklen_t		 peerlen, locallen;
+static int			 sendfd, recvfd;
+static uint8_t			 payload[MSGLEN];
+static uint64_t			 nallocs, nbytes;
+
+#ifdef __GLIBC__
+void	*__libc_malloc(size_t);
+void	*__libc_calloc(size_t, size_t);
+void	*__libc_realloc(void *, size_t);
+
+void *
+malloc(size_t size)
+{
+	nallocs++;
+	nbytes += size;
+	return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	nbytes += nmemb * size;
+	return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	nallocs++;
+	nbytes += size;
+	return (__libc_realloc(ptr, size));
+}
+#endif
+
+/*
+ * Stubs for the parts of iked that ikev2_msg.c calls but that are not
+ * used to send a message.
+ */
+void
+ca_sslerror(const char *caller)
+{
+}
+
+const char *
+ikev2_ikesa_info(uint64_t spi, const char *msg)
+{
+	return (msg == NULL ? "" : msg);
+}
+
+struct iked_proposal *
+config_add_proposal(struct iked_proposals *head, unsigned int id,
+    unsigned int proto)
+{
+	return (NULL);
+}
+
+int
+config_add_transform(struct iked_proposal *prop, unsigned int type,
+    unsigned int id, unsigned int length, unsigned int keylength)
+{
+	return (-1);
+}
+
+void
+config_free_fragments(struct iked_frag *frag)
+{
+}
+
+void
+config_free_proposal(struct iked_proposals *head, struct iked_proposal *prop)
+{
+}
+
+void
+config_free_proposals(struct iked_proposals *head, unsigned int proto)
+{
+}
+
+int
+eap_parse(struct iked *e, const struct iked_sa *s, struct iked_message *msg,
+    void *data, int response)
+{
+	return (-1);
+}
+
+struct ike_header *
+ikev2_add_header(struct ibuf *buf, struct iked_sa *s, uint32_t msgid,
+    uint8_t nextp, uint8_t exchange, uint8_t flags)
+{
+	return (NULL);
+}
+
+struct ikev2_payload *
+ikev2_add_payload(struct ibuf *buf)
+{
+	return (NULL);
+}
+
+int
+ikev2_next_payload(struct ikev2_payload *pld, size_t length,
+    uint8_t nextpayload)
+{
+	return (-1);
+}
+
+int
+ikev2_set_header(struct ike_header *hdr, size_t length)
+{
+	return (-1);
+}
+
+void
+ikev2_ike_sa_setreason(struct iked_sa *s, char *reason)
+{
+}
+
+void
+ikev2_ike_sa_timeout(struct iked *e, void *arg)
+{
+}
+
+time_t
+ikev2_init_time(void)
+{
+	return (time(NULL));
+}
+
+ssize_t
+ikev2_nat_detection(struct iked *e, struct iked_message *msg, void *ptr,
+    size_t len, unsigned int type, int frompeer)
+{
+	return (-1);
+}
+
+int
+ikev2_print_id(struct iked_id *id, char *idstr, size_t idstrlen)
+{
+	return (-1);
+}
+
+ssize_t
+ikev2_psk(struct iked_sa *s, uint8_t *data, size_t length, uint8_t **pskptr)
+{
+	return (-1);
+}
+
+void
+ikev2_recv(struct iked *e, struct iked_message *msg)
+{
+}
+
+int
+ikev2_send_informational(struct iked *e, struct iked_message *msg)
+{
+	return (-1);
+}
+
+void
+peerstat_add(struct iked *e, struct sockaddr *addr, struct iked_sa *s,
+    unsigned int counter, uint64_t value)
+{
+}
+
+void
+peerstat_msg(struct iked *e, struct iked_message *msg, unsigned int counter,
+    uint64_t value)
+{
+}
+
+ssize_t
+redirect_getgw(uint8_t *buf, size_t len, struct sockaddr_storage *gw)
+{
+	return (-1);
+}
+
+void
+sa_free(struct iked *e, struct iked_sa *s)
+{
+}
+
+void
+sa_state(struct iked *e, struct iked_sa *s, int state)
+{
+	s->sa_state = state;
+}
+
+void
+sa_stateflags(struct iked_sa *s, unsigned int flag)
+{
+}
+
+int
+sa_stateok(const struct iked_sa *s, int state)
+{
+	return (1);
+}
+
+/* ikev2_msg_send() before the sent datagram was shared */
+int
+copy_send(struct iked *e, struct iked_message *msg)
+{
+	uint32_t		 natt = 0x00000000;
+	struct iked_message	*m;
+	struct ibuf		*buf = msg->msg_data, *new;
+	struct ike_header	*hdr;
+	uint8_t			 exchange;
+
+	if ((hdr = ibuf_seek(buf, msg->msg_offset, sizeof(*hdr))) == NULL)
+		return (-1);
+	exchange = hdr->ike_exchange;
+	msg->msg_natt = (msg->msg_natt || sa.sa_natt);
+
+	if (msg->msg_natt) {
+		if ((new = ibuf_new(&natt, sizeof(natt))) == NULL)
+			return (-1);
+		if (ibuf_add_ibuf(new, buf) == -1) {
+			ibuf_free(new);
+			return (-1);
+		}
+		ibuf_free(buf);
+		buf = msg->msg_data = new;
+	}
+
+	if (sendtofrom(msg->msg_fd, ibuf_data(buf), ibuf_size(buf), 0,
+	    (struct sockaddr *)&msg->msg_peer, msg->msg_peerlen,
+	    (struct sockaddr *)&msg->msg_local, msg->msg_locallen) == -1)
+		return (-1);
+
+	if ((m = copy_msg(e, msg)) == NULL)
+		return (-1);
+	m->msg_exchange = exchange;
+	if (ikev2_msg_enqueue(e, &sa.sa_requests, m,
+	    IKED_RETRANSMIT_TIMEOUT) != 0) {
+		ikev2_msg_cleanup(e, m);
+		free(m);
+		return (-1);
+	}
+	return (0);
+}
+
+/* ikev2_msg_copy() before the sent datagram was shared */
+struct iked_message *
+copy_msg(struct iked *e, struct iked_message *msg)
+{
+	struct iked_message	*m;
+	struct ibuf		*buf;
+	size_t			 len;
+	void			*ptr;
+
+	len = ibuf_size(msg->msg_data) - msg->msg_offset;
+	if ((m = malloc(sizeof(*m))) == NULL)
+		return (NULL);
+	if ((ptr = ibuf_seek(msg->msg_data, msg->msg_offset, len)) == NULL ||
+	    (buf = ikev2_msg_init(e, m, &msg->msg_peer, msg->msg_peerlen,
+	    &msg->msg_local, msg->msg_locallen, msg->msg_response,
+	    IKEV2_EXCHANGE_INFORMATIONAL)) == NULL ||
+	    ibuf_add(buf, ptr, len)) {
+		free(m);
+		return (NULL);
+	}
+	m->msg_fd = msg->msg_fd;
+	m->msg_msgid = msg->msg_msgid;
+	m->msg_offset = msg->msg_offset;
+	m->msg_sa = msg->msg_sa;
+	return (m);
+}
+
+/*
+ * Build and send one request, then drop it from the retransmit queue
+ * as if the response had arrived.
+ */
+int
+run_exchange(int (*sendf)(struct iked *, struct iked_message *), uint32_t msgid)
+{
+	struct iked_message		 msg;
+	struct iked_msg_retransmit	*mr;
+	struct ike_header		*hdr;
+	struct ibuf			*buf;
+
+	if ((buf = ikev2_msg_init(&env, &msg, &peer, peerlen, &local,
+	    locallen, 0, IKEV2_EXCHANGE_INFORMATIONAL)) == NULL ||
+	    ibuf_add(buf, payload, sizeof(payload)) != 0)
+		return (-1);
+	hdr = ibuf_data(buf);
+	hdr->ike_exchange = IKEV2_EXCHANGE_INFORMATIONAL;
+	hdr->ike_flags = IKEV2_FLAG_INITIATOR;
+	hdr->ike_msgid = htobe32(msgid);
+	msg.msg_msgid = msgid;
+	msg.msg_fd = sendfd;
+	msg.msg_sa = &sa;
+
+	if (sendf(&env, &msg) == -1) {
+		ikev2_msg_cleanup(&env, &msg);
+		return (-1);
+	}
+	ikev2_msg_cleanup(&env, &msg);
+
+	if ((mr = ikev2_msg_lookup(&env, &sa.sa_requests, &msg,
+	    IKEV2_EXCHANGE_INFORMATIONAL)) == NULL)
+		return (-1);
+	ikev2_msg_dispose(&env, &sa.sa_requests, mr);
+	return (0);
+}
+
+/* Receive a datagram and compare it to the sent request */
+int
+check_datagram(uint32_t msgid, int natt)
+{
+	struct ike_header	*hdr;
+	uint8_t			 buf[MSGLEN + 16], *p = buf;
+	ssize_t			 len;
+
+	if ((len = recv(recvfd, buf, sizeof(buf), 0)) == -1)
+		return (-1);
+	if (natt) {
+		if (len < 4 || memcmp(buf, "\0\0\0\0", 4) != 0)
+			return (-1);
+		p += 4;
+		len -= 4;
+	}
+	hdr = (struct ike_header *)p;
+	return (len == MSGLEN && hdr->ike_msgid == htobe32(msgid) &&
+	    memcmp(p + sizeof(*hdr), payload + sizeof(*hdr),
+	    MSGLEN - sizeof(*hdr)) == 0 ? 0 : -1);
+}
+
+/*
+ * The queued copy must share the datagram, outlive the sent message
+ * and retransmit the same bytes.
+ */
+int
+check_shared(int natt)
+{
+	struct iked_message		 msg, *m;
+	struct iked_msg_retransmit	*mr;
+	struct ike_header		*hdr;
+	struct ibuf			*buf;
+	uint32_t			 msgid = 1;
+	int				 ret = -1;
+
+	sa.sa_natt = natt;
+	if ((buf = ikev2_msg_init(&env, &msg, &peer, peerlen, &local,
+	    locallen, 0, IKEV2_EXCHANGE_INFORMATIONAL)) == NULL ||
+	    ibuf_add(buf, payload, sizeof(payload)) != 0)
+		return (-1);
+	hdr = ibuf_data(buf);
+	hdr->ike_exchange = IKEV2_EXCHANGE_INFORMATIONAL;
+	hdr->ike_flags = IKEV2_FLAG_INITIATOR;
+	hdr->ike_msgid = htobe32(msgid);
+	msg.msg_msgid = msgid;
+	msg.msg_fd = sendfd;
+	msg.msg_sa = &sa;
+
+	if (ikev2_msg_send(&env, &msg) == -1 ||
+	    check_datagram(msgid, natt) == -1 ||
+	    (mr = ikev2_msg_lookup(&env, &sa.sa_requests, &msg,
+	    IKEV2_EXCHANGE_INFORMATIONAL)) == NULL ||
+	    (m = TAILQ_FIRST(&mr->mrt_frags)) == NULL ||
+	    m->msg_data != msg.msg_data || msg.msg_wire == NULL ||
+	    msg.msg_wire->wb_refcnt != 2) {
+		ikev2_msg_cleanup(&env, &msg);
+		goto done;
+	}
+	ikev2_msg_cleanup(&env, &msg);
+
+	if (m->msg_wire->wb_refcnt == 1 &&
+	    ikev2_msg_sendtofrom(m) != -1 &&
+	    check_datagram(msgid, natt) == 0)
+		ret = 0;
+	ikev2_msg_dispose(&env, &sa.sa_requests, mr);
+ done:
+	sa.sa_natt = 0;
+	return (ret);
+}
+
+int
+run(int (*sendf)(struct iked *, struct iked_message *), int natt,
+    struct result *res)
+{
+	struct timespec	 start, end;
+	uint8_t		 buf[MSGLEN + 16];
+	uint32_t	 i;
+	int		 ret = 0;
+
+	sa.sa_natt = natt;
+	nallocs = nbytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < EXCHANGES; i++) {
+		if (run_exchange(sendf, i) == -1) {
+			ret = -1;
+			break;
+		}
+		/* drain the socket now and then, losses do not matter */
+		if (i % 64 == 63)
+			while (recv(recvfd, buf, sizeof(buf),
+			    MSG_DONTWAIT) != -1)
+				;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	res->r_allocs = nallocs;
+	res->r_bytes = nbytes;
+	res->r_usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+	    (end.tv_nsec - start.tv_nsec) / 1000;
+	sa.sa_natt = 0;
+	return (ret);
+}
+
+int
+main(void)
+{
+	struct sockaddr_in	*sin;
+	struct result		 copy, shared;
+	int			 natt, ret = 0;
+	size_t			 i;
+
+	log_init(0, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = arc4random();
+
+	sin = (struct sockaddr_in *)&local;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	sin->sin_len = sizeof(*sin);
+#endif
+	peer = local;
+	peerlen = locallen = sizeof(*sin);
+	if ((sendfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    (recvfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(sendfd, (struct sockaddr *)&local, locallen) == -1 ||
+	    getsockname(sendfd, (struct sockaddr *)&local, &locallen) == -1 ||
+	    bind(recvfd, (struct sockaddr *)&peer, peerlen) == -1 ||
+	    getsockname(recvfd, (struct sockaddr *)&peer, &peerlen) == -1)
+		err(1, "bind");
+	TAILQ_INIT(&env.sc_responses);
+
+	for (natt = 0; natt <= 1; natt++) {
+		printf("Testing shared retransmit copy%s: ",
+		    natt ? ", NAT-T" : "");
+		if (check_shared(natt) == -1) {
+			printf("FAILED\n");
+			ret = 1;
+		} else
+			printf("OKAY\n");
+	}
+
+	for (natt = 0; natt <= 1; natt++) {
+		printf("Testing %d exchanges%s: ", EXCHANGES,
+		    natt ? ", NAT-T" : "");
+		if (run(copy_send, natt, &copy) == -1 ||
+		    run(ikev2_msg_send, natt, &shared) == -1 ||
+		    shared.r_allocs > copy.r_allocs ||
+		    shared.r_bytes > copy.r_bytes) {
+			printf("FAILED\n");
+			ret = 1;
+			continue;
+		}
+		printf("OKAY\n");
+#ifdef __GLIBC__
+		printf("Per exchange: %.1f allocations of %llu bytes in "
+		    "%llu ns before, %.1f allocations of %llu bytes in "
+		    "%llu ns now\n",
+		    (double)copy.r_allocs / EXCHANGES,
+		    (unsigned long long)copy.r_bytes / EXCHANGES,
+		    (unsigned long long)copy.r_usec * 1000 / EXCHANGES,
+		    (double)shared.r_allocs / EXCHANGES,
+		    (unsigned long long)shared.r_bytes / EXCHANGES,
+		    (unsigned long long)shared.r_usec * 1000 / EXCHANGES);
+#else
+		printf("Per exchange: %llu ns before, %llu ns now\n",
+		    (unsigned long long)copy.r_usec * 1000 / EXCHANGES,
+		    (unsigned long long)shared.r_usec * 1000 / EXCHANGES);
+#endif
+	}
+
+	close(sendfd);
+	close(recvfd);
+
+	return (ret);
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Validate the certificates of many peers at once through ocsp.c
+ * against a stand-in OCSP responder on a loopback socket.  The
+ * responder answers with a chunked body or with a Content-Length,
+ * depending on the path of the request, and counts the connections
+ * and requests it gets.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "iked.h"
+#include "ikev2.h"
+
+#define PEERS		512
+#define SHARED		8		/* peers with the same cert */
+
+struct peer {
+	uint8_t		*p_cert;	/* DER */
+	int		 p_certlen;
+	int		 p_valid;
+	int		 p_invalid;
+};
+
+struct client {
+	int		 cl_fd;
+	struct event	 cl_ev;
+	struct ibuf	*cl_buf;
+};
+
+struct connect {
+	struct iked_sahdr	 co_sh;
+};
+
+void	 responder_accept(int, short, void *);
+void	 responder_read(int, short, void *);
+int	 responder_add(struct ibuf *, const char *, ...)
+	    __attribute__((__format__ (printf, 2, 3)));
+int	 responder_request(struct client *, const char *, const uint8_t *,
+	    size_t);
+void	 connect_cb(int, short, void *);
+EVP_PKEY *key_new(void);
+X509	*cert_new(EVP_PKEY *, const char *, long);
+int	 run(unsigned int, unsigned int, const char *, uint64_t *);
+
+static struct iked	 env;
+static struct peer	 peers[PEERS];
+static struct sockaddr_in srvaddr;
+static X509		*cacert;
+static EVP_PKEY		*cakey;
+static unsigned int	 finished;
+static unsigned int	 srv_conns, srv_requests, srv_certs;
+
+/*
+ * Stubs for ca.c, ikev2.c and proc.c.  The parent's connection to the
+ * responder is made in the next event loop iteration and the results
+ * of the validations are counted.
+ */
+void
+ca_sslerror(const char *caller)
+{
+	unsigned long	 error;
+
+	while ((error = ERR_get_error()) != 0)
+		warnx("%s: %s", caller, ERR_error_string(error, NULL));
+}
+
+const char *
+ikev2_ikesa_info(uint64_t spi, const char *msg)
+{
+	return (msg == NULL ? "" : msg);
+}
+
+int
+proc_composev_imsg(struct privsep *ps, enum privsep_procid id, int n,
+    uint16_t type, uint32_t peerid, int fd, const struct iovec *iov,
+    int iovcnt)
+{
+	return (0);
+}
+
+int
+proc_composev(struct privsep *ps, enum privsep_procid id, uint16_t type,
+    const struct iovec *iov, int iovcnt)
+{
+	struct iked_sahdr	*sh = iov[0].iov_base;
+	struct connect		*co;
+	struct timeval		 tv;
+
+	switch (type) {
+	case IMSG_OCSP_FD:
+		if ((co = calloc(1, sizeof(*co))) == NULL)
+			err(1, NULL);
+		co->co_sh = *sh;
+		timerclear(&tv);
+		event_once(-1, EV_TIMEOUT, connect_cb, co, &tv);
+		return (0);
+	case IMSG_CERTVALID:
+		peers[sh->sh_ispi].p_valid++;
+		break;
+	case IMSG_CERTINVALID:
+		peers[sh->sh_ispi].p_invalid++;
+		break;
+	default:
+		return (-1);
+	}
+	finished++;
+	return (0);
+}
+
+void
+connect_cb(int fd, short event, void *arg)
+{
+	struct connect	*co = arg;
+	struct imsg	 imsg;
+	int		 s;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) == -1)
+		err(1, "connect");
+	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	bzero(&imsg, sizeof(imsg));
+	imsg.hdr.type = IMSG_OCSP_FD;
+	imsg.hdr.len = IMSG_HEADER_SIZE + sizeof(co->co_sh);
+	imsg.data = &co->co_sh;
+	if ((imsg.buf = ibuf_open(1)) == NULL)
+		err(1, "ibuf_open");
+	ibuf_fd_set(imsg.buf, s);
+	ocsp_receive_fd(&env, &imsg);
+	ibuf_free(imsg.buf);
+	free(co);
+}
+
+void
+responder_accept(int fd, short event, void *arg)
+{
+	struct client	*cl;
+	int		 s;
+
+	if ((s = accept(fd, NULL, NULL)) == -1)
+		err(1, "accept");
+	if ((cl = calloc(1, sizeof(*cl))) == NULL ||
+	    (cl->cl_buf = ibuf_dynamic(1024, 1024 * 1024)) == NULL)
+		err(1, NULL);
+	cl->cl_fd = s;
+	srv_conns++;
+	event_set(&cl->cl_ev, s, EV_READ | EV_PERSIST, responder_read, cl);
+	event_add(&cl->cl_ev, NULL);
+}
+
+void
+responder_read(int fd, short event, void *arg)
+{
+	struct client	*cl = arg;
+	struct ibuf	*rest;
+	char		 buf[4096], path[64], *data, *hdrend, *p;
+	size_t		 size, hdrlen, clen;
+	ssize_t		 n;
+
+	if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+		event_del(&cl->cl_ev);
+		close(fd);
+		ibuf_free(cl->cl_buf);
+		free(cl);
+		return;
+	}
+	if (ibuf_add(cl->cl_buf, buf, n) != 0)
+		errx(1, "request too large");
+
+	/* answer all complete requests in the buffer */
+	for (;;) {
+		data = ibuf_data(cl->cl_buf);
+		size = ibuf_size(cl->cl_buf);
+		if ((hdrend = memmem(data, size, "\r\n\r\n", 4)) == NULL)
+			return;
+		hdrlen = hdrend + 4 - data;
+		if (sscanf(data, "POST %63s HTTP/1.1", path) != 1 ||
+		    (p = strcasestr(data, "Content-Length:")) == NULL ||
+		    p > hdrend)
+			errx(1, "invalid request");
+		clen = strtoul(p + 15, NULL, 10);
+		if (size < hdrlen + clen)
+			return;
+
+		if (responder_request(cl, path, (uint8_t *)data + hdrlen,
+		    clen) == -1)
+			errx(1, "responder_request");
+
+		if ((rest = ibuf_dynamic(1024, 1024 * 1024)) == NULL ||
+		    ibuf_add(rest, data + hdrlen + clen,
+		    size - hdrlen - clen) != 0)
+			err(1, NULL);
+		ibuf_free(cl->cl_buf);
+		cl->cl_buf = rest;
+	}
+}
+
+int
+responder_add(struct ibuf *buf, const char *fmt, ...)
+{
+	va_list		 ap;
+	char		 str[256];
+	int		 len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(str, sizeof(str), fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= sizeof(str))
+		return (-1);
+	return (ibuf_add(buf, str, len));
+}
+
+int
+responder_request(struct client *cl, const char *path, const uint8_t *der,
+    size_t len)
+{
+	OCSP_REQUEST	*req;
+	OCSP_BASICRESP	*bs = NULL;
+	OCSP_RESPONSE	*resp;
+	ASN1_TIME	*now = NULL;
+	struct ibuf	*msg = NULL;
+	unsigned char	*body = NULL;
+	int		 i, n, bodylen, half, ret = -1;
+
+	srv_requests++;
+	if ((req = d2i_OCSP_REQUEST(NULL, &der, len)) == NULL ||
+	    (bs = OCSP_BASICRESP_new()) == NULL ||
+	    (now = X509_gmtime_adj(NULL, 0)) == NULL)
+		goto done;
+
+	/* no nextUpdate, so the statuses are not cached */
+	n = OCSP_request_onereq_count(req);
+	for (i = 0; i < n; i++) {
+		if (OCSP_basic_add1_status(bs, OCSP_onereq_get0_id(
+		    OCSP_request_onereq_get0(req, i)), V_OCSP_CERTSTATUS_GOOD,
+		    0, NULL, now, NULL) == NULL)
+			goto done;
+		srv_certs++;
+	}
+	if (!OCSP_basic_sign(bs, cacert, cakey, EVP_sha256(), NULL, 0) ||
+	    (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL,
+	    bs)) == NULL)
+		goto done;
+	bodylen = i2d_OCSP_RESPONSE(resp, &body);
+	OCSP_RESPONSE_free(resp);
+	if (bodylen <= 0 ||
+	    (msg = ibuf_dynamic(bodylen, bodylen + 1024)) == NULL)
+		goto done;
+
+	/* a chunked body is sent in two chunks with a trailer */
+	half = bodylen / 2;
+	if (strcmp(path, "/chunked") == 0) {
+		if (responder_add(msg, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: application/ocsp-response\r\n"
+		    "Transfer-Encoding: chunked\r\n"
+		    "\r\n"
+		    "%x;name=value\r\n", half) != 0 ||
+		    ibuf_add(msg, body, half) != 0 ||
+		    responder_add(msg, "\r\n%X\r\n", bodylen - half) != 0 ||
+		    ibuf_add(msg, body + half, bodylen - half) != 0 ||
+		    responder_add(msg, "\r\n0\r\nX-Trailer: yes\r\n\r\n") != 0)
+			goto done;
+	} else {
+		if (responder_add(msg, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: application/ocsp-response\r\n"
+		    "Content-Length: %d\r\n"
+		    "\r\n", bodylen) != 0 ||
+		    ibuf_add(msg, body, bodylen) != 0)
+			goto done;
+	}
+
+	if (write(cl->cl_fd, ibuf_data(msg), ibuf_size(msg)) !=
+	    (ssize_t)ibuf_size(msg))
+		goto done;
+	ret = 0;
+ done:
+	OCSP_REQUEST_free(req);
+	OCSP_BASICRESP_free(bs);
+	ASN1_TIME_free(now);
+	OPENSSL_free(body);
+	ibuf_free(msg);
+	return (ret);
+}
+
+EVP_PKEY *
+key_new(void)
+{
+	EVP_PKEY_CTX	*ctx;
+	EVP_PKEY	*key = NULL;
+
+	if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL ||
+	    EVP_PKEY_keygen_init(ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+	    NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(ctx, &key) <= 0)
+		errx(1, "EVP_PKEY_keygen");
+	EVP_PKEY_CTX_free(ctx);
+	return (key);
+}
+
+/* Create a certificate issued by the ca, or the ca itself */
+X509 *
+cert_new(EVP_PKEY *key, const char *cn, long serial)
+{
+	X509		*x;
+	X509_NAME	*name;
+
+	if ((x = X509_new()) == NULL ||
+	    !X509_set_version(x, 2) ||
+	    !ASN1_INTEGER_set(X509_get_serialNumber(x), serial) ||
+	    X509_gmtime_adj(X509_getm_notBefore(x), -60) == NULL ||
+	    X509_gmtime_adj(X509_getm_notAfter(x), 60 * 60) == NULL ||
+	    (name = X509_get_subject_name(x)) == NULL ||
+	    !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *)cn, -1, -1, 0) ||
+	    !X509_set_issuer_name(x, cacert == NULL ? name :
+	    X509_get_subject_name(cacert)) ||
+	    !X509_set_pubkey(x, key) ||
+	    !X509_sign(x, cakey, EVP_sha256()))
+		errx(1, "cert_new");
+	return (x);
+}
+
+/*
+ * Validate the certificates of n peers at once, where each certificate
+ * is shared by the given number of peers.
+ */
+int
+run(unsigned int n, unsigned int shared, const char *url, uint64_t *usec)
+{
+	struct iked_sahdr	 sh;
+	struct timespec		 start, end;
+	struct peer		*cert;
+	unsigned int		 i;
+
+	free(env.sc_ocsp_url);
+	if ((env.sc_ocsp_url = strdup(url)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++)
+		peers[i].p_valid = peers[i].p_invalid = 0;
+	finished = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		bzero(&sh, sizeof(sh));
+		sh.sh_ispi = i;
+		cert = &peers[i / shared];
+		if (ocsp_validate_cert(&env, cert->p_cert, cert->p_certlen,
+		    sh, IKEV2_AUTH_ECDSA_256, cacert) == -1)
+			return (-1);
+	}
+	while (finished < n)
+		event_loop(EVLOOP_ONCE);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (usec != NULL)
+		*usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+		    (end.tv_nsec - start.tv_nsec) / 1000;
+
+	for (i = 0; i < n; i++)
+		if (peers[i].p_valid != 1 || peers[i].p_invalid != 0)
+			return (-1);
+	return (0);
+}
+
+int
+main(void)
+{
+	struct event	 ev;
+	socklen_t	 slen;
+	EVP_PKEY	*key;
+	X509		*x;
+	FILE		*fp;
+	char		 dir[] = "/tmp/ocsptest.XXXXXXXXXX";
+	char		 chunked[64], length[64], cn[16];
+	uint64_t	 usec;
+	unsigned int	 i, shared;
+	int		 s, ret = 0;
+
+	log_init(0, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+	alarm(60);
+
+	/* The responder signs with the ca key and is trusted directly */
+	cakey = key_new();
+	cacert = cert_new(cakey, "ca", 1);
+	key = key_new();
+	for (i = 0; i < PEERS; i++) {
+		snprintf(cn, sizeof(cn), "peer%u", i);
+		x = cert_new(key, cn, 100 + i);
+		if ((peers[i].p_certlen = i2d_X509(x, &peers[i].p_cert)) <= 0)
+			errx(1, "i2d_X509");
+		X509_free(x);
+	}
+	EVP_PKEY_free(key);
+
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1 ||
+	    mkdir("ocsp", 0700) == -1)
+		err(1, "%s", dir);
+	if ((fp = fopen(IKED_OCSP_RESPCERT, "w")) == NULL ||
+	    !PEM_write_X509(fp, cacert) || fclose(fp) != 0)
+		err(1, "%s", IKED_OCSP_RESPCERT);
+
+	TAILQ_INIT(&env.sc_ocsp);
+	TAILQ_INIT(&env.sc_ocsp_conns);
+	RB_INIT(&env.sc_ocsp_cache);
+	env.sc_ocsp_cachefd = -1;
+	env.sc_ocsp_maxage = -1;
+
+	bzero(&srvaddr, sizeof(srvaddr));
+	srvaddr.sin_family = AF_INET;
+	srvaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	srvaddr.sin_len = sizeof(srvaddr);
+#endif
+	slen = sizeof(srvaddr);
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(s, (struct sockaddr *)&srvaddr, slen) == -1 ||
+	    getsockname(s, (struct sockaddr *)&srvaddr, &slen) == -1 ||
+	    listen(s, 1024) == -1)
+		err(1, "listen");
+	event_set(&ev, s, EV_READ | EV_PERSIST, responder_accept, NULL);
+	event_add(&ev, NULL);
+	snprintf(chunked, sizeof(chunked), "http://127.0.0.1:%d/chunked",
+	    ntohs(srvaddr.sin_port));
+	snprintf(length, sizeof(length), "http://127.0.0.1:%d/length",
+	    ntohs(srvaddr.sin_port));
+
+	printf("Testing chunked response: ");
+	if (run(1, 1, chunked, NULL) == -1 || srv_requests != 1) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	printf("Testing Content-Length response: ");
+	if (run(1, 1, length, NULL) == -1 || srv_requests != 2) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	/* The idle connection is reused and the queries are joined */
+	printf("Testing shared certificate: ");
+	srv_conns = srv_requests = srv_certs = 0;
+	if (run(SHARED, SHARED, chunked, NULL) == -1 || srv_conns != 0 ||
+	    srv_requests != 1 || srv_certs != 1) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	for (shared = 1; shared <= SHARED; shared *= SHARED) {
+		printf("Testing connection storm, %u peer%s per cert: ",
+		    shared, shared == 1 ? "" : "s");
+		srv_conns = srv_requests = srv_certs = 0;
+		if (run(PEERS, shared, chunked, &usec) == -1 ||
+		    srv_requests > PEERS / shared / 8) {
+			printf("FAILED\n");
+			ret = 1;
+		} else
+			printf("OKAY\n");
+		printf("%u validations in %llu ms, %u connections, "
+		    "%u requests for %u certs, %.3f requests per validation\n",
+		    PEERS, (unsigned long long)usec / 1000, srv_conns,
+		    srv_requests, srv_certs, (double)srv_requests / PEERS);
+	}
+
+	unlink(IKED_OCSP_RESPCERT);
+	rmdir("ocsp");
+	chdir("/");
+	rmdir(dir);
+
+	return (ret);
+}
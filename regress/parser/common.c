@@ -51,6 +51,9 @@ int	 ikev2_send_informational(struct iked *, struct iked_message *);
 struct ibuf *
 	 ikev2_msg_decrypt(struct iked *, struct iked_sa *, struct ibuf *,
 	     struct ibuf *);
+ssize_t	 ikev2_msg_decrypt_buf(struct iked *, struct iked_sa *, struct ibuf *,
+	     uint8_t *, size_t, uint8_t *, size_t);
+ssize_t	 redirect_getgw(uint8_t *, size_t, struct sockaddr_storage *);
 
 int
 eap_parse(struct iked *env, const struct iked_sa *sa, struct iked_message *msg,
@@ -204,6 +207,14 @@ ikev2_msg_decrypt(struct iked *env, struct iked_sa *sa,
 	return (NULL);
 }
 
+ssize_t
+ikev2_msg_decrypt_buf(struct iked *env, struct iked_sa *sa,
+    struct ibuf *msg, uint8_t *src, size_t srclen, uint8_t *dst,
+    size_t dstlen)
+{
+	return (-1);
+}
+
 void
 ikev2_ike_sa_setreason(struct iked_sa *sa, char *r)
 {
@@ -221,3 +232,9 @@ ikev2_msg_lookup(struct iked *env, struct iked_msgqueue *queue,
 {
 	return NULL;
 }
+
+ssize_t
+redirect_getgw(uint8_t *buf, size_t len, struct sockaddr_storage *ss)
+{
+	return (-1);
+}
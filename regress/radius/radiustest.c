@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Run EAP conversations of many SAs at once through radius.c against a
+ * RADIUS server in a child process.  The server answers the first
+ * request of a user with an Access-Challenge and the second one with
+ * an Access-Accept carrying the MS-MPPE keys.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "iked.h"
+#include "ikev2.h"
+#include "eap.h"
+#include "chap_ms.h"
+#include "radius.h"
+
+#define CONVERSATIONS	4096
+#define SECRET		"testing123"
+#define RECVKEY		0x11
+#define SENDKEY		0x22
+
+struct conv {
+	struct iked_sa	 c_sa;
+	int		 c_challenges;
+	int		 c_success;
+	int		 c_failure;
+	int		 c_freed;
+};
+
+void	 responder(int);
+size_t	 responder_attr(uint8_t *, size_t, uint8_t, const void *, size_t);
+size_t	 responder_mppe(uint8_t *, size_t, uint8_t, uint8_t, uint8_t *);
+int	 conv_start(struct conv *, const char *);
+int	 run(unsigned int, uint64_t *);
+int	 check_msk(struct conv *);
+
+static struct iked	 env;
+static struct conv	*convs;
+static unsigned int	 nconvs, finished;
+
+/*
+ * Stubs for ikev2.c and policy.c; the EAP messages of the server are
+ * answered as the peer would do.
+ */
+int
+ikev2_send_ike_e(struct iked *e, struct iked_sa *sa, struct ibuf *buf,
+    uint8_t firstpayload, uint8_t exchange, int response)
+{
+	struct conv	*c = &convs[sa->sa_hdr.sh_ispi];
+	struct ibuf	*eap;
+	uint8_t		*msg = ibuf_data(buf);
+	uint8_t		 resp[] = { EAP_CODE_RESPONSE, 0, 0, 6,
+			    EAP_TYPE_MSCHAP_V2, 0 };
+
+	switch (msg[0]) {
+	case EAP_CODE_REQUEST:
+		c->c_challenges++;
+		resp[1] = msg[1];
+		if ((eap = ibuf_new(resp, sizeof(resp))) == NULL)
+			err(1, "ibuf_new");
+		if (radius_request(e, sa, &eap) == -1)
+			errx(1, "radius_request");
+		ibuf_free(eap);
+		return (0);
+	case EAP_CODE_SUCCESS:
+		c->c_success++;
+		break;
+	case EAP_CODE_FAILURE:
+		c->c_failure++;
+		break;
+	}
+	finished++;
+	return (0);
+}
+
+void
+ikev2_ike_sa_setreason(struct iked_sa *sa, char *reason)
+{
+}
+
+const char *
+ikev2_ikesa_info(uint64_t spi, const char *msg)
+{
+	return (msg == NULL ? "" : msg);
+}
+
+void
+sa_state(struct iked *e, struct iked_sa *sa, int state)
+{
+	sa->sa_state = state;
+}
+
+void
+sa_free(struct iked *e, struct iked_sa *sa)
+{
+	struct conv	*c = &convs[sa->sa_hdr.sh_ispi];
+
+	radius_request_free(e, sa->sa_radreq);
+	if (c->c_success == 0 && c->c_failure == 0)
+		finished++;
+	c->c_freed++;
+}
+
+size_t
+responder_attr(uint8_t *pkt, size_t off, uint8_t type, const void *val,
+    size_t len)
+{
+	pkt[off] = type;
+	pkt[off + 1] = len + 2;
+	memcpy(pkt + off + 2, val, len);
+	return (off + len + 2);
+}
+
+/* RFC 2548 2.4.2 */
+size_t
+responder_mppe(uint8_t *pkt, size_t off, uint8_t vtype, uint8_t fill,
+    uint8_t *reqauth)
+{
+	uint8_t		 val[4 + 2 + 2 + 48], plain[48], b[EVP_MAX_MD_SIZE];
+	uint8_t		*c = val + 8, *prev = reqauth;
+	uint32_t	 vendor = htobe32(RADIUS_VENDOR_MICROSOFT);
+	unsigned int	 mdlen;
+	size_t		 i, j;
+	EVP_MD_CTX	*ctx;
+
+	memcpy(val, &vendor, sizeof(vendor));
+	val[4] = vtype;
+	val[5] = sizeof(val) - 4;
+	val[6] = 0x80 | arc4random_uniform(0x80);
+	val[7] = arc4random();
+
+	bzero(plain, sizeof(plain));
+	plain[0] = MSCHAP_MSK_KEY_SZ;
+	memset(plain + 1, fill, MSCHAP_MSK_KEY_SZ);
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		errx(1, "EVP_MD_CTX_new");
+	for (i = 0; i < sizeof(plain); i += 16) {
+		EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+		EVP_DigestUpdate(ctx, SECRET, strlen(SECRET));
+		EVP_DigestUpdate(ctx, prev, 16);
+		if (i == 0)
+			EVP_DigestUpdate(ctx, val + 6, 2);
+		EVP_DigestFinal_ex(ctx, b, &mdlen);
+		for (j = 0; j < 16; j++)
+			c[i + j] = plain[i + j] ^ b[j];
+		prev = c + i;
+	}
+	EVP_MD_CTX_free(ctx);
+
+	return (responder_attr(pkt, off, RADIUS_TYPE_VENDOR_SPECIFIC,
+	    val, sizeof(val)));
+}
+
+void
+responder(int s)
+{
+	struct radius_header	*hdr;
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen;
+	uint8_t			 req[RADIUS_PACKET_MAX];
+	uint8_t			 pkt[RADIUS_PACKET_MAX];
+	uint8_t			 mac[EVP_MAX_MD_SIZE], ma[RADIUS_AUTH_SZ];
+	uint8_t			 eap[4 + 1 + 16], *user, *state, *eapid;
+	uint8_t			 zero[RADIUS_AUTH_SZ];
+	unsigned int		 maclen;
+	size_t			 off, maoff = 0, userlen;
+	ssize_t			 len;
+	EVP_MD_CTX		*ctx;
+	int			 forged;
+
+	bzero(zero, sizeof(zero));
+	for (;;) {
+		sslen = sizeof(ss);
+		if ((len = recvfrom(s, req, sizeof(req), 0,
+		    (struct sockaddr *)&ss, &sslen)) == -1)
+			err(1, "recvfrom");
+		hdr = (struct radius_header *)req;
+		if (len < (ssize_t)sizeof(*hdr) ||
+		    hdr->rad_code != RADIUS_CODE_ACCESS_REQUEST ||
+		    betoh16(hdr->rad_length) != len)
+			continue;
+
+		user = state = eapid = NULL;
+		userlen = 0;
+		for (off = sizeof(*hdr); off + 2 <= (size_t)len &&
+		    req[off + 1] >= 2; off += req[off + 1]) {
+			switch (req[off]) {
+			case RADIUS_TYPE_USER_NAME:
+				user = req + off + 2;
+				userlen = req[off + 1] - 2;
+				break;
+			case RADIUS_TYPE_STATE:
+				state = req + off + 2;
+				break;
+			case RADIUS_TYPE_EAP_MESSAGE:
+				if (eapid == NULL)
+					eapid = req + off + 2 + 1;
+				break;
+			case RADIUS_TYPE_MESSAGE_AUTH:
+				maoff = off + 2;
+				break;
+			}
+		}
+		if (user == NULL || eapid == NULL || maoff == 0)
+			continue;
+		memcpy(ma, req + maoff, sizeof(ma));
+		memset(req + maoff, 0, sizeof(ma));
+		if (HMAC(EVP_md5(), SECRET, strlen(SECRET), req, len,
+		    mac, &maclen) == NULL || memcmp(mac, ma, sizeof(ma)) != 0)
+			continue;
+		forged = userlen == 6 && memcmp(user, "forged", 6) == 0;
+
+		hdr = (struct radius_header *)pkt;
+		hdr->rad_id = ((struct radius_header *)req)->rad_id;
+		memcpy(hdr->rad_auth, ((struct radius_header *)req)->rad_auth,
+		    RADIUS_AUTH_SZ);
+		off = sizeof(*hdr);
+		eap[1] = *eapid + 1;
+		eap[2] = 0;
+		eap[3] = 4;
+		if (userlen == 6 && memcmp(user, "reject", 6) == 0) {
+			hdr->rad_code = RADIUS_CODE_ACCESS_REJECT;
+			eap[0] = EAP_CODE_FAILURE;
+		} else if (state == NULL) {
+			hdr->rad_code = RADIUS_CODE_ACCESS_CHALLENGE;
+			eap[0] = EAP_CODE_REQUEST;
+			eap[3] = sizeof(eap);
+			eap[4] = EAP_TYPE_MSCHAP_V2;
+			arc4random_buf(eap + 5, 16);
+			off = responder_attr(pkt, off, RADIUS_TYPE_STATE,
+			    "state", 5);
+		} else {
+			hdr->rad_code = RADIUS_CODE_ACCESS_ACCEPT;
+			eap[0] = EAP_CODE_SUCCESS;
+			off = responder_mppe(pkt, off,
+			    RADIUS_VTYPE_MPPE_RECV_KEY, RECVKEY,
+			    hdr->rad_auth);
+			off = responder_mppe(pkt, off,
+			    RADIUS_VTYPE_MPPE_SEND_KEY, SENDKEY,
+			    hdr->rad_auth);
+		}
+		off = responder_attr(pkt, off, RADIUS_TYPE_EAP_MESSAGE,
+		    eap, eap[3]);
+		maoff = off + 2;
+		off = responder_attr(pkt, off, RADIUS_TYPE_MESSAGE_AUTH,
+		    zero, sizeof(zero));
+		hdr->rad_length = htobe16(off);
+
+		HMAC(EVP_md5(), SECRET, strlen(SECRET), pkt, off, mac,
+		    &maclen);
+		memcpy(pkt + maoff, mac, RADIUS_AUTH_SZ);
+		if ((ctx = EVP_MD_CTX_new()) == NULL)
+			errx(1, "EVP_MD_CTX_new");
+		EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+		EVP_DigestUpdate(ctx, pkt, off);
+		EVP_DigestUpdate(ctx, SECRET, strlen(SECRET));
+		EVP_DigestFinal_ex(ctx, hdr->rad_auth, &maclen);
+		EVP_MD_CTX_free(ctx);
+
+		/* A reply with a wrong authenticator before the real one */
+		if (forged) {
+			hdr->rad_auth[0] ^= 1;
+			sendto(s, pkt, off, 0, (struct sockaddr *)&ss, sslen);
+			hdr->rad_auth[0] ^= 1;
+		}
+		if (sendto(s, pkt, off, 0, (struct sockaddr *)&ss,
+		    sslen) == -1)
+			err(1, "sendto");
+	}
+}
+
+int
+conv_start(struct conv *c, const char *user)
+{
+	struct sockaddr_in	*sin;
+	struct ibuf		*eap;
+	uint8_t			 ident[4 + 1 + 32];
+	size_t			 len = strlen(user);
+
+	c->c_sa.sa_hdr.sh_ispi = c - convs;
+	if ((c->c_sa.sa_eapid = strdup(user)) == NULL)
+		err(1, NULL);
+	sin = (struct sockaddr_in *)&c->c_sa.sa_peer.addr;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0xc0000200 | (c - convs) % 254 + 1);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	sin->sin_len = sizeof(*sin);
+#endif
+
+	ident[0] = EAP_CODE_RESPONSE;
+	ident[1] = 0;
+	ident[2] = 0;
+	ident[3] = 5 + len;
+	ident[4] = EAP_TYPE_IDENTITY;
+	memcpy(ident + 5, user, len);
+	if ((eap = ibuf_new(ident, 5 + len)) == NULL)
+		err(1, "ibuf_new");
+	if (radius_request(&env, &c->c_sa, &eap) == -1)
+		return (-1);
+	ibuf_free(eap);
+	return (0);
+}
+
+int
+check_msk(struct conv *c)
+{
+	uint8_t		 msk[MSCHAP_MSK_SZ];
+
+	bzero(msk, sizeof(msk));
+	memset(msk, RECVKEY, MSCHAP_MSK_KEY_SZ);
+	memset(msk + MSCHAP_MSK_KEY_SZ, SENDKEY, MSCHAP_MSK_KEY_SZ);
+	return (c->c_sa.sa_eapmsk != NULL &&
+	    ibuf_size(c->c_sa.sa_eapmsk) == sizeof(msk) &&
+	    memcmp(ibuf_data(c->c_sa.sa_eapmsk), msk, sizeof(msk)) == 0 &&
+	    c->c_sa.sa_state == IKEV2_STATE_AUTH_SUCCESS);
+}
+
+/* Start the conversations and run the event loop until all ended */
+int
+run(unsigned int n, uint64_t *usec)
+{
+	struct timespec	 start, end;
+	unsigned int	 i, first = nconvs;
+	const char	*user;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	finished = 0;
+	for (i = 0; i < n; i++, nconvs++) {
+		user = n == 1 ? "user" : "benchmark";
+		if (conv_start(&convs[nconvs], user) == -1)
+			return (-1);
+	}
+	while (finished < n)
+		event_loop(EVLOOP_ONCE);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (usec != NULL)
+		*usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+		    (end.tv_nsec - start.tv_nsec) / 1000;
+
+	for (i = first; i < nconvs; i++)
+		if (convs[i].c_challenges != 1 || !check_msk(&convs[i]))
+			return (-1);
+	return (0);
+}
+
+int
+main(void)
+{
+	struct iked_radserver	 srv, dead;
+	struct sockaddr_in	*sin;
+	socklen_t		 slen;
+	uint64_t		 usec;
+	pid_t			 pid;
+	int			 s, d, ret = 0;
+
+	log_init(0, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+	alarm(60);
+
+	if ((convs = calloc(CONVERSATIONS + 16, sizeof(*convs))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&env.sc_radservers);
+	TAILQ_INIT(&env.sc_radwait);
+	env.sc_radius_timeout = IKED_RADIUS_TIMEOUT;
+	env.sc_radius_maxtries = IKED_RADIUS_MAXTRIES;
+
+	/* The dead server is bound but never answers */
+	bzero(&srv, sizeof(srv));
+	sin = (struct sockaddr_in *)&srv.rs_sockaddr;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	sin->sin_len = sizeof(*sin);
+#endif
+	strlcpy(srv.rs_secret, SECRET, sizeof(srv.rs_secret));
+	dead = srv;
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    (d = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+	slen = sizeof(*sin);
+	if (bind(s, (struct sockaddr *)sin, slen) == -1 ||
+	    getsockname(s, (struct sockaddr *)sin, &slen) == -1)
+		err(1, "bind");
+	sin = (struct sockaddr_in *)&dead.rs_sockaddr;
+	slen = sizeof(*sin);
+	if (bind(d, (struct sockaddr *)sin, slen) == -1 ||
+	    getsockname(d, (struct sockaddr *)sin, &slen) == -1)
+		err(1, "bind");
+	slen = 1024 * 1024;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &slen, sizeof(slen));
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		responder(s);
+		_exit(0);
+	}
+	close(s);
+
+	radius_config_add(&env, &srv);
+
+	printf("Testing challenge and accept: ");
+	if (run(1, NULL) == -1) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	printf("Testing reject: ");
+	finished = 0;
+	if (conv_start(&convs[nconvs], "reject") == -1)
+		errx(1, "conv_start");
+	while (finished < 1)
+		event_loop(EVLOOP_ONCE);
+	if (convs[nconvs].c_failure != 1 || convs[nconvs].c_freed != 1 ||
+	    env.sc_stats.ikes_radius_reject != 1) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+	nconvs++;
+
+	printf("Testing forged reply: ");
+	finished = 0;
+	if (conv_start(&convs[nconvs], "forged") == -1)
+		errx(1, "conv_start");
+	while (finished < 1)
+		event_loop(EVLOOP_ONCE);
+	if (!check_msk(&convs[nconvs]) ||
+	    env.sc_stats.ikes_radius_invalid != 2) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+	nconvs++;
+
+	printf("Testing concurrent requests: ");
+	if (run(CONVERSATIONS, &usec) == -1 ||
+	    env.sc_stats.ikes_radius_pending != 0) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+	printf("%u EAP conversations in %llu ms, %llu round trips/s, "
+	    "%llu waited for an identifier, %llu retransmitted\n",
+	    CONVERSATIONS, (unsigned long long)usec / 1000,
+	    (unsigned long long)CONVERSATIONS * 2 * 1000000 / (usec + 1),
+	    (unsigned long long)env.sc_stats.ikes_radius_wait,
+	    (unsigned long long)env.sc_stats.ikes_radius_retransmit);
+
+	/* The dead server is tried first, then skipped */
+	printf("Testing failover: ");
+	radius_config_reset(&env);
+	radius_config_add(&env, &dead);
+	radius_config_add(&env, &srv);
+	env.sc_radius_timeout = 1;
+	env.sc_radius_maxtries = 1;
+	if (run(1, NULL) == -1 || run(2, NULL) == -1 ||
+	    env.sc_stats.ikes_radius_failover != 1 ||
+	    env.sc_stats.ikes_radius_pending != 0) {
+		printf("FAILED\n");
+		ret = 1;
+	} else
+		printf("OKAY\n");
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	close(d);
+
+	return (ret);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2026 The OpenIKED Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send batches of datagrams over loopback with sendmtofrom() and
+ * verify that every datagram is received unchanged.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iked.h"
+
+#define MAXDGRAMS	100
+#define MAXDGRAMLEN	1280
+
+int	test_batch(int, int, struct sockaddr_in *, const char *,
+	    size_t *, unsigned int, int);
+
+int
+test_batch(int s, int r, struct sockaddr_in *sin, const char *name,
+    size_t *lens, unsigned int n, int natt)
+{
+	static uint8_t		 data[MAXDGRAMS][MAXDGRAMLEN];
+	uint8_t			 rbuf[MAXDGRAMLEN + 16];
+	uint32_t		 marker = 0;
+	struct iovec		 iov[MAXDGRAMS * 2];
+	struct sockaddr_in	 from;
+	struct pollfd		 pfd;
+	unsigned int		 i, j;
+	int			 iovcnt = natt ? 2 : 1;
+	ssize_t			 len, hlen = natt ? sizeof(marker) : 0;
+
+	printf("Testing %s (%u datagrams%s): ", name, n,
+	    natt ? ", NAT-T" : "");
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < lens[i]; j++)
+			data[i][j] = arc4random();
+		if (natt) {
+			iov[i * 2].iov_base = &marker;
+			iov[i * 2].iov_len = sizeof(marker);
+		}
+		iov[i * iovcnt + iovcnt - 1].iov_base = data[i];
+		iov[i * iovcnt + iovcnt - 1].iov_len = lens[i];
+	}
+
+	bzero(&from, sizeof(from));
+	from.sin_family = AF_INET;
+	if (sendmtofrom(s, iov, iovcnt, n, (struct sockaddr *)sin,
+	    sizeof(*sin), (struct sockaddr *)&from, sizeof(from)) == -1) {
+		printf("FAILED (send)\n");
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		pfd.fd = r;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) != 1 ||
+		    (len = recv(r, rbuf, sizeof(rbuf), 0)) == -1) {
+			printf("FAILED (datagram %u missing)\n", i);
+			return (-1);
+		}
+		if ((size_t)len != lens[i] + hlen ||
+		    memcmp(rbuf, &marker, hlen) != 0 ||
+		    memcmp(rbuf + hlen, data[i], lens[i]) != 0) {
+			printf("FAILED (datagram %u differs)\n", i);
+			return (-1);
+		}
+	}
+
+	pfd.fd = r;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 0) {
+		printf("FAILED (extra datagram)\n");
+		return (-1);
+	}
+
+	printf("OKAY\n");
+	return (0);
+}
+
+int
+main(void)
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 slen = sizeof(sin);
+	size_t			 lens[MAXDGRAMS];
+	unsigned int		 i;
+	int			 s, r, natt, ret = 0;
+
+	if ((r = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    (s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+	i = 1024 * 1024;
+	setsockopt(r, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i));
+
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(r, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    getsockname(r, (struct sockaddr *)&sin, &slen) == -1)
+		err(1, "bind");
+
+	for (natt = 0; natt <= 1; natt++) {
+		lens[0] = 300;
+		ret |= test_batch(s, r, &sin, "single", lens, 1, natt);
+
+		for (i = 0; i < 8; i++)
+			lens[i] = 548;
+		ret |= test_batch(s, r, &sin, "equal", lens, 8, natt);
+
+		lens[7] = 123;
+		ret |= test_batch(s, r, &sin, "short last", lens, 8, natt);
+
+		for (i = 0; i < 8; i++)
+			lens[i] = 100 + i * 37;
+		ret |= test_batch(s, r, &sin, "mixed", lens, 8, natt);
+
+		for (i = 0; i < MAXDGRAMS; i++)
+			lens[i] = MAXDGRAMLEN;
+		lens[MAXDGRAMS - 1] = 17;
+		ret |= test_batch(s, r, &sin, "large", lens, MAXDGRAMS, natt);
+
+		lens[50] = 17;
+		ret |= test_batch(s, r, &sin, "large mixed", lens, MAXDGRAMS,
+		    natt);
+	}
+
+	close(s);
+	close(r);
+
+	return (ret == 0 ? 0 : 1);
+}